@@ -41,6 +41,7 @@ static char rcsid[] = "$Id: com-config.c,v 1.7 2002/05/02 12:57:10 mt Exp $";
 #  include <stdlib.h>
 #  include <stdarg.h>
 #  include <errno.h>
+#  include <ctype.h>
 #endif
 
 #if defined(HAVE_UNISTD_H)
@@ -50,6 +51,8 @@ static char rcsid[] = "$Id: com-config.c,v 1.7 2002/05/02 12:57:10 mt Exp $";
 #include <pwd.h>
 #include <grp.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "com-config.h"
 #include "com-debug.h"
@@ -62,14 +65,32 @@ static char rcsid[] = "$Id: com-config.c,v 1.7 2002/05/02 12:57:10 mt Exp $";
 
 typedef struct config_t {
 	struct config_t *next;	/* Next config option in chain	*/
+	struct config_t *hnxt;	/* Next option in hash bucket	*/
+	u_int32_t hash;		/* Hash of the option name	*/
 	char *name;		/* Config option name		*/
 	char *data;		/* Config value as string	*/
+	int   flag;		/* Which typed values are valid	*/
+	int   ival;		/* Value as integer		*/
+	int   bval;		/* Value as boolean		*/
+	u_int32_t aval;		/* Value as address (host order)*/
+	u_int16_t pval;		/* Value as port (host order)	*/
 } CONFIG;
 
+#define CF_ADDR		0x01	/* aval holds a parsed address	*/
+#define CF_NOADDR	0x02	/* Numeric, but not an address	*/
+#define CF_PORT		0x04	/* pval holds a numeric port	*/
+#define CF_ID		0x08	/* ival holds a numeric uid/gid	*/
+
 typedef struct section_t {
 	struct section_t *next;	/* Next config section in chain	*/
+	struct section_t *hnxt;	/* Next in bucket / wildcards	*/
+	u_int32_t hash;		/* Hash of the section name	*/
+	int     order;		/* Position in the sorted chain	*/
+	int     wlen;		/* Prefix length before the '*'	*/
 	char   *name;		/* Section name (NULL=global)	*/
 	CONFIG *conf;		/* Chained config option list	*/
+	CONFIG **htab;		/* Hashed config option index	*/
+	int     mask;		/* Bucket mask of the index	*/
 } SECTION;
 
 
@@ -80,11 +101,19 @@ typedef struct section_t {
 #define MAX_CONF_NAME		128	/* Max display size	*/
 #define MIN_CONF_NAME		24	/* Display column size	*/
 
+#define MIN_CONF_HASH		16	/* Min hash table size	*/
+
 
 /* ------------------------------------------------------------ */
 
 static void  config_cleanup(void);
 static char *config_line   (FILE *fp);
+static u_int32_t config_hash(const char *name);
+static int   config_size   (int cnt);
+static void  config_parse  (CONFIG *conf);
+static void  config_index  (void);
+static SECTION *config_sect_find(char *snam);
+static CONFIG  *config_find (char *snam, char *name);
 
 
 /* ------------------------------------------------------------ */
@@ -93,6 +122,14 @@ static int initflag = 0;	/* Have we been initialized?	*/
 
 static SECTION *sechead = NULL;	/* Chain of config sections	*/
 
+static SECTION **sectab = NULL;	/* Hashed plain section names	*/
+static int       secmask = 0;	/* Bucket mask of sectab	*/
+static SECTION *wildhead = NULL;/* Sorted wildcard sections	*/
+static SECTION **sectarr = NULL;/* Sections by sorted order	*/
+static int       sectcnt = 0;	/* Number of sections		*/
+
+static int      configgen = 0;	/* Bumped by each config_read	*/
+
 
 /* ------------------------------------------------------------ **
 **
@@ -115,9 +152,22 @@ static void config_cleanup(void)
 	debug(3, "config_cleanup");
 #endif
 
+	if (sectab != NULL) {
+		misc_free(FL, sectab);
+		sectab = NULL;
+	}
+	if (sectarr != NULL) {
+		misc_free(FL, sectarr);
+		sectarr = NULL;
+	}
+	sectcnt  = 0;
+	wildhead = NULL;
+
 	for (sect = sechead; sect != NULL; ) {
 		if (sect->name != NULL)
 			misc_free(FL, sect->name);
+		if (sect->htab != NULL)
+			misc_free(FL, sect->htab);
 		for (conf = sect->conf; conf != NULL; ) {
 			sect->conf = conf->next;
 			if (conf->name != NULL)
@@ -398,6 +448,12 @@ void config_read(char *file, int dflg)
 	}
 	fclose(fp);
 
+	/*
+	** Build the lookup index over the final values
+	*/
+	config_index();
+	configgen++;
+
 	/*
 	** Do we just want to validate the interpretation?
 	*/
@@ -457,6 +513,181 @@ void config_dump(FILE *fd)
 	}
 }
 
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_hash
+**
+**	Parameters....:	name		Section or option name
+**
+**	Return........:	Case-insensitive hash value
+**
+**	Purpose.......: FNV-1a over the lowercased name, used
+**			for both the section and option index.
+**
+** ------------------------------------------------------------ */
+
+static u_int32_t config_hash(const char *name)
+{
+	u_int32_t hash = 2166136261U;
+
+	while (*name != '\0') {
+		hash ^= (u_int32_t) tolower((unsigned char) *name++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_size
+**
+**	Parameters....:	cnt		Number of entries
+**
+**	Return........:	Bucket mask for a hash table
+**
+**	Purpose.......: Size a table to a power of two with at
+**			least twice as many buckets as entries.
+**
+** ------------------------------------------------------------ */
+
+static int config_size(int cnt)
+{
+	int size;
+
+	for (size = MIN_CONF_HASH; size < cnt * 2; size <<= 1)
+		;
+	return size - 1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_parse
+**
+**	Parameters....:	conf		Config option
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Pre-parse the typed values of an option
+**			so the lookups need not touch the string.
+**			Symbolic host and service names are left
+**			to the resolver at lookup time.
+**
+** ------------------------------------------------------------ */
+
+static void config_parse(CONFIG *conf)
+{
+	char *p = conf->data;
+	struct in_addr iadr;
+
+	conf->ival = atoi(p);
+
+	if (strcasecmp(p, "y") == 0)
+		conf->bval = 1;
+	else if (strcasecmp(p, "on") == 0)
+		conf->bval = 1;
+	else if (strcasecmp(p, "yes") == 0)
+		conf->bval = 1;
+	else if (strcasecmp(p, "true") == 0)
+		conf->bval = 1;
+	else if (*p >= '0' && *p <= '9')
+		conf->bval = (conf->ival != 0);
+	else
+		conf->bval = 0;
+
+	conf->flag = 0;
+	if (*p >= '0' && *p <= '9') {
+		memset(&iadr, 0, sizeof(iadr));
+		if (inet_aton(p, &iadr) != 0) {
+			conf->aval  = ntohl(iadr.s_addr);
+			conf->flag |= CF_ADDR;
+		} else {
+			conf->flag |= CF_NOADDR;
+		}
+		conf->pval  = (u_int16_t) conf->ival;
+		conf->flag |= CF_PORT;
+	}
+	if (*p == '-' || (*p >= '0' && *p <= '9'))
+		conf->flag |= CF_ID;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_index
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Build the hashed section and option
+**			index once the config file is read.
+**			Sections without a wildcard are hashed
+**			by name; wildcard sections are chained
+**			in their sorted order, so the lookup
+**			still picks the first match in the list.
+**
+** ------------------------------------------------------------ */
+
+static void config_index(void)
+{
+	SECTION *sect, **wtail;
+	CONFIG *conf;
+	char *wild;
+	int cnt, order, slot;
+
+	for (sect = sechead, cnt = 0; sect; sect = sect->next)
+		cnt++;
+	secmask = config_size(cnt);
+	sectab  = (SECTION **) misc_alloc(FL,
+			(secmask + 1) * sizeof(SECTION *));
+	sectarr = (SECTION **) misc_alloc(FL, cnt * sizeof(SECTION *));
+	sectcnt = cnt;
+
+	wildhead = NULL;
+	wtail    = &wildhead;
+	for (sect = sechead, order = 0; sect; sect = sect->next) {
+		sectarr[order] = sect;
+		sect->order = order++;
+
+		/*
+		** Hash and pre-parse the options
+		*/
+		for (conf = sect->conf, cnt = 0; conf; conf = conf->next)
+			cnt++;
+		sect->mask = config_size(cnt);
+		sect->htab = (CONFIG **) misc_alloc(FL,
+				(sect->mask + 1) * sizeof(CONFIG *));
+		for (conf = sect->conf; conf; conf = conf->next) {
+			config_parse(conf);
+			conf->hash = config_hash(conf->name);
+			slot = conf->hash & sect->mask;
+			conf->hnxt = sect->htab[slot];
+			sect->htab[slot] = conf;
+		}
+
+		/*
+		** The global section is always the list head
+		*/
+		if (sect->name == NULL)
+			continue;
+
+		if ((wild = strchr(sect->name, '*')) != NULL) {
+			sect->wlen = wild - sect->name;
+			sect->hnxt = NULL;
+			*wtail = sect;
+			wtail  = &sect->hnxt;
+		} else {
+			sect->hash = config_hash(sect->name);
+			slot = sect->hash & secmask;
+			sect->hnxt = sectab[slot];
+			sectab[slot] = sect;
+		}
+	}
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	config_sect
@@ -472,18 +703,113 @@ void config_dump(FILE *fd)
 int config_sect(char *snam)
 {
 	SECTION *sect;
+	u_int32_t hash;
+
+	if (snam == NULL)
+		return (sechead != NULL);
+	if (sectab == NULL)
+		return 0;
 
 	/*
 	** Find the relevant section
 	*/
-	for (sect = sechead; sect; sect = sect->next) {
-		if (misc_strcaseequ(snam, sect->name))
+	hash = config_hash(snam);
+	for (sect = sectab[hash & secmask]; sect; sect = sect->hnxt) {
+		if (sect->hash == hash && strcasecmp(sect->name, snam) == 0)
+			return 1;
+	}
+	for (sect = wildhead; sect; sect = sect->hnxt) {
+		if (strcasecmp(sect->name, snam) == 0)
 			return 1;
 	}
 	return 0;
 }
 
 
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_gen
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Generation of the config in memory
+**
+**	Purpose.......: Allows callers to notice that the config
+**			file has been re-read since they derived
+**			something from it.
+**
+** ------------------------------------------------------------ */
+
+int config_gen(void)
+{
+	return configgen;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_sect_cnt
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Number of sections incl. the global one
+**
+**	Purpose.......: Upper bound for config_sect_id values.
+**
+** ------------------------------------------------------------ */
+
+int config_sect_cnt(void)
+{
+	return sectcnt;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_sect_id
+**
+**	Parameters....:	snam		Section (NULL=global)
+**
+**	Return........:	Id of the section the lookups for snam
+**			are answered from (0=global)
+**
+**	Purpose.......: Tells callers which snam values share the
+**			same settings, so anything derived from a
+**			section can be computed once per section.
+**
+** ------------------------------------------------------------ */
+
+int config_sect_id(char *snam)
+{
+	SECTION *sect;
+
+	if ((sect = config_sect_find(snam)) == NULL)
+		return 0;
+	return sect->order;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_sect_name
+**
+**	Parameters....:	id		Section id
+**
+**	Return........:	Section name, NULL for the global one
+**			or an invalid id
+**
+**	Purpose.......: Map a section id back to its name.
+**
+** ------------------------------------------------------------ */
+
+char *config_sect_name(int id)
+{
+	if (id < 0 || id >= sectcnt)
+		return NULL;
+	return sectarr[id]->name;
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	config_sect_find
@@ -494,33 +820,85 @@ int config_sect(char *snam)
 **
 **	Purpose.......: find a config section by name; if snam
 **			is NULL the global section matches!
+**			A wildcard section sorted before the
+**			exact match wins, as it always did.
 **
 ** ------------------------------------------------------------ */
 static SECTION* config_sect_find(char *snam)
 {
-	SECTION *sect;
-	char    *wild;
+	SECTION *sect, *wild;
+	u_int32_t hash;
+
+	if (snam == NULL)
+		return sechead;
+	if (sectab == NULL)
+		return NULL;
 
 	/*
-	** Find the relevant section
+	** Find the exact match in the hash
 	*/
-	for(sect = sechead; sect; sect = sect->next) {
-		if(sect->name && (wild = strchr(sect->name, '*'))) {
+	hash = config_hash(snam);
+	for (sect = sectab[hash & secmask]; sect; sect = sect->hnxt) {
+		if (sect->hash == hash && strcasecmp(sect->name, snam) == 0)
+			break;
+	}
+
+	/*
+	** Check the wildcard sections sorted before it
+	*/
+	for (wild = wildhead; wild; wild = wild->hnxt) {
+		if (sect != NULL && wild->order > sect->order)
+			break;
 #if defined(COMPILE_DEBUG)
-			debug(3, "config_sect_find: wildcard-sect='%.*s*'\n",
-				  wild - sect->name, sect->name);
+		debug(3, "config_sect_find: wildcard-sect='%.*s*'\n",
+			  wild->wlen, wild->name);
 #endif
-			if (misc_strncaseequ(sect->name, snam,
-			                     wild - sect->name))
-				break;
-		} else {
-			if (misc_strcaseequ(sect->name, snam))
-				break;
-		}
+		if (strncasecmp(wild->name, snam, wild->wlen) == 0)
+			return wild;
 	}
 	return sect;
 }
 
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	config_find
+**
+**	Parameters....:	snam		Section (NULL=global)
+**			name		Config option name
+**
+**	Return........:	pointer to the option or NULL
+**
+**	Purpose.......: Look up an option in the section; an
+**			option missing there (or a section not
+**			present at all) falls back to global.
+**
+** ------------------------------------------------------------ */
+
+static CONFIG* config_find(char *snam, char *name)
+{
+	SECTION *sect;
+	CONFIG *conf;
+	u_int32_t hash;
+
+	hash = config_hash(name);
+	for (;;) {
+		sect = config_sect_find(snam);
+		if (sect != NULL && sect->htab != NULL) {
+			for (conf = sect->htab[hash & sect->mask];
+					conf; conf = conf->hnxt) {
+				if (conf->hash == hash &&
+				    strcasecmp(conf->name, name) == 0)
+					return conf;
+			}
+		}
+		if (snam == NULL)
+			return NULL;
+		snam = NULL;
+	}
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	config_int
@@ -537,10 +915,7 @@ static SECTION* config_sect_find(char *snam)
 
 int config_int(char *snam, char *name, int dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
-	char *p;
-	int i;
 
 	if (name == NULL)		/* Basic sanity check	*/
 		misc_die(FL, "config_int: ?name?");
@@ -552,37 +927,16 @@ int config_int(char *snam, char *name, int dflt)
 				dflt);
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_int(NULL, name, dflt) : dflt);
-
-	/*
-	** Now look for the desired value
-	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_int(NULL, name, dflt) : dflt);
-
-	/*
-	** Evaluate the found string
-	*/
-	i = atoi(p);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
 	** Return the value found
 	*/
 #if defined(COMPILE_DEBUG)
-	debug(3, "config_int: result=%d", i);
+	debug(3, "config_int: result=%d", conf->ival);
 #endif
-	return i;
+	return conf->ival;
 }
 
 
@@ -602,14 +956,10 @@ int config_int(char *snam, char *name, int dflt)
 
 int config_bool(char *snam, char *name, int dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
-	char *p;
-	int i;
 
 	if (name == NULL)		/* Basic sanity check	*/
 		misc_die(FL, "config_bool: ?name?");
-	dflt = (dflt != 0);		/* Normalize value	*/
 
 #if defined(COMPILE_DEBUG)
 	debug(3, "config_bool: s='%.*s' n='%.*s' d=%d",
@@ -618,48 +968,16 @@ int config_bool(char *snam, char *name, int dflt)
 				dflt);
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_bool(NULL, name, dflt) : dflt);
-
-	/*
-	** Now look for the desired value
-	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_bool(NULL, name, dflt) : dflt);
-
-	/*
-	** Evaluate the found string
-	*/
-	if (strcasecmp(p, "y") == 0)
-		i = 1;
-	else if (strcasecmp(p, "on") == 0)
-		i = 1;
-	else if (strcasecmp(p, "yes") == 0)
-		i = 1;
-	else if (strcasecmp(p, "true") == 0)
-		i = 1;
-	else if (*p >= '0' && *p <= '9')
-		i = (atoi(p) != 0);
-	else
-		i = 0;
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
 	** Return the value found
 	*/
 #if defined(COMPILE_DEBUG)
-	debug(3, "config_bool: result=%d", i);
+	debug(3, "config_bool: result=%d", conf->bval);
 #endif
-	return i;
+	return conf->bval;
 }
 
 
@@ -679,9 +997,7 @@ int config_bool(char *snam, char *name, int dflt)
 
 char *config_str(char *snam, char *name, char *dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
-	char *p;
 
 	if (name == NULL)		/* Basic sanity check	*/
 		misc_die(FL, "config_str: ?name?");
@@ -693,32 +1009,16 @@ char *config_str(char *snam, char *name, char *dflt)
 				MAX_PATH_SIZE, NIL(dflt));
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_str(NULL, name, dflt) : dflt);
-
-	/*
-	** Now look for the desired value
-	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_str(NULL, name, dflt) : dflt);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
 	** Return the value found
 	*/
 #if defined(COMPILE_DEBUG)
-	debug(3, "config_str: result='%.*s'", MAX_PATH_SIZE, NIL(p));
+	debug(3, "config_str: result='%.*s'", MAX_PATH_SIZE, conf->data);
 #endif
-	return p;
+	return conf->data;
 }
 
 
@@ -739,9 +1039,7 @@ char *config_str(char *snam, char *name, char *dflt)
 
 u_int32_t config_addr(char *snam, char *name, u_int32_t dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
-	char *p;
 	u_int32_t addr;
 
 	if (name == NULL)		/* Basic sanity check	*/
@@ -754,29 +1052,19 @@ u_int32_t config_addr(char *snam, char *name, u_int32_t dflt)
 				socket_addr2str(dflt));
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_addr(NULL, name, dflt) : dflt);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
-	** Now look for the desired value
+	** Dotted decimals are parsed already,
+	** host names go through the resolver
 	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_addr(NULL, name, dflt) : dflt);
-
-	/*
-	** Evaluate the found string
-	*/
-	addr = socket_str2addr(p, dflt);
+	if (conf->flag & CF_ADDR)
+		addr = conf->aval;
+	else if (conf->flag & CF_NOADDR)
+		addr = dflt;
+	else
+		addr = socket_str2addr(conf->data, dflt);
 
 	/*
 	** Return the value found
@@ -805,9 +1093,7 @@ u_int32_t config_addr(char *snam, char *name, u_int32_t dflt)
 
 u_int16_t config_port(char *snam, char *name, u_int16_t dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
-	char *p;
 	u_int16_t port;
 
 	if (name == NULL)		/* Basic sanity check	*/
@@ -820,29 +1106,17 @@ u_int16_t config_port(char *snam, char *name, u_int16_t dflt)
 				(int) dflt);
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_port(NULL, name, dflt) : dflt);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
-	** Now look for the desired value
+	** Numeric ports are parsed already,
+	** service names go through the resolver
 	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_port(NULL, name, dflt) : dflt);
-
-	/*
-	** Evaluate the found string
-	*/
-	port = socket_str2port(p, dflt);
+	if (conf->flag & CF_PORT)
+		port = conf->pval;
+	else
+		port = socket_str2port(conf->data, dflt);
 
 	/*
 	** Return the value found
@@ -870,7 +1144,6 @@ u_int16_t config_port(char *snam, char *name, u_int16_t dflt)
 
 uid_t config_uid(char *snam, char *name, uid_t dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
 	char *p;
 	struct passwd *pwd;
@@ -886,31 +1159,16 @@ uid_t config_uid(char *snam, char *name, uid_t dflt)
 				(int) dflt);
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_uid(NULL, name, dflt) : dflt);
-
-	/*
-	** Now look for the desired value
-	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_uid(NULL, name, dflt) : dflt);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
 	** Evaluate the found string
 	*/
-	if (*p == '-' || (*p >= '0' && *p <= '9'))
-		uid = (uid_t) atoi(p);
+	if (conf->flag & CF_ID)
+		uid = (uid_t) conf->ival;
 	else {
+		p   = conf->data;
 		uid = dflt;
 		setpwent();
 		while ((pwd = getpwent()) != NULL) {
@@ -948,7 +1206,6 @@ uid_t config_uid(char *snam, char *name, uid_t dflt)
 
 gid_t config_gid(char *snam, char *name, gid_t dflt)
 {
-	SECTION *sect;
 	CONFIG *conf;
 	char *p;
 	struct group *grp;
@@ -964,31 +1221,16 @@ gid_t config_gid(char *snam, char *name, gid_t dflt)
 				(int) dflt);
 #endif
 
-	/*
-	** Find the relevant section
-	*/
-	sect = config_sect_find(snam);
-	if (sect == NULL)
-		return (snam ? config_gid(NULL, name, dflt) : dflt);
-
-	/*
-	** Now look for the desired value
-	*/
-	for (conf = sect->conf, p = NULL; conf; conf = conf->next) {
-		if (strcasecmp(conf->name, name) == 0) {
-			p = conf->data;
-			break;
-		}
-	}
-	if (conf == NULL)
-		return (snam ? config_gid(NULL, name, dflt) : dflt);
+	if ((conf = config_find(snam, name)) == NULL)
+		return dflt;
 
 	/*
 	** Evaluate the found string
 	*/
-	if (*p == '-' || (*p >= '0' && *p <= '9'))
-		gid = (gid_t) atoi(p);
+	if (conf->flag & CF_ID)
+		gid = (gid_t) conf->ival;
 	else {
+		p   = conf->data;
 		gid = dflt;
 		setgrent();
 		while ((grp = getgrent()) != NULL) {
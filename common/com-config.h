@@ -43,6 +43,10 @@
 void      config_read(char *file, int dflg);
 void      config_dump(FILE *fd);
 int       config_sect(char *snam);
+int       config_gen (void);
+int       config_sect_cnt (void);
+int       config_sect_id  (char *snam);
+char     *config_sect_name(int id);
 
 int       config_int (char *snam, char *name, int       dflt);
 int       config_bool(char *snam, char *name, int       dflt);
@@ -65,15 +65,38 @@ static char rcsid[] = "$Id: com-misc.c,v 1.9.2.1 2003/05/07 11:15:05 mt Exp $";
 #  include <sys/fcntl.h>
 #endif
 
+#if defined(_POSIX_PRIORITY_SCHEDULING)
+#  include <sched.h>
+#endif
+
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
 #include "com-syslog.h"
 
 
+/* ------------------------------------------------------------ */
+
+#define SHA_BLOCK	64	/* SHA-256 block size		*/
+#define SHA_ROR(x,n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+** SHA-256 state, for misc_hmac
+*/
+typedef struct {
+	u_int32_t st[8];	/* Chaining state		*/
+	size_t    cnt;		/* Bytes hashed so far		*/
+	u_char    buf[SHA_BLOCK]; /* Partial block		*/
+} SHA256;
+
+
 /* ------------------------------------------------------------ */
 
 static void misc_cleanup(void);
+static void misc_sha_init (SHA256 *sc);
+static void misc_sha_block(SHA256 *sc, const u_char *p);
+static void misc_sha_add  (SHA256 *sc, const u_char *p, size_t len);
+static void misc_sha_done (SHA256 *sc, u_char *out);
 
 
 /* ------------------------------------------------------------ */
@@ -784,6 +807,361 @@ int misc_rand (int lrng, int urng)
 	return (lrng + (rand () % (urng - lrng + 1)));
 }
 
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_random
+**
+**	Parameters....:	buf		Buffer to fill
+**			len		Number of bytes
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Fill a buffer with unpredictable bytes
+**			from /dev/urandom, e.g. for DNS message
+**			ids or keys. The device is kept open, so
+**			call it once (len may be 0) before the
+**			chroot. Every process uses a pool of its
+**			own; a forked child never reuses the
+**			bytes of its parent.
+**
+** ------------------------------------------------------------ */
+
+void misc_random(void *buf, size_t len)
+{
+	static int    fd   = -1;
+	static pid_t  pid  = 0;
+	static size_t left = 0;
+	static u_char pool[256];
+	static u_int32_t mix = 0;
+	struct timeval tv;
+	u_char *p = (u_char *) buf;
+	size_t n;
+
+	if (pid != getpid()) {
+		pid  = getpid();
+		left = 0;
+	}
+	if (fd == -1) {
+		if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+#if defined(FD_CLOEXEC)
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+		} else {
+			syslog_error("can't open /dev/urandom");
+		}
+	}
+
+	while (len > 0) {
+		if (left == 0) {
+			if (fd < 0 || read(fd, pool, sizeof(pool)) !=
+			              (ssize_t) sizeof(pool)) {
+				/*
+				** Better than nothing, but guessable
+				*/
+				for (n = 0; n < sizeof(pool); n++) {
+					gettimeofday(&tv, NULL);
+					mix = (mix ^ (u_int32_t) tv.tv_usec ^
+					      ((u_int32_t) pid << 16) ^
+					      (u_int32_t) n) * 16777619U;
+					pool[n] = (u_char) (mix >> 11);
+				}
+			}
+			left = sizeof(pool);
+		}
+		n = (len < left) ? len : left;
+		memcpy(p, pool + sizeof(pool) - left, n);
+		memset(pool + sizeof(pool) - left, 0, n);
+		left -= n;
+		p    += n;
+		len  -= n;
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_sha_init
+**
+**	Parameters....:	sc		SHA-256 state
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Start a SHA-256 hash (FIPS 180-4).
+**
+** ------------------------------------------------------------ */
+
+static void misc_sha_init(SHA256 *sc)
+{
+	static const u_int32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(sc->st, iv, sizeof(sc->st));
+	sc->cnt = 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_sha_block
+**
+**	Parameters....:	sc		SHA-256 state
+**			p		64 bytes of input
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Compress one block into the state.
+**
+** ------------------------------------------------------------ */
+
+static void misc_sha_block(SHA256 *sc, const u_char *p)
+{
+	static const u_int32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+		0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+		0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+		0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+		0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+		0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+		0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+		0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+		0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	u_int32_t w[64], v[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++, p += 4) {
+		w[i] = ((u_int32_t) p[0] << 24) | ((u_int32_t) p[1] << 16) |
+		       ((u_int32_t) p[2] <<  8) |  (u_int32_t) p[3];
+	}
+	for (i = 16; i < 64; i++) {
+		t1 = SHA_ROR(w[i - 2], 17) ^ SHA_ROR(w[i - 2], 19) ^
+		     (w[i - 2] >> 10);
+		t2 = SHA_ROR(w[i - 15], 7) ^ SHA_ROR(w[i - 15], 18) ^
+		     (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+
+	memcpy(v, sc->st, sizeof(v));
+	for (i = 0; i < 64; i++) {
+		t1 = v[7] + (SHA_ROR(v[4], 6) ^ SHA_ROR(v[4], 11) ^
+		             SHA_ROR(v[4], 25)) +
+		     ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+		t2 = (SHA_ROR(v[0], 2) ^ SHA_ROR(v[0], 13) ^
+		      SHA_ROR(v[0], 22)) +
+		     ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = v[3] + t1;
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		sc->st[i] += v[i];
+	memset(w, 0, sizeof(w));
+	memset(v, 0, sizeof(v));
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_sha_add
+**
+**	Parameters....:	sc		SHA-256 state
+**			p		Input
+**			len		Input length
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Hash more input.
+**
+** ------------------------------------------------------------ */
+
+static void misc_sha_add(SHA256 *sc, const u_char *p, size_t len)
+{
+	size_t fill = sc->cnt % SHA_BLOCK, n;
+
+	sc->cnt += len;
+	while (len > 0) {
+		n = SHA_BLOCK - fill;
+		if (n > len)
+			n = len;
+		memcpy(sc->buf + fill, p, n);
+		fill += n;
+		p    += n;
+		len  -= n;
+		if (fill == SHA_BLOCK) {
+			misc_sha_block(sc, sc->buf);
+			fill = 0;
+		}
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_sha_done
+**
+**	Parameters....:	sc		SHA-256 state
+**			out		Set to the 32 byte digest
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Pad the input, put out the digest and
+**			wipe the state.
+**
+** ------------------------------------------------------------ */
+
+static void misc_sha_done(SHA256 *sc, u_char *out)
+{
+	u_char pad[SHA_BLOCK + 8];
+	u_int32_t hi, lo;
+	size_t n;
+	int i;
+
+	hi = (u_int32_t) (sc->cnt >> 29);
+	lo = (u_int32_t) (sc->cnt << 3);
+	n  = SHA_BLOCK - (sc->cnt + 8) % SHA_BLOCK;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 4; i++) {
+		pad[n + i]     = (u_char) (hi >> (24 - 8 * i));
+		pad[n + 4 + i] = (u_char) (lo >> (24 - 8 * i));
+	}
+	misc_sha_add(sc, pad, n + 8);
+
+	for (i = 0; i < 32; i++)
+		out[i] = (u_char) (sc->st[i / 4] >> (24 - 8 * (i % 4)));
+	memset(sc, 0, sizeof(SHA256));
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_hmac
+**
+**	Parameters....:	key		Secret key
+**			klen		Key length
+**			msg		Message
+**			mlen		Message length
+**			out		Set to the MISC_HMAC_LEN
+**					byte result
+**
+**	Return........:	(none)
+**
+**	Purpose.......: HMAC-SHA256 (RFC 2104) of a message,
+**			e.g. to keep a password check without
+**			the password.
+**
+** ------------------------------------------------------------ */
+
+void misc_hmac(const u_char *key, size_t klen,
+               const u_char *msg, size_t mlen, u_char *out)
+{
+	u_char pad[SHA_BLOCK], kh[MISC_HMAC_LEN];
+	SHA256 sc;
+	size_t i;
+
+	if (klen > SHA_BLOCK) {
+		misc_sha_init(&sc);
+		misc_sha_add(&sc, key, klen);
+		misc_sha_done(&sc, kh);
+		key  = kh;
+		klen = sizeof(kh);
+	}
+
+	memset(pad, 0x36, sizeof(pad));
+	for (i = 0; i < klen; i++)
+		pad[i] ^= key[i];
+	misc_sha_init(&sc);
+	misc_sha_add(&sc, pad, sizeof(pad));
+	misc_sha_add(&sc, msg, mlen);
+	misc_sha_done(&sc, out);
+
+	memset(pad, 0x5c, sizeof(pad));
+	for (i = 0; i < klen; i++)
+		pad[i] ^= key[i];
+	misc_sha_init(&sc);
+	misc_sha_add(&sc, pad, sizeof(pad));
+	misc_sha_add(&sc, out, MISC_HMAC_LEN);
+	misc_sha_done(&sc, out);
+
+	memset(pad, 0, sizeof(pad));
+	memset(kh, 0, sizeof(kh));
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_memequ
+**
+**	Parameters....:	m1		First buffer
+**			m2		Second buffer
+**			len		Number of bytes
+**
+**	Return........:	1=buffers are equal, 0=they differ
+**
+**	Purpose.......: Compare secrets in constant time; how
+**			many bytes match does not show in the
+**			time taken.
+**
+** ------------------------------------------------------------ */
+
+int misc_memequ(const void *m1, const void *m2, size_t len)
+{
+	const volatile u_char *p1 = (const volatile u_char *) m1;
+	const volatile u_char *p2 = (const volatile u_char *) m2;
+	u_char dif = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dif |= p1[i] ^ p2[i];
+	return dif == 0;
+}
+
+
+#if defined(HAVE_SPIN)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	misc_spin
+**
+**	Parameters....:	lock		Lock word in shared memory
+**			on		1=lock, 0=unlock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Spin lock for the tables shared by the
+**			daemon and its children; it is meant to
+**			be held for a few compares or a copy.
+**
+** ------------------------------------------------------------ */
+
+void misc_spin(volatile int *lock, int on)
+{
+	if (on == 0) {
+		__sync_lock_release(lock);
+		return;
+	}
+	while (__sync_lock_test_and_set(lock, 1)) {
+#if defined(_POSIX_PRIORITY_SCHEDULING)
+		sched_yield();
+#endif
+	}
+}
+#endif
+
 /* ------------------------------------------------------------
  * $Log: com-misc.c,v $
  * Revision 1.9.2.1  2003/05/07 11:15:05  mt
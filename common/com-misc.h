@@ -59,6 +59,18 @@
 #endif
 
 
+/*
+** Tables shared between processes are locked with
+** misc_spin, which needs the GCC atomic builtins;
+** without them the tables have to stay private
+*/
+#if defined(__GNUC__)
+#  define HAVE_SPIN		1
+#endif
+
+#define MISC_HMAC_LEN	32	/* Bytes put out by misc_hmac	*/
+
+
 /* ------------------------------------------------------------ */
 
 void  misc_forget (void);
@@ -90,6 +102,13 @@ char *misc_strncpy   (char *s1, const char *s2, size_t len);
 int   misc_chroot (char *dir);
 void  misc_uidgid (uid_t uid, gid_t gid);
 int   misc_rand (int lrng, int urng);
+void  misc_random(void *buf, size_t len);
+void  misc_hmac  (const u_char *key, size_t klen,
+                  const u_char *msg, size_t mlen, u_char *out);
+int   misc_memequ(const void *m1, const void *m2, size_t len);
+#if defined(HAVE_SPIN)
+void  misc_spin   (volatile int *lock, int on);
+#endif
 
 /* ------------------------------------------------------------ */
 
@@ -0,0 +1,1459 @@
+/*
+ * $Id$
+ *
+ * Common caching host name resolver
+ *
+ * Author(s): Jens-Gero Boehm <jens-gero.boehm@suse.de>
+ *            Pieter Hollants <pieter.hollants@suse.de>
+ *            Marius Tomaschewski <mt@suse.de>
+ *            Volker Wiegand <volker.wiegand@suse.de>
+ *
+ * This file is part of the SuSE Proxy Suite
+ *            See also  http://proxy-suite.suse.de/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * A history log can be found at the end of this file.
+ */
+
+#ifndef lint
+static char rcsid[] = "$Id$";
+#endif
+
+#include <config.h>
+
+#if defined(STDC_HEADERS)
+#  include <stdio.h>
+#  include <string.h>
+#  include <stdlib.h>
+#  include <stdarg.h>
+#  include <errno.h>
+#  include <ctype.h>
+#endif
+
+#if defined(HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#if defined(TIME_WITH_SYS_TIME)
+#  include <sys/time.h>
+#  include <time.h>
+#else
+#  if defined(HAVE_SYS_TIME_H)
+#    include <sys/time.h>
+#  else
+#    include <time.h>
+#  endif
+#endif
+
+#if defined(HAVE_POLL_H)
+#  include <poll.h>
+#elif defined(HAVE_SYS_POLL_H)
+#  include <sys/poll.h>
+#endif
+
+#if defined(HAVE_FCNTL_H)
+#  include <fcntl.h>
+#elif defined(HAVE_SYS_FCNTL_H)
+#  include <sys/fcntl.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#endif
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "com-config.h"
+#include "com-debug.h"
+#include "com-misc.h"
+#include "com-resolv.h"
+#include "com-socket.h"
+#include "com-syslog.h"
+
+/*
+** The cache is shared where misc_spin can lock it
+*/
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS) && defined(HAVE_SPIN)
+#  define HAVE_SHARED	1
+#endif
+
+
+/* ------------------------------------------------------------ */
+
+#define RS_NAMELEN	256	/* Max. host name length	*/
+#define RS_PACKET	512	/* Max. UDP DNS message size	*/
+#define RS_SERVERS	3	/* Max. name servers used	*/
+#define RS_PROBE	8	/* Cache slots probed per name	*/
+#define RS_SOCKS	16	/* Max. query sockets per proc.	*/
+#define RS_CHAIN	8	/* Max. CNAMEs followed		*/
+
+#define RS_ENTRIES	1024	/* Default cache entries	*/
+#define RS_MINSIZE	64	/* Min. cache entries		*/
+#define RS_TIMEOUT	2	/* Default secs per try		*/
+#define RS_RETRIES	2	/* Default rounds over servers	*/
+#define RS_NEGTTL	30	/* Default negative TTL (secs)	*/
+#define RS_MAXTTL	3600	/* Default max. TTL (secs)	*/
+
+#define RS_CONF		"/etc/resolv.conf"
+#define RS_HOSTS	"/etc/hosts"
+
+#define RC_FREE		0	/* Cache slot is unused		*/
+#define RC_POS		1	/* Name has an address		*/
+#define RC_NEG		2	/* Name does not resolve	*/
+
+/*
+** Cache entry; the negative ones keep failures away
+** from the name servers for ResolverNegativeTTL
+*/
+typedef struct {
+	u_int32_t hash;		/* Hash of the name		*/
+	int       stat;		/* RC_FREE, RC_POS or RC_NEG	*/
+	time_t    expire;	/* Valid until			*/
+	u_int32_t addr;		/* Address (host order)		*/
+	char      name[RS_NAMELEN]; /* Host name		*/
+} RCACHE;
+
+/*
+** The cache and its counters; shared by the daemon
+** and its children if resolv_init was called first
+*/
+typedef struct {
+	volatile int lock;	/* Spin lock for the table	*/
+	u_int32_t mask;		/* Number of entries - 1	*/
+	u_long    hits;		/* Positive answers from cache	*/
+	u_long    nhits;	/* Negative answers from cache	*/
+	u_long    miss;		/* Names queried		*/
+	u_long    joined;	/* Lookups joining a query	*/
+	u_long    sent;		/* Packets sent			*/
+	u_long    tmout;	/* Packets without answer	*/
+	u_long    fail;		/* Queries without any answer	*/
+	u_long    lcnt;		/* Queries answered		*/
+	double    lsum;		/* Sum of their latency (ms)	*/
+	double    lmax;		/* Max. latency (ms)		*/
+	RCACHE    ent[1];	/* The entries (mask + 1)	*/
+} RCTAB;
+
+/*
+** Query in flight, owned by the process that sent it
+*/
+typedef struct rquery_t {
+	struct rquery_t *next;	/* Next query in flight		*/
+	char      name[RS_NAMELEN];  /* Name asked for		*/
+	char      qname[RS_NAMELEN]; /* Name in the question	*/
+	int       sock;		/* Its UDP socket, -1 if queued	*/
+	u_int16_t id;		/* DNS message id (random)	*/
+	int       srv;		/* Server of the last try	*/
+	int       tries;	/* Tries left			*/
+	time_t    due;		/* Deadline of the last try	*/
+	struct timeval beg;	/* Start of the query		*/
+} RQUERY;
+
+
+/* ------------------------------------------------------------ */
+
+static void resolv_setup (void);
+static void resolv_open  (void);
+static void resolv_lock  (int on);
+static u_int32_t resolv_hash(char *name);
+static int  resolv_look  (char *name, u_int32_t *addr, int count);
+static void resolv_store (char *name, int stat, u_int32_t addr,
+                          u_int32_t ttl);
+static int  resolv_hosts (char *name, u_int32_t *addr);
+static int  resolv_start (char *name);
+static void resolv_next  (void);
+static int  resolv_qsock (RQUERY *rq);
+static void resolv_qclose(RQUERY *rq);
+static int  resolv_send  (RQUERY *rq);
+static int  resolv_pack  (u_char *buf, u_int16_t id, char *name);
+static int  resolv_name  (u_char *buf, int len, int off,
+                          char *out, size_t size);
+static int  resolv_quest (u_char *buf, int len, char *qname);
+static int  resolv_parse (u_char *buf, int len, int off, char *qname,
+                          u_int32_t *addr, u_int32_t *ttl);
+static void resolv_done  (RQUERY *rq, int stat, u_int32_t addr,
+                          u_int32_t ttl);
+static void resolv_event (int sock);
+static void resolv_arm   (void);
+
+
+/* ------------------------------------------------------------ */
+
+static RCTAB *rctab = NULL;	/* The cache			*/
+
+static int    rgen  = -1;	/* Config generation of setup	*/
+static int    rasync = 1;	/* Use our own DNS queries	*/
+static u_int32_t rsrv[RS_SERVERS]; /* Name servers (host order)	*/
+static int    rnsrv = 0;	/* Number of name servers	*/
+static u_int16_t rport = 53;	/* Name server port		*/
+static int    rtmout = RS_TIMEOUT; /* Secs per try		*/
+static int    rretry = RS_RETRIES; /* Rounds over the servers	*/
+static int    rnegttl = RS_NEGTTL; /* TTL of negative entries	*/
+static int    rmaxttl = RS_MAXTTL; /* Max. TTL of any entry	*/
+static char   rdomain[RS_NAMELEN]; /* Domain for short names	*/
+
+static pid_t  rpid  = 0;	/* Process owning the queries	*/
+static int    rqsocks = 0;	/* Query sockets open		*/
+static RQUERY *rqhead = NULL;	/* Queries in flight		*/
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_init
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Create the cache in shared memory, so
+**			that processes forked afterwards share
+**			it. Without this call every process
+**			uses a private cache of its own.
+**
+** ------------------------------------------------------------ */
+
+void resolv_init(void)
+{
+	size_t len;
+	int cnt;
+
+	resolv_setup();
+	if (rctab != NULL)
+		return;
+
+	/*
+	** Query ids and ports are random; open the
+	** source while /dev is still in reach
+	*/
+	misc_random(NULL, 0);
+
+	/*
+	** Round the size up to a power of two
+	*/
+	cnt = config_int(NULL, "ResolverCacheSize", RS_ENTRIES);
+	if (cnt < RS_MINSIZE)
+		cnt = RS_MINSIZE;
+	else if (cnt > (1 << 20))
+		cnt = (1 << 20);
+	for (len = RS_MINSIZE; len < (size_t) cnt; len <<= 1)
+		;
+	cnt = (int) len;
+	len = sizeof(RCTAB) + (cnt - 1) * sizeof(RCACHE);
+
+#if defined(HAVE_SHARED)
+	rctab = (RCTAB *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (rctab == (RCTAB *) MAP_FAILED) {
+		syslog_error("can't map resolver cache");
+		exit(EXIT_FAILURE);
+	}
+	memset((void *) rctab, 0, len);
+#else
+	rctab = (RCTAB *) misc_alloc(FL, len);
+#endif
+	rctab->mask = (u_int32_t) (cnt - 1);
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "resolver cache: %d entries, %lu bytes",
+			cnt, (u_long) len);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_setup
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: (Re-)read the resolver options once per
+**			config generation. The name servers and
+**			the domain for short names default to
+**			the ones in /etc/resolv.conf.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_setup(void)
+{
+	char str[RS_NAMELEN], *p, *q;
+	struct in_addr iadr;
+	FILE *fp;
+
+	if (rgen == config_gen())
+		return;
+	rgen = config_gen();
+
+	rasync  = config_bool(NULL, "AsyncResolver", 1);
+	rport   = config_port(NULL, "ResolverPort", 53);
+	rtmout  = config_int (NULL, "ResolverTimeOut", RS_TIMEOUT);
+	rretry  = config_int (NULL, "ResolverRetries", RS_RETRIES);
+	rnegttl = config_int (NULL, "ResolverNegativeTTL", RS_NEGTTL);
+	rmaxttl = config_int (NULL, "ResolverMaxTTL", RS_MAXTTL);
+	if (rtmout < 1)
+		rtmout = 1;
+	if (rretry < 1)
+		rretry = 1;
+	if (rnegttl < 1)
+		rnegttl = 1;
+	if (rmaxttl < 1)
+		rmaxttl = 1;
+
+	/*
+	** Configured name servers ...
+	*/
+	if ((p = config_str(NULL, "ResolverAddress", NULL)) != NULL) {
+		rnsrv = 0;
+		misc_strncpy(str, p, sizeof(str));
+		for (p = strtok(str, " \t,"); p && rnsrv < RS_SERVERS;
+		     p = strtok(NULL, " \t,")) {
+			if (inet_aton(p, &iadr) != 0)
+				rsrv[rnsrv++] = ntohl(iadr.s_addr);
+			else
+				syslog_write(T_WRN, "bad ResolverAddress "
+				             "'%.256s' ignored", p);
+		}
+	}
+
+	/*
+	** ... or the ones of the system resolver; if the file
+	** is out of reach (chroot), keep what we had before
+	*/
+	if ((fp = fopen(RS_CONF, "r")) != NULL) {
+		if (config_str(NULL, "ResolverAddress", NULL) == NULL)
+			rnsrv = 0;
+		memset(rdomain, 0, sizeof(rdomain));
+		while (fgets(str, sizeof(str), fp) != NULL) {
+			p = strtok(str, " \t\r\n");
+			q = strtok(NULL, " \t\r\n");
+			if (p == NULL || q == NULL)
+				continue;
+			if (strcasecmp(p, "nameserver") == 0 &&
+			    rnsrv < RS_SERVERS &&
+			    config_str(NULL, "ResolverAddress", NULL) == NULL &&
+			    inet_aton(q, &iadr) != 0) {
+				rsrv[rnsrv++] = ntohl(iadr.s_addr);
+			} else
+			if ((strcasecmp(p, "domain") == 0 ||
+			     strcasecmp(p, "search") == 0) &&
+			    rdomain[0] == '\0') {
+				misc_strncpy(rdomain, q, sizeof(rdomain));
+			}
+		}
+		fclose(fp);
+	}
+
+	if (rasync && rnsrv == 0) {
+		syslog_write(T_WRN, "no name server known - "
+		             "using the system resolver");
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_open
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Take over the queries in this process;
+**			a forked child drops the parent's query
+**			sockets and queries, as it can't receive
+**			their answers anyway.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_open(void)
+{
+	RQUERY *rq;
+
+	if (rpid == getpid())
+		return;
+
+	socket_watch(-1, resolv_event, 0);
+	while ((rq = rqhead) != NULL) {
+		rqhead = rq->next;
+		if (rq->sock != -1)
+			close(rq->sock);
+		misc_free(FL, rq);
+	}
+	rqsocks = 0;
+	rpid    = getpid();
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_lock
+**
+**	Parameters....:	on		1=lock, 0=unlock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Serialize access to the shared cache;
+**			it is held for a few compares only.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_lock(int on)
+{
+#if defined(HAVE_SHARED)
+	misc_spin(&rctab->lock, on);
+#else
+	on = on;		/* A private cache needs none	*/
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_hash
+**
+**	Parameters....:	name		Host name
+**
+**	Return........:	Case-insensitive hash of the name
+**
+**	Purpose.......: FNV-1a over the lowercased name.
+**
+** ------------------------------------------------------------ */
+
+static u_int32_t resolv_hash(char *name)
+{
+	u_int32_t hash = 2166136261U;
+
+	while (*name != '\0') {
+		hash ^= (u_int32_t) tolower((unsigned char) *name++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_look
+**
+**	Parameters....:	name		Host name
+**			addr		Set to the cached address
+**					(INADDR_NONE if negative)
+**			count		1=count a hit
+**
+**	Return........:	1 if the name is cached, 0 if not
+**
+**	Purpose.......: Cache lookup; expired entries are
+**			misses and get replaced later.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_look(char *name, u_int32_t *addr, int count)
+{
+	RCACHE *ent;
+	u_int32_t hash, i;
+	time_t now;
+	int found = 0;
+
+	if (rctab == NULL)
+		resolv_init();
+
+	hash = resolv_hash(name);
+	now  = time(NULL);
+
+	resolv_lock(1);
+	for (i = 0; i < RS_PROBE; i++) {
+		ent = &rctab->ent[(hash + i) & rctab->mask];
+		if (ent->stat == RC_FREE || ent->hash != hash ||
+		    strcasecmp(ent->name, name) != 0)
+			continue;
+		if (ent->expire > now) {
+			*addr = (ent->stat == RC_POS) ? ent->addr
+			                              : INADDR_NONE;
+			found = 1;
+			if (count && ent->stat == RC_POS)
+				rctab->hits++;
+			else if (count)
+				rctab->nhits++;
+		}
+		break;
+	}
+	resolv_lock(0);
+	return found;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_store
+**
+**	Parameters....:	name		Host name
+**			stat		RC_POS or RC_NEG
+**			addr		Address (host order)
+**			ttl		Time to live (secs)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Enter an answer into the cache; a full
+**			probe sequence evicts the entry that
+**			expires first.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_store(char *name, int stat, u_int32_t addr,
+                         u_int32_t ttl)
+{
+	RCACHE *ent, *use = NULL;
+	u_int32_t hash, i;
+	time_t now;
+
+	if (rctab == NULL)
+		resolv_init();
+
+	hash = resolv_hash(name);
+	now  = time(NULL);
+	if (ttl < 1)
+		ttl = 1;
+	else if (ttl > (u_int32_t) rmaxttl)
+		ttl = (u_int32_t) rmaxttl;
+
+	resolv_lock(1);
+	for (i = 0; i < RS_PROBE; i++) {
+		ent = &rctab->ent[(hash + i) & rctab->mask];
+		if (ent->stat != RC_FREE && ent->hash == hash &&
+		    strcasecmp(ent->name, name) == 0) {
+			use = ent;
+			break;
+		}
+		if (ent->stat == RC_FREE || ent->expire <= now) {
+			if (use == NULL || use->stat != RC_FREE)
+				use = ent;
+		} else if (use == NULL || (use->stat != RC_FREE &&
+		           use->expire > now && ent->expire < use->expire)) {
+			use = ent;
+		}
+	}
+	use->hash   = hash;
+	use->stat   = stat;
+	use->expire = now + (time_t) ttl;
+	use->addr   = addr;
+	misc_strncpy(use->name, name, sizeof(use->name));
+	resolv_lock(0);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_hosts
+**
+**	Parameters....:	name		Host name
+**			addr		Set to the address found
+**
+**	Return........:	1 if found in /etc/hosts, 0 if not
+**
+**	Purpose.......: The hosts file comes first, as with the
+**			system resolver. It is read on misses
+**			only, so changes are seen right away.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_hosts(char *name, u_int32_t *addr)
+{
+	char line[1024], *p, *a;
+	struct in_addr iadr;
+	FILE *fp;
+
+	if ((fp = fopen(RS_HOSTS, "r")) == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if ((a = strtok(line, " \t\r\n")) == NULL ||
+		    inet_aton(a, &iadr) == 0)
+			continue;
+		while ((p = strtok(NULL, " \t\r\n")) != NULL) {
+			if (strcasecmp(p, name) == 0) {
+				fclose(fp);
+				*addr = ntohl(iadr.s_addr);
+				return 1;
+			}
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_addr
+**
+**	Parameters....:	name		Host name or dotted quad
+**			addr		Set to the address found,
+**					INADDR_NONE on failure
+**
+**	Return........:	RS_DONE if addr is set, RS_WAIT if
+**			a query is in flight
+**
+**	Purpose.......: Non-blocking lookup for the event loop.
+**			Answers come from the cache or the hosts
+**			file; else a query is sent (or joined,
+**			if one for the name is in flight) and
+**			its answer is entered into the cache.
+**			Callers ask again once resolv_busy says
+**			the query is done.
+**
+** ------------------------------------------------------------ */
+
+int resolv_addr(char *name, u_int32_t *addr)
+{
+	struct hostent *hptr;
+	struct in_addr iadr;
+	RQUERY *rq;
+
+	*addr = INADDR_NONE;
+	if (name == NULL || *name == '\0' ||
+	    strlen(name) >= RS_NAMELEN)
+		return RS_DONE;
+
+	/*
+	** Dotted decimal needs no resolver
+	*/
+	if (*name >= '0' && *name <= '9') {
+		if (inet_aton(name, &iadr) != 0)
+			*addr = ntohl(iadr.s_addr);
+		return RS_DONE;
+	}
+
+	resolv_setup();
+	if (resolv_look(name, addr, 1))
+		return RS_DONE;
+	if (resolv_hosts(name, addr))
+		return RS_DONE;
+
+	/*
+	** Without a name server, block in the system resolver
+	*/
+	if (rasync == 0 || rnsrv == 0) {
+		if ((hptr = gethostbyname(name)) != NULL) {
+			memcpy(&iadr.s_addr, hptr->h_addr,
+			       sizeof(iadr.s_addr));
+			*addr = ntohl(iadr.s_addr);
+		}
+		return RS_DONE;
+	}
+
+	/*
+	** Join a query in flight or start a new one
+	*/
+	resolv_open();
+	for (rq = rqhead; rq != NULL; rq = rq->next) {
+		if (strcasecmp(rq->name, name) == 0) {
+			resolv_lock(1);
+			rctab->joined++;
+			resolv_lock(0);
+			return RS_WAIT;
+		}
+	}
+	if (resolv_start(name) != 0)
+		return RS_DONE;
+	return RS_WAIT;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_busy
+**
+**	Parameters....:	name		Host name
+**
+**	Return........:	1 if a query for name is in flight
+**
+**	Purpose.......: Lets a caller waiting for an answer
+**			know when to call resolv_addr again.
+**
+** ------------------------------------------------------------ */
+
+int resolv_busy(char *name)
+{
+	RQUERY *rq;
+
+	if (rpid != getpid() || name == NULL)
+		return 0;
+	for (rq = rqhead; rq != NULL; rq = rq->next) {
+		if (strcasecmp(rq->name, name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_wait
+**
+**	Parameters....:	name		Host name or dotted quad
+**			dflt		Default value
+**
+**	Return........:	Resolved address or default
+**
+**	Purpose.......: Blocking lookup through the cache for
+**			callers outside of the event loop. Only
+**			our own query sockets are polled, so a
+**			high descriptor number does no harm.
+**
+** ------------------------------------------------------------ */
+
+u_int32_t resolv_wait(char *name, u_int32_t dflt)
+{
+	struct pollfd pfd[RS_SOCKS];
+	u_int32_t addr;
+	RQUERY *rq;
+	time_t now, due;
+	int i, n, rc;
+
+	if (resolv_addr(name, &addr) == RS_WAIT) {
+		while (resolv_busy(name)) {
+			now = time(NULL);
+			for (due = 0, n = 0, rq = rqhead; rq; rq = rq->next) {
+				if (rq->sock == -1 || n >= RS_SOCKS)
+					continue;
+				pfd[n].fd      = rq->sock;
+				pfd[n].events  = POLLIN;
+				pfd[n].revents = 0;
+				n++;
+				if (due == 0 || rq->due < due)
+					due = rq->due;
+			}
+			rc = poll(pfd, n, (due > now) ?
+			          (int) (due - now) * 1000 : 0);
+			if (rc < 0 && errno != EINTR)
+				break;
+			for (i = 0; rc > 0 && i < n; i++) {
+				if (pfd[i].revents != 0)
+					resolv_event(pfd[i].fd);
+			}
+			if (rc <= 0)
+				resolv_event(-1);
+		}
+		if (resolv_look(name, &addr, 0) == 0)
+			addr = INADDR_NONE;
+	}
+	return (addr == INADDR_NONE) ? dflt : addr;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_start
+**
+**	Parameters....:	name		Host name
+**
+**	Return........:	0 if the query was sent or queued,
+**			-1 if not
+**
+**	Purpose.......: Start a query; names without a dot get
+**			the domain from resolv.conf appended at
+**			first (the bare name is tried next). If
+**			RS_SOCKS queries are out already, it is
+**			queued until one of them is done.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_start(char *name)
+{
+	RQUERY *rq;
+	size_t len;
+
+	rq = (RQUERY *) misc_alloc(FL, sizeof(RQUERY));
+	misc_strncpy(rq->name, name, sizeof(rq->name));
+	if (strchr(name, '.') == NULL && rdomain[0] != '\0' &&
+	    strlen(name) + strlen(rdomain) + 1 < sizeof(rq->qname)) {
+		strcpy(rq->qname, name);
+		strcat(rq->qname, ".");
+		strcat(rq->qname, rdomain);
+	} else {
+		misc_strncpy(rq->qname, name, sizeof(rq->qname));
+	}
+	len = strlen(rq->qname);
+	if (len > 1 && rq->qname[len - 1] == '.')
+		rq->qname[len - 1] = '\0';	/* Compared later */
+	rq->sock  = -1;
+	rq->tries = rnsrv * rretry;
+	rq->srv   = -1;
+	misc_random(&(rq->id), sizeof(rq->id));
+	gettimeofday(&(rq->beg), NULL);
+
+	resolv_lock(1);
+	rctab->miss++;
+	resolv_lock(0);
+
+	if (rqsocks < RS_SOCKS && resolv_send(rq) != 0) {
+		resolv_qclose(rq);
+		misc_free(FL, rq);
+		resolv_store(name, RC_NEG, 0, (u_int32_t) rnegttl);
+		return -1;
+	}
+	rq->next = rqhead;
+	rqhead   = rq;
+	resolv_arm();
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "resolver: query '%.256s' %s", rq->qname,
+	      (rq->sock == -1) ? "queued" : "sent");
+#endif
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_next
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Send queued queries while query sockets
+**			are available.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_next(void)
+{
+	RQUERY *rq, *nxt;
+
+	for (rq = rqhead; rq != NULL && rqsocks < RS_SOCKS; rq = nxt) {
+		nxt = rq->next;
+		if (rq->sock != -1)
+			continue;
+		if (resolv_send(rq) != 0) {
+			resolv_lock(1);
+			rctab->fail++;
+			resolv_lock(0);
+			resolv_done(rq, RC_NEG, 0, (u_int32_t) rnegttl);
+		}
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_qsock
+**
+**	Parameters....:	rq		Query
+**
+**	Return........:	0 on success, -1 on error
+**
+**	Purpose.......: Open a UDP socket of its own for a query,
+**			bound to a random port; together with the
+**			random id, a forged answer has to guess
+**			about 31 bits instead of 16.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_qsock(RQUERY *rq)
+{
+	struct sockaddr_in saddr;
+	u_int16_t port;
+	int i;
+
+	if ((rq->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		syslog_error("can't create resolver socket");
+		rq->sock = -1;
+		return -1;
+	}
+	fcntl(rq->sock, F_SETFL, fcntl(rq->sock, F_GETFL, 0) | O_NONBLOCK);
+#if defined(FD_CLOEXEC)
+	fcntl(rq->sock, F_SETFD, FD_CLOEXEC);
+#endif
+	rqsocks++;
+
+	/*
+	** Unprivileged ports only; if none of the tries
+	** is free, sendto takes an ephemeral port
+	*/
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family      = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	for (i = 0; i < 8; i++) {
+		misc_random(&port, sizeof(port));
+		port = 1024 + (u_int16_t) (port % (65536 - 1024));
+		saddr.sin_port = htons(port);
+		if (bind(rq->sock, (struct sockaddr *) &saddr,
+		         sizeof(saddr)) == 0)
+			break;
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_qclose
+**
+**	Parameters....:	rq		Query
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Close the socket of a query, if any.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_qclose(RQUERY *rq)
+{
+	if (rq->sock == -1)
+		return;
+	socket_unwatch(rq->sock);
+	close(rq->sock);
+	rq->sock = -1;
+	rqsocks--;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_send
+**
+**	Parameters....:	rq		Query in flight
+**
+**	Return........:	0 on success, -1 if no try is left
+**			or the name can't be encoded
+**
+**	Purpose.......: (Re-)send the question to the next name
+**			server. Socket and message id stay the
+**			same, so a late answer to an earlier try
+**			is still taken.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_send(RQUERY *rq)
+{
+	u_char buf[RS_PACKET];
+	struct sockaddr_in saddr;
+	int len;
+
+	if ((len = resolv_pack(buf, rq->id, rq->qname)) < 0)
+		return -1;
+	if (rq->sock == -1 && resolv_qsock(rq) != 0)
+		return -1;
+
+	while (rq->tries-- > 0) {
+		rq->srv = (rq->srv + 1) % rnsrv;
+
+		memset(&saddr, 0, sizeof(saddr));
+		saddr.sin_family      = AF_INET;
+		saddr.sin_addr.s_addr = htonl(rsrv[rq->srv]);
+		saddr.sin_port        = htons(rport);
+
+		/*
+		** The clock ticks in seconds; add one, so
+		** that a try gets at least ResolverTimeOut
+		*/
+		rq->due = time(NULL) + rtmout + 1;
+		resolv_lock(1);
+		rctab->sent++;
+		resolv_lock(0);
+		if (sendto(rq->sock, buf, len, 0,
+		           (struct sockaddr *) &saddr,
+		           sizeof(saddr)) == len)
+			return 0;
+		syslog_write(T_WRN, "can't send query to name server %s: %s",
+		             socket_addr2str(rsrv[rq->srv]), strerror(errno));
+	}
+	return -1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_pack
+**
+**	Parameters....:	buf		Message buffer (RS_PACKET)
+**			id		Message id
+**			name		Host name
+**
+**	Return........:	Message length or -1 for a bad name
+**
+**	Purpose.......: Encode a recursive A/IN question.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_pack(u_char *buf, u_int16_t id, char *name)
+{
+	u_char *p, *lenp;
+	int n;
+
+	memset(buf, 0, 12);
+	buf[0] = (u_char) (id >> 8);
+	buf[1] = (u_char) (id & 0xff);
+	buf[2] = 0x01;			/* RD: recursion desired */
+	buf[5] = 1;			/* QDCOUNT		 */
+
+	for (p = buf + 12; *name != '\0'; ) {
+		lenp = p++;
+		for (n = 0; *name != '\0' && *name != '.'; n++) {
+			if (n >= 63 || p - buf >= RS_PACKET - 6)
+				return -1;
+			*p++ = (u_char) *name++;
+		}
+		if (n == 0)
+			return -1;	/* Empty label	*/
+		*lenp = (u_char) n;
+		if (*name == '.')
+			name++;
+	}
+	*p++ = 0;			/* Root label	*/
+	*p++ = 0; *p++ = 1;		/* QTYPE  A	*/
+	*p++ = 0; *p++ = 1;		/* QCLASS IN	*/
+	return (int) (p - buf);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_name
+**
+**	Parameters....:	buf		Message
+**			len		Message length
+**			off		Offset of a domain name
+**			out		Buffer for the name
+**			size		Size of the buffer
+**
+**	Return........:	Offset behind the name or -1
+**
+**	Purpose.......: Decode a (possibly compressed) name to
+**			the dotted form, without the root dot.
+**			Pointer loops and labels with dots or
+**			NULs in them are refused.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_name(u_char *buf, int len, int off,
+                       char *out, size_t size)
+{
+	int end = -1, jumps = 0, c, i;
+	size_t n = 0;
+
+	while (1) {
+		if (off >= len)
+			return -1;
+		c = buf[off];
+		if (c == 0) {
+			if (end < 0)
+				end = off + 1;
+			break;
+		}
+		if ((c & 0xc0) == 0xc0) {
+			if (off + 1 >= len || ++jumps > RS_PACKET / 2)
+				return -1;
+			if (end < 0)
+				end = off + 2;
+			off = ((c & 0x3f) << 8) | buf[off + 1];
+			continue;
+		}
+		if ((c & 0xc0) != 0 || off + 1 + c > len ||
+		    n + c + 2 > size)
+			return -1;
+		if (n > 0)
+			out[n++] = '.';
+		for (i = 1; i <= c; i++) {
+			if (buf[off + i] == '.' || buf[off + i] == '\0')
+				return -1;
+			out[n++] = (char) buf[off + i];
+		}
+		off += c + 1;
+	}
+	out[n] = '\0';
+	return end;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_quest
+**
+**	Parameters....:	buf		Message
+**			len		Message length
+**			qname		Name we asked for
+**
+**	Return........:	Offset behind the question or -1
+**
+**	Purpose.......: An answer has to echo our question:
+**			exactly one, with our name, type A and
+**			class IN.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_quest(u_char *buf, int len, char *qname)
+{
+	char name[RS_NAMELEN];
+	int off;
+
+	if (len < 12 || buf[4] != 0 || buf[5] != 1)
+		return -1;
+	if ((off = resolv_name(buf, len, 12, name, sizeof(name))) < 0 ||
+	    off + 4 > len || strcasecmp(name, qname) != 0)
+		return -1;
+	if (buf[off] != 0 || buf[off + 1] != 1 ||	/* QTYPE  A  */
+	    buf[off + 2] != 0 || buf[off + 3] != 1)	/* QCLASS IN */
+		return -1;
+	return off + 4;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_parse
+**
+**	Parameters....:	buf		Message
+**			len		Message length
+**			off		Offset behind the question
+**			qname		Name we asked for
+**			addr		Set to the address found
+**			ttl		Set to its time to live
+**
+**	Return........:	RC_POS, RC_NEG (no such name / no
+**			address) or -1 if the server failed
+**
+**	Purpose.......: Evaluate the answer to our question.
+**			Only A records owned by qname or by a
+**			name its CNAME chain leads to count;
+**			the TTL is the lowest along the chain.
+**
+** ------------------------------------------------------------ */
+
+static int resolv_parse(u_char *buf, int len, int off, char *qname,
+                        u_int32_t *addr, u_int32_t *ttl)
+{
+	char want[RS_NAMELEN], owner[RS_NAMELEN], alias[RS_NAMELEN];
+	int rcode, an, n, pos, end, type, class, rdlen, hops, found;
+	u_int32_t rttl, minttl = 0xffffffffU;
+
+	rcode = buf[3] & 0x0f;
+	if (rcode == 3) {		/* NXDOMAIN		*/
+		*ttl = (u_int32_t) rnegttl;
+		return RC_NEG;
+	}
+	if (rcode != 0 || (buf[2] & 0x02))
+		return -1;		/* Failed or truncated	*/
+
+	an = (buf[6] << 8) | buf[7];
+	misc_strncpy(want, qname, sizeof(want));
+	for (hops = 0; hops <= RS_CHAIN; hops++) {
+		found = 0;
+		for (pos = off, n = an; n > 0; n--) {
+			if ((pos = resolv_name(buf, len, pos, owner,
+			                       sizeof(owner))) < 0 ||
+			    pos + 10 > len)
+				return -1;
+			type  = (buf[pos] << 8) | buf[pos + 1];
+			class = (buf[pos + 2] << 8) | buf[pos + 3];
+			rttl  = ((u_int32_t) buf[pos + 4] << 24) |
+			        ((u_int32_t) buf[pos + 5] << 16) |
+			        ((u_int32_t) buf[pos + 6] <<  8) |
+			         (u_int32_t) buf[pos + 7];
+			rdlen = (buf[pos + 8] << 8) | buf[pos + 9];
+			pos  += 10;
+			if (pos + rdlen > len)
+				return -1;
+			if (class != 1 || strcasecmp(owner, want) != 0) {
+				pos += rdlen;
+				continue;	/* Not on our chain */
+			}
+			if (type == 1 && rdlen == 4) {
+				*ttl  = (rttl < minttl) ? rttl : minttl;
+				*addr = ((u_int32_t) buf[pos]     << 24) |
+				        ((u_int32_t) buf[pos + 1] << 16) |
+				        ((u_int32_t) buf[pos + 2] <<  8) |
+				         (u_int32_t) buf[pos + 3];
+				return RC_POS;
+			}
+			if (type == 5 && found == 0) {
+				end = resolv_name(buf, len, pos, alias,
+				                  sizeof(alias));
+				if (end < 0 || end > pos + rdlen)
+					return -1;
+				if (rttl < minttl)
+					minttl = rttl;
+				found = 1;
+			}
+			pos += rdlen;
+		}
+		if (found == 0)
+			break;
+		misc_strncpy(want, alias, sizeof(want));
+	}
+	*ttl = (u_int32_t) rnegttl;	/* No address	*/
+	return RC_NEG;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_done
+**
+**	Parameters....:	rq		Finished query
+**			stat		RC_POS or RC_NEG
+**			addr		Address (host order)
+**			ttl		Time to live (secs)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Cache the answer, account the latency
+**			and release the query.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_done(RQUERY *rq, int stat, u_int32_t addr,
+                        u_int32_t ttl)
+{
+	RQUERY **pp;
+	struct timeval now;
+	double ms;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec  - rq->beg.tv_sec)  * 1000.0 +
+	     (now.tv_usec - rq->beg.tv_usec) / 1000.0;
+
+	resolv_store(rq->name, stat, addr, ttl);
+	resolv_lock(1);
+	rctab->lcnt++;
+	rctab->lsum += ms;
+	if (ms > rctab->lmax)
+		rctab->lmax = ms;
+	resolv_lock(0);
+
+	syslog_write(T_DBG, "resolved '%.256s' to %s in %.1f ms (ttl %u)",
+	             rq->name, (stat == RC_POS) ? socket_addr2str(addr)
+	                                        : "(none)", ms, ttl);
+
+	for (pp = &rqhead; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == rq) {
+			*pp = rq->next;
+			break;
+		}
+	}
+	resolv_qclose(rq);
+	misc_free(FL, rq);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_event
+**
+**	Parameters....:	sock		Query socket or -1
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Watch callback for socket_exec: read the
+**			answer that arrived on a query socket,
+**			then retry or fail the queries whose try
+**			timed out and send queued ones.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_event(int sock)
+{
+	u_char buf[RS_PACKET];
+	struct sockaddr_in from;
+	socklen_t flen;
+	RQUERY *rq, *nxt;
+	u_int32_t addr, ttl;
+	u_int16_t id;
+	time_t now;
+	int len, rc, off, i;
+
+	for (rq = rqhead; sock != -1 && rq != NULL; rq = rq->next) {
+		if (rq->sock == sock)
+			break;
+	}
+	while (sock != -1 && rq != NULL) {
+		flen = sizeof(from);
+		len  = recvfrom(sock, buf, sizeof(buf), 0,
+		                (struct sockaddr *) &from, &flen);
+		if (len < 0)
+			break;
+		if (len < 12 || !(buf[2] & 0x80))
+			continue;	/* Not an answer	*/
+
+		/*
+		** The answer has to come from one of our
+		** servers, carry our id and echo our question
+		*/
+		for (i = 0; i < rnsrv; i++) {
+			if (ntohl(from.sin_addr.s_addr) == rsrv[i])
+				break;
+		}
+		id = (u_int16_t) ((buf[0] << 8) | buf[1]);
+		if (i == rnsrv || ntohs(from.sin_port) != rport ||
+		    id != rq->id ||
+		    (off = resolv_quest(buf, len, rq->qname)) < 0) {
+			syslog_write(T_DBG, "resolver: bogus answer from "
+			             "%s:%d for '%.256s' dropped",
+			             socket_addr2str(ntohl(
+			                 from.sin_addr.s_addr)),
+			             (int) ntohs(from.sin_port), rq->qname);
+			continue;	/* Forged or late	*/
+		}
+
+		addr = ttl = 0;
+		rc = resolv_parse(buf, len, off, rq->qname, &addr, &ttl);
+		if (rc < 0) {
+			if (resolv_send(rq) != 0) {
+				resolv_lock(1);
+				rctab->fail++;
+				resolv_lock(0);
+				resolv_done(rq, RC_NEG, 0,
+				            (u_int32_t) rnegttl);
+			}
+			break;
+		}
+
+		/*
+		** A short name with the domain appended
+		** failed - try the bare name as well, with
+		** a new id and port
+		*/
+		if (rc == RC_NEG && strcmp(rq->qname, rq->name) != 0) {
+			misc_strncpy(rq->qname, rq->name, sizeof(rq->qname));
+			rq->tries = rnsrv * rretry;
+			misc_random(&(rq->id), sizeof(rq->id));
+			resolv_qclose(rq);
+			if (resolv_send(rq) == 0)
+				break;
+		}
+		resolv_done(rq, rc, addr, ttl);
+		break;
+	}
+
+	/*
+	** Check for timed out tries
+	*/
+	now = time(NULL);
+	for (rq = rqhead; rq != NULL; rq = nxt) {
+		nxt = rq->next;
+		if (rq->sock == -1 || rq->due > now)
+			continue;
+		resolv_lock(1);
+		rctab->tmout++;
+		resolv_lock(0);
+		syslog_write(T_DBG, "name server %s: no answer for '%.256s'",
+		             socket_addr2str(rsrv[rq->srv]), rq->qname);
+		if (resolv_send(rq) != 0) {
+			resolv_lock(1);
+			rctab->fail++;
+			resolv_lock(0);
+			syslog_write(T_WRN, "can't resolve '%.256s': "
+			             "no name server answered", rq->name);
+			resolv_done(rq, RC_NEG, 0, (u_int32_t) rnegttl);
+		}
+	}
+	resolv_next();
+	resolv_arm();
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_arm
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Tell socket_exec about our query sockets
+**			and their try deadlines.
+**
+** ------------------------------------------------------------ */
+
+static void resolv_arm(void)
+{
+	RQUERY *rq;
+
+	for (rq = rqhead; rq != NULL; rq = rq->next) {
+		if (rq->sock != -1)
+			socket_watch(rq->sock, resolv_event, rq->due);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	resolv_stats
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log the cache and query counters.
+**
+** ------------------------------------------------------------ */
+
+void resolv_stats(void)
+{
+	u_long hits, nhits, miss, joined, sent, tmout, fail, lcnt;
+	double lsum, lmax;
+	u_int32_t i;
+	int used = 0;
+	time_t now;
+
+	if (rctab == NULL)
+		return;
+
+	now = time(NULL);
+	resolv_lock(1);
+	hits   = rctab->hits;
+	nhits  = rctab->nhits;
+	miss   = rctab->miss;
+	joined = rctab->joined;
+	sent   = rctab->sent;
+	tmout  = rctab->tmout;
+	fail   = rctab->fail;
+	lcnt   = rctab->lcnt;
+	lsum   = rctab->lsum;
+	lmax   = rctab->lmax;
+	for (i = 0; i <= rctab->mask; i++) {
+		if (rctab->ent[i].stat != RC_FREE &&
+		    rctab->ent[i].expire > now)
+			used++;
+	}
+	resolv_lock(0);
+
+	syslog_write(T_INF, "resolver: %lu hits, %lu negative hits, "
+	             "%lu misses, %lu joined, %d/%lu cached",
+	             hits, nhits, miss, joined, used,
+	             (u_long) rctab->mask + 1);
+	syslog_write(T_INF, "resolver: %lu queries sent, %lu timed out, "
+	             "%lu failed, latency avg %.1f ms, max %.1f ms",
+	             sent, tmout, fail,
+	             lcnt ? lsum / lcnt : 0.0, lmax);
+}
+
+
+/* ------------------------------------------------------------
+ * $Log$
+ *
+ * ------------------------------------------------------------ */
@@ -0,0 +1,58 @@
+/*
+ * $Id$
+ *
+ * Header for the common caching host name resolver
+ *
+ * Author(s): Jens-Gero Boehm <jens-gero.boehm@suse.de>
+ *            Pieter Hollants <pieter.hollants@suse.de>
+ *            Marius Tomaschewski <mt@suse.de>
+ *            Volker Wiegand <volker.wiegand@suse.de>
+ *
+ * This file is part of the SuSE Proxy Suite
+ *            See also  http://proxy-suite.suse.de/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * A history log can be found at the end of this file.
+ */
+
+#if !defined(_COM_RESOLV_H_)
+#define _COM_RESOLV_H_
+
+#include <config.h>
+#include <sys/types.h>
+
+/* ------------------------------------------------------------ */
+
+#define RS_DONE		0	/* Answer (or failure) is known	*/
+#define RS_WAIT		1	/* Query is still in flight	*/
+
+/* ------------------------------------------------------------ */
+
+void      resolv_init(void);
+int       resolv_addr(char *name, u_int32_t *addr);
+int       resolv_busy(char *name);
+u_int32_t resolv_wait(char *name, u_int32_t dflt);
+void      resolv_stats(void);
+
+/* ------------------------------------------------------------ */
+
+#endif /* defined(_COM_RESOLV_H_) */
+
+/* ------------------------------------------------------------
+ * $Log$
+ *
+ * ------------------------------------------------------------ */
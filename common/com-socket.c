@@ -35,6 +35,8 @@ static char rcsid[] = "$Id: com-socket.c,v 1.7.2.2 2005/01/10 11:37:36 mt Exp $"
 
 #include <config.h>
 
+#define _GNU_SOURCE		/* needed for splice in Linux... */
+
 #if defined(STDC_HEADERS)
 #  include <stdio.h>
 #  include <string.h>
@@ -62,6 +64,10 @@ static char rcsid[] = "$Id: com-socket.c,v 1.7.2.2 2005/01/10 11:37:36 mt Exp $"
 #  include <sys/select.h>
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H)
+#  include <sys/epoll.h>
+#endif
+
 #if defined(HAVE_FCNTL_H)
 #  include <fcntl.h>
 #elif defined(HAVE_SYS_FCNTL_H)
@@ -74,6 +80,7 @@ static char rcsid[] = "$Id: com-socket.c,v 1.7.2.2 2005/01/10 11:37:36 mt Exp $"
 #endif
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #if defined(HAVE_NETINET_IN_SYSTM_H)
 #   include <netinet/in_systm.h>
@@ -138,6 +145,7 @@ static char rcsid[] = "$Id: com-socket.c,v 1.7.2.2 2005/01/10 11:37:36 mt Exp $"
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-resolv.h"
 #include "com-socket.h"
 #include "com-syslog.h"
 
@@ -152,14 +160,134 @@ static char rcsid[] = "$Id: com-socket.c,v 1.7.2.2 2005/01/10 11:37:36 mt Exp $"
 #  define NETSIZ	8192	/* Default network buffer size	*/
 #endif
 
+#define EV_SELECT	0	/* Event engine: select()	*/
+#define EV_EPOLL	1	/* Event engine: epoll (Linux)	*/
+
+#define EV_RD		0x01	/* Interest/ready: readable	*/
+#define EV_WR		0x02	/* Interest/ready: writable	*/
+#define EV_REG		0x04	/* Socket is registered		*/
+#define EV_QUE		0x08	/* Socket is on the ready list	*/
+#define EV_HUP		0x10	/* Peer has closed (sticky)	*/
+
+#define EV_MAXEVENTS	64	/* Events per epoll_wait call	*/
+
+#if defined(EPOLLRDHUP)
+#  define EV_RDHUP	EPOLLRDHUP	/* Linux 2.6.17+	*/
+#else
+#  define EV_RDHUP	0
+#endif
+
+#if defined(HAVE_SPLICE) && defined(SPLICE_F_NONBLOCK)
+#  define HAVE_RELAY	1	/* Zero-copy relay available	*/
+#endif
+#define RELAY_SIZE	65536	/* Default relay pipe capacity	*/
+
+#define BUF_CLASSES	3	/* Number of BUF pool classes	*/
+#define BUF_SEGMAX	65536	/* Largest pooled BUF segment	*/
+
+#define SOCK_IOVMAX	16	/* Segments per readv / writev	*/
+#define RD_MINSIZE	2048	/* Smallest adaptive read size	*/
+
+#define WR_HIGHMARK	262144	/* Default output high mark	*/
+#define WR_LOWMARK	65536	/* Default output low mark	*/
+
+#define CN_TIMEOUT	30	/* Default connect timeout	*/
+#define CN_DESTS	16	/* Destinations with latency	*/
+#define WT_MAX		24	/* Max. watched descriptors	*/
+
+/*
+** Output is pending in the buffers or the relay pipe;
+** reading stops while the relay peer's pipe is full.
+*/
+#define WPENDING(h)	((h)->wbuf != NULL || (h)->plen > 0)
+#define RBLOCKED(h)	((h)->rlay != NULL && \
+			 (h)->rlay->plen >= (h)->rlay->pmax)
+
+
+/*
+** State of a non-blocking connect while it is in progress
+*/
+typedef struct scon_t {
+	u_int32_t addr;		/* Destination address		*/
+	u_int16_t port;		/* Destination port		*/
+	u_int32_t ladr;		/* Local address to bind to	*/
+	u_int16_t lrng;		/* Lower local port range limit	*/
+	u_int16_t urng;		/* Upper local port range limit	*/
+	u_int16_t lprt;		/* Local port bound last	*/
+	int       incr;		/* Incremental port binding	*/
+	int       kind;		/* Socket kind for socket_opts	*/
+	int       retry;	/* Retries left			*/
+	time_t    due;		/* Deadline (0=none)		*/
+	struct timeval beg;	/* Start of the connect		*/
+} SCON;
+
+/*
+** Foreign descriptor watched by socket_exec (e.g. the
+** resolver's socket); a slot is free without func
+*/
+typedef struct {
+	int     sock;		/* Watched descriptor		*/
+	time_t  due;		/* Deadline (0=none)		*/
+	WTCH_CB func;		/* Call back function		*/
+	int     rdy;		/* Reported readable		*/
+	int     reg;		/* Registered with epoll	*/
+} WATCH;
+
 
 /* ------------------------------------------------------------ */
 
+static void socket_setup   (void);
 static void socket_cleanup (void);
 static void socket_accept  (void);
+static int  socket_lpick   (void);
+
+static int  socket_sel_exec(int timeout, int *close_flag);
+#if defined(HAVE_SYS_EPOLL_H)
+static int  socket_ev_exec (int timeout, int *close_flag);
+static int  socket_ev_open (void);
+static void socket_ev_reset(void);
+static void socket_ev_set  (HLS *hls, int want);
+static void socket_ev_del  (HLS *hls);
+static void socket_ev_drop (HLS *rdy);
+#endif
 
 static void socket_ll_read (HLS *hls);
+static void socket_rd_direct(HLS *hls);
+static int  socket_rd_segs (HLS *hls, int len);
+static int  socket_rd_ceil (void);
 static void socket_ll_write(HLS *hls);
+static void socket_ll_close(HLS *hls);
+static int  socket_nblock  (int sock);
+
+static u_int16_t socket_connect(u_int32_t addr, u_int16_t port,
+				u_int32_t ladr,
+				u_int16_t lrng, u_int16_t urng,
+				HLS **phls, char *ctyp,
+				int incr, int kind);
+static int  socket_cn_start(SCON *scon, char *ctyp, int *busy);
+static int  socket_cn_retry(SCON *scon, int err);
+static int  socket_cn_due  (HLS *hls, time_t now, int *wait);
+static void socket_wt_due  (time_t now, int *wait);
+static void socket_wt_fire (void);
+static void socket_wt_drop (WATCH *wt);
+static void socket_cn_done (HLS *hls);
+static void socket_cn_fail (HLS *hls, int err);
+static void socket_cn_note (HLS *hls);
+
+#if defined(HAVE_RELAY)
+static int  socket_sp_read (HLS *hls);
+static void socket_sp_write(HLS *hls);
+static int  socket_sp_pipe (HLS *hls);
+#endif
+static void socket_sp_drop (HLS *hls);
+
+static BUF *socket_bf_get  (size_t len);
+static void socket_bf_put  (BUF *buf);
+static void socket_bf_link (BUF **head, BUF **tail, BUF *frst, BUF *last);
+static void socket_bf_pack (HLS *hls);
+static void socket_bf_skip (HLS *hls, int chr);
+static char *socket_eol    (char *ptr, size_t len);
+static void socket_bf_flush(void);
 
 
 /* ------------------------------------------------------------ */
@@ -167,8 +295,15 @@ static void socket_ll_write(HLS *hls);
 static int initflag = 0;	/* Have we been initialized?	*/
 
 static int lsock = -1;		/* Daemon: listening socket	*/
+static int lsocks[MAX_SHARDS];	/* All listener shards		*/
+static int lcnt  = 0;		/* Listener shards open		*/
+static int lwant = 1;		/* Listener shards requested	*/
+static pid_t lpid = 0;		/* Process owning the listener	*/
+static int lhold = 0;		/* Listener out of socket_exec	*/
 static ACPT_CB acpt_fp = NULL;	/* Call back function pointer	*/
 
+static WATCH wtab[WT_MAX];	/* The watched descriptors	*/
+
 static HLS *hlshead = NULL;	/* Chain of HighLevSock's	*/
 
 #if defined(HAVE_LIBWRAP)
@@ -177,6 +312,151 @@ int deny_severity  = LOG_WARNING;
 #endif
 
 static int maxrecv_bufsiz = -1;	/* max receive buffer size	*/
+static int rd_probe = 0;	/* Ask FIONREAD before reads	*/
+
+static int wr_high = WR_HIGHMARK; /* Output queue high mark	*/
+static int wr_low  = WR_LOWMARK;  /* Output queue low mark	*/
+
+static int evmode = EV_SELECT;	/* Event engine in use		*/
+#if defined(HAVE_SYS_EPOLL_H)
+static int evfd  = -1;		/* epoll instance descriptor	*/
+static pid_t evpid = 0;		/* Process owning the instance	*/
+static int lsreg = 0;		/* Listener is registered	*/
+#endif
+
+static int cn_timeout = CN_TIMEOUT; /* Connect timeout (secs)	*/
+
+/*
+** Connect latency, recorded per destination
+*/
+static struct {
+	u_int32_t addr;		/* Destination address		*/
+	u_long    cnt;		/* Number of connects		*/
+	double    sum;		/* Sum of latencies (ms)	*/
+	double    max;		/* Maximum latency (ms)		*/
+} cnstat[CN_DESTS];
+static int cnused = 0;		/* Entries used in cnstat	*/
+
+static int relay_ok   = 0;	/* Zero-copy relay enabled	*/
+static int relay_size = RELAY_SIZE; /* Relay pipe capacity	*/
+
+/*
+** Size-classed free lists for the BUF segments; large
+** data reads use the biggest class, control lines the
+** smallest one. Bigger requests bypass the pool.
+*/
+static struct {
+	size_t  siz;		/* Payload capacity of class	*/
+	int     max;		/* Max. buffers kept on list	*/
+	int     cnt;		/* Buffers currently on list	*/
+	BUF    *head;		/* The free list itself		*/
+} bfpool[BUF_CLASSES] = {
+	{  2048, 64, 0, NULL },
+	{ 16384, 16, 0, NULL },
+	{ 65536,  8, 0, NULL }
+};
+
+static u_long bfhits = 0;	/* Requests served from a list	*/
+static u_long bfmiss = 0;	/* Requests needing malloc	*/
+static size_t bfheld = 0;	/* Bytes held on the lists	*/
+
+static u_long iorops = 0;	/* Read system calls issued	*/
+static u_long iowops = 0;	/* Write system calls issued	*/
+static double iorbytes = 0.0;	/* Bytes transferred by reads	*/
+static double iowbytes = 0.0;	/* Bytes transferred by writes	*/
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_setup
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: One-time initialization of the socket
+**			related data (config values, cleanup).
+**
+** ------------------------------------------------------------ */
+
+static void socket_setup(void)
+{
+	char *p;
+
+	if (initflag != 0)
+		return;
+	atexit(socket_cleanup);
+	initflag = 1;
+
+	/*
+	** Check if we should limit the recv buffer size...
+	** (because the link on the write side is much slower)
+	*/
+	if(maxrecv_bufsiz < 0) {
+		maxrecv_bufsiz = config_int(NULL, "MaxRecvBufSize", 0);
+		if(maxrecv_bufsiz < 0)
+			maxrecv_bufsiz = 0;
+	}
+
+	/*
+	** Read without asking for the pending bytes first;
+	** MaxRecvBufSize is the ceiling of the read size
+	*/
+	rd_probe = config_bool(NULL, "ReadProbe", 0);
+
+	/*
+	** Connects are driven by socket_exec and give
+	** up after this time (0 = system default)
+	*/
+	cn_timeout = config_int(NULL, "ConnectTimeOut", CN_TIMEOUT);
+	if (cn_timeout < 0)
+		cn_timeout = 0;
+
+	/*
+	** Output queue watermarks for the flow control
+	** between two sockets (see socket_flow)
+	*/
+	wr_high = config_int(NULL, "QueueHighMark", WR_HIGHMARK);
+	if (wr_high < RD_MINSIZE)
+		wr_high = RD_MINSIZE;
+	wr_low  = config_int(NULL, "QueueLowMark", wr_high / 4);
+	if (wr_low < 0 || wr_low > wr_high)
+		wr_low = wr_high / 4;
+
+	/*
+	** Select the event engine driving socket_exec;
+	** epoll is the default where the system has it.
+	*/
+	p = config_str(NULL, "EventEngine", NULL);
+#if defined(HAVE_SYS_EPOLL_H)
+	evmode = EV_EPOLL;
+	if (p != NULL && 0 == strcasecmp(p, "select"))
+		evmode = EV_SELECT;
+	else
+	if (p != NULL && 0 != strcasecmp(p, "epoll"))
+		syslog_write(T_WRN, "unknown EventEngine '%.64s' - "
+		                    "using epoll", p);
+#else
+	evmode = EV_SELECT;
+	if (p != NULL && 0 != strcasecmp(p, "select"))
+		syslog_write(T_WRN, "unsupported EventEngine '%.64s' - "
+		                    "using select", p);
+#endif
+#if defined(COMPILE_DEBUG)
+	debug(2, "event engine: %s",
+		(evmode == EV_EPOLL) ? "epoll" : "select");
+#endif
+
+	/*
+	** Relay data connections through a kernel pipe
+	** using splice, unless disabled or unsupported
+	*/
+#if defined(HAVE_RELAY)
+	relay_ok = config_bool(NULL, "DataSplice", 1);
+#else
+	relay_ok = 0;
+#endif
+}
 
 /* ------------------------------------------------------------ **
 **
@@ -196,6 +476,47 @@ static void socket_cleanup(void)
 
 	while (hlshead != NULL)
 		socket_kill(hlshead);
+
+	socket_bf_flush();
+
+#if defined(HAVE_SYS_EPOLL_H)
+	if (evfd != -1) {
+		close(evfd);
+		evfd = -1;
+	}
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_lshards
+**
+**	Parameters....:	cnt		Number of listener shards
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Request cnt listening sockets bound to
+**			the same address with SO_REUSEPORT, so
+**			the kernel spreads the incoming clients
+**			over them. Call before socket_listen.
+**
+** ------------------------------------------------------------ */
+
+void socket_lshards(int cnt)
+{
+	if (cnt < 1)
+		cnt = 1;
+	else if (cnt > MAX_SHARDS)
+		cnt = MAX_SHARDS;
+#if !defined(SO_REUSEPORT)
+	if (cnt > 1) {
+		syslog_write(T_WRN, "SO_REUSEPORT not supported - "
+		                    "using one listener");
+		cnt = 1;
+	}
+#endif
+	lwant = cnt;
 }
 
 
@@ -209,28 +530,20 @@ static void socket_cleanup(void)
 **	Return........:	0=success, -1=failure (EADDRINUSE)
 **			Other errors make the program die.
 **
-**	Purpose.......: Opens a listening port.
+**	Purpose.......: Opens a listening port; with shards
+**			requested one socket per shard.
 **
 ** ------------------------------------------------------------ */
 
 int socket_listen(u_int32_t addr, u_int16_t port, ACPT_CB func)
 {
 	struct sockaddr_in saddr;
+	int sock;
+#if defined(SO_REUSEPORT)
+	int opt;
+#endif
 
-	if (initflag == 0) {
-		atexit(socket_cleanup);
-		initflag = 1;
-
-		/*
-		** Check if we should limit the recv buffer size...
-		** (because the link on the write side is much slower)
-		*/
-		if(maxrecv_bufsiz < 0) {
-			maxrecv_bufsiz = config_int(NULL, "MaxRecvBufSize", 0);
-			if(maxrecv_bufsiz < 0)
-				maxrecv_bufsiz = 0;
-		}
-	}
+	socket_setup();
 
 	/*
 	** Remember whom to call back for accept
@@ -246,31 +559,85 @@ int socket_listen(u_int32_t addr, u_int16_t port, ACPT_CB func)
 	saddr.sin_port        = htons(port);
 
 #if defined(COMPILE_DEBUG)
-	debug(2, "about to listen: %s:%d",
-			inet_ntoa(saddr.sin_addr), (int) port);
+	debug(2, "about to listen: %s:%d (%d shards)",
+			inet_ntoa(saddr.sin_addr), (int) port, lwant);
 #endif
 
-	if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		syslog_error("can't create listener socket");
-		exit(EXIT_FAILURE);
-	}
-	socket_opts(lsock, SK_LISTEN);
+	for (lcnt = 0; lcnt < lwant; lcnt++) {
+		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			syslog_error("can't create listener socket");
+			exit(EXIT_FAILURE);
+		}
+		socket_opts(sock, SK_LISTEN);
+#if defined(SO_REUSEPORT)
+		opt = 1;
+		if (lwant > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+		                            &opt, sizeof(opt)) < 0) {
+			syslog_error("can't share listener socket");
+			exit(EXIT_FAILURE);
+		}
+#endif
 
-	if (bind(lsock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0) {
-		if (errno == EADDRINUSE) {
-			syslog_write(T_WRN,
-				"port %d is in use...", (int) port);
-			return -1;
+		if (bind(sock, (struct sockaddr *) &saddr,
+		                         sizeof(saddr)) < 0) {
+			if (errno == EADDRINUSE && lcnt == 0) {
+				close(sock);
+				syslog_write(T_WRN,
+					"port %d is in use...", (int) port);
+				return -1;
+			}
+			syslog_error("can't bind to %s:%d",
+					inet_ntoa(saddr.sin_addr), (int) port);
+			exit(EXIT_FAILURE);
 		}
-		syslog_error("can't bind to %s:%d",
-				inet_ntoa(saddr.sin_addr), (int) port);
-		exit(EXIT_FAILURE);
+		listen(sock, SOMAXCONN);
+
+		/*
+		** The listeners never block; the accepts
+		** are drained until there is nothing left
+		*/
+		socket_nblock(sock);
+		lsocks[lcnt] = sock;
 	}
-	listen(lsock, SOMAXCONN);
+	lsock = lsocks[0];
+	lpid  = getpid();
 	return 0;
 }
 
 
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_lshard
+**
+**	Parameters....:	idx		Listener shard to keep
+**
+**	Return........:	Index of the shard kept
+**
+**	Purpose.......: Used by a pre-forked worker to accept
+**			from one listener shard only; closes
+**			its copies of the other ones.
+**
+** ------------------------------------------------------------ */
+
+int socket_lshard(int idx)
+{
+	int i;
+
+	if (lcnt < 2)
+		return 0;
+	if (idx < 0 || idx >= lcnt)
+		idx = 0;
+
+	for (i = 0; i < lcnt; i++) {
+		if (i != idx)
+			close(lsocks[i]);
+	}
+	lsock = lsocks[0] = lsocks[idx];
+	lcnt  = 1;
+	return idx;
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	socket_lclose
@@ -286,11 +653,122 @@ int socket_listen(u_int32_t addr, u_int16_t port, ACPT_CB func)
 void socket_lclose(int shut)
 {
 	if (lsock != -1) {
-		if (shut)
+		/*
+		** A shutdown hits all processes sharing the
+		** listener - leave that to its owner, unless
+		** workers are still accepting on it
+		*/
+		if (shut && lpid == getpid() && lhold == 0)
 			shutdown(lsock, 2);
+#if defined(HAVE_SYS_EPOLL_H)
+		if (lsreg != 0 && evfd != -1 && evpid == getpid())
+			epoll_ctl(evfd, EPOLL_CTL_DEL, lsock, NULL);
+		lsreg = 0;
+#endif
+		while (lcnt > 0) {
+			if (lsocks[--lcnt] != lsock)
+				close(lsocks[lcnt]);
+		}
 		close(lsock);
 		lsock = -1;
 	}
+
+#if defined(HAVE_SYS_EPOLL_H)
+	/*
+	** A forked child closes the inherited listener;
+	** it must not touch the parent's epoll instance
+	** either, so forget it and create an own one.
+	*/
+	if (evfd != -1 && evpid != getpid())
+		socket_ev_reset();
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_lserve
+**
+**	Parameters....:	func		Accept callback or NULL
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Change who accepts on the listening socket.
+**			With NULL it stays open, but out of the
+**			socket_exec loop; pre-forked workers use
+**			socket_lwait or serve it with an own
+**			callback from their socket_exec loop.
+**
+** ------------------------------------------------------------ */
+
+void socket_lserve(ACPT_CB func)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+	/*
+	** A worker must not touch the epoll instance
+	** inherited from the daemon
+	*/
+	if (evfd != -1 && evpid != getpid())
+		socket_ev_reset();
+	if (func == NULL && lsreg != 0) {
+		if (lsock != -1 && evfd != -1)
+			epoll_ctl(evfd, EPOLL_CTL_DEL, lsock, NULL);
+		lsreg = 0;
+	}
+#endif
+
+	acpt_fp = func;
+	lhold   = (func == NULL);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_lwait
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Accepted socket or -1 if none
+**
+**	Purpose.......: Wait for and accept a new client on the
+**			(shared) listening socket. Used by the
+**			pre-forked workers instead of socket_exec.
+**
+** ------------------------------------------------------------ */
+
+int socket_lwait(void)
+{
+	fd_set rfds;
+	int nsock;
+
+	socket_setup();
+
+	if (lsock == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+#if defined(HAVE_SYS_EPOLL_H)
+	/*
+	** The inherited epoll instance belongs to the
+	** daemon; the sessions need an own one
+	*/
+	if (evfd != -1 && evpid != getpid())
+		socket_ev_reset();
+#endif
+
+	/*
+	** Other processes may take the client first;
+	** wait again when we lost the race
+	*/
+	do {
+		FD_ZERO(&rfds);
+		FD_SET(lsock, &rfds);
+		if (select(lsock + 1, &rfds, NULL, NULL, NULL) < 0)
+			return -1;
+		nsock = socket_lpick();
+	} while (nsock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+	return nsock;
 }
 
 
@@ -302,26 +780,76 @@ void socket_lclose(int shut)
 **
 **	Return........:	(none)
 **
-**	Purpose.......: Accept a new client connection.
+**	Purpose.......: Accept the pending client connections,
+**			until there are none left or the callback
+**			stops serving the listener.
 **
 ** ------------------------------------------------------------ */
 
 static void socket_accept(void)
+{
+	int nsock;
+
+	while (lsock != -1 && lhold == 0) {
+		if ((nsock = socket_lpick()) < 0) {
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			break;
+		}
+
+		/*
+		** Perform user level initialization
+		*/
+		if (acpt_fp)
+			(*acpt_fp)(nsock);
+		else
+			close(nsock);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_lpick
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Accepted socket or -1 if none
+**
+**	Purpose.......: Accept a connection from the listening
+**			socket and apply the access checks and
+**			the basic socket options.
+**
+** ------------------------------------------------------------ */
+
+static int socket_lpick(void)
 {
 	char peer[PEER_LEN] = {0};
 	char dest[PEER_LEN] = {0};
 	struct sockaddr_in saddr;
-	int nsock, len;
+	socklen_t len;
+	int nsock;
 
 	/*
 	** Let the show begin ...
 	*/
 	memset(&saddr, 0, sizeof(saddr));
 	len = sizeof(saddr);
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	nsock = accept4(lsock, (struct sockaddr *) &saddr, &len,
+	                SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	nsock = accept(lsock, (struct sockaddr *) &saddr, &len);
+#endif
 	if (nsock < 0) {
-		syslog_error("can't accept client");
-		return;
+		/*
+		** Workers are woken by signals and may
+		** lose the race for a dropped client
+		*/
+		if (errno != EINTR && errno != ECONNABORTED &&
+		    errno != EAGAIN && errno != EWOULDBLOCK)
+			syslog_error("can't accept client");
+		return -1;
 	}
 
 	misc_strncpy(peer, inet_ntoa(saddr.sin_addr), sizeof(peer));
@@ -352,7 +880,8 @@ static void socket_accept(void)
 			close(nsock);
 			syslog_write(U_ERR,
 				"%s reject: '%s' (Wrap)", wn, peer);
-			return;
+			errno = ECONNABORTED;
+			return -1;
 		}
 	}
 #endif
@@ -361,12 +890,7 @@ static void socket_accept(void)
 	** Setup some basic socket options
 	*/
 	socket_opts(nsock, SK_CONTROL);
-
-	/*
-	** Perform user level initialization
-	*/
-	if (acpt_fp)
-		(*acpt_fp)(nsock);
+	return nsock;
 }
 
 
@@ -389,20 +913,7 @@ HLS *socket_init(int sock)
 {
 	HLS *hls;
 
-	if (initflag == 0) {
-		atexit(socket_cleanup);
-		initflag = 1;
-
-		/*
-		** Check if we should limit the recv buffer size...
-		** (because the link on the write side is much slower)
-		*/
-		if(maxrecv_bufsiz < 0) {
-			maxrecv_bufsiz = config_int(NULL, "MaxRecvBufSize", 0);
-			if(maxrecv_bufsiz < 0)
-				maxrecv_bufsiz = 0;
-		}
-	}
+	socket_setup();
 
 	hls = (HLS *) misc_alloc(FL, sizeof(HLS));
 	hls->next = hlshead;
@@ -423,13 +934,36 @@ HLS *socket_init(int sock)
 	hls->retr = 0;
 	hls->flag = 0;
 	hls->more = 0;
+	hls->lscn = 0;
 	hls->ctyp = "HLS-TYPE";
 
 	hls->wbuf = NULL;
 	hls->rbuf = NULL;
+	hls->wlst = NULL;
+	hls->rlst = NULL;
+	hls->wlen = 0;
+	hls->whi  = (size_t) wr_high;
+	hls->wlo  = (size_t) wr_low;
+	hls->rmax = 0;
 
 	hls->wcnt = 0;
 	hls->rcnt = 0;
+	hls->nbio = 0;
+	hls->rsiz = 0;
+	if (rd_probe == 0)
+		hls->rsiz = (socket_rd_ceil() < RD_MINSIZE)
+		          ? socket_rd_ceil() : RD_MINSIZE;
+
+	hls->evfl = 0;
+	hls->evrd = 0;
+	hls->rdnx = NULL;
+
+	hls->rlay   = NULL;
+	hls->pfd[0] = -1;
+	hls->pfd[1] = -1;
+	hls->plen   = 0;
+	hls->pmax   = 0;
+	hls->scon   = NULL;
 
 #if defined(COMPILE_DEBUG)
 	debug(2, "created HLS for %d=%s:%d",
@@ -545,15 +1079,22 @@ void socket_kill(HLS *hls)
 	** Now destroy the socket itself
 	*/
 	if (hls->sock != -1)
-		close(hls->sock);
+		socket_ll_close(hls);
+	socket_sp_drop(hls);
+	if (hls->pfd[0] != -1) {
+		close(hls->pfd[0]);
+		close(hls->pfd[1]);
+	}
+	if (hls->scon != NULL)
+		misc_free(FL, hls->scon);
 	for (buf = hls->wbuf; buf != NULL; ) {
 		hls->wbuf = buf->next;
-		misc_free(FL, buf);
+		socket_bf_put(buf);
 		buf = hls->wbuf;
 	}
 	for (buf = hls->rbuf; buf != NULL; ) {
 		hls->rbuf = buf->next;
-		misc_free(FL, buf);
+		socket_bf_put(buf);
 		buf = hls->rbuf;
 	}
 	misc_free(FL, hls);
@@ -574,80 +1115,99 @@ void socket_kill(HLS *hls)
 **	Purpose.......: Read one line of input from a HighLevSock.
 **			This function waits for complete lines with
 **			(CR)LF at the end, which will be discarded.
+**			A partial line stays in the read chain.
 **
 ** ------------------------------------------------------------ */
 
 char *socket_gets(HLS *hls, char *ptr, int len)
 {
-	int cnt;
 	BUF *buf;
+	char *eol;
+	size_t cnt, avl, off, lim;
 
 	if (hls == NULL || ptr == NULL || len <= 0)
 		misc_die(FL, "socket_gets: ?hls? ?ptr? ?len?");
 
 	if (hls->rbuf == NULL) {
+		hls->lscn = 0;
 		errno = 0;
 		return NULL;
 	}
-	len--;		/* Account for the trailing null byte */
+	lim = (size_t) len - 1;	/* Account for the trailing null byte */
 
 	/*
-	** Transfer at most one line of data
+	** Look for the end of the line. The bytes up to
+	** hls->lscn have been scanned by an earlier call
+	** already, so only the new input is searched.
 	*/
 	hls->more = 0;
-	for (buf = hls->rbuf, cnt = 0; buf != NULL && cnt < len; ) {
-		if (buf->cur >= buf->len) {
-			hls->rbuf = buf->next;
-			misc_free(FL, buf);
-			if(NULL == (buf = hls->rbuf)) {
-				/*
-				** last buffer in HLS and no EOL found;
-				** restore the data into the HLS and
-				** exit to wait to read more
-				*/
-				hls->more = 1;
-				hls->rbuf = (BUF *)misc_alloc(FL, sizeof(BUF) + cnt);
-				hls->rbuf->len = cnt;
-				hls->rbuf->cur = 0;
-				memcpy(hls->rbuf->dat, ptr, cnt);
-#if defined(COMPILE_DEBUG)
-				debug(4, "preread %d bytes while waiting "
-					 "for end-of-line: '%.128s'%s",
-					 cnt, hls->rbuf->dat,
-					 (cnt > 128) ? "..." : "");
-#endif
-				return NULL;
+	for (buf = hls->rbuf, cnt = 0, eol = NULL; buf != NULL;
+	     buf = buf->next) {
+		avl = buf->len - buf->cur;
+		if (cnt + avl > hls->lscn) {
+			off = (hls->lscn > cnt) ? hls->lscn - cnt : 0;
+			eol = socket_eol(buf->dat + buf->cur + off,
+			                 avl - off);
+			if (eol != NULL) {
+				cnt += eol - (buf->dat + buf->cur);
+				break;
 			}
-			continue;
 		}
-		if (buf->dat[buf->cur] == '\r')
-			break;
-		if (buf->dat[buf->cur] == '\n')
+		cnt += avl;
+		if (cnt >= lim)
 			break;
-		ptr[cnt++] = buf->dat[buf->cur++];
 	}
-	ptr[cnt] = '\0';	/* Add the trailing null byte */
+
+	if (eol == NULL && cnt < lim) {
+		/*
+		** No EOL yet: remember how far we got and
+		** wait to read more. The tail of the line is
+		** packed into the first buffer, so a line that
+		** trickles in doesn't pin a buffer per read.
+		*/
+		hls->lscn = cnt;
+		hls->more = 1;
+		socket_bf_pack(hls);
+#if defined(COMPILE_DEBUG)
+		debug(4, "preread %d bytes while waiting "
+			 "for end-of-line", (int) cnt);
+#endif
+		return NULL;
+	}
+	if (cnt > lim) {
+		cnt = lim;	/* Overlong: rest is the next line */
+		eol = NULL;
+	}
+	hls->lscn = 0;
 
 	/*
-	** Remove possible newline and used up buffer
+	** Transfer the line, remove the newline and
+	** release the used up buffers
 	*/
-	if (buf != NULL) {
-		while (buf->cur < buf->len &&
-				buf->dat[buf->cur] == '\r')
-			buf->cur++;
-		while (buf->cur < buf->len &&
-				buf->dat[buf->cur] == '\n')
-			buf->cur++;
+	for (off = 0; off < cnt; ) {
+		buf = hls->rbuf;
+		avl = buf->len - buf->cur;
+		if (avl > cnt - off)
+			avl = cnt - off;
+		memcpy(ptr + off, buf->dat + buf->cur, avl);
+		off      += avl;
+		buf->cur += avl;
 		if (buf->cur >= buf->len) {
 			hls->rbuf = buf->next;
-			misc_free(FL, buf);
-			buf = hls->rbuf;
+			socket_bf_put(buf);
 		}
 	}
+	ptr[cnt] = '\0';	/* Add the trailing null byte */
+
+	if (eol != NULL) {
+		socket_bf_skip(hls, '\r');
+		socket_bf_skip(hls, '\n');
+	}
 
 #if defined(COMPILE_DEBUG)
 	debug(2, "gets %s %d=%s: %d bytes '%.128s'%s", hls->ctyp,
-		hls->sock, hls->peer, cnt, ptr, (cnt > 128) ? "..." : "");
+		hls->sock, hls->peer, (int) cnt, ptr,
+		(cnt > 128) ? "..." : "");
 #endif
 	return ptr;
 }
@@ -655,14 +1215,43 @@ char *socket_gets(HLS *hls, char *ptr, int len)
 
 /* ------------------------------------------------------------ **
 **
-**	Function......:	socket_flag
+**	Function......:	socket_eol
 **
-**	Parameters....:	hls		Pointer to HighLevSock
-**			flag		Flags to be applied
+**	Parameters....:	ptr		Pointer to the input
+**			len		Number of bytes at ptr
 **
-**	Return........:	(none)
+**	Return........:	Pointer to the first CR or LF,
+**			NULL if there is none
 **
-**	Purpose.......: Set the send() flags for the next write.
+**	Purpose.......: Find the end of a line. memchr is the
+**			vectorized scan of the C library, so
+**			the LF is searched first and the CR
+**			only in front of it.
+**
+** ------------------------------------------------------------ */
+
+static char *socket_eol(char *ptr, size_t len)
+{
+	char *lf, *cr;
+
+	if ((lf = memchr(ptr, '\n', len)) != NULL)
+		len = lf - ptr;
+	if ((cr = memchr(ptr, '\r', len)) != NULL)
+		return cr;
+	return lf;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_flag
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			flag		Flags to be applied
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Set the send() flags for the next write.
 **			They will be reset with the write/printf
 **			function.
 **
@@ -696,7 +1285,7 @@ void socket_flag(HLS *hls, int flag)
 
 int socket_write(HLS *hls, char *ptr, int len)
 {
-	BUF *buf, *tmp;
+	BUF *buf;
 
 	if (hls == NULL || ptr == NULL)
 		misc_die(FL, "socket_write: ?hls? ?ptr?");
@@ -712,10 +1301,10 @@ int socket_write(HLS *hls, char *ptr, int len)
 	/*
 	** Allocate a new buffer for the data
 	*/
-	buf = (BUF *) misc_alloc(FL, sizeof(BUF) + len);
+	buf = socket_bf_get(len);
 	buf->len = len;
-	buf->cur = 0;
 	memcpy(buf->dat, ptr, len);
+	hls->wlen += len;
 
 	buf->flg  = hls->flag;
 	hls->flag = 0;
@@ -723,14 +1312,7 @@ int socket_write(HLS *hls, char *ptr, int len)
 	/*
 	** Chain the newly filled buffer
 	*/
-	if (hls->wbuf == NULL)
-		hls->wbuf = buf;
-	else {
-		for (tmp = hls->wbuf; tmp->next; tmp = tmp->next)
-			;
-		tmp->next = buf;
-	}
-	buf->next = NULL;
+	socket_bf_link(&(hls->wbuf), &(hls->wlst), buf, buf);
 
 	return 0;
 }
@@ -754,7 +1336,7 @@ int socket_printf(HLS *hls, char *fmt, ...)
 	va_list aptr;
 	char str[NETSIZ];
 	int len;
-	BUF *buf, *tmp;
+	BUF *buf;
 
 	if (hls == NULL || fmt == NULL)
 		misc_die(FL, "socket_printf: ?hls? ?fmt?");
@@ -795,10 +1377,10 @@ int socket_printf(HLS *hls, char *fmt, ...)
 	/*
 	** Allocate a new buffer for the data
 	*/
-	buf = (BUF *) misc_alloc(FL, sizeof(BUF) + len);
+	buf = socket_bf_get(len);
 	buf->len = len;
-	buf->cur = 0;
 	memcpy(buf->dat, str, len);
+	hls->wlen += len;
 
 	buf->flg  = hls->flag;
 	hls->flag = 0;
@@ -806,19 +1388,105 @@ int socket_printf(HLS *hls, char *fmt, ...)
 	/*
 	** Chain the newly filled buffer
 	*/
-	if (hls->wbuf == NULL)
-		hls->wbuf = buf;
-	else {
-		for (tmp = hls->wbuf; tmp->next; tmp = tmp->next)
-			;
-		tmp->next = buf;
-	}
-	buf->next = NULL;
+	socket_bf_link(&(hls->wbuf), &(hls->wlst), buf, buf);
 
 	return 0;
 }
 
 
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_pass
+**
+**	Parameters....:	from		HLS with data read
+**			to		HLS to write the data to
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Hand the read buffers of one HLS over
+**			to the write chain of another one.
+**
+** ------------------------------------------------------------ */
+
+void socket_pass(HLS *from, HLS *to)
+{
+	BUF *buf;
+
+	if (from == NULL || to == NULL)
+		misc_die(FL, "socket_pass: ?from? ?to?");
+
+	if (from->rbuf == NULL)
+		return;
+
+	for (buf = from->rbuf; buf != NULL; buf = buf->next)
+		to->wlen += buf->len - buf->cur;
+	socket_bf_link(&(to->wbuf), &(to->wlst), from->rbuf, from->rlst);
+	from->rbuf = NULL;
+	from->rlst = NULL;
+	from->lscn = 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_flow
+**
+**	Parameters....:	src		HLS feeding the data
+**			dst		HLS writing the data
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Flow control between two sockets: stop
+**			reading from src while the output queue
+**			of dst is above its high watermark and
+**			resume once it drained below the low one.
+**			Reading and writing overlap in between;
+**			the reads are limited to the room left,
+**			so the queue stays below the high mark.
+**
+** ------------------------------------------------------------ */
+
+void socket_flow(HLS *src, HLS *dst)
+{
+	size_t len;
+
+	if (src == NULL || dst == NULL)
+		misc_die(FL, "socket_flow: ?src? ?dst?");
+
+	len = socket_queued(dst);
+	if (len >= dst->whi)
+		src->more = -1;
+	else if (len <= dst->wlo)
+		src->more = 0;
+
+	/*
+	** Bound the next read by the room left
+	*/
+	src->rmax = (len < dst->whi) ? dst->whi - len : 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_queued
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	Number of bytes queued for output
+**
+**	Purpose.......: Report the output queued in the write
+**			chain and the relay pipe of the HLS.
+**
+** ------------------------------------------------------------ */
+
+size_t socket_queued(HLS *hls)
+{
+	if (hls == NULL)
+		return 0;
+	return hls->wlen + hls->plen;
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	socket_file
@@ -867,18 +1535,211 @@ int socket_file(HLS *hls, char *file, int crlf)
 **
 **	Return........:	0=timeout, 1=activity, -1=error
 **
-**	Purpose.......: Prepare all relevant sockets, call the
-**			select function (main waiting point),
-**			and handle the outstanding actions.
+**	Purpose.......: Prepare all relevant sockets, wait for
+**			events (main waiting point) using the
+**			configured event engine and handle the
+**			outstanding actions.
 **
 ** ------------------------------------------------------------ */
 
 int socket_exec(int timeout, int *close_flag)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+	if (evmode == EV_EPOLL && socket_ev_open() == 0)
+		return socket_ev_exec(timeout, close_flag);
+#endif
+	return socket_sel_exec(timeout, close_flag);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_watch
+**
+**	Parameters....:	sock		Descriptor to watch (-1=none)
+**			func		Call back function
+**			due		Deadline (0=none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Let socket_exec watch a descriptor that
+**			is not a HLS (e.g. a resolver socket).
+**			The function is called with the descriptor
+**			when it is readable or the deadline passed;
+**			the owner calls again to update the due.
+**			A function may watch several descriptors;
+**			with sock -1 all its watches end. A watch
+**			must end (see socket_unwatch) before the
+**			descriptor is closed.
+**
+** ------------------------------------------------------------ */
+
+void socket_watch(int sock, WTCH_CB func, time_t due)
+{
+	WATCH *wt, *use = NULL;
+	int i;
+
+	if (func == NULL)
+		return;
+	for (i = 0; i < WT_MAX; i++) {
+		wt = &wtab[i];
+		if (wt->func == func && sock == -1) {
+			socket_wt_drop(wt);
+			wt->func = NULL;
+			continue;
+		}
+		if (wt->func == func && wt->sock == sock) {
+			use = wt;
+			break;
+		}
+		if (wt->func == NULL && use == NULL)
+			use = wt;
+	}
+	if (sock == -1)
+		return;
+	if (use == NULL)
+		misc_die(FL, "socket_watch: ?WT_MAX?");
+
+	if (use->func == NULL)
+		socket_wt_drop(use);
+	use->sock = sock;
+	use->func = func;
+	use->due  = due;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_unwatch
+**
+**	Parameters....:	sock		Watched descriptor
+**
+**	Return........:	(none)
+**
+**	Purpose.......: End the watch of a descriptor, before
+**			it is closed.
+**
+** ------------------------------------------------------------ */
+
+void socket_unwatch(int sock)
+{
+	WATCH *wt;
+
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		if (wt->func == NULL || wt->sock != sock)
+			continue;
+		socket_wt_drop(wt);
+		wt->func = NULL;
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_wt_due
+**
+**	Parameters....:	now		Current time
+**			wait		Seconds socket_exec will wait
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Shorten the wait to the watch deadline.
+**
+** ------------------------------------------------------------ */
+
+static void socket_wt_due(time_t now, int *wait)
+{
+	WATCH *wt;
+
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		if (wt->func == NULL || wt->due == 0)
+			continue;
+		if (now >= wt->due)
+			*wait = 0;
+		else if (*wait > (int) (wt->due - now))
+			*wait = (int) (wt->due - now);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_wt_fire
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Call the watch functions whose descriptor
+**			was reported readable or whose deadline
+**			has passed. They may change the watches.
+**
+** ------------------------------------------------------------ */
+
+static void socket_wt_fire(void)
+{
+	time_t now = time(NULL);
+	WATCH *wt;
+	int ready;
+
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		ready   = wt->rdy;
+		wt->rdy = 0;
+		if (wt->func == NULL)
+			continue;
+		if (ready || (wt->due != 0 && now >= wt->due))
+			(*wt->func)(wt->sock);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_wt_drop
+**
+**	Parameters....:	wt		Pointer to the watch
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Take the watched descriptor out of the
+**			epoll instance right away, while it is
+**			still open.
+**
+** ------------------------------------------------------------ */
+
+static void socket_wt_drop(WATCH *wt)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+	if (wt->reg != 0 && evfd != -1 && evpid == getpid())
+		epoll_ctl(evfd, EPOLL_CTL_DEL, wt->sock, NULL);
+#endif
+	wt->reg = 0;
+	wt->rdy = 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_sel_exec
+**
+**	Parameters....:	timeout		Maximum seconds to wait
+**			close_flag	Pointer to close_flag
+**
+**	Return........:	0=timeout, 1=activity, -1=error
+**
+**	Purpose.......: The select() event engine; rebuilds the
+**			descriptor sets on every call.
+**
+** ------------------------------------------------------------ */
+
+static int socket_sel_exec(int timeout, int *close_flag)
 {
 	HLS *hls;
+	WATCH *wt;
 	fd_set rfds, wfds;
-	int fdcnt, i;
+	int fdcnt, i, wait;
 	struct timeval tv;
+	time_t now;
 
 	/*
 	** Prepare the select() input structures
@@ -890,20 +1751,33 @@ int socket_exec(int timeout, int *close_flag)
 	/*
 	** Allow the daemon listening socket to accept
 	*/
-	if (lsock != -1) {
+	if (lsock != -1 && lhold == 0) {
 		fdcnt = lsock;
 		FD_SET(lsock, &rfds);
 	}
 
+	/*
+	** Add the watched descriptors (e.g. the resolver)
+	*/
+	now  = time(NULL);
+	wait = timeout;
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		if (wt->func == NULL)
+			continue;
+		if (wt->sock > fdcnt)
+			fdcnt = wt->sock;
+		FD_SET(wt->sock, &rfds);
+	}
+	socket_wt_due(now, &wait);
+
 	/*
 	** Last but not least walk through the connections
 	*/
 	for (hls = hlshead; hls != NULL; hls = hls->next) {
 		if (hls->sock == -1)
 			continue;
-		if (hls->kill != 0 && hls->wbuf == NULL) {
-			close(hls->sock);
-			hls->sock = -1;
+		if (hls->kill != 0 && !WPENDING(hls)) {
+			socket_ll_close(hls);
 #if defined(COMPILE_DEBUG)
 			debug(4, "FD_CLR %s", hls->ctyp);
 #endif
@@ -913,15 +1787,18 @@ int socket_exec(int timeout, int *close_flag)
 			*/
 			return 1;
 		}
+		if (socket_cn_due(hls, now, &wait))
+			return 1;	/* Connect timed out	*/
 		if (hls->sock > fdcnt)
 			fdcnt = hls->sock;
-		if (hls->wbuf != NULL && hls->peer[0] != '\0') {
+		if ((WPENDING(hls) || hls->scon != NULL) &&
+		    hls->peer[0] != '\0') {
 			FD_SET(hls->sock, &wfds);
 #if defined(COMPILE_DEBUG)
 			debug(4, "FD_SET %s for W", hls->ctyp);
 #endif
 		}
-		if(hls->more >= 0) {
+		if(hls->more >= 0 && !RBLOCKED(hls) && hls->scon == NULL) {
 			FD_SET(hls->sock, &rfds);
 #if defined(COMPILE_DEBUG)
 			debug(4, "FD_SET %s for R", hls->ctyp);
@@ -930,9 +1807,10 @@ int socket_exec(int timeout, int *close_flag)
 	}
 
 	/*
-	** If not a single descriptor remains, we are doomed
+	** If not a single descriptor remains, we are doomed;
+	** a listener held for the workers keeps us alive
 	*/
-	if (fdcnt == -1) {
+	if (fdcnt == -1 && lsock == -1) {
 		if (close_flag)
 			*close_flag = 1;
 		return 1;	/* Return as non-defect situation */
@@ -941,14 +1819,15 @@ int socket_exec(int timeout, int *close_flag)
 	/*
 	** Wait for the next event
 	*/
-	tv.tv_sec  = timeout;
+	tv.tv_sec  = wait;
 	tv.tv_usec = 0;
 	i = select(fdcnt + 1, &rfds, &wfds, NULL, &tv);
 	if (i == 0) {
 #if defined(COMPILE_DEBUG)
 		debug(2, "select: timeout (%d)", (int) time(NULL));
 #endif
-		return 0;
+		socket_wt_fire();
+		return (wait < timeout) ? 1 : 0;
 	}
 	if (i < 0) {
 		if (errno == EINTR)
@@ -960,13 +1839,24 @@ int socket_exec(int timeout, int *close_flag)
 	/*
 	** Check the various sources of events
 	*/
-	if (lsock != -1 && FD_ISSET(lsock, &rfds))
+	if (lsock != -1 && lhold == 0 && FD_ISSET(lsock, &rfds))
 		socket_accept();
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		if (wt->func != NULL && FD_ISSET(wt->sock, &rfds))
+			wt->rdy = 1;
+	}
+	socket_wt_fire();
 	for (hls = hlshead; hls != NULL; hls = hls->next) {
 
 		if (hls->sock == -1)
 			continue;
 
+		if (hls->scon != NULL) {
+			if (FD_ISSET(hls->sock, &wfds))
+				socket_cn_done(hls);
+			continue;
+		}
+
 		if (FD_ISSET(hls->sock, &wfds))
 			socket_ll_write(hls);
 		if (hls->sock == -1)	/* May be dead by now */
@@ -977,104 +1867,513 @@ int socket_exec(int timeout, int *close_flag)
 		if (hls->sock == -1)	/* May be dead by now */
 			continue;
 
-		if (hls->kill != 0 && hls->wbuf == NULL) {
-			close(hls->sock);
-			hls->sock = -1;
-		}
+		if (hls->kill != 0 && !WPENDING(hls))
+			socket_ll_close(hls);
 	}
 	return 1;
 }
 
 
+#if defined(HAVE_SYS_EPOLL_H)
 /* ------------------------------------------------------------ **
 **
-**	Function......:	socket_ll_read
+**	Function......:	socket_ev_exec
 **
-**	Parameters....:	hls		Pointer to HighLevSock
+**	Parameters....:	timeout		Maximum seconds to wait
+**			close_flag	Pointer to close_flag
 **
-**	Return........:	(none)
+**	Return........:	0=timeout, 1=activity, -1=error
 **
-**	Purpose.......: Socket low level read routine. If
-**			peer is not set, we are listening.
+**	Purpose.......: The epoll event engine. The sockets stay
+**			registered (edge triggered) as long as
+**			they live; the interest is only changed
+**			when the write buffer, read state or kill
+**			flag of a socket changes. Only sockets
+**			reported ready (or left ready by a short
+**			read) are dispatched.
 **
 ** ------------------------------------------------------------ */
 
-static void socket_ll_read(HLS *hls)
+static int socket_ev_exec(int timeout, int *close_flag)
 {
-	int len, cnt, nsock;
-	BUF *buf, *tmp;
-	struct sockaddr_in saddr;
-
-	if (hls == NULL)
-		misc_die(FL, "socket_ll_read: ?hls?");
+	struct epoll_event evs[EV_MAXEVENTS];
+	HLS *hls, *rdy, *nxt;
+	WATCH *wt;
+	int cnt, want, acpt, wait, i, n;
+	time_t now;
 
 	/*
-	** If the peer is not (yet) filled, this is a listening
-	** socket. In this case we need to accept() the (data)
-	** connection (e.g. FTP passive client or active server).
+	** Allow the daemon listening socket to accept;
+	** it is level triggered - one accept per call
 	*/
-	if (hls->peer[0] == '\0') {
-		memset(&saddr, 0, sizeof(saddr));
-		len = sizeof(saddr);
-		nsock = accept(hls->sock,
-				(struct sockaddr *) &saddr, &len);
-		if (nsock < 0) {
-			hls->ernr = errno;
-			syslog_error("can't accept %s", hls->ctyp);
-			shutdown(hls->sock, 2);
-			close(hls->sock);
-			hls->sock = -1;
-			return;
+	if (lsock != -1 && lhold == 0 && lsreg == 0) {
+		memset(&evs[0], 0, sizeof(evs[0]));
+		evs[0].events   = EPOLLIN;
+		evs[0].data.ptr = NULL;
+		if (epoll_ctl(evfd, EPOLL_CTL_ADD, lsock, &evs[0]) < 0) {
+			syslog_error("can't register listener socket");
+			return -1;
 		}
-		socket_opts(nsock, SK_DATA);
-
-		/*
-		** Update the High Level Socket
-		*/
-		shutdown(hls->sock, 2);		/* the "acceptor" */
-		close(hls->sock);
-		hls->sock = nsock;
-		hls->addr = socket_sck2addr(nsock, REM_END, &(hls->port));
-		misc_strncpy(hls->peer, socket_addr2str(hls->addr),
-		             sizeof(hls->peer));
-#if defined(COMPILE_DEBUG)
-		debug(2, "accept %s (%d) from %s",
-				hls->ctyp, hls->sock, hls->peer);
-#endif
-		return;
+		lsreg = 1;
 	}
 
 	/*
-	** Get the number of bytes waiting to be read
+	** The watched descriptors are level triggered as
+	** well; socket_watch drops the registrations
 	*/
-	len = 0;
-	if( (cnt=ioctl(hls->sock, FIONREAD, &len)) < 0) {
-		hls->ernr = errno;
-		syslog_error("can't get num of bytes: %s %d=%s",
-		             hls->ctyp, hls->sock, hls->peer);
-		close(hls->sock);
-		hls->sock = -1;
-		return;
+	for (wt = wtab; wt < wtab + WT_MAX; wt++) {
+		if (wt->func == NULL || wt->reg != 0)
+			continue;
+		memset(&evs[0], 0, sizeof(evs[0]));
+		evs[0].events   = EPOLLIN;
+		evs[0].data.ptr = (void *) wt;
+		if (epoll_ctl(evfd, EPOLL_CTL_ADD, wt->sock, &evs[0]) < 0) {
+			syslog_error("can't register watched socket");
+			return -1;
+		}
+		wt->reg = 1;
 	}
-#if defined(COMPILE_DEBUG)
-	debug(4, "ll_read: FIONREAD reported %d bytes for %s %d=%s",
-		len, hls->ctyp, hls->sock, hls->peer);
-#endif
 
 	/*
-	** Check if the socket has been closed
+	** Sync the interest of the connections; sockets
+	** with events left over from the last round go
+	** to the ready list without waiting for an edge.
 	*/
-	if (len == 0) {
-#if defined(I_NREAD) && defined(__sun__)
-		/*
-		** solaris powers up select and returns "no data"
-		** (both, len == cnt == 0) in the middle of a data
-		** transfer; this was interpreted as EOF and has
-		** caused transfer aborts on bigger files.
+	cnt  = (lsock != -1 && lhold == 0) ? 1 : 0;
+	now  = time(NULL);
+	wait = timeout;
+	socket_wt_due(now, &wait);
+	for (hls = hlshead, rdy = NULL; hls != NULL; hls = hls->next) {
+		if (hls->sock == -1)
+			continue;
+		if (hls->kill != 0 && !WPENDING(hls)) {
+			socket_ll_close(hls);
+#if defined(COMPILE_DEBUG)
+			debug(4, "EV_DEL %s", hls->ctyp);
+#endif
+			/*
+			** The following return ensures that
+			** killed sockets will be detected.
+			*/
+			socket_ev_drop(rdy);
+			return 1;
+		}
+		if (socket_cn_due(hls, now, &wait)) {
+			socket_ev_drop(rdy);
+			return 1;	/* Connect timed out	*/
+		}
+		cnt++;
+
+		want = 0;
+		if ((WPENDING(hls) || hls->scon != NULL) &&
+		    hls->peer[0] != '\0')
+			want |= EV_WR;
+		if (hls->more >= 0 && !RBLOCKED(hls) && hls->scon == NULL)
+			want |= EV_RD;
+		if ((hls->evfl & EV_REG) == 0 ||
+		    (hls->evfl & (EV_RD|EV_WR)) != want) {
+			socket_ev_set(hls, want);
+			if (hls->sock == -1) {
+				socket_ev_drop(rdy);
+				return 1;
+			}
+		}
+
+		if ((hls->evrd & want) && !(hls->evrd & EV_QUE)) {
+			hls->evrd |= EV_QUE;
+			hls->rdnx  = rdy;
+			rdy = hls;
+		}
+	}
+
+	/*
+	** If not a single descriptor remains, we are doomed;
+	** a listener held for the workers keeps us alive
+	*/
+	if (cnt == 0 && lsock == -1) {
+		if (close_flag)
+			*close_flag = 1;
+		return 1;	/* Return as non-defect situation */
+	}
+
+	/*
+	** Wait for the next event (just poll, if some
+	** sockets are still ready from the last round)
+	*/
+	n = epoll_wait(evfd, evs, EV_MAXEVENTS,
+	               (rdy != NULL) ? 0 : wait * 1000);
+	if (n < 0) {
+		socket_ev_drop(rdy);
+		if (errno == EINTR)
+			return 1;
+		syslog_error("can't execute epoll_wait");
+		return -1;
+	}
+	if (n == 0 && rdy == NULL) {
+#if defined(COMPILE_DEBUG)
+		debug(2, "epoll: timeout (%d)", (int) time(NULL));
+#endif
+		socket_wt_fire();
+		return (wait < timeout) ? 1 : 0;
+	}
+
+	/*
+	** Remember the reported events at the sockets
+	*/
+	for (i = 0, acpt = 0; i < n; i++) {
+		if ((hls = (HLS *) evs[i].data.ptr) == NULL) {
+			acpt = 1;
+			continue;
+		}
+		wt = (WATCH *) evs[i].data.ptr;
+		if (wt >= wtab && wt < wtab + WT_MAX) {
+			wt->rdy = 1;
+			continue;
+		}
+		if (evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+			hls->evrd |= EV_RD;
+		if (evs[i].events & (EV_RDHUP|EPOLLERR|EPOLLHUP))
+			hls->evrd |= EV_RD | EV_HUP;
+		if (evs[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+			hls->evrd |= EV_WR;
+		if ( !(hls->evrd & EV_QUE)) {
+			hls->evrd |= EV_QUE;
+			hls->rdnx  = rdy;
+			rdy = hls;
+		}
+	}
+
+	/*
+	** Check the various sources of events
+	*/
+	if (acpt != 0 && lsock != -1)
+		socket_accept();
+	socket_wt_fire();
+	for (hls = rdy; hls != NULL; hls = nxt) {
+		nxt = hls->rdnx;
+		hls->rdnx  = NULL;
+		hls->evrd &= ~EV_QUE;
+
+		if (hls->sock == -1)
+			continue;
+
+		if (hls->scon != NULL) {
+			if (hls->evrd & EV_WR) {
+				hls->evrd = 0;
+				socket_cn_done(hls);
+			}
+			continue;
+		}
+
+		if ((hls->evrd & EV_WR) && WPENDING(hls) &&
+		    hls->peer[0] != '\0') {
+			hls->evrd &= ~EV_WR;
+			socket_ll_write(hls);
+
+			/*
+			** A complete flush leaves the socket
+			** writable; there is no new edge for it.
+			*/
+			if (hls->sock != -1 && !WPENDING(hls))
+				hls->evrd |= EV_WR;
+		}
+		if (hls->sock == -1)	/* May be dead by now */
+			continue;
+
+		if ((hls->evrd & EV_RD) && hls->more >= 0 &&
+		    !RBLOCKED(hls)) {
+			hls->evrd &= ~EV_RD;
+			socket_ll_read(hls);
+
+			/*
+			** After a hangup there will be no further
+			** edge; keep reading until the EOF shows.
+			*/
+			if (hls->evrd & EV_HUP)
+				hls->evrd |= EV_RD;
+		}
+		if (hls->sock == -1)	/* May be dead by now */
+			continue;
+
+		if (hls->kill != 0 && !WPENDING(hls))
+			socket_ll_close(hls);
+	}
+	return 1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ev_open
+**
+**	Parameters....:	(none)
+**
+**	Return........:	0=success, -1=failure
+**
+**	Purpose.......: Create the epoll instance on first use.
+**			Falls back to select on failure.
+**
+** ------------------------------------------------------------ */
+
+static int socket_ev_open(void)
+{
+	if (evfd != -1)
+		return 0;
+
+	if ((evfd = epoll_create(EV_MAXEVENTS)) < 0) {
+		syslog_error("can't create epoll instance - using select");
+		evmode = EV_SELECT;
+		return -1;
+	}
+#if defined(FD_CLOEXEC)
+	fcntl(evfd, F_SETFD, FD_CLOEXEC);
+#endif
+	evpid = getpid();
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "created epoll instance fd=%d", evfd);
+#endif
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ev_reset
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Forget the (inherited) epoll instance and
+**			all registrations; they are recreated on
+**			the next socket_exec call.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ev_reset(void)
+{
+	HLS *hls;
+	int i;
+
+	if (evfd != -1)
+		close(evfd);
+	evfd  = -1;
+	evpid = 0;
+	lsreg = 0;
+	for (i = 0; i < WT_MAX; i++)
+		wtab[i].reg = 0;
+
+	for (hls = hlshead; hls != NULL; hls = hls->next) {
+		hls->evfl = 0;
+		hls->evrd = 0;
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ev_set
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			want		EV_RD / EV_WR interest
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Register the socket or change its event
+**			interest. Modifying the interest makes
+**			the kernel report a pending readiness
+**			again, so no edge can be lost.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ev_set(HLS *hls, int want)
+{
+	struct epoll_event ev;
+	int op;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLET | EV_RDHUP;
+	if (want & EV_RD)
+		ev.events |= EPOLLIN;
+	if (want & EV_WR)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = hls;
+
+	op = (hls->evfl & EV_REG) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(evfd, op, hls->sock, &ev) < 0) {
+		hls->ernr = errno;
+		syslog_error("can't register %s %d=%s for events",
+		             hls->ctyp, hls->sock, hls->peer);
+		hls->evfl = 0;
+		close(hls->sock);
+		hls->sock = -1;
+		return;
+	}
+	hls->evfl = EV_REG | want;
+
+#if defined(COMPILE_DEBUG)
+	debug(4, "EV_SET %s for %s%s", hls->ctyp,
+		(want & EV_RD) ? "R" : "", (want & EV_WR) ? "W" : "");
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ev_del
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Remove the socket from the epoll set.
+**			Required before close, since the socket
+**			may be dup'ed (e.g. stdin / stdout).
+**
+** ------------------------------------------------------------ */
+
+static void socket_ev_del(HLS *hls)
+{
+	if ((hls->evfl & EV_REG) && evfd != -1)
+		epoll_ctl(evfd, EPOLL_CTL_DEL, hls->sock, NULL);
+	hls->evfl = 0;
+	hls->evrd &= EV_QUE;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ev_drop
+**
+**	Parameters....:	rdy		Head of the ready list
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Unlink a not dispatched ready list; the
+**			pending events stay at the sockets.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ev_drop(HLS *rdy)
+{
+	HLS *nxt;
+
+	for ( ; rdy != NULL; rdy = nxt) {
+		nxt = rdy->rdnx;
+		rdy->rdnx  = NULL;
+		rdy->evrd &= ~EV_QUE;
+	}
+}
+#endif
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ll_read
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Socket low level read routine. If
+**			peer is not set, we are listening.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ll_read(HLS *hls)
+{
+	int len, cnt, nsock;
+	struct sockaddr_in saddr;
+
+	if (hls == NULL)
+		misc_die(FL, "socket_ll_read: ?hls?");
+
+	/*
+	** If the peer is not (yet) filled, this is a listening
+	** socket. In this case we need to accept() the (data)
+	** connection (e.g. FTP passive client or active server).
+	*/
+	if (hls->peer[0] == '\0') {
+		memset(&saddr, 0, sizeof(saddr));
+		len = sizeof(saddr);
+		nsock = accept(hls->sock,
+				(struct sockaddr *) &saddr, &len);
+		if (nsock < 0) {
+			hls->ernr = errno;
+			syslog_error("can't accept %s", hls->ctyp);
+			shutdown(hls->sock, 2);
+			socket_ll_close(hls);
+			return;
+		}
+		socket_opts(nsock, SK_DATA);
+
+		/*
+		** Update the High Level Socket
+		*/
+		shutdown(hls->sock, 2);		/* the "acceptor" */
+		socket_ll_close(hls);
+		hls->sock = nsock;
+		hls->nbio = 0;
+		hls->addr = socket_sck2addr(nsock, REM_END, &(hls->port));
+		misc_strncpy(hls->peer, socket_addr2str(hls->addr),
+		             sizeof(hls->peer));
+#if defined(COMPILE_DEBUG)
+		debug(2, "accept %s (%d) from %s",
+				hls->ctyp, hls->sock, hls->peer);
+#endif
+		return;
+	}
+
+#if defined(HAVE_RELAY)
+	/*
+	** Relay mode: move the data straight into the pipe
+	** of our relay peer, unless the relay was refused.
+	*/
+	if (hls->rlay != NULL && socket_sp_read(hls) == 0)
+		return;
+#endif
+
+	/*
+	** Read straight into the buffers, unless the
+	** kernel shall be asked for the size first
+	*/
+	if (hls->rsiz > 0) {
+		socket_rd_direct(hls);
+		return;
+	}
+
+	/*
+	** Get the number of bytes waiting to be read
+	*/
+	len = 0;
+	iorops++;
+	if( (cnt=ioctl(hls->sock, FIONREAD, &len)) < 0) {
+		hls->ernr = errno;
+		syslog_error("can't get num of bytes: %s %d=%s",
+		             hls->ctyp, hls->sock, hls->peer);
+		socket_ll_close(hls);
+		return;
+	}
+#if defined(COMPILE_DEBUG)
+	debug(4, "ll_read: FIONREAD reported %d bytes for %s %d=%s",
+		len, hls->ctyp, hls->sock, hls->peer);
+#endif
+
+	/*
+	** Check if the socket has been closed
+	*/
+	if (len == 0) {
+#if defined(I_NREAD) && defined(__sun__)
+		/*
+		** solaris powers up select and returns "no data"
+		** (both, len == cnt == 0) in the middle of a data
+		** transfer; this was interpreted as EOF and has
+		** caused transfer aborts on bigger files.
 		** wait and retry before we assume this is a EOF.
 		*/
 		if((0 == cnt) && (++hls->retr < MAX_RETRIES)) {
-			syslog_write(T_DBG,
+			syslog_write(T_DBG | L_SOCK,
 			      "zero bytes to read reported: %s %d=%s",
 			      hls->ctyp, hls->sock, hls->peer);
 			usleep(10000);
@@ -1082,163 +2381,965 @@ static void socket_ll_read(HLS *hls)
 		}
 #endif
 
-		/*
-		** OK, EOF recived - should be cnt>0 and len == 0
-		** on solaris / I_NREAD according to streamio(7I)
-		*/
-#if defined(COMPILE_DEBUG)
-		debug(1, "closed: %s %d=%s, len=%d, cnt=%d",
-			hls->ctyp, hls->sock, hls->peer, len, cnt);
-#endif
-		close(hls->sock);
-		hls->sock = -1;
-		return;
-	}
-	/*
-	** else reset retry counter on success
-	*/
-	hls->retr = 0;
+		/*
+		** OK, EOF recived - should be cnt>0 and len == 0
+		** on solaris / I_NREAD according to streamio(7I)
+		*/
+#if defined(COMPILE_DEBUG)
+		debug(1, "closed: %s %d=%s, len=%d, cnt=%d",
+			hls->ctyp, hls->sock, hls->peer, len, cnt);
+#endif
+		socket_ll_close(hls);
+		return;
+	}
+	/*
+	** else reset retry counter on success
+	*/
+	hls->retr = 0;
+
+	/*
+	** Limit the receive buffer sizes; the rest stays
+	** pending and is read in the next round without
+	** waiting for a new event.
+	*/
+	if(maxrecv_bufsiz > 0 && len > maxrecv_bufsiz) {
+		len = maxrecv_bufsiz;
+		hls->evrd |= EV_RD;
+	}
+	if (len > SOCK_IOVMAX * BUF_SEGMAX) {
+		len = SOCK_IOVMAX * BUF_SEGMAX;
+		hls->evrd |= EV_RD;
+	}
+	if (hls->rmax > 0 && (size_t) len > hls->rmax) {
+		len = (int) hls->rmax;
+		hls->evrd |= EV_RD;
+	}
+
+	/*
+	** Now read the data that is waiting
+	*/
+	if ((cnt = socket_rd_segs(hls, len)) != len) {
+		if(cnt > 0) {
+			/*
+			** hmm... seems to be solaris, isn't? :-)
+			*/
+			syslog_write(T_DBG | L_SOCK,
+			"recvd %d bytes while %d reported: %s %d=%s",
+			cnt, len, hls->ctyp, hls->sock, hls->peer);
+		} else {
+			/*
+			** report as error because we use FIONREAD
+			** above and handle EOF's (len = 0) there...
+			*/
+			hls->ernr = errno;
+			syslog_error("can't ll_read: %s %d=%s",
+			             hls->ctyp, hls->sock, hls->peer);
+			socket_ll_close(hls);
+			return;
+		}
+	}
+
+#if defined(COMPILE_DEBUG)
+	debug(3, "ll_read %s %d=%s: %d/%d bytes",
+			hls->ctyp, hls->sock, hls->peer,
+			cnt, hls->rcnt);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_rd_direct
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Read without asking for the number of
+**			bytes pending: fill buffers of the adaptive
+**			read size until the socket is drained (a
+**			short read or EAGAIN) or the ceiling is
+**			reached. The size doubles after full reads
+**			and shrinks after small ones. Reading 0
+**			bytes means EOF.
+**
+** ------------------------------------------------------------ */
+
+static void socket_rd_direct(HLS *hls)
+{
+	int len, cnt, tot, max;
+
+	/*
+	** The socket must not block us on the final read
+	*/
+	if (hls->nbio == 0) {
+		if (socket_nblock(hls->sock) < 0) {
+			hls->ernr = errno;
+			syslog_error("can't set %s %d=%s non-blocking",
+			             hls->ctyp, hls->sock, hls->peer);
+			socket_ll_close(hls);
+			return;
+		}
+		hls->nbio = 1;
+	}
+
+	/*
+	** Never read more than the ceiling or the room
+	** left in the peer's output queue in one round
+	*/
+	max = socket_rd_ceil();
+	if (hls->rmax > 0 && hls->rmax < (size_t) max)
+		max = (int) hls->rmax;
+
+	for (tot = 0; ; ) {
+		len = (hls->rsiz < max - tot) ? hls->rsiz : max - tot;
+		if ((cnt = socket_rd_segs(hls, len)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;		/* Drained	*/
+			hls->ernr = errno;
+			syslog_error("can't ll_read: %s %d=%s",
+			             hls->ctyp, hls->sock, hls->peer);
+			socket_ll_close(hls);
+			return;
+		}
+
+		/*
+		** Check if the socket has been closed; data
+		** read before is handed over first, the EOF
+		** shows up again in the next round.
+		*/
+		if (cnt == 0) {
+			if (tot > 0) {
+				hls->evrd |= EV_RD;
+				break;
+			}
+#if defined(COMPILE_DEBUG)
+			debug(1, "closed: %s %d=%s",
+				hls->ctyp, hls->sock, hls->peer);
+#endif
+			socket_ll_close(hls);
+			return;
+		}
+		tot += cnt;
+
+		/*
+		** A short read drained the socket; shrink
+		** the read size if it was much too big.
+		*/
+		if (cnt < len) {
+			if (cnt <= hls->rsiz / 4 &&
+			    hls->rsiz / 2 >= RD_MINSIZE)
+				hls->rsiz /= 2;
+			break;
+		}
+
+		/*
+		** A full read; grow up to the ceiling and
+		** leave the rest for the next round, when
+		** the limit has been read in this one.
+		*/
+		if (len == hls->rsiz && hls->rsiz * 2 <= socket_rd_ceil())
+			hls->rsiz *= 2;
+		if (tot >= max) {
+			hls->evrd |= EV_RD;
+			break;
+		}
+	}
+
+#if defined(COMPILE_DEBUG)
+	debug(3, "ll_read %s %d=%s: %d/%d bytes (size %d)",
+			hls->ctyp, hls->sock, hls->peer,
+			tot, hls->rcnt, hls->rsiz);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_rd_segs
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			len		Number of bytes to read
+**
+**	Return........:	Bytes read, 0=EOF, -1=error (errno)
+**
+**	Purpose.......: Read into pooled segments with a single
+**			readv and chain the filled ones.
+**
+** ------------------------------------------------------------ */
+
+static int socket_rd_segs(HLS *hls, int len)
+{
+	BUF *seg[SOCK_IOVMAX], *buf;
+	struct iovec iov[SOCK_IOVMAX];
+	int cnt, i, n;
+
+	for (n = 0, cnt = 0; n == 0 || (cnt < len && n < SOCK_IOVMAX); n++) {
+		i = (len - cnt > BUF_SEGMAX) ? BUF_SEGMAX : len - cnt;
+		seg[n] = socket_bf_get(i);
+		iov[n].iov_base = seg[n]->dat;
+		iov[n].iov_len  = i;
+		cnt += i;
+	}
+	do {
+		errno = 0;
+		cnt = readv(hls->sock, iov, n);
+	} while (cnt == -1 && EINTR == errno);
+	iorops++;
+
+	if (cnt > 0) {
+		hls->rcnt += cnt;
+		iorbytes  += cnt;
+	}
+
+	/*
+	** Chain the newly filled buffers, recycle the rest
+	*/
+	for (i = 0, len = cnt; i < n; i++) {
+		buf = seg[i];
+		if (len > 0) {
+			buf->len = (len > (int) iov[i].iov_len)
+			         ? (int) iov[i].iov_len : len;
+			len -= buf->len;
+			socket_bf_link(&(hls->rbuf), &(hls->rlst), buf, buf);
+		} else
+			socket_bf_put(buf);
+	}
+	return cnt;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_rd_ceil
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Ceiling for the adaptive read size
+**
+**	Purpose.......: MaxRecvBufSize limits the amount read
+**			per round, within the bounds of a single
+**			scatter read.
+**
+** ------------------------------------------------------------ */
+
+static int socket_rd_ceil(void)
+{
+	if (maxrecv_bufsiz > 0 && maxrecv_bufsiz < SOCK_IOVMAX * BUF_SEGMAX)
+		return maxrecv_bufsiz;
+	return SOCK_IOVMAX * BUF_SEGMAX;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ll_write
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Socket low level write routine.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ll_write(HLS *hls)
+{
+	struct iovec iov[SOCK_IOVMAX];
+	int cnt, tot, want, n;
+	BUF *buf;
+
+	if (hls == NULL)
+		misc_die(FL, "socket_ll_write: ?hls?");
+
+	/*
+	** Try to send as much as possible; the pending
+	** segments are gathered into a single writev,
+	** except those needing send() flags (e.g. OOB).
+	*/
+	for (tot = 0; (buf = hls->wbuf) != NULL; ) {
+		if (buf->flg != 0) {
+			want = buf->len - buf->cur;
+			do
+				cnt = send(hls->sock, buf->dat + buf->cur,
+						want, buf->flg);
+			while (cnt == -1 && errno == EINTR);
+		} else {
+			for (n = 0, want = 0; n < SOCK_IOVMAX && buf != NULL
+			     && buf->flg == 0; n++, buf = buf->next) {
+				iov[n].iov_base = buf->dat + buf->cur;
+				iov[n].iov_len  = buf->len - buf->cur;
+				want += iov[n].iov_len;
+			}
+			do
+				cnt = writev(hls->sock, iov, n);
+			while (cnt == -1 && errno == EINTR);
+		}
+		iowops++;
+
+		/*
+		** Did we write anything?
+		*/
+		if (cnt < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;	/* Non-blocking and full */
+			if (tot == 0) {
+				hls->ernr = errno;
+				syslog_error("can't ll_write: %s %d=%s",
+				             hls->ctyp, hls->sock, hls->peer);
+				socket_ll_close(hls);
+				return;
+			}
+			break;	/* At least the first write was ok */
+		}
+
+#if defined(COMPILE_DEBUG)
+		debug(4, "ll_write %s %d=%s: sent %d bytes",
+			hls->ctyp, hls->sock, hls->peer, cnt);
+#endif
+
+		/*
+		** Update byte conter
+		*/
+		tot += cnt;
+		hls->wcnt += cnt;
+		hls->wlen -= cnt;
+		iowbytes  += cnt;
+
+		/*
+		** Release the buffers that are done and
+		** advance the write pointer of the next one
+		*/
+		for (n = cnt; (buf = hls->wbuf) != NULL &&
+		              (int) (buf->len - buf->cur) <= n; ) {
+			n -= buf->len - buf->cur;
+			hls->wbuf = buf->next;
+			socket_bf_put(buf);
+		}
+		if (buf != NULL)
+			buf->cur += n;
+
+		if (cnt < want)
+			break;	/* Partly sent, try again later */
+	}
+
+#if defined(COMPILE_DEBUG)
+	debug(3, "ll_write %s %d=%s: %d/%d bytes",
+			hls->ctyp, hls->sock, hls->peer,
+			tot, hls->wcnt);
+#endif
+
+#if defined(HAVE_RELAY)
+	/*
+	** The relay pipe follows the buffered data
+	*/
+	if (hls->wbuf == NULL && hls->plen > 0)
+		socket_sp_write(hls);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_ll_close
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Socket low level close routine; drops
+**			the event registration and the socket.
+**
+** ------------------------------------------------------------ */
+
+static void socket_ll_close(HLS *hls)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+	socket_ev_del(hls);
+#endif
+	close(hls->sock);
+	hls->sock = -1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_nblock
+**
+**	Parameters....:	sock		Socket descriptor
+**
+**	Return........:	0=success, -1=failure
+**
+**	Purpose.......: Switch a socket into non-blocking mode.
+**
+** ------------------------------------------------------------ */
+
+static int socket_nblock(int sock)
+{
+	int flags;
+
+	if ((flags = fcntl(sock, F_GETFL, 0)) < 0)
+		return -1;
+	if (flags & O_NONBLOCK)
+		return 0;
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_splice
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			peer		Pointer to its peer HLS
+**
+**	Return........:	0=relay active, -1=use buffers
+**
+**	Purpose.......: Switch a pair of connected sockets to
+**			zero-copy relay mode: data read from one
+**			of them is moved through a kernel pipe
+**			into the other one using splice(), never
+**			entering the read/write buffer chains.
+**			Callers that need to see the payload do
+**			not call this and keep the buffer path.
+**
+** ------------------------------------------------------------ */
+
+int socket_splice(HLS *hls, HLS *peer)
+{
+	if (hls == NULL || peer == NULL)	/* Sanity check	*/
+		misc_die(FL, "socket_splice: ?hls? ?peer?");
+
+	if (hls->rlay == peer && peer->rlay == hls)
+		return 0;
+
+#if defined(HAVE_RELAY)
+	if (relay_ok == 0)
+		return -1;
 
 	/*
-	** Limit the receive buffer sizes
+	** Both ends have to be connected; data that has
+	** been read already must go the buffer way first
 	*/
-	if(maxrecv_bufsiz > 0 && len > maxrecv_bufsiz)
-		len = maxrecv_bufsiz;
+	if (hls->sock  == -1 || hls->peer[0]  == '\0' ||
+	    peer->sock == -1 || peer->peer[0] == '\0' ||
+	    hls->scon  != NULL || peer->scon  != NULL)
+		return -1;
+	if (hls->rbuf != NULL || peer->rbuf != NULL ||
+	    hls->rlay != NULL || peer->rlay != NULL ||
+	    hls->kill != 0    || peer->kill != 0)
+		return -1;
 
 	/*
-	** Now read the data that is waiting
+	** Pipe writes to a socket must not block us
 	*/
-	buf = (BUF *) misc_alloc(FL, sizeof(BUF) + len);
+	if (socket_nblock(hls->sock) < 0 || socket_nblock(peer->sock) < 0) {
+		syslog_error("can't set %s / %s non-blocking",
+		             hls->ctyp, peer->ctyp);
+		return -1;
+	}
+
+	hls->rlay  = peer;
+	peer->rlay = hls;
+	hls->nbio  = peer->nbio = 1;
+	hls->pmax  = peer->pmax = (size_t) relay_size;
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "splice relay %s %d=%s <-> %s %d=%s",
+		hls->ctyp,  hls->sock,  hls->peer,
+		peer->ctyp, peer->sock, peer->peer);
+#endif
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_sp_drop
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Leave the relay mode for both peers.
+**			Data pending in the pipes is still sent.
+**
+** ------------------------------------------------------------ */
+
+static void socket_sp_drop(HLS *hls)
+{
+	if (hls->rlay != NULL) {
+		hls->rlay->rlay = NULL;
+		hls->rlay = NULL;
+	}
+}
+
+
+#if defined(HAVE_RELAY)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_sp_pipe
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	0=success, -1=failure
+**
+**	Purpose.......: Create the relay pipe feeding the HLS.
+**
+** ------------------------------------------------------------ */
+
+static int socket_sp_pipe(HLS *hls)
+{
+#if defined(F_GETPIPE_SZ)
+	int n;
+#endif
+
+	if (hls->pfd[0] != -1)
+		return 0;
+
+	if (pipe(hls->pfd) < 0) {
+		syslog_error("can't create relay pipe for %s", hls->ctyp);
+		hls->pfd[0] = -1;
+		hls->pfd[1] = -1;
+		return -1;
+	}
+#if defined(FD_CLOEXEC)
+	fcntl(hls->pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(hls->pfd[1], F_SETFD, FD_CLOEXEC);
+#endif
+#if defined(F_GETPIPE_SZ)
+	if ((n = fcntl(hls->pfd[0], F_GETPIPE_SZ)) > 0)
+		relay_size = n;
+#endif
+	hls->pmax = (size_t) relay_size;
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_sp_read
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	0=done, -1=use the buffers
+**
+**	Purpose.......: Relay mode read routine; moves the data
+**			into the relay peer's pipe and pushes it
+**			on to the peer right away.
+**
+** ------------------------------------------------------------ */
+
+static int socket_sp_read(HLS *hls)
+{
+	HLS    *dst = hls->rlay;
+	ssize_t cnt;
+	size_t  len;
+
+	if (socket_sp_pipe(dst) < 0) {
+		socket_sp_drop(hls);
+		return -1;
+	}
+
+	len = dst->pmax - dst->plen;
 	do {
 		errno = 0;
-		cnt = recv(hls->sock, buf->dat, len, 0);
+		cnt = splice(hls->sock, NULL, dst->pfd[1], NULL, len,
+		             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 	} while (cnt == -1 && EINTR == errno);
+	iorops++;
 
-	if (cnt != len) {
-		if(cnt > 0) {
+	if (cnt < 0) {
+		if (errno == EAGAIN) {
+			if (dst->plen == 0)
+				return 0;	/* Nothing there (yet)	*/
 			/*
-			** hmm... seems to be solaris, isn't? :-)
+			** The pipe may be full by its buffer
+			** slots (small segments) long before it
+			** is full by bytes; block until the peer
+			** drained it and keep the readiness, so
+			** no edge gets lost.
 			*/
-			syslog_write(T_DBG,
-			"recvd %d bytes while %d reported: %s %d=%s",
-			cnt, len, hls->ctyp, hls->sock, hls->peer);
-		} else {
+			dst->pmax  = dst->plen;
+			hls->evrd |= EV_RD;
+			return 0;
+		}
+		if ((errno == EINVAL || errno == ENOSYS) &&
+		    dst->plen == 0) {
 			/*
-			** report as error because we use FIONREAD
-			** above and handle EOF's (len = 0) there...
+			** not supported for this kind of
+			** socket - use the buffers from now
 			*/
-			hls->ernr = errno;
-			syslog_error("can't ll_read: %s %d=%s",
-			             hls->ctyp, hls->sock, hls->peer);
-			close(hls->sock);
-			hls->sock = -1;
-			misc_free(FL, buf);
-			return;
+			syslog_write(T_WRN, "can't splice %s - "
+			             "relay disabled", hls->ctyp);
+			relay_ok = 0;
+			socket_sp_drop(hls);
+			return -1;
 		}
+		hls->ernr = errno;
+		syslog_error("can't sp_read: %s %d=%s",
+		             hls->ctyp, hls->sock, hls->peer);
+		socket_ll_close(hls);
+		return 0;
 	}
-	buf->len = cnt;
-	buf->cur = 0;
-	buf->flg = 0;
 
 	/*
-	** Update byte conter
+	** Check if the socket has been closed
+	*/
+	if (cnt == 0) {
+#if defined(COMPILE_DEBUG)
+		debug(1, "closed: %s %d=%s (relay)",
+			hls->ctyp, hls->sock, hls->peer);
+#endif
+		socket_ll_close(hls);
+		return 0;
+	}
+
+	/*
+	** A full read may have left more data behind
 	*/
+	if ((size_t) cnt == len)
+		hls->evrd |= EV_RD;
+
 	hls->rcnt += cnt;
+	dst->plen += cnt;
+	iorbytes  += cnt;
+
+#if defined(COMPILE_DEBUG)
+	debug(3, "sp_read %s %d=%s: %d/%d bytes",
+			hls->ctyp, hls->sock, hls->peer,
+			(int) cnt, hls->rcnt);
+#endif
 
 	/*
-	** Chain the newly filled buffer
+	** The peer is non-blocking, so try to pass it on
 	*/
-	if (hls->rbuf == NULL)
-		hls->rbuf = buf;
-	else {
-		for (tmp = hls->rbuf; tmp->next; tmp = tmp->next)
-			;
-		tmp->next = buf;
+	if (dst->sock != -1 && dst->wbuf == NULL)
+		socket_sp_write(dst);
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_sp_write
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Relay mode write routine; moves data
+**			from the pipe into the socket.
+**
+** ------------------------------------------------------------ */
+
+static void socket_sp_write(HLS *hls)
+{
+	ssize_t cnt;
+
+	do {
+		errno = 0;
+		cnt = splice(hls->pfd[0], NULL, hls->sock, NULL, hls->plen,
+		             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (cnt == -1 && EINTR == errno);
+	iowops++;
+
+	if (cnt < 0) {
+		if (errno == EAGAIN)
+			return;		/* Socket is full	*/
+		hls->ernr = errno;
+		syslog_error("can't sp_write: %s %d=%s",
+		             hls->ctyp, hls->sock, hls->peer);
+		socket_ll_close(hls);
+		return;
 	}
-	buf->next = NULL;
+
+	hls->plen -= cnt;
+	hls->wcnt += cnt;
+	iowbytes  += cnt;
+	hls->pmax  = (size_t) relay_size;	/* Room again	*/
 
 #if defined(COMPILE_DEBUG)
-	debug(3, "ll_read %s %d=%s: %d/%d bytes",
+	debug(3, "sp_write %s %d=%s: %d/%d bytes",
 			hls->ctyp, hls->sock, hls->peer,
-			cnt, hls->rcnt);
+			(int) cnt, hls->wcnt);
 #endif
 }
+#endif
 
 
 /* ------------------------------------------------------------ **
 **
-**	Function......:	socket_ll_write
+**	Function......:	socket_bf_get
+**
+**	Parameters....:	len		Payload bytes needed
+**
+**	Return........:	Pointer to BUF (dies on failure)
+**
+**	Purpose.......: Get a BUF segment from the pool of the
+**			smallest fitting class. Only the header is
+**			initialized; the payload is overwritten by
+**			the caller anyway, so it is not zero'ed.
+**
+** ------------------------------------------------------------ */
+
+static BUF *socket_bf_get(size_t len)
+{
+	BUF *buf;
+	size_t siz;
+	int i;
+
+	for (i = 0; i < BUF_CLASSES && bfpool[i].siz < len; i++)
+		;
+	if (i < BUF_CLASSES && (buf = bfpool[i].head) != NULL) {
+		bfpool[i].head = buf->next;
+		bfpool[i].cnt--;
+		bfheld -= buf->siz;
+		bfhits++;
+	} else {
+		siz = (i < BUF_CLASSES) ? bfpool[i].siz : len;
+		if ((buf = (BUF *) malloc(sizeof(BUF) + siz)) == NULL)
+			misc_die(FL, "out of memory");
+		buf->siz = siz;
+		bfmiss++;
+	}
+
+	buf->next = NULL;
+	buf->len  = 0;
+	buf->cur  = 0;
+	buf->flg  = 0;
+	return buf;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bf_put
+**
+**	Parameters....:	buf		Pointer to BUF
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Return a BUF segment to the pool of its
+**			class or free it, if the list is full or
+**			the segment does not belong to a class.
+**
+** ------------------------------------------------------------ */
+
+static void socket_bf_put(BUF *buf)
+{
+	int i;
+
+	if (buf == NULL)
+		return;
+
+	for (i = 0; i < BUF_CLASSES; i++) {
+		if (bfpool[i].siz == buf->siz)
+			break;
+	}
+	if (i >= BUF_CLASSES || bfpool[i].cnt >= bfpool[i].max) {
+		free(buf);
+		return;
+	}
+	buf->next = bfpool[i].head;
+	bfpool[i].head = buf;
+	bfpool[i].cnt++;
+	bfheld += buf->siz;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bf_link
+**
+**	Parameters....:	head		Pointer to chain head
+**			tail		Pointer to chain tail
+**			frst		First BUF to append
+**			last		Last BUF to append
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Append the BUF's frst ... last to a
+**			chain. The tail is only valid while
+**			the head is set, so consumers removing
+**			buffers from the head need no update.
+**
+** ------------------------------------------------------------ */
+
+static void socket_bf_link(BUF **head, BUF **tail, BUF *frst, BUF *last)
+{
+	last->next = NULL;
+	if (*head == NULL)
+		*head = frst;
+	else
+		(*tail)->next = frst;
+	*tail = last;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bf_pack
 **
 **	Parameters....:	hls		Pointer to HighLevSock
 **
 **	Return........:	(none)
 **
-**	Purpose.......: Socket low level write routine.
+**	Purpose.......: Move the data of the following read
+**			buffers into the spare room of the first
+**			one, as long as it fits. Every byte gets
+**			copied once; the first buffer's data is
+**			moved to its front only if needed.
 **
 ** ------------------------------------------------------------ */
 
-static void socket_ll_write(HLS *hls)
+static void socket_bf_pack(HLS *hls)
+{
+	BUF *buf, *nxt;
+	size_t avl;
+
+	if ((buf = hls->rbuf) == NULL)
+		return;
+
+	while ((nxt = buf->next) != NULL) {
+		avl = nxt->len - nxt->cur;
+		if (avl > buf->siz - (buf->len - buf->cur))
+			break;
+		if (avl > buf->siz - buf->len) {
+			memmove(buf->dat, buf->dat + buf->cur,
+			        buf->len - buf->cur);
+			buf->len -= buf->cur;
+			buf->cur  = 0;
+		}
+		memcpy(buf->dat + buf->len, nxt->dat + nxt->cur, avl);
+		buf->len += avl;
+		buf->next = nxt->next;
+		if (hls->rlst == nxt)
+			hls->rlst = buf;
+		socket_bf_put(nxt);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bf_skip
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			chr		Character to be skipped
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Skip a run of chr at the beginning of
+**			the read chain, releasing used up buffers.
+**
+** ------------------------------------------------------------ */
+
+static void socket_bf_skip(HLS *hls, int chr)
 {
-	int cnt, tot;
 	BUF *buf;
 
-	if (hls == NULL)
-		misc_die(FL, "socket_ll_write: ?hls?");
+	while ((buf = hls->rbuf) != NULL) {
+		while (buf->cur < buf->len && buf->dat[buf->cur] == chr)
+			buf->cur++;
+		if (buf->cur < buf->len)
+			break;
+		hls->rbuf = buf->next;
+		socket_bf_put(buf);
+	}
+}
 
-	/*
-	** Try to send as much as possible
-	*/
-	for (buf = hls->wbuf, tot = 0; buf != NULL; ) {
-		do
-			cnt = send(hls->sock, buf->dat + buf->cur,
-					buf->len - buf->cur, buf->flg);
-		while (cnt == -1 && errno == EINTR);
 
-		/*
-		** Did we write anything?
-		*/
-		if (cnt < 0) {
-			if (tot == 0) {
-				hls->ernr = errno;
-				syslog_error("can't ll_write: %s %d=%s",
-				             hls->ctyp, hls->sock, hls->peer);
-				close(hls->sock);
-				hls->sock = -1;
-				return;
-			}
-			break;	/* At least the first write was ok */
-		}
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bf_flush
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release all BUF segments held in the pool.
+**
+** ------------------------------------------------------------ */
+
+static void socket_bf_flush(void)
+{
+	BUF *buf;
+	int i;
 
 #if defined(COMPILE_DEBUG)
-		debug(4, "ll_write %s %d=%s: sent %d bytes",
-			hls->ctyp, hls->sock, hls->peer, cnt);
+	debug(2, "buffer pool: %lu hits, %lu misses, %lu bytes held",
+		bfhits, bfmiss, (u_long) bfheld);
 #endif
+	for (i = 0; i < BUF_CLASSES; i++) {
+		while ((buf = bfpool[i].head) != NULL) {
+			bfpool[i].head = buf->next;
+			free(buf);
+		}
+		bfpool[i].cnt = 0;
+	}
+	bfheld = 0;
+}
 
-		/*
-		** Update byte conter
-		*/
-		tot += cnt;
-		hls->wcnt += cnt;
 
-		/*
-		** Advance the write pointers
-		*/
-		if ((buf->cur += cnt) < buf->len)
-			break;	/* Partly sent, try again later */
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_bstat
+**
+**	Parameters....:	hits		Pointer for pool hits
+**			miss		Pointer for pool misses
+**			held		Pointer for bytes held
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Report the BUF pool counters. Each of
+**			the pointers may be NULL.
+**
+** ------------------------------------------------------------ */
 
-		/*
-		** This buffer is done, try and send next one
-		*/
-		hls->wbuf = buf->next;
-		misc_free(FL, buf);
-		buf = hls->wbuf;
-	}
+void socket_bstat(u_long *hits, u_long *miss, size_t *held)
+{
+	if (hits != NULL)
+		*hits = bfhits;
+	if (miss != NULL)
+		*miss = bfmiss;
+	if (held != NULL)
+		*held = bfheld;
+}
 
-#if defined(COMPILE_DEBUG)
-	debug(3, "ll_write %s %d=%s: %d/%d bytes",
-			hls->ctyp, hls->sock, hls->peer,
-			tot, hls->wcnt);
-#endif
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_iostat
+**
+**	Parameters....:	rops		Pointer for read calls
+**			wops		Pointer for write calls
+**			rbytes		Pointer for bytes read
+**			wbytes		Pointer for bytes written
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Report the number of read and write
+**			system calls and the bytes they moved,
+**			buffered or relayed. Each of the
+**			pointers may be NULL.
+**
+** ------------------------------------------------------------ */
+
+void socket_iostat(u_long *rops, u_long *wops,
+                   double *rbytes, double *wbytes)
+{
+	if (rops != NULL)
+		*rops = iorops;
+	if (wops != NULL)
+		*wops = iowops;
+	if (rbytes != NULL)
+		*rbytes = iorbytes;
+	if (wbytes != NULL)
+		*wbytes = iowbytes;
 }
 
 
@@ -1565,10 +3666,11 @@ u_int16_t socket_d_listen(u_int32_t addr,
 **			ctyp		Desired comms type identifier
 **			incr		use rand or incremental bind
 **
-**	Return........:	Local end of connected port (0=failure)
+**	Return........:	Local end of connecting port (0=failure)
 **
 **	Purpose.......: Open a connecting socket, suitable for
 **			an additional data connection (e.g. FTP).
+**			The connect completes in socket_exec.
 **
 ** ------------------------------------------------------------ */
 
@@ -1578,125 +3680,438 @@ u_int16_t socket_d_connect(u_int32_t addr, u_int16_t port,
 			   HLS **phls, char *ctyp,
 			   int incr)
 {
-	struct sockaddr_in saddr;
-	int                sock  = -1; /* mark socket invalid */
-	int                retry = MAX_RETRIES;
-	u_int16_t          lprt  = lrng;
+	return socket_connect(addr, port, ladr, lrng, urng,
+	                      phls, ctyp, incr, SK_DATA);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_c_connect
+**
+**	Parameters....:	(see socket_d_connect)
+**
+**	Return........:	Local end of connecting port (0=failure)
+**
+**	Purpose.......: Open a connecting socket, suitable for
+**			a control connection.
+**
+** ------------------------------------------------------------ */
+
+u_int16_t socket_c_connect(u_int32_t addr, u_int16_t port,
+			   u_int32_t ladr,
+			   u_int16_t lrng, u_int16_t urng,
+			   HLS **phls, char *ctyp,
+			   int incr)
+{
+	return socket_connect(addr, port, ladr, lrng, urng,
+	                      phls, ctyp, incr, SK_CONTROL);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_connect
+**
+**	Parameters....:	(see socket_d_connect)
+**			kind		Socket kind for socket_opts
+**
+**	Return........:	Local end of connecting port (0=failure)
+**
+**	Purpose.......: Start a non-blocking connect and set up
+**			the HLS for it. Until the connect is done,
+**			the HLS is only watched for writability;
+**			data written to it is queued meanwhile.
+**
+** ------------------------------------------------------------ */
+
+static u_int16_t socket_connect(u_int32_t addr, u_int16_t port,
+				u_int32_t ladr,
+				u_int16_t lrng, u_int16_t urng,
+				HLS **phls, char *ctyp,
+				int incr, int kind)
+{
+	SCON *scon;
+	HLS  *hls;
+	int   sock, busy;
 
 	if (phls == NULL || ctyp == NULL)	/* Sanity check	*/
-		misc_die(FL, "socket_d_connect: ?phls? ?ctyp?");
+		misc_die(FL, "socket_connect: ?phls? ?ctyp?");
+
+	socket_setup();
+
+	scon = (SCON *) misc_alloc(FL, sizeof(SCON));
+	scon->addr  = addr;
+	scon->port  = port;
+	scon->ladr  = ladr;
+	scon->lrng  = lrng;
+	scon->urng  = urng;
+	scon->lprt  = lrng;
+	scon->incr  = incr;
+	scon->kind  = kind;
+	scon->retry = MAX_RETRIES;
+	gettimeofday(&(scon->beg), NULL);
+	scon->due   = (cn_timeout > 0) ? scon->beg.tv_sec + cn_timeout : 0;
+
+	if ((sock = socket_cn_start(scon, ctyp, &busy)) < 0) {
+		syslog_write(T_WRN, "can't connect %s to %s:%d - %s",
+		             ctyp, socket_addr2str(addr), (int) port,
+		             strerror(errno));
+		misc_free(FL, scon);
+		return 0;
+	}
 
-	while(0 <= retry--)
-	{
+	/*
+	** Allocate the corresponding High Level Socket;
+	** the peer is known, even if not connected yet
+	*/
+	if ((hls = socket_init(-1)) == NULL)
+		misc_die(FL, "socket_connect: ?hls?");
+	hls->sock = sock;
+	hls->addr = addr;
+	hls->port = port;
+	hls->nbio = 1;
+	hls->ctyp = ctyp;
+	misc_strncpy(hls->peer, socket_addr2str(addr), sizeof(hls->peer));
+
+	hls->scon = scon;
+	if (busy == 0)
+		socket_cn_note(hls);
+	*phls = hls;
+
+	(void) socket_sck2addr(sock, LOC_END, &port);
+#if defined(COMPILE_DEBUG)
+	debug(2, "connect: %s fd=%d%s", hls->ctyp, hls->sock,
+		(hls->scon != NULL) ? " (in progress)" : "");
+#endif
+	return port;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_start
+**
+**	Parameters....:	scon		Connect state
+**			ctyp		Comms type identifier
+**			busy		Set to 1 if in progress
+**
+**	Return........:	Socket descriptor, -1=failure (errno)
+**
+**	Purpose.......: Get a socket, bind it to the local port
+**			range if required and start the connect.
+**			Retries with the next local port on
+**			EADDRINUSE / EADDRNOTAVAIL.
+**
+** ------------------------------------------------------------ */
+
+static int socket_cn_start(SCON *scon, char *ctyp, int *busy)
+{
+	struct sockaddr_in saddr;
+	int sock, err;
+
+	while (0 <= scon->retry--) {
 		/*
 		** First of all, get a socket
 		*/
 		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			err = errno;
 			syslog_error("can't create %s socket", ctyp);
-			exit(EXIT_FAILURE);
+			errno = err;	/* Only this connect fails	*/
+			return -1;
 		}
-		socket_opts(sock, SK_DATA);
+		socket_opts(sock, scon->kind);
 
 		/*
 		** check if we have to use a port range
 		*/
-		if( !(INPORT_ANY == lrng && INPORT_ANY == urng)) {
-			/*
-			** Bind the socket, taking care of a given port range
-			*/
-			if(incr) {
-#if defined(COMPILE_DEBUG)
-				debug(2, "%s: about to bind to %s:range(%d-%d)",
-				         ctyp, socket_addr2str(ladr),
-				         lprt, urng);
-#endif
-				lprt = socket_d_bind(sock, ladr,
-				                     lprt, urng, incr);
-			} else {
+		if( !(INPORT_ANY == scon->lrng && INPORT_ANY == scon->urng)) {
 #if defined(COMPILE_DEBUG)
-				debug(2, "%s: about to bind to %s:range(%d-%d)",
-				         ctyp, socket_addr2str(ladr),
-				         lrng, urng);
+			debug(2, "%s: about to bind to %s:range(%d-%d)",
+			         ctyp, socket_addr2str(scon->ladr),
+			         scon->incr ? scon->lprt : scon->lrng,
+			         scon->urng);
 #endif
-				lprt = socket_d_bind(sock, ladr,
-				                     lrng, urng, incr);
-			}
-			if (INPORT_ANY == lprt) {
+			scon->lprt = socket_d_bind(sock, scon->ladr,
+			             scon->incr ? scon->lprt : scon->lrng,
+			             scon->urng, scon->incr);
+			if (INPORT_ANY == scon->lprt) {
 				/* nothing found? */
 				close(sock);
-				return 0;
+				errno = EADDRNOTAVAIL;
+				return -1;
 			}
-		} else lprt = INPORT_ANY;
+		} else scon->lprt = INPORT_ANY;
+
+		if (socket_nblock(sock) < 0) {
+			err = errno;
+			close(sock);
+			errno = err;
+			return -1;
+		}
 
 		/*
 		** Actually connect the socket
 		*/
 		memset(&saddr, 0, sizeof(saddr));
-		saddr.sin_addr.s_addr = htonl(addr);
+		saddr.sin_addr.s_addr = htonl(scon->addr);
 		saddr.sin_family      = AF_INET;
-		saddr.sin_port        = htons(port);
+		saddr.sin_port        = htons(scon->port);
 
 		if (connect(sock, (struct sockaddr *) &saddr,
-		                  sizeof(saddr)) < 0)
-		{
+		                  sizeof(saddr)) == 0) {
+			*busy = 0;
+			return sock;
+		}
+		if (errno == EINPROGRESS) {
+			*busy = 1;
+			return sock;
+		}
+
+		err = errno;
 #if defined(COMPILE_DEBUG)
-			debug(2, "%s: connect failed with '%s'",
-			         ctyp, strerror(errno));
+		debug(2, "%s: connect failed with '%s'",
+		         ctyp, strerror(err));
 #endif
-			close(sock);
-			sock = -1;
-			/* check if is makes sense to retry?
-			** perhaps we only need an other
-			** local port (EADDRNOTAVAIL) for
-			** this destination?
+		close(sock);
+		if (socket_cn_retry(scon, err) < 0) {
+			errno = err;
+			return -1;
+		}
+	}
+	errno = EADDRNOTAVAIL;
+	return -1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_retry
+**
+**	Parameters....:	scon		Connect state
+**			err		Error of the last attempt
+**
+**	Return........:	0=retry, -1=give up
+**
+**	Purpose.......: Check if it makes sense to retry; perhaps
+**			we only need an other local port
+**			(EADDRNOTAVAIL) for this destination.
+**
+** ------------------------------------------------------------ */
+
+static int socket_cn_retry(SCON *scon, int err)
+{
+	if( !(EINTR == err ||
+	      EAGAIN == err ||
+	      EADDRINUSE == err ||
+	      EADDRNOTAVAIL == err))
+	{
+		/*
+		** an other (real) error ocurred
+		*/
+		return -1;
+	}
+	if (scon->retry < 0)
+		return -1;
+
+	if(scon->incr && INPORT_ANY != scon->lprt) {
+		/*
+		** increment lower range if we use
+		** increment mode and have a range
+		*/
+		if(scon->lprt < scon->urng) {
+			scon->lprt++; /* incr lower range */
+		} else {
+			/*
+			** no more ports in range we can try
 			*/
-			if( !(EINTR == errno ||
-			      EAGAIN == errno ||
-			      EADDRINUSE == errno ||
-			      EADDRNOTAVAIL == errno))
-			{
-				/*
-				** an other (real) error ocurred
-				*/
-				return 0;
-			} else
-			if(incr && INPORT_ANY != lprt) {
-				/*
-				** increment lower range if we use
-				** increment mode and have a range
-				*/
-				if(lprt < urng) {
-					lprt++; /* incr lower range */
-				} else {
-				/*
-				** no more ports in range we can try
-				*/
-					return 0;
-				}
-			}
-		} else break;
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	/*
-	** check if we have a valid, connected socket
-	*/
-	if(-1 == sock) {
-		close(sock);
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_due
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			now		Current time
+**			wait		Seconds to wait for events
+**
+**	Return........:	1=connect timed out, 0=otherwise
+**
+**	Purpose.......: Check the deadline of a pending connect
+**			and shorten the wait for events to it.
+**
+** ------------------------------------------------------------ */
+
+static int socket_cn_due(HLS *hls, time_t now, int *wait)
+{
+	if (hls->scon == NULL || hls->scon->due == 0)
 		return 0;
+
+	if (now >= hls->scon->due) {
+		socket_cn_fail(hls, ETIMEDOUT);
+		return 1;
 	}
+	if (*wait > (int) (hls->scon->due - now))
+		*wait = (int) (hls->scon->due - now);
+	return 0;
+}
 
-	/*
-	** Allocate the corresponding High Level Socket
-	*/
-	if ((*phls = socket_init(sock)) == NULL)
-		misc_die(FL, "socket_d_connect: ?*phls?");
-	(*phls)->ctyp = ctyp;
 
-	(void) socket_sck2addr(sock, LOC_END, &port);
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_done
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Finish a connect once the socket became
+**			writable: check the result and retry or
+**			fail as appropriate.
+**
+** ------------------------------------------------------------ */
+
+static void socket_cn_done(HLS *hls)
+{
+	SCON     *scon = hls->scon;
+	int       err = 0, sock, busy;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(hls->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err == 0) {
+		socket_cn_note(hls);
+		return;
+	}
+
 #if defined(COMPILE_DEBUG)
-	debug(2, "connect: %s fd=%d", (*phls)->ctyp, (*phls)->sock);
+	debug(2, "%s: connect failed with '%s'",
+	         hls->ctyp, strerror(err));
 #endif
-	return port;
+	socket_ll_close(hls);
+	if (socket_cn_retry(scon, err) == 0) {
+		if ((sock = socket_cn_start(scon, hls->ctyp, &busy)) >= 0) {
+			hls->sock = sock;
+			hls->evrd = 0;
+			if (busy == 0)
+				socket_cn_note(hls);
+			return;
+		}
+		err = errno;
+	}
+	socket_cn_fail(hls, err);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_fail
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**			err		Error number
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Give up a connect; the HLS is closed.
+**
+** ------------------------------------------------------------ */
+
+static void socket_cn_fail(HLS *hls, int err)
+{
+	hls->ernr = err;
+	syslog_write(T_WRN, "can't connect %s to %s:%d - %s",
+	             hls->ctyp, hls->peer, (int) hls->port, strerror(err));
+
+	misc_free(FL, hls->scon);
+	hls->scon = NULL;
+	if (hls->sock != -1)
+		socket_ll_close(hls);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cn_note
+**
+**	Parameters....:	hls		Pointer to HighLevSock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Complete a connect and account its
+**			latency to the destination.
+**
+** ------------------------------------------------------------ */
+
+static void socket_cn_note(HLS *hls)
+{
+	struct timeval now;
+	double ms;
+	int i, j;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec  - hls->scon->beg.tv_sec)  * 1000.0 +
+	     (now.tv_usec - hls->scon->beg.tv_usec) / 1000.0;
+
+	misc_free(FL, hls->scon);
+	hls->scon = NULL;
+	hls->evrd = EV_WR;	/* Freshly connected: writable	*/
+
+	/*
+	** Find the destination, or recycle the one
+	** with the least connects for it
+	*/
+	for (i = 0, j = 0; i < cnused; i++) {
+		if (cnstat[i].addr == hls->addr)
+			break;
+		if (cnstat[i].cnt < cnstat[j].cnt)
+			j = i;
+	}
+	if (i >= cnused) {
+		if (cnused < CN_DESTS)
+			i = cnused++;
+		else
+			i = j;
+		memset(&cnstat[i], 0, sizeof(cnstat[i]));
+		cnstat[i].addr = hls->addr;
+	}
+	cnstat[i].cnt++;
+	cnstat[i].sum += ms;
+	if (ms > cnstat[i].max)
+		cnstat[i].max = ms;
+
+	syslog_write(T_DBG | L_SOCK, "connected %s to %s:%d in %.1f ms",
+	             hls->ctyp, hls->peer, (int) hls->port, ms);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	socket_cstat
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log the connect latency recorded for
+**			each destination.
+**
+** ------------------------------------------------------------ */
+
+void socket_cstat(void)
+{
+	int i;
+
+	for (i = 0; i < cnused; i++) {
+		syslog_write(T_DBG | L_SOCK, "connect latency %s: %lu connects, "
+		             "avg %.1f ms, max %.1f ms",
+		             socket_addr2str(cnstat[i].addr), cnstat[i].cnt,
+		             cnstat[i].sum / cnstat[i].cnt, cnstat[i].max);
+	}
 }
 
 
@@ -1715,7 +4130,6 @@ u_int16_t socket_d_connect(u_int32_t addr, u_int16_t port,
 
 u_int32_t socket_str2addr(char *name, u_int32_t dflt)
 {
-	struct hostent *hptr;
 	struct in_addr iadr;
 
 #if defined(COMPILE_DEBUG)
@@ -1736,17 +4150,10 @@ u_int32_t socket_str2addr(char *name, u_int32_t dflt)
 	}
 
 	/*
-	** Try to resolve the host as a DNS name
-	*/
-	if ((hptr = gethostbyname(name)) != NULL) {
-		memcpy(&iadr.s_addr, hptr->h_addr, sizeof(iadr.s_addr));
-		return (u_int32_t) ntohl(iadr.s_addr);
-	}
-
-	/*
-	** Well, then return the default
+	** Try to resolve the host as a DNS name; the
+	** resolver cache makes repeated lookups cheap
 	*/
-	return dflt;
+	return resolv_wait(name, dflt);
 }
 
 
@@ -2008,7 +4415,7 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 		syslog_error("can't get sockname for socket %d", phls->sock);
 		return -1;
 	}
-	syslog_write(T_DBG, "socket name address is %s:%d",
+	syslog_write(T_DBG | L_SOCK, "socket name address is %s:%d",
 		     socket_addr2str(ntohl(name.sin_addr.s_addr)),
 		                     ntohs(name.sin_port));
 
@@ -2044,14 +4451,15 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 	} else {
 		if((name.sin_port == dest.sin_port) &&
 		   (name.sin_addr.s_addr == dest.sin_addr.s_addr)) {
-			syslog_write(T_DBG,
+			syslog_write(T_DBG | L_SOCK,
 			      "iptables transparent destination %s:%d is local",
 			      socket_addr2str(ntohl(dest.sin_addr.s_addr)),
 			      ntohs(dest.sin_port));
 			return -1;
 		}
 
-		syslog_write(T_DBG, "iptables transparent destination: %s:%d",
+		syslog_write(T_DBG | L_SOCK,
+			"iptables transparent destination: %s:%d",
 			socket_addr2str(ntohl(dest.sin_addr.s_addr)),
 			ntohs(dest.sin_port));
 
@@ -2072,7 +4480,7 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 		syslog_error("can't get peername for socket %d", phls->sock);
 		return -1;
 	}
-	syslog_write(T_DBG, "socket peer address is %s:%d",
+	syslog_write(T_DBG | L_SOCK, "socket peer address is %s:%d",
 		     socket_addr2str(ntohl(peer.sin_addr.s_addr)),
 		                     ntohs(peer.sin_port));
 
@@ -2117,12 +4525,13 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 	if((natlook.rdport == name.sin_port) &&
 	   (natlook.rdaddr.v4.s_addr == name.sin_addr.s_addr))
 	{
-		syslog_write(T_DBG, "pfnat proxy destination %s:%d is local",
+		syslog_write(T_DBG | L_SOCK,
+		       "pfnat proxy destination %s:%d is local",
 		       socket_addr2str(ntohl(natlook.rdaddr.v4.s_addr)),
 		       ntohs(natlook.rdport));
 		return -1;
 	}
-	syslog_write(T_DBG, "pfnat transparent destination: %s:%d",
+	syslog_write(T_DBG | L_SOCK, "pfnat transparent destination: %s:%d",
 	             socket_addr2str(ntohl(natlook.rdaddr.v4.s_addr)),
 	             ntohs(natlook.rdport));
 
@@ -2175,13 +4584,13 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 	if((natlook.nl_realport == name.sin_port) &&
 	   (natlook.nl_realip.s_addr == name.sin_addr.s_addr))
 	{
-		syslog_write(T_DBG,
+		syslog_write(T_DBG | L_SOCK,
 		       "ipnat transparent destination %s:%d is local",
 		       socket_addr2str(ntohl(natlook.nl_realip.s_addr)),
 		       ntohs(natlook.nl_realport));
 		return -1;
 	}
-	syslog_write(T_DBG, "ipnat transparent destination: %s:%d",
+	syslog_write(T_DBG | L_SOCK, "ipnat transparent destination: %s:%d",
 		socket_addr2str(ntohl(natlook.nl_realip.s_addr)),
 		ntohs(natlook.nl_realport));
 
@@ -2194,7 +4603,7 @@ int socket_orgdst(HLS *phls, u_int32_t *addr, u_int16_t *port)
 	/*
 	** IP-Chains uses getsockname, as "transparent address"
 	*/
-	syslog_write(T_DBG,
+	syslog_write(T_DBG | L_SOCK,
 			"ipchains transparent destination: %s:%d",
 			socket_addr2str(ntohl(name.sin_addr.s_addr)),
 			ntohs(name.sin_port));
@@ -65,8 +65,10 @@
 #define PEER_LEN	32	/* Storage for dotted decimal	*/
 
 #define MAX_RETRIES	6	/* bind retries on EADDRINUSE	*/
+#define MAX_SHARDS	64	/* Max. SO_REUSEPORT listeners	*/
 
 typedef void (*ACPT_CB)(int);	/* Accept callback function	*/
+typedef void (*WTCH_CB)(int);	/* Watch callback function	*/
 
 
 /* ------------------------------------------------------------ */
@@ -80,6 +82,7 @@ typedef struct buf_t {
 	size_t  len;		/* Number of bytes at ptr	*/
 	size_t  cur;		/* Currently used offset	*/
 	int     flg;		/* Flag for send() (e.g. OOB)	*/
+	size_t  siz;		/* Capacity at dat (pool class)	*/
 	char    dat[8];		/* Beginning of data (Guard)	*/
 } BUF;
 
@@ -91,21 +94,42 @@ typedef struct hls_t {
 	int       retr;		/* recv i/o retry counter	*/
 	int       flag;		/* Flag for send() (e.g. OOB)	*/
 	int       more;		/* 1=read more to complete line	*/
+	size_t    lscn;		/* Line bytes scanned w/o EOL	*/
 	u_int32_t addr;		/* Peer's address (host order)	*/
 	u_int16_t port;		/* Peer's port (host order)	*/
 	char      peer[PEER_LEN]; /* Peer's readable address	*/
 	char     *ctyp;		/* Connection type identifier	*/
 	BUF      *wbuf;		/* Write buffer chain		*/
 	BUF      *rbuf;		/* Read buffer chain		*/
+	BUF      *wlst;		/* Last one in the write chain	*/
+	BUF      *rlst;		/* Last one in the read chain	*/
+	size_t    wlen;		/* Bytes queued in write chain	*/
+	size_t    whi;		/* High watermark (stop peer)	*/
+	size_t    wlo;		/* Low watermark (resume peer)	*/
+	size_t    rmax;		/* Read limit per round (0=off)	*/
 	size_t    wcnt;		/* write bytes counter		*/
 	size_t    rcnt;		/* read bytes counter		*/
+	int       nbio;		/* 1=socket is non-blocking	*/
+	int       rsiz;		/* Read size (0=ask FIONREAD)	*/
+	int       evfl;		/* Registered event interest	*/
+	int       evrd;		/* Pending (edge) ready events	*/
+	struct hls_t *rdnx;	/* Next one in the ready list	*/
+	struct hls_t *rlay;	/* Relay peer (splice mode)	*/
+	int       pfd[2];	/* Relay pipe feeding this one	*/
+	size_t    plen;		/* Bytes pending in relay pipe	*/
+	size_t    pmax;		/* Current relay pipe capacity	*/
+	struct scon_t *scon;	/* Pending connect (or NULL)	*/
 } HLS;
 
 
 /* ------------------------------------------------------------ */
 
+void socket_lshards(int cnt);
 int  socket_listen (u_int32_t addr, u_int16_t port, ACPT_CB func);
+int  socket_lshard (int idx);
 void socket_lclose (int shut);
+void socket_lserve (ACPT_CB func);
+int  socket_lwait  (void);
 
 HLS  *socket_init  (int sock);
 void  socket_opts  (int sock, int kind);
@@ -114,9 +138,19 @@ char *socket_gets  (HLS *hls, char *ptr, int len);
 void  socket_flag  (HLS *hls, int flag);
 int   socket_write (HLS *hls, char *ptr, int len);
 int   socket_printf(HLS *hls, char *fmt, ...);
+void  socket_pass  (HLS *from, HLS *to);
+void  socket_flow  (HLS *src, HLS *dst);
+size_t socket_queued(HLS *hls);
 int   socket_file  (HLS *hls, char *file, int crlf);
 
 int   socket_exec  (int timeout, int *close_flag);
+void  socket_watch (int sock, WTCH_CB func, time_t due);
+void  socket_unwatch(int sock);
+int   socket_splice(HLS *hls, HLS *peer);
+void  socket_bstat (u_long *hits, u_long *miss, size_t *held);
+void  socket_iostat(u_long *rops, u_long *wops,
+                    double *rbytes, double *wbytes);
+void  socket_cstat (void);
 
 char *socket_msgline(char *fmt);
 
@@ -135,6 +169,12 @@ u_int16_t socket_d_connect(u_int32_t addr, u_int16_t port,
 			   HLS **phls, char *ctyp,
 			   int incr);
 
+u_int16_t socket_c_connect(u_int32_t addr, u_int16_t port,
+			   u_int32_t ladr,
+			   u_int16_t lrng, u_int16_t urng,
+			   HLS **phls, char *ctyp,
+			   int incr);
+
 u_int32_t  socket_str2addr(char *name, u_int32_t dflt);
 u_int16_t  socket_str2port(char *name, u_int16_t dflt);
 char      *socket_addr2str(u_int32_t addr);
@@ -71,11 +71,27 @@ static char rcsid[] = "$Id: com-syslog.c,v 1.6.2.1 2003/05/07 11:14:34 mt Exp $"
 #  endif
 #endif
 
+#if defined(HAVE_SYS_SELECT_H)
+#  include <sys/select.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#endif
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS) && defined(__GNUC__)
+#  define HAVE_RING	1
+#endif
+
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-socket.h"
 #include "com-syslog.h"
 
 /*
@@ -93,6 +109,51 @@ typedef struct {
 	int   code;		/* The corresponding code	*/
 } FACIL;
 
+#define LV_MASK		0xff	/* Level part of a level	*/
+#define LC_MAX		8	/* Categories, see L_xxx	*/
+#define LC_OF(l)	(((l) >> 8) & (LC_MAX - 1))
+
+#if defined(HAVE_RING)
+#define LR_TEXT		192	/* Message bytes per slot	*/
+#define LR_MINSIZE	64	/* Min. slots in the buffer	*/
+#define LR_MAXSIZE	65536	/* Max. slots in the buffer	*/
+#define LR_STUCK	2	/* Secs a claimed slot may wait	*/
+
+/*
+** A slot of the log buffer. A message takes one or more
+** slots in a row; seq tells whose turn it is: pos while
+** it is free for the writer of position pos, pos + 1
+** once the message part is in. Both the writer and the
+** logger skipping a stuck slot change seq only if it is
+** still pos, so a late writer can't take a slot back.
+*/
+typedef struct {
+	volatile u_int32_t seq;	/* Position, see above		*/
+	u_int16_t nslot;	/* Slots of the message, 0=cont.*/
+	u_int16_t len;		/* Text bytes in this slot	*/
+	int       level;	/* T_xxx or U_xxx level		*/
+	pid_t     pid;		/* Writing process		*/
+	time_t    when;		/* Time of the message		*/
+	char      prog[16];	/* Program name of the writer	*/
+	char      text[LR_TEXT]; /* (Part of) the message	*/
+} LSLOT;
+
+/*
+** The log buffer, shared by the daemon, its children
+** and the logger process that writes it out
+*/
+typedef struct {
+	volatile u_int32_t head; /* Next position to claim	*/
+	volatile u_int32_t tail; /* Next position to write out	*/
+	volatile int   idle;	/* 1=logger waits for a wake-up	*/
+	volatile pid_t cons;	/* PID of the logger, 0=none	*/
+	volatile u_long drops;	/* Messages dropped, buffer full*/
+	volatile u_long quiet[LC_MAX]; /* Suppressed, gone processes*/
+	u_int32_t mask;		/* Number of slots - 1		*/
+	LSLOT     slot[1];	/* The slots (mask + 1)		*/
+} LRING;
+#endif
+
 
 /* ------------------------------------------------------------ */
 
@@ -104,6 +165,51 @@ static FILE  *log_file   = NULL;
 static FILE  *log_pipe   = NULL;
 static FACIL *log_syslog = NULL;
 
+static int    log_upto   = DEFAULT_LOG_LEVEL; /* Highest level	*/
+static int    log_cat[LC_MAX] = {		/* -1=log_level	*/
+	-1, -1, -1, -1, -1, -1, -1, -1
+};
+static u_long log_quiet[LC_MAX];		/* Suppressed	*/
+
+static char  *cat_name[LC_MAX] = {
+	"other", "control", "data", "auth", "rules", "socket", NULL, NULL
+};
+
+/*
+** Syslog and debug levels of T_xxx / U_xxx modulo 10
+*/
+static int    lv_log[6] = {
+	LOG_CRIT, LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR, LOG_CRIT
+};
+#if defined(COMPILE_DEBUG)
+static int    lv_dbg[6] = { 1, 3, 2, 1, 1, 1 };
+#endif
+
+#if defined(HAVE_RING)
+static LRING *ring       = NULL; /* The log buffer, if any	*/
+static int    ring_wake[2] = { -1, -1 }; /* Logger wake-up pipe	*/
+static pid_t  ring_owner = 0;	/* Process that created it	*/
+static volatile pid_t lg_pid = 0; /* Logger PID (owner only)	*/
+static time_t lg_born    = 0;	/* Logger start time		*/
+static int    lg_self    = 0;	/* 1=this is the logger		*/
+static volatile int lg_stop = 0; /* Logger: drain and exit	*/
+#endif
+
+static int    syslog_lvl  (char *word, size_t len);
+static void   syslog_levels(char *level);
+static char  *syslog_tag  (int level, int *loglvl, int *dbglvl);
+static void   syslog_put  (int level, char *str);
+static void   syslog_emit (char *prog, pid_t pid, time_t when,
+                           int level, char *str);
+#if defined(HAVE_RING)
+static int    syslog_ring_put  (int level, char *str);
+static void   syslog_ring_start(void);
+static void   syslog_ring_stop (void);
+static void   syslog_ring_serve(void);
+static int    syslog_ring_drain(time_t now);
+static RETSIGTYPE syslog_ring_signal(int signo);
+#endif
+
 static FACIL facilities[] = {
 #ifdef LOG_AUTH
 	{ "auth",   LOG_AUTH   },
@@ -182,6 +288,7 @@ void syslog_stderr()
 	syslog_close();
 	log_file = stderr;
 	log_level = LOG_ERR;
+	log_upto  = LOG_ERR;
 }
 
 /* ------------------------------------------------------------ **
@@ -212,9 +319,12 @@ void syslog_open(char *name, char *level)
 
 	if (misc_strequ(name, log_name)) {
 		/*
-		** log destination hasn't changed
-		** rotate, if a log file is used
+		** log destination hasn't changed, but
+		** the levels may have; rotate, if a
+		** log file is used
 		*/
+		log_level = DEFAULT_LOG_LEVEL;
+		syslog_levels(level);
 		if(log_file) {
 			syslog_rotate();
 		}
@@ -239,25 +349,7 @@ void syslog_open(char *name, char *level)
 		return;
 	}
 
-	if(level && *level) {
-		if( !strcasecmp("FLT", level)) {
-			log_level = LOG_CRIT;
-		} else
-		if( !strcasecmp("ERR", level)) {
-			log_level = LOG_ERR;
-		} else
-		if( !strcasecmp("WRN", level)) {
-			log_level = LOG_WARNING;
-		} else
-		if( !strcasecmp("INF", level)) {
-			log_level = LOG_INFO;
-		} else
-		if( !strcasecmp("DBG", level)) {
-			log_level = LOG_DEBUG;
-		} else {
-			misc_die(FL, "invalid log level '%.3s'");
-		}
-	}
+	syslog_levels(level);
 
 	/*
 	** So we do have a destination now ...
@@ -310,9 +402,13 @@ void syslog_open(char *name, char *level)
 		openlog(misc_getprog(),
 				LOG_PID | LOG_CONS | LOG_NDELAY,
 				log_syslog->code);
-		setlogmask(LOG_UPTO(log_level));
+		setlogmask(LOG_UPTO(log_upto));
 	}
 	log_name = misc_strdup(FL, name);
+
+#if defined(HAVE_RING)
+	syslog_ring_start();
+#endif
 }
 
 
@@ -334,11 +430,16 @@ void syslog_write(int level, char *fmt, ...)
 {
 	int tmperr = errno;		/* Save errno for later	*/
 	va_list aptr;
-	int loglvl, dbglvl;
-	FILE *fp;
-	time_t now;
-	struct tm *t;
-	char *logstr, buf[32], str[MAX_PATH_SIZE * 4];
+	int loglvl, dbglvl, cat;
+	char *logstr, str[MAX_PATH_SIZE * 4];
+
+	/*
+	** Don't format what nobody is going to read
+	*/
+	if (syslog_want(level) == 0) {
+		errno = tmperr;		/* Restore errno	*/
+		return;
+	}
 
 	va_start(aptr, fmt);
 #if defined(HAVE_VSNPRINTF)
@@ -348,89 +449,21 @@ void syslog_write(int level, char *fmt, ...)
 #endif
 	va_end(aptr);
 
-	switch (level) {
-		case T_DBG:	loglvl = LOG_DEBUG;
-				logstr = "TECH-DBG";
-				dbglvl = 3;
-				break;
-		case T_INF:	loglvl = LOG_INFO;
-				logstr = "TECH-INF";
-				dbglvl = 2;
-				break;
-		case T_WRN:	loglvl = LOG_WARNING;
-				logstr = "TECH-WRN";
-				dbglvl = 1;
-				break;
-		case T_ERR:	loglvl = LOG_ERR;
-				logstr = "TECH-ERR";
-				dbglvl = 1;
-				break;
-		case T_FTL:	loglvl = LOG_CRIT;
-				logstr = "TECH-FTL";
-				dbglvl = 1;
-				break;
-
-		case U_DBG:	loglvl = LOG_DEBUG;
-				logstr = "USER-DBG";
-				dbglvl = 3;
-				break;
-		case U_INF:	loglvl = LOG_INFO;
-				logstr = "USER-INF";
-				dbglvl = 2;
-				break;
-		case U_WRN:	loglvl = LOG_WARNING;
-				logstr = "USER-WRN";
-				dbglvl = 1;
-				break;
-		case U_ERR:	loglvl = LOG_ERR;
-				logstr = "USER-ERR";
-				dbglvl = 1;
-				break;
-		case U_FTL:	loglvl = LOG_CRIT;
-				logstr = "USER-FTL";
-				dbglvl = 1;
-				break;
-
-		default:	loglvl = LOG_CRIT;
-				logstr = "TECH-FLT";
-				dbglvl = 1;
-	}
+	logstr = syslog_tag(level, &loglvl, &dbglvl);
 
 #if defined(COMPILE_DEBUG)
 	debug(dbglvl, "%s %s", logstr, str);
+#else
+	logstr = logstr;
 #endif
 
-	if (log_level < loglvl) {
-		errno = tmperr;		/* Restore errno	*/
-		return;
-	}
-
-	if (log_syslog) {
-		syslog(loglvl, "%s %s", logstr, str);
+	cat = LC_OF(level);
+	if ((log_cat[cat] < 0 ? log_level : log_cat[cat]) < loglvl) {
 		errno = tmperr;		/* Restore errno	*/
 		return;
 	}
 
-	if ((fp = (log_file ? log_file : log_pipe)) == NULL) {
-		errno = tmperr;		/* Restore errno	*/
-		return;
-	}
-
-	time(&now);
-	t = localtime(&now);
-#if defined(HAVE_SNPRINTF)
-	snprintf(buf, sizeof(buf), "%02d/%02d-%02d:%02d:%02d",
-			t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec);
-#else
-	sprintf(buf, "%02d/%02d-%02d:%02d:%02d",
-			t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec);
-#endif
-	fprintf(fp, "%s [%d] <%s> %s %s\n", misc_getprog(),
-				(int) getpid(), buf, logstr, str);
-	fflush(fp);
-
+	syslog_put(level & LV_MASK, str);
 	errno = tmperr;			/* Restore errno	*/
 }
 
@@ -452,10 +485,13 @@ void syslog_error(char *fmt, ...)
 {
 	int tmperr = errno;		/* Save errno for later	*/
 	va_list aptr;
-	FILE *fp;
-	time_t now;
-	struct tm *t;
-	char buf[32], str[MAX_PATH_SIZE * 4];
+	size_t len;
+	char str[MAX_PATH_SIZE * 4];
+
+	if (syslog_want(T_ERR) == 0) {
+		errno = tmperr;		/* Restore errno	*/
+		return;
+	}
 
 	va_start(aptr, fmt);
 #if defined(HAVE_VSNPRINTF)
@@ -478,38 +514,754 @@ void syslog_error(char *fmt, ...)
 		return;
 	}
 
+	/*
+	** Only syslog gets to know the errno
+	*/
+	len = strlen(str);
+	if (log_syslog && tmperr != 0 && len + 300 < sizeof(str)) {
+#if defined(HAVE_SNPRINTF)
+		snprintf(str + len, sizeof(str) - len,
+		         " (errno=%d [%.256s])", tmperr, strerror(tmperr));
+#else
+		sprintf(str + len, " (errno=%d [%.256s])",
+		        tmperr, strerror(tmperr));
+#endif
+	}
+
+	syslog_put(T_ERR, str);
+	errno = tmperr;			/* Restore errno	*/
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_want
+**
+**	Parameters....:	level		T_xxx or U_xxx level,
+**					or-ed with a L_xxx category
+**
+**	Return........:	1 if a message of this level would
+**			be logged, else 0
+**
+**	Purpose.......: Check the level of the category (or the
+**			LogLevel) before any work is done for a
+**			message. Counts the suppressed ones per
+**			category, see syslog_stats. Call sites
+**			with expensive arguments use it to skip
+**			them: if (syslog_want(T_DBG | L_CTRL)).
+**
+** ------------------------------------------------------------ */
+
+int  syslog_want(int level)
+{
+	int i, cat;
+
+	if ((i = (level & LV_MASK) % 10) > 5)
+		i = 0;
+	cat = LC_OF(level);
+
+	if ((log_cat[cat] < 0 ? log_level : log_cat[cat]) >= lv_log[i])
+		return 1;
+#if defined(COMPILE_DEBUG)
+	if (debug_level() >= lv_dbg[i])
+		return 1;
+#endif
+	log_quiet[cat]++;
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_stats
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log how many messages were suppressed by
+**			their level, per category; includes the
+**			gone children if there is a log buffer.
+**
+** ------------------------------------------------------------ */
+
+void syslog_stats(void)
+{
+	u_long sum[LC_MAX];
+	int i;
+
+	for (i = 0; i < LC_MAX; i++) {
+		sum[i] = log_quiet[i];
+#if defined(HAVE_RING)
+		if (ring != NULL)
+			sum[i] += ring->quiet[i];
+#endif
+	}
+
+	syslog_write(T_INF, "log: suppressed %lu control, %lu data, "
+	             "%lu auth, %lu rules, %lu socket, %lu other messages",
+	             sum[1], sum[2], sum[3], sum[4], sum[5],
+	             sum[0] + sum[6] + sum[7]);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_tag
+**
+**	Parameters....:	level		T_xxx or U_xxx level
+**			loglvl		Where to put syslog level
+**			dbglvl		Where to put debug level
+**
+**	Return........:	Tag of the level for the log
+**
+**	Purpose.......: Map our levels to the syslog ones.
+**
+** ------------------------------------------------------------ */
+
+static char *syslog_tag(int level, int *loglvl, int *dbglvl)
+{
+	switch (level & LV_MASK) {
+		case T_DBG:	*loglvl = LOG_DEBUG;
+				*dbglvl = 3;
+				return "TECH-DBG";
+		case T_INF:	*loglvl = LOG_INFO;
+				*dbglvl = 2;
+				return "TECH-INF";
+		case T_WRN:	*loglvl = LOG_WARNING;
+				*dbglvl = 1;
+				return "TECH-WRN";
+		case T_ERR:	*loglvl = LOG_ERR;
+				*dbglvl = 1;
+				return "TECH-ERR";
+		case T_FTL:	*loglvl = LOG_CRIT;
+				*dbglvl = 1;
+				return "TECH-FTL";
+
+		case U_DBG:	*loglvl = LOG_DEBUG;
+				*dbglvl = 3;
+				return "USER-DBG";
+		case U_INF:	*loglvl = LOG_INFO;
+				*dbglvl = 2;
+				return "USER-INF";
+		case U_WRN:	*loglvl = LOG_WARNING;
+				*dbglvl = 1;
+				return "USER-WRN";
+		case U_ERR:	*loglvl = LOG_ERR;
+				*dbglvl = 1;
+				return "USER-ERR";
+		case U_FTL:	*loglvl = LOG_CRIT;
+				*dbglvl = 1;
+				return "USER-FTL";
+	}
+	*loglvl = LOG_CRIT;
+	*dbglvl = 1;
+	return "TECH-FLT";
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_lvl
+**
+**	Parameters....:	word		Level name, FLT to DBG
+**			len		Length of the name
+**
+**	Return........:	Syslog level
+**
+**	Purpose.......: Parse a log level name; dies if it is
+**			not a valid one.
+**
+** ------------------------------------------------------------ */
+
+static int syslog_lvl(char *word, size_t len)
+{
+	if (len == 3) {
+		if ( !strncasecmp("FLT", word, 3))
+			return LOG_CRIT;
+		if ( !strncasecmp("ERR", word, 3))
+			return LOG_ERR;
+		if ( !strncasecmp("WRN", word, 3))
+			return LOG_WARNING;
+		if ( !strncasecmp("INF", word, 3))
+			return LOG_INFO;
+		if ( !strncasecmp("DBG", word, 3))
+			return LOG_DEBUG;
+	}
+	misc_die(FL, "invalid log level '%.*s'",
+	         (int) (len > 16 ? 16 : len), word);
+	return LOG_CRIT;	/* Not reached	*/
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_levels
+**
+**	Parameters....:	level		LogLevel value (optional)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Set the log level and the levels of the
+**			categories, e.g. "WRN control=DBG auth=INF".
+**			Categories not listed use the log level.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_levels(char *level)
+{
+	size_t len, nlen;
+	char *eq;
+	int i;
+
+	for (i = 0; i < LC_MAX; i++)
+		log_cat[i] = -1;
+
+	while (level && *level) {
+		len = strcspn(level, " \t,");
+		if (len == 0) {
+			level++;
+			continue;
+		}
+
+		eq = memchr(level, '=', len);
+		if (eq == NULL) {
+			log_level = syslog_lvl(level, len);
+		} else {
+			nlen = eq - level;
+			for (i = 1; cat_name[i] != NULL; i++) {
+				if (strlen(cat_name[i]) == nlen &&
+				    !strncasecmp(cat_name[i], level, nlen))
+					break;
+			}
+			if (cat_name[i] == NULL) {
+				misc_die(FL, "invalid log category '%.*s'",
+				         (int) (nlen > 16 ? 16 : nlen), level);
+			}
+			log_cat[i] = syslog_lvl(eq + 1, len - nlen - 1);
+		}
+		level += len;
+	}
+
+	/*
+	** Syslog must let the highest one pass
+	*/
+	log_upto = log_level;
+	for (i = 0; i < LC_MAX; i++) {
+		if (log_cat[i] > log_upto)
+			log_upto = log_cat[i];
+	}
+	if (log_syslog)
+		setlogmask(LOG_UPTO(log_upto));
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_put
+**
+**	Parameters....:	level		T_xxx or U_xxx level
+**			str		The message
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Hand a message to the logger process or,
+**			if there is none, write it ourself.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_put(int level, char *str)
+{
+	FILE *fp;
+
+	if (log_syslog == NULL && log_file == NULL && log_pipe == NULL)
+		return;
+
+#if defined(HAVE_RING)
+	if (ring != NULL && lg_self == 0 && syslog_ring_put(level, str) == 0)
+		return;
+#endif
+
+	syslog_emit(misc_getprog(), getpid(), time(NULL), level, str);
+	if ((fp = (log_file ? log_file : log_pipe)) != NULL)
+		fflush(fp);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_emit
+**
+**	Parameters....:	prog		Program name of the writer
+**			pid		Process ID of the writer
+**			when		Time of the message
+**			level		T_xxx or U_xxx level
+**			str		The message
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Write a message to the log destination;
+**			the caller flushes the log file.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_emit(char *prog, pid_t pid, time_t when,
+                        int level, char *str)
+{
+	static time_t last = 0;
+	static char buf[32];
+	int loglvl, dbglvl;
+	struct tm *t;
+	char *logstr;
+	FILE *fp;
+
+	logstr = syslog_tag(level, &loglvl, &dbglvl);
+
 	if (log_syslog) {
-		if (tmperr == 0)
-			syslog(LOG_ERR, "TECH-ERR %s", str);
+		if (pid == getpid())
+			syslog(loglvl, "%s %s", logstr, str);
 		else
-			syslog(LOG_ERR, "TECH-ERR %s (errno=%d [%.256s])",
-					str, tmperr, strerror(tmperr));
-		errno = tmperr;		/* Restore errno	*/
+			syslog(loglvl, "[%d] %s %s", (int) pid, logstr, str);
 		return;
 	}
 
-	if ((fp = (log_file ? log_file : log_pipe)) == NULL) {
-		errno = tmperr;		/* Restore errno	*/
+	if ((fp = (log_file ? log_file : log_pipe)) == NULL)
 		return;
+
+	/*
+	** The logger writes lots of messages per second
+	*/
+	if (when != last || buf[0] == '\0') {
+		last = when;
+		t = localtime(&when);
+#if defined(HAVE_SNPRINTF)
+		snprintf(buf, sizeof(buf), "%02d/%02d-%02d:%02d:%02d",
+				t->tm_mon + 1, t->tm_mday,
+				t->tm_hour, t->tm_min, t->tm_sec);
+#else
+		sprintf(buf, "%02d/%02d-%02d:%02d:%02d",
+				t->tm_mon + 1, t->tm_mday,
+				t->tm_hour, t->tm_min, t->tm_sec);
+#endif
 	}
+	fprintf(fp, "%s [%d] <%s> %s %s\n", prog,
+				(int) pid, buf, logstr, str);
+}
 
-	time(&now);
-	t = localtime(&now);
+
+#if defined(HAVE_RING)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_put
+**
+**	Parameters....:	level		T_xxx or U_xxx level
+**			str		The message
+**
+**	Return........:	0 if the message was handled, -1 if
+**			the caller has to write it itself
+**
+**	Purpose.......: Put a message into the log buffer and
+**			wake up the logger if it is waiting.
+**			Never waits for the logger: if the
+**			buffer is full, the message is dropped
+**			and counted. The same goes for message
+**			parts the logger gave up waiting for.
+**
+** ------------------------------------------------------------ */
+
+static int syslog_ring_put(int level, char *str)
+{
+	u_int32_t pos, p, n, i;
+	size_t len, off, cnt;
+	int32_t dif;
+	LSLOT *sp;
+
+	/*
+	** No logger (yet or any more), e.g. the
+	** children outliving the daemon
+	*/
+	if (ring->cons == 0)
+		return -1;
+
+	len = strlen(str);
+	n   = (len + LR_TEXT - 1) / LR_TEXT;
+	if (n == 0)
+		n = 1;
+	if (n > (ring->mask + 1) / 4) {
+		/*
+		** Don't let a single message eat the buffer
+		*/
+		n   = (ring->mask + 1) / 4;
+		len = n * LR_TEXT;
+	}
+
+	/*
+	** Claim n slots in a row; the last one tells
+	** whether all of them are written out
+	*/
+	for (;;) {
+		pos = ring->head;
+		sp  = &ring->slot[(pos + n - 1) & ring->mask];
+		dif = (int32_t) (sp->seq - (pos + n - 1));
+		if (dif < 0) {
+			__sync_fetch_and_add(&ring->drops, 1);
+			return 0;
+		}
+		if (dif == 0 && __sync_bool_compare_and_swap(&ring->head,
+		                                          pos, pos + n))
+			break;
+	}
+
+	for (i = 0, off = 0; i < n; i++, off += cnt) {
+		p   = pos + i;
+		sp  = &ring->slot[p & ring->mask];
+		cnt = (len - off > LR_TEXT) ? LR_TEXT : len - off;
+		if (sp->seq != p)
+			continue;	/* Skipped by the logger */
+		if (i == 0) {
+			sp->nslot = (u_int16_t) n;
+			sp->level = level;
+			sp->pid   = getpid();
+			sp->when  = time(NULL);
+			misc_strncpy(sp->prog, misc_getprog(),
+			             sizeof(sp->prog));
+		} else {
+			sp->nslot = 0;
+		}
+		sp->len = (u_int16_t) cnt;
+		memcpy(sp->text, str + off, cnt);
+		__sync_synchronize();
+		(void) __sync_bool_compare_and_swap(&sp->seq, p, p + 1);
+	}
+
+	if (ring->idle && __sync_bool_compare_and_swap(&ring->idle, 1, 0) &&
+	    write(ring_wake[1], "", 1) != 1) {
+		/*
+		** A full pipe wakes it up as well
+		*/
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_drain
+**
+**	Parameters....:	now		Current time
+**
+**	Return........:	Number of messages written
+**
+**	Purpose.......: Logger: write out the messages that are
+**			complete, in the order they were queued.
+**			A slot claimed by a writer that did not
+**			fill it in LR_STUCK seconds (e.g. it was
+**			killed) is skipped; a writer that is
+**			still alive then finds the slot taken.
+**			Reports the messages dropped since the
+**			last call.
+**
+** ------------------------------------------------------------ */
+
+static int syslog_ring_drain(time_t now)
+{
+	static u_int32_t spos  = 0;	/* Slot we are waiting for */
+	static time_t    since = 0;	/* ... since then	*/
+	static u_long    seen  = 0;	/* Drops reported	*/
+	char text[MAX_PATH_SIZE * 4], buf[64];
+	u_int32_t pos, n, i;
+	LSLOT *sp, *cp;
+	size_t len;
+	u_long cnt;
+	FILE *fp;
+	int num = 0;
+
+	for (;;) {
+		pos = ring->tail;
+		sp  = &ring->slot[pos & ring->mask];
+		if (sp->seq != pos + 1) {
+			if (pos == ring->head)
+				break;		/* Empty	*/
+			if (since == 0 || spos != pos) {
+				spos  = pos;
+				since = now;
+				break;
+			}
+			if (now - since < LR_STUCK)
+				break;
+
+			/*
+			** The writer is gone or much too slow -
+			** skip it, unless it just came through
+			*/
+			since = 0;
+			if (!__sync_bool_compare_and_swap(&sp->seq, pos,
+			                                  pos + ring->mask + 1))
+				continue;
+			ring->tail = pos + 1;
+			__sync_fetch_and_add(&ring->drops, 1);
+			continue;
+		}
+		if ((n = sp->nslot) == 0) {
+			/*
+			** Rest of a message we skipped
+			*/
+			sp->seq = pos + ring->mask + 1;
+			ring->tail = pos + 1;
+			continue;
+		}
+
+		for (i = 1; i < n; i++) {
+			cp = &ring->slot[(pos + i) & ring->mask];
+			if (cp->seq != pos + i + 1)
+				break;
+		}
+		if (i < n) {
+			/*
+			** Not complete yet; give up on it
+			** only if it takes much too long
+			*/
+			if (since == 0 || spos != pos) {
+				spos  = pos;
+				since = now;
+				break;
+			}
+			if (now - since < LR_STUCK)
+				break;
+			n = i;
+		}
+		since = 0;
+
+		for (i = 0, len = 0; i < n; i++) {
+			cp = &ring->slot[(pos + i) & ring->mask];
+			if (len + cp->len >= sizeof(text))
+				break;
+			memcpy(text + len, cp->text, cp->len);
+			len += cp->len;
+		}
+		text[len] = '\0';
+		syslog_emit(sp->prog, sp->pid, sp->when, sp->level, text);
+		num++;
+
+		__sync_synchronize();
+		for (i = 0; i < n; i++) {
+			cp = &ring->slot[(pos + i) & ring->mask];
+			cp->seq = pos + i + ring->mask + 1;
+		}
+		ring->tail = pos + n;
+	}
+
+	if (seen != (cnt = ring->drops)) {
+		if (log_level >= LOG_WARNING) {
 #if defined(HAVE_SNPRINTF)
-	snprintf(buf, sizeof(buf), "%02d/%02d-%02d:%02d:%02d",
-			t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec);
+			snprintf(buf, sizeof(buf), "log buffer full: "
+			         "%lu messages dropped", cnt - seen);
 #else
-	sprintf(buf, "%02d/%02d-%02d:%02d:%02d",
-			t->tm_mon + 1, t->tm_mday,
-			t->tm_hour, t->tm_min, t->tm_sec);
+			sprintf(buf, "log buffer full: "
+			        "%lu messages dropped", cnt - seen);
 #endif
-	fprintf(fp, "%s [%d] <%s> TECH-ERR %s\n",
-			misc_getprog(), (int) getpid(), buf, str);
-	fflush(fp);
+			syslog_emit(misc_getprog(), getpid(), now, T_WRN, buf);
+			num++;
+		}
+		seen = cnt;
+	}
 
-	errno = tmperr;			/* Restore errno	*/
+	if (num > 0 && (fp = (log_file ? log_file : log_pipe)) != NULL)
+		fflush(fp);
+	return num;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_signal
+**
+**	Parameters....:	signo		Signal to be handled
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Logger: drain the buffer and terminate.
+**
+** ------------------------------------------------------------ */
+
+static RETSIGTYPE syslog_ring_signal(int signo)
+{
+	lg_stop = 1;
+	signal(signo, syslog_ring_signal);
+#if RETSIGTYPE != void
+	return 0;
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_serve
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none, exits)
+**
+**	Purpose.......: Main loop of the logger process: write
+**			out the log buffer, sleep on the wake-up
+**			pipe while it is empty. Runs until it is
+**			told to stop or the daemon goes away.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_ring_serve(void)
+{
+	struct timeval tv;
+	fd_set rfds;
+	char buf[64];
+	pid_t ppid, pid, old;
+
+	misc_setprog("ftp-log", NULL);
+	misc_forget();
+	socket_lclose(0);
+	close(ring_wake[1]);
+
+	signal(SIGINT,  syslog_ring_signal);
+	signal(SIGTERM, syslog_ring_signal);
+	signal(SIGQUIT, syslog_ring_signal);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP,  SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	lg_self = 1;
+	pid  = getpid();
+	ppid = getppid();
+
+	/*
+	** A logger we replaced may still be draining
+	*/
+	while (!__sync_bool_compare_and_swap(&ring->cons, 0, pid)) {
+		old = ring->cons;
+		if (old != 0 && kill(old, 0) != 0 && errno == ESRCH &&
+		    __sync_bool_compare_and_swap(&ring->cons, old, pid))
+			break;
+		if (lg_stop || getppid() != ppid)
+			exit(EXIT_SUCCESS);
+		tv.tv_sec  = 0;
+		tv.tv_usec = 100000;
+		select(0, NULL, NULL, NULL, &tv);
+	}
+
+	while (lg_stop == 0 && getppid() == ppid) {
+		syslog_ring_drain(time(NULL));
+
+		/*
+		** Tell the writers we need a wake-up,
+		** then look again so we don't miss one
+		*/
+		ring->idle = 1;
+		__sync_synchronize();
+		if (ring->slot[ring->tail & ring->mask].seq ==
+		    ring->tail + 1) {
+			ring->idle = 0;
+			continue;
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(ring_wake[0], &rfds);
+		tv.tv_sec  = 1;
+		tv.tv_usec = 0;
+		if (select(ring_wake[0] + 1, &rfds, NULL, NULL, &tv) > 0) {
+			while (read(ring_wake[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		ring->idle = 0;
+	}
+
+	syslog_ring_drain(time(NULL));
+	if (log_file)
+		fflush(log_file);
+	else if (log_pipe)
+		fflush(log_pipe);
+	ring->cons = 0;
+	exit(EXIT_SUCCESS);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_start
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Owner: start the logger process, but
+**			not more than once a second.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_ring_start(void)
+{
+	time_t now;
+	pid_t pid;
+
+	if (ring == NULL || ring_owner != getpid() || lg_pid != 0)
+		return;
+	if (log_syslog == NULL && log_file == NULL && log_pipe == NULL)
+		return;
+
+	now = time(NULL);
+	if (lg_born == now)
+		return;
+	lg_born = now;
+
+	switch (pid = fork()) {
+		case -1:
+			syslog_error("can't fork logger");
+			break;
+		case 0:
+			syslog_ring_serve();
+			exit(EXIT_SUCCESS);
+		default:
+			lg_pid = pid;
+#if defined(COMPILE_DEBUG)
+			debug(1, "logger started with pid=%d", (int) pid);
+#endif
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_ring_stop
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Owner: let the logger write out what is
+**			in the buffer and wait (a while) until it
+**			is done, so the log can be closed.
+**
+** ------------------------------------------------------------ */
+
+static void syslog_ring_stop(void)
+{
+	struct timeval tv;
+	pid_t pid;
+	int i;
+
+	if (ring == NULL || ring_owner != getpid() || (pid = lg_pid) == 0)
+		return;
+
+	lg_pid  = 0;
+	lg_born = 0;
+	kill(pid, SIGTERM);
+	for (i = 0; i < 500 && ring->cons == pid; i++) {
+		tv.tv_sec  = 0;
+		tv.tv_usec = 10000;
+		select(0, NULL, NULL, NULL, &tv);
+	}
 }
+#endif
 
 
 /* ------------------------------------------------------------ **
@@ -602,6 +1354,9 @@ void syslog_rotate(void)
 	syslog_write(T_INF, "rotating log file '%.*s'",
 	                    MAX_PATH_SIZE, log_name);
 
+#if defined(HAVE_RING)
+	syslog_ring_stop();
+#endif
 	fclose(log_file);
 	log_file = NULL;
 
@@ -618,6 +1373,10 @@ void syslog_rotate(void)
 		misc_die(FL, "can't open logfile '%.*s'",
 					MAX_PATH_SIZE, log_name);
 	}
+
+#if defined(HAVE_RING)
+	syslog_ring_start();
+#endif
 }
 
 
@@ -635,6 +1394,25 @@ void syslog_rotate(void)
 
 void syslog_close(void)
 {
+	int c;
+#if defined(HAVE_RING)
+	int i;
+
+	syslog_ring_stop();
+
+	/*
+	** Leave our suppressed counts to syslog_stats
+	*/
+	if (ring != NULL && ring_owner != getpid()) {
+		for (i = 0; i < LC_MAX; i++) {
+			if (log_quiet[i] == 0)
+				continue;
+			__sync_fetch_and_add(&ring->quiet[i], log_quiet[i]);
+			log_quiet[i] = 0;
+		}
+	}
+#endif
+
 	if (log_syslog) {
 		closelog();
 		log_syslog = NULL;
@@ -658,6 +1436,129 @@ void syslog_close(void)
 	}
 
 	log_level = DEFAULT_LOG_LEVEL;
+	log_upto  = DEFAULT_LOG_LEVEL;
+	for (c = 0; c < LC_MAX; c++)
+		log_cat[c] = -1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_spool
+**
+**	Parameters....:	slots		Size of the log buffer
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: create a log buffer shared with
+**			all processes forked later on and start
+**			a logger process writing it out, so the
+**			writers don't wait for the log file,
+**			pipe or syslog any more. The size is
+**			rounded up to a power of two; 0 keeps
+**			the synchronous writes.
+**
+** ------------------------------------------------------------ */
+
+void syslog_spool(int slots)
+{
+#if defined(HAVE_RING)
+	size_t size;
+	u_int32_t n, i;
+
+	if (ring != NULL || slots <= 0)
+		return;
+
+	for (n = LR_MINSIZE; n < (u_int32_t) slots && n < LR_MAXSIZE; )
+		n <<= 1;
+	size = sizeof(LRING) + (n - 1) * sizeof(LSLOT);
+
+	if (pipe(ring_wake) != 0) {
+		syslog_error("can't create log buffer pipe");
+		ring_wake[0] = ring_wake[1] = -1;
+		return;
+	}
+	fcntl(ring_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(ring_wake[1], F_SETFL, O_NONBLOCK);
+
+	ring = (LRING *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == (LRING *) MAP_FAILED) {
+		syslog_error("can't map log buffer");
+		ring = NULL;
+		close(ring_wake[0]);
+		close(ring_wake[1]);
+		ring_wake[0] = ring_wake[1] = -1;
+		return;
+	}
+	memset(ring, 0, size);
+	ring->mask = n - 1;
+	for (i = 0; i < n; i++)
+		ring->slot[i].seq = i;
+
+	ring_owner = getpid();
+	syslog_ring_start();
+	syslog_write(T_DBG, "log buffer with %u slots", (u_int) n);
+#else
+	slots = slots;
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_check
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: restart the logger process if
+**			it terminated. Called from the main loop.
+**
+** ------------------------------------------------------------ */
+
+void syslog_check(void)
+{
+#if defined(HAVE_RING)
+	if (ring == NULL || ring_owner != getpid())
+		return;
+
+	/*
+	** In case we missed its SIGCHLD
+	*/
+	if (lg_pid != 0 && kill(lg_pid, 0) != 0 && errno == ESRCH)
+		lg_pid = 0;
+	syslog_ring_start();
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	syslog_gone
+**
+**	Parameters....:	pid		Terminated process
+**
+**	Return........:	1 if it was the logger
+**
+**	Purpose.......: Daemon: forget a logger that terminated,
+**			syslog_check will start a new one.
+**			Called from the SIGCHLD handler.
+**
+** ------------------------------------------------------------ */
+
+int  syslog_gone(pid_t pid)
+{
+#if defined(HAVE_RING)
+	if (pid != 0 && pid == lg_pid) {
+		lg_pid = 0;
+		return 1;
+	}
+#else
+	pid = pid;
+#endif
+	return 0;
 }
 
 
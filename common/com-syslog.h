@@ -46,6 +46,16 @@
 #define U_ERR		14	/* User rel. log level ERROR	*/
 #define U_FTL		15	/* User rel. log level FATAL	*/
 
+/*
+** Categories, or-ed to a level; they may have own
+** levels, e.g. "LogLevel INF control=DBG"
+*/
+#define L_CTRL		0x100	/* Control connections		*/
+#define L_DATA		0x200	/* Data connections		*/
+#define L_AUTH		0x300	/* Authentication, LDAP		*/
+#define L_RULE		0x400	/* Access and user rules	*/
+#define L_SOCK		0x500	/* Socket layer			*/
+
 
 /* ------------------------------------------------------------ */
 
@@ -53,10 +63,16 @@ void syslog_stderr(void);
 void syslog_open  (char *name, char *level);
 void syslog_write (int level, char *fmt, ...);
 void syslog_error (char *fmt, ...);
+int  syslog_want  (int level);
+void syslog_stats (void);
 int  syslog_rename(char *new_name, char *log_name, size_t len);
 void syslog_rotate(void);
 void syslog_close (void);
 
+void syslog_spool (int slots);
+void syslog_check (void);
+int  syslog_gone  (pid_t pid);
+
 /* ------------------------------------------------------------ */
 
 #endif /* defined(_COM_SYSLOG_H_) */
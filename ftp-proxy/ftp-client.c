@@ -69,27 +69,96 @@ static char rcsid[] = "$Id: ftp-client.c,v 1.9.2.3 2005/01/11 13:00:01 mt Exp $"
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-resolv.h"
 #include "com-socket.h"
 #include "com-syslog.h"
 #include "ftp-client.h"
 #include "ftp-cmds.h"
+#include "ftp-daemon.h"
 #include "ftp-ldap.h"
+#include "ftp-match.h"
 
 
 /* ------------------------------------------------------------ */
 
-static void client_cli_ctrl_read(char *str);
-static void client_srv_ctrl_read(char *str);
-static void client_srv_passive  (char *arg);
-static void client_xfer_fireup  (void);
+/*
+** The group rule files hold dotted quads, host names and
+** string prefixes ending in 'x' (e.g. "10.1.x"), matched as
+** text against the dotted source and destination address.
+** They are compiled into a trie over '0'-'9' and '.', each
+** node remembering the rank (file line order, 1 based) of the
+** first line equal to or ending in an 'x' after its text.
+*/
+#define ACL_FANOUT	11	/* Digits plus the dot		*/
+#define ACL_LINE	17	/* Line chunk as read by fgets	*/
+#define MAX_GROUPS	1024	/* Max. groupN options		*/
+
+typedef struct acl_node {
+	struct acl_node *next[ACL_FANOUT];
+	int exact;		/* First line equal to the text	*/
+	int pref;		/* First 'x' line with the text	*/
+} ACLNODE;
+
+typedef struct {
+	ACLNODE root;		/* Trie over the rule lines	*/
+	int     cnt;		/* Number of groupN options	*/
+	char  **file;		/* groupN file names [1..cnt]	*/
+	int     miss;		/* First unreadable group, 0=no	*/
+	int    *rule;		/* Group of each rank - 1	*/
+	int     nrule;		/* Number of ranks used		*/
+	int     arule;		/* Number of ranks allocated	*/
+} ACL;
+
+/*
+** Per-user settings compiled from one config section
+*/
+typedef struct {
+	char     *dst_name;	/* DestinationAddress as given	*/
+	u_int32_t srv_addr;	/* ... and as resolved at load	*/
+	u_int16_t srv_port;	/* Destination server port	*/
+	int       srv_mode;	/* Transfer mode, -1 = invalid	*/
+	u_int16_t srv_lrng;	/* Lower port range to server	*/
+	u_int16_t srv_urng;	/* Upper port range to server	*/
+	u_int16_t act_lrng;	/* Lower port range (active)	*/
+	u_int16_t act_urng;	/* Upper port range (active)	*/
+	u_int16_t pas_lrng;	/* Lower port range (passive)	*/
+	u_int16_t pas_urng;	/* Upper port range (passive)	*/
+	int       same_adr;	/* 1=PORT to same address only	*/
+	int       timeout;	/* Inactivity timeout in secs	*/
+	ACL      *acl;		/* Compiled group rules		*/
+	int       acl_own;	/* 1=acl not shared with global	*/
+	char    **grp_cmds;	/* ValidCommandsN [1..acl->cnt]	*/
+	char     *dflt_cmds;	/* defaultrules			*/
+} PROFILE;
+
+
+/* ------------------------------------------------------------ */
+
+static int  client_pipe_ok      (CONTEXT *ctx);
+static void client_cli_ctrl_read(CONTEXT *ctx, char *str);
+static void client_srv_ctrl_read(CONTEXT *ctx, char *str);
+static void client_srv_passive  (CONTEXT *ctx, char *arg);
+static void client_xfer_fireup  (CONTEXT *ctx);
 static int  client_setup_file(CONTEXT *ctx, char *who);
+static void client_prof_make (PROFILE *prof, char *snam);
+static void client_prof_free (PROFILE *prof);
+static ACL *client_acl_make  (char *snam, ACL *share);
+static void client_acl_add   (ACL *acl, char *text, int len, int pref);
+static int  client_acl_walk  (ACLNODE *node, char *addr, int *net);
+static int  client_acl_find  (PROFILE *prof, char *src, char *dst,
+                              int *net);
+static void client_acl_free  (ACLNODE *node);
 
 
 /* ------------------------------------------------------------ */
 
 static int close_flag  = 0;	/* Program termination request	*/
+static int term_flag   = 0;	/* Termination signal received	*/
+
+static PROFILE *profiles = NULL;/* Compiled profile per section	*/
+static int      prof_cnt = 0;	/* Number of compiled profiles	*/
+static int      prof_gen = -1;	/* Config generation compiled	*/
 
-static CONTEXT ctx;		/* The general client context	*/
 
 
 /* ------------------------------------------------------------ **
@@ -111,6 +180,7 @@ static RETSIGTYPE client_signal(int signo)
 #endif
 
 	close_flag  = 1;
+	term_flag   = 1;
 
 	signal(signo, client_signal);
 #if RETSIGTYPE != void
@@ -133,12 +203,34 @@ static RETSIGTYPE client_signal(int signo)
 
 void client_run(void)
 {
-	int  sock, need, diff;
-	char str[MAX_PATH_SIZE * 2];
-	char *p, *q;
-	FILE *fp;
-	BUF  *buf;
-	
+	client_session();
+
+#if defined(COMPILE_DEBUG)
+	debug(1, "}}}}} %s client-exit", misc_getprog());
+#endif
+	exit(EXIT_SUCCESS);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_session
+**
+**	Parameters....:	(stdin/stdout is the User-PI)
+**
+**	Return........:	0 or 1 if termination was requested
+**
+**	Purpose.......: Serve one client session; all of its
+**			sockets are closed on return, so that
+**			a pre-forked worker can serve the next.
+**
+** ------------------------------------------------------------ */
+
+int client_session(void)
+{
+	CONTEXT *ctx;
+	int rc;
+
 	/*
 	** Setup client signal handling (mostly graceful exit)
 	*/
@@ -149,24 +241,80 @@ void client_run(void)
 	signal(SIGCHLD, SIG_IGN);
 	signal(SIGUSR1, SIG_IGN);
 
+	close_flag = term_flag;
+	if ((ctx = client_open(fileno(stdin))) == NULL)
+		return term_flag;
+
 	/*
-	** Prepare our general client context
+	** Enter the client mainloop
 	*/
-	memset(&ctx, 0, sizeof(ctx));
-	ctx.sess_beg = time(NULL);
-	ctx.cli_mode = MOD_ACT_FTP;
-	ctx.expect   = EXP_IDLE;
-	ctx.timeout  = config_int(NULL, "TimeOut", 900);
+	for (rc = 0; close_flag == 0; ) {
+		/*
+		** We need to go into select() only
+		** if all input has been processed
+		**   or
+		** we wait for more data to get a line
+		** complete (partially sent, no EOL).
+		*/
+		if (rc == 0) {
+			if (socket_exec(ctx->timeout, &close_flag) <= 0) {
+				syslog_write(U_INF, "[ %s ] Timeout closing connection [%d s]", ctx->cli_ctrl->peer, ctx->timeout);
+				break;
+			}
+		}
+#if defined(COMPILE_DEBUG)
+		debug(4, "client-loop ...");
+#endif
+		if ((rc = client_step(ctx)) < 0)
+			break;
+	}
 
-	sock = fileno(stdin);		/* "recover" our socket */
+	client_close(ctx);
+	return term_flag;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_open
+**
+**	Parameters....:	sock		Accepted client socket
+**
+**	Return........:	New client context or NULL if the
+**			client was rejected
+**
+**	Purpose.......: Start a client session: setup the context
+**			and send the welcome message. The session
+**			is then driven by client_step.
+**
+** ------------------------------------------------------------ */
+
+CONTEXT *client_open(int sock)
+{
+	CONTEXT *ctx;
+	char str[MAX_PATH_SIZE * 2];
+	char *p, *q;
+	FILE *fp;
+
+	/*
+	** Prepare our general client context
+	*/
+	ctx = (CONTEXT *) misc_alloc(FL, sizeof(CONTEXT));
+	memset(ctx, 0, sizeof(CONTEXT));
+	ctx->sess_beg = time(NULL);
+	ctx->sess_act = ctx->sess_beg;
+	ctx->cli_mode = MOD_ACT_FTP;
+	ctx->expect   = EXP_IDLE;
+	ctx->pipe     = config_bool(NULL, "CommandPipelining", 1);
+	ctx->timeout  = config_int(NULL, "TimeOut", 900);
 
 /* Fred Patch Timeout */
 
         static int timeout = -1;
         if ((timeout = config_int(NULL, "TimeOut", 0)) == 0) {
-        	ctx.timeout  = config_int(NULL, "TimeOut", 900);
+        	ctx->timeout  = config_int(NULL, "TimeOut", 900);
         } else {
-         	ctx.timeout  = config_int(NULL, "TimeOut", 0);
+         	ctx->timeout  = config_int(NULL, "TimeOut", 0);
 	} 
 
 	/*
@@ -196,21 +344,22 @@ void client_run(void)
 		p = socket_addr2str(socket_sck2addr(sock, REM_END, NULL));
 		close(sock);
 		syslog_write(U_ERR, "reject: '%s' (DenyMessage)", p);
-		exit(EXIT_SUCCESS);
+		misc_free(FL, ctx);
+		return NULL;
 	}
 
 	/*
 	** Create a High Level Socket for the client's User-PI
 	*/
-	if ((ctx.cli_ctrl = socket_init(sock)) == NULL)
-		misc_die(FL, "client_run: ?cli_ctrl?");
-	ctx.cli_ctrl->ctyp = "Cli-Ctrl";
+	if ((ctx->cli_ctrl = socket_init(sock)) == NULL)
+		misc_die(FL, "client_open: ?cli_ctrl?");
+	ctx->cli_ctrl->ctyp = "Cli-Ctrl";
 
 	/*
 	** Announce the connection request
 	*/
-	syslog_write(U_INF, "[ %s ] connect from %s", ctx.cli_ctrl->peer, ctx.cli_ctrl->peer);
-	syslog_write(U_INF, "[ %s ] Timeout activity [%d s]", ctx.cli_ctrl->peer, ctx.timeout);
+	syslog_write(U_INF, "[ %s ] connect from %s", ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
+	syslog_write(U_INF, "[ %s ] Timeout activity [%d s]", ctx->cli_ctrl->peer, ctx->timeout);
 
 	/*
 	** Display the welcome message (invite the user to login)
@@ -218,245 +367,359 @@ void client_run(void)
 	if ((p = config_str(NULL, "WelcomeString", NULL)) == NULL)
 		p = "%h FTP server (Version %v - %b) ready";
 	misc_strncpy(str, socket_msgline(p), sizeof(str));
-	client_respond(220,
+	client_respond(ctx, 220,
 		config_str(NULL, "WelcomeMessage", NULL), str);
+	return ctx;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_step
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	-1 if the session is over, 1 if input
+**			is buffered, 0 to wait for socket_exec
+**
+**	Purpose.......: Process what socket_exec has read or
+**			closed for the session. Sessions do not
+**			share any state, so a process may serve
+**			many of them from one socket_exec loop.
+**
+** ------------------------------------------------------------ */
+
+int client_step(CONTEXT *ctx)
+{
+	char str[MAX_PATH_SIZE * 2], *ptr;
+	size_t qlen, io;
+	int diff, ncli, more, done = 0;
+
+	if (ctx == NULL)		/* Basic sanity check	*/
+		misc_die(FL, "client_step: ?ctx?");
+
 	/*
-	** Enter the client mainloop
+	** Remember the last activity on the session's
+	** sockets for the inactivity timeout
+	*/
+	io = 0;
+	if (ctx->cli_ctrl != NULL)
+		io += ctx->cli_ctrl->rcnt + ctx->cli_ctrl->wcnt;
+	if (ctx->srv_ctrl != NULL)
+		io += ctx->srv_ctrl->rcnt + ctx->srv_ctrl->wcnt;
+	if (ctx->cli_data != NULL)
+		io += ctx->cli_data->rcnt + ctx->cli_data->wcnt;
+	if (ctx->srv_data != NULL)
+		io += ctx->srv_data->rcnt + ctx->srv_data->wcnt;
+	if (io != ctx->sess_io) {
+		ctx->sess_io  = io;
+		ctx->sess_act = time(NULL);
+	}
+
+	/*
+	** Check if any zombie sockets can be removed
 	*/
-	while (close_flag == 0) {
+	if (ctx->cli_ctrl != NULL && ctx->cli_ctrl->sock == -1)
+		done = 1;		/* Oops, forget it ... */
+
+	if (ctx->srv_ctrl != NULL && ctx->srv_ctrl->sock == -1) {
+#if defined(COMPILE_DEBUG)
+		debug(3, "about to destroy Srv-Ctrl");
+#endif
 		/*
-		** We need to go into select() only
-		** if all input has been processed
-		**   or
-		** we wait for more data to get a line
-		** complete (partially sent, no EOL).
-		**
-		** (data buffers are never splited)
+		** If we have any open data connections,
+		** make really sure they don't survive.
 		*/
-		need = 1;
-		if (ctx.cli_ctrl && ctx.cli_ctrl->rbuf)
-			need = 0;
-		if (ctx.srv_ctrl && ctx.srv_ctrl->rbuf)
-			need = 0;
-		if((ctx.cli_ctrl && ctx.cli_ctrl->more>0) ||
-		   (ctx.srv_ctrl && ctx.srv_ctrl->more>0))
-			need = 1;
+		if (ctx->cli_data != NULL)
+			ctx->cli_data->kill = 1;
+		if (ctx->srv_data != NULL)
+			ctx->srv_data->kill = 1;
 
 		/*
-		** use higher priority to writes;
-		** read only if nothing to write...
+		** Our client should be informed
 		*/
-		if(ctx.srv_data && ctx.cli_data) {
-			if(ctx.srv_data->wbuf) {
-				ctx.cli_data->more = -1;
-			} else {
-				ctx.cli_data->more = 0;
-			}
-			if(ctx.cli_data->wbuf) {
-				ctx.srv_data->more = -1;
-			} else {
-				ctx.srv_data->more = 0;
-			}
+		if (ctx->cli_ctrl->kill == 0) {
+			client_respond(ctx, 421, NULL,
+				"Service not available, "
+				"closing control connection");
 		}
 
-	if (need != 0) {
-			if (socket_exec(ctx.timeout, &close_flag) <= 0) {
-				syslog_write(U_INF, "[ %s ] Timeout closing connection [%d s]", ctx.cli_ctrl->peer, ctx.timeout);
-				break;
-				}
-		}
-#if defined(COMPILE_DEBUG)
-		debug(4, "client-loop ...");
-#endif
+		/*
+		** The connect to the server failed, or it
+		** went away before its welcome - give up
+		*/
+		if (ctx->expect == EXP_CONN)
+			ctx->cli_ctrl->kill = 1;
 
 		/*
-		** Check if any zombie sockets can be removed
+		** Don't forget to remove the dead socket
 		*/
-		if (ctx.cli_ctrl != NULL && ctx.cli_ctrl->sock == -1)
-			close_flag = 1;		/* Oops, forget it ... */
+		socket_kill(ctx->srv_ctrl);
+		ctx->srv_ctrl = NULL;
+	}
 
-		if (ctx.srv_ctrl != NULL && ctx.srv_ctrl->sock == -1) {
+	if (ctx->cli_data != NULL && ctx->cli_data->sock == -1) {
 #if defined(COMPILE_DEBUG)
-			debug(3, "about to destroy Srv-Ctrl");
+		debug(3, "about to destroy Cli-Data");
 #endif
-			/*
-			** If we have any open data connections,
-			** make really sure they don't survive.
-			*/
-			if (ctx.cli_data != NULL)
-				ctx.cli_data->kill = 1;
-			if (ctx.srv_data != NULL)
-				ctx.srv_data->kill = 1;
-
-			/*
-			** Our client should be informed
-			*/
-			if (ctx.cli_ctrl->kill == 0) {
-				client_respond(421, NULL,
-					"Service not available, "
-					"closing control connection");
-			}
-
-			/*
-			** Don't forget to remove the dead socket
-			*/
-			socket_kill(ctx.srv_ctrl);
-			ctx.srv_ctrl = NULL;
+		/*
+		** If we have an outstanding server reply
+		** (e.g. 226 Transfer complete), send it.
+		*/
+		if (ctx->xfer_rep[0] != '\0') {
+			socket_printf(ctx->cli_ctrl,
+				"%s\r\n", ctx->xfer_rep);
+			memset(ctx->xfer_rep, 0,
+				sizeof(ctx->xfer_rep));
+		} else {
+			if(ctx->expect == EXP_XFER)
+				ctx->expect = EXP_PTHR;
 		}
 
-		if (ctx.cli_data != NULL && ctx.cli_data->sock == -1) {
-#if defined(COMPILE_DEBUG)
-			debug(3, "about to destroy Cli-Data");
-#endif
-			/*
-			** If we have an outstanding server reply
-			** (e.g. 226 Transfer complete), send it.
-			*/
-			if (ctx.xfer_rep[0] != '\0') {
-				socket_printf(ctx.cli_ctrl,
-					"%s\r\n", ctx.xfer_rep);
-				memset(ctx.xfer_rep, 0,
-					sizeof(ctx.xfer_rep));
-			} else {
-				if(ctx.expect == EXP_XFER)
-					ctx.expect = EXP_PTHR;
-			}
-
-			/*
-			** Good time for statistics and data reset
-			*/
-			if (ctx.xfer_beg == 0)
-				ctx.xfer_beg = time(NULL);
-			diff = (int) (time(NULL) - ctx.xfer_beg);
-			if (diff < 1)
-				diff = 1;
+		/*
+		** Good time for statistics and data reset
+		*/
+		if (ctx->xfer_beg == 0)
+			ctx->xfer_beg = time(NULL);
+		diff = (int) (time(NULL) - ctx->xfer_beg);
+		if (diff < 1)
+			diff = 1;
 
-			/*
-			** print our current statistic
-			*/
-			syslog_write(U_INF,
-				"[ %s ] Transfer for %s %s: %s '%s' %s %u/%d byte/sec",
-				ctx.cli_ctrl->peer,
-				ctx.cli_ctrl->peer,
-				ctx.cli_data->ernr ?  "failed" : "completed",
-				ctx.xfer_cmd, ctx.xfer_arg,
-				ctx.cli_data->rcnt ? "sent" : "read",
-				ctx.cli_data->rcnt ? ctx.cli_data->rcnt
-				                   : ctx.cli_data->wcnt,
-				diff);
+		/*
+		** print our current statistic
+		*/
+		syslog_write(U_INF,
+			"[ %s ] Transfer for %s %s: %s '%s' %s %u/%d byte/sec",
+			ctx->cli_ctrl->peer,
+			ctx->cli_ctrl->peer,
+			ctx->cli_data->ernr ?  "failed" : "completed",
+			ctx->xfer_cmd, ctx->xfer_arg,
+			ctx->cli_data->rcnt ? "sent" : "read",
+			ctx->cli_data->rcnt ? ctx->cli_data->rcnt
+			                   : ctx->cli_data->wcnt,
+			diff);
 
-			/*
-			** update session statistics data
-			*/
-			if(ctx.cli_data->rcnt)
-				ctx.xfer_rsec += diff;
-			ctx.xfer_rcnt += ctx.cli_data->rcnt;
-			if(ctx.cli_data->wcnt)
-				ctx.xfer_wsec += diff;
-			ctx.xfer_wcnt += ctx.cli_data->wcnt;
+		/*
+		** update session statistics data
+		*/
+		if(ctx->cli_data->rcnt)
+			ctx->xfer_rsec += diff;
+		ctx->xfer_rcnt += ctx->cli_data->rcnt;
+		if(ctx->cli_data->wcnt)
+			ctx->xfer_wsec += diff;
+		ctx->xfer_wcnt += ctx->cli_data->wcnt;
 
-			/*
-			** reset data transfer state
-			*/
-			client_data_reset(MOD_RESET);
+		/*
+		** reset data transfer state
+		*/
+		client_data_reset(ctx, MOD_RESET);
 
-			/*
-			** Doom the corresponding server socket
-			*/
-			if (ctx.srv_data != NULL)
-				ctx.srv_data->kill = 1;
+		/*
+		** Doom the corresponding server socket
+		*/
+		if (ctx->srv_data != NULL)
+			ctx->srv_data->kill = 1;
 
-			/*
-			** Don't forget to remove the dead socket
-			*/
-			socket_kill(ctx.cli_data);
-			ctx.cli_data = NULL;
-		}
+		/*
+		** Don't forget to remove the dead socket
+		*/
+		socket_kill(ctx->cli_data);
+		ctx->cli_data = NULL;
+	}
 
-		if (ctx.srv_data != NULL && ctx.srv_data->sock == -1) {
+	if (ctx->srv_data != NULL && ctx->srv_data->sock == -1) {
 
 #if defined(COMPILE_DEBUG)
-			debug(3, "about to destroy Srv-Data");
+		debug(3, "about to destroy Srv-Data");
 #endif
-			/*
-			** Doom the corresponding client socket if an
-			** error occured, FailResetsPasv=yes or we
-			** expect other response than PASV (Netscape!)
-			*/
-			if(ctx.cli_data != NULL) {
-				if(0 != ctx.srv_data->ernr) {
-					ctx.cli_data->ernr = -1;
-					ctx.cli_data->kill =  1;
-				}
-				if(config_bool(NULL,"FailResetsPasv", 0)) {
-					ctx.cli_data->kill = 1;
-				} else if(ctx.expect != EXP_PASV) {
-					ctx.cli_data->kill = 1;
-				}
+		/*
+		** Doom the corresponding client socket if an
+		** error occured, FailResetsPasv=yes or we
+		** expect other response than PASV (Netscape!)
+		*/
+		if(ctx->cli_data != NULL) {
+			if(0 != ctx->srv_data->ernr) {
+				ctx->cli_data->ernr = -1;
+				ctx->cli_data->kill =  1;
+			}
+			if(config_bool(NULL,"FailResetsPasv", 0)) {
+				ctx->cli_data->kill = 1;
+			} else if(ctx->expect != EXP_PASV) {
+				ctx->cli_data->kill = 1;
 			}
-
-			/*
-			** Don't forget to remove the dead socket
-			*/
-			socket_kill(ctx.srv_data);
-			ctx.srv_data = NULL;
 		}
 
 		/*
-		** Serve the control connections
+		** Don't forget to remove the dead socket
 		*/
-		if (ctx.cli_ctrl != NULL && ctx.cli_ctrl->rbuf != NULL) {
-			if (socket_gets(ctx.cli_ctrl,
-					str, sizeof(str)) != NULL)
-				client_cli_ctrl_read(str);
+		socket_kill(ctx->srv_data);
+		ctx->srv_data = NULL;
+	}
+
+	/*
+	** A USER command waiting for the resolver runs
+	** again once the answer is in; no further client
+	** commands are read until then
+	*/
+	if (ctx->rs_park != NULL && done == 0 &&
+	    resolv_busy(ctx->rs_name) == 0) {
+		snprintf(str, sizeof(str), "USER %s", ctx->rs_park);
+		misc_free(FL, ctx->rs_park);
+		ctx->rs_park = NULL;
+		client_cli_ctrl_read(ctx, str);
+	}
+
+	/*
+	** Likewise a login waiting for its LDAP lookup
+	*/
+	if (ctx->ld_park != NULL && done == 0 && ldap_busy(ctx) == 0) {
+		ptr = ctx->ld_park;
+		ctx->ld_park = NULL;
+		cmds_login(ctx, ptr);
+		memset(ptr, 0, strlen(ptr));
+		misc_free(FL, ptr);
+	}
+
+	/*
+	** Serve the control connections. With pipelining,
+	** all complete lines are handled in one go and the
+	** replies leave in one write on the next exec.
+	*/
+	for (ncli = 0, more = 1; more != 0 && done == 0; ) {
+		more = 0;
+		while (ctx->cli_ctrl != NULL && ctx->cli_ctrl->rbuf != NULL &&
+		       ctx->cli_ctrl->kill == 0 && ctx->rs_park == NULL &&
+		       ctx->ld_park == NULL &&
+		       (ncli == 0 || client_pipe_ok(ctx))) {
+			if (socket_gets(ctx->cli_ctrl,
+					str, sizeof(str)) == NULL)
+				break;
+			client_cli_ctrl_read(ctx, str);
+			ncli++;
+			more = ctx->pipe;
 		}
-		if (ctx.srv_ctrl != NULL && ctx.srv_ctrl->rbuf != NULL) {
-			if (socket_gets(ctx.srv_ctrl,
-					str, sizeof(str)) != NULL)
-				client_srv_ctrl_read(str);
+		while (ctx->srv_ctrl != NULL && ctx->srv_ctrl->rbuf != NULL) {
+			if (socket_gets(ctx->srv_ctrl,
+					str, sizeof(str)) == NULL)
+				break;
+			client_srv_ctrl_read(ctx, str);
+			if (ctx->pipe == 0)
+				break;
+			more = 1;
 		}
+		if (ctx->pipe == 0)
+			break;
+	}
 
-		/*
-		** Serve the data connections. This is a bit tricky,
-		** since all we do is move the buffer pointers.
-		*/
-		if (ctx.cli_data != NULL && ctx.srv_data != NULL) {
-			if (ctx.cli_data->rbuf != NULL) {
+	/*
+	** Serve the data connections. All we do is move
+	** the buffer pointers from one socket to the other.
+	*/
+	if (ctx->cli_data != NULL && ctx->srv_data != NULL) {
+		if (ctx->cli_data->rbuf != NULL) {
 #if defined(COMPILE_DEBUG)
-				debug(2, "Cli-Data -> Srv-Data");
+			debug(2, "Cli-Data -> Srv-Data");
 #endif
-				if (ctx.srv_data->wbuf == NULL) {
-					ctx.srv_data->wbuf =
-						ctx.cli_data->rbuf;
-				} else {
-					for (buf = ctx.srv_data->wbuf;
-							buf && buf->next;
-							buf = buf->next)
-						;
-					buf->next = ctx.cli_data->rbuf;
-				}
-				ctx.cli_data->rbuf = NULL;
-			}
-			if (ctx.srv_data->rbuf != NULL) {
+			socket_pass(ctx->cli_data, ctx->srv_data);
+		}
+		if (ctx->srv_data->rbuf != NULL) {
 #if defined(COMPILE_DEBUG)
-				debug(2, "Srv-Data -> Cli-Data");
+			debug(2, "Srv-Data -> Cli-Data");
 #endif
-				if (ctx.cli_data->wbuf == NULL) {
-					ctx.cli_data->wbuf =
-						ctx.srv_data->rbuf;
-				} else {
-					for (buf = ctx.cli_data->wbuf;
-							buf && buf->next;
-							buf = buf->next)
-						;
-					buf->next = ctx.srv_data->rbuf;
-				}
-				ctx.srv_data->rbuf = NULL;
-			}
+			socket_pass(ctx->srv_data, ctx->cli_data);
 		}
-		/* at this point the main loop resumes ... */
+
+		/*
+		** Once both data connections are up and the
+		** buffers are handed over, let the kernel do
+		** the relay (zero-copy via splice, if enabled)
+		*/
+		if (ctx->cli_data->rlay == NULL)
+			socket_splice(ctx->cli_data, ctx->srv_data);
+	}
+	/*
+	** keep reading while the output queue of
+	** the other side is below its watermarks
+	*/
+	if(ctx->srv_data && ctx->cli_data) {
+		socket_flow(ctx->cli_data, ctx->srv_data);
+		socket_flow(ctx->srv_data, ctx->cli_data);
+
+		qlen = socket_queued(ctx->cli_data) +
+		       socket_queued(ctx->srv_data);
+		if (qlen > ctx->xfer_qpek)
+			ctx->xfer_qpek = qlen;
 	}
 
+	if (done != 0)
+		return -1;
+	if (ctx->rs_park != NULL || ctx->ld_park != NULL)
+		return 0;
+
+	/*
+	** Input is left if a complete line waits in
+	** a buffer (data buffers are never splited)
+	*/
+	if((ctx->cli_ctrl && ctx->cli_ctrl->more>0) ||
+	   (ctx->srv_ctrl && ctx->srv_ctrl->more>0))
+		return 0;
+	if (ctx->cli_ctrl && ctx->cli_ctrl->rbuf)
+		return 1;
+	if (ctx->srv_ctrl && ctx->srv_ctrl->rbuf)
+		return 1;
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_idle
+**
+**	Parameters....:	ctx		Pointer to user context
+**			now		Current time
+**
+**	Return........:	Seconds left until the inactivity
+**			timeout, 0 if it has expired
+**
+**	Purpose.......: Per session timeout check for processes
+**			serving many sessions.
+**
+** ------------------------------------------------------------ */
+
+int client_idle(CONTEXT *ctx, time_t now)
+{
+	int left;
+
+	if (ctx == NULL)		/* Basic sanity check	*/
+		misc_die(FL, "client_idle: ?ctx?");
+
+	left = ctx->timeout - (int) (now - ctx->sess_act);
+	return (left > 0) ? left : 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_close
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	(none)
+**
+**	Purpose.......: End a client session: log its statistics,
+**			close its sockets and free the context.
+**
+** ------------------------------------------------------------ */
+
+void client_close(CONTEXT *ctx)
+{
+	u_long bhit, bmis, rops, wops;
+	size_t bheld;
+	double rmb, wmb;
+
+	if (ctx == NULL)		/* Basic sanity check	*/
+		misc_die(FL, "client_close: ?ctx?");
+
 	/*
 	** Display basic session statistics...
 	**   in secs since session begin
@@ -464,33 +727,113 @@ void client_run(void)
 	**   uploads   / send (xfer-sends from server)
 	*/
 	syslog_write(U_INF, "[ %s ] closing connect from %s after %d secs - "
-	                    "read %d/%d, sent %d/%d byte/sec",ctx.cli_ctrl->peer,
-	             ctx.cli_ctrl ? ctx.cli_ctrl->peer : "unknown peer",
-	             time(NULL)-ctx.sess_beg,
-	             ctx.xfer_wcnt, ctx.xfer_wsec,
-	             ctx.xfer_rcnt, ctx.xfer_rsec);
+	                    "read %d/%d, sent %d/%d byte/sec",ctx->cli_ctrl->peer,
+	             ctx->cli_ctrl ? ctx->cli_ctrl->peer : "unknown peer",
+	             time(NULL)-ctx->sess_beg,
+	             ctx->xfer_wcnt, ctx->xfer_wsec,
+	             ctx->xfer_rcnt, ctx->xfer_rsec);
+	daemon_count((double) ctx->xfer_rcnt + (double) ctx->xfer_wcnt);
+
+	/*
+	** ... and the usage of the socket buffer pool
+	*/
+	if (syslog_want(T_DBG | L_SOCK)) {
+		socket_bstat(&bhit, &bmis, &bheld);
+		syslog_write(T_DBG | L_SOCK, "buffer pool: %lu hits, "
+		             "%lu misses, %lu bytes held, "
+		             "%lu bytes peak queued", bhit, bmis,
+		             (u_long) bheld, (u_long) ctx->xfer_qpek);
+
+		/*
+		** ... and the system calls needed per MB
+		*/
+		socket_iostat(&rops, &wops, &rmb, &wmb);
+		rmb /= 1048576.0;
+		wmb /= 1048576.0;
+		syslog_write(T_DBG | L_SOCK, "i/o: %lu reads for %.2f MB "
+		             "(%.1f/MB), %lu writes for %.2f MB (%.1f/MB)",
+		             rops, rmb, (rmb > 0.0) ? rops / rmb : 0.0,
+		             wops, wmb, (wmb > 0.0) ? wops / wmb : 0.0);
+	}
+	socket_cstat();
+#if defined(HAVE_REGEX)
+	match_stats();
+#endif
 
 	/*
 	** Free allocated memory
 	*/
-	ctx.magic_auth = NULL;
-	if (ctx.userauth != NULL) {
-		misc_free(FL, ctx.userauth);
-		ctx.userauth = NULL;
+	ctx->magic_auth = NULL;
+	if (ctx->userauth != NULL) {
+		misc_free(FL, ctx->userauth);
+		ctx->userauth = NULL;
+	}
+	if (ctx->username != NULL) {
+		misc_free(FL, ctx->username);
+		ctx->username = NULL;
 	}
-	if (ctx.username != NULL) {
-		misc_free(FL, ctx.username);
-		ctx.username = NULL;
+	if(ctx->userpass != NULL) {
+		misc_free(FL, ctx->userpass);
+		ctx->userpass = NULL;
 	}
-	if(ctx.userpass != NULL) {
-		misc_free(FL, ctx.userpass);
-		ctx.userpass = NULL;
+	if (ctx->rs_park != NULL) {
+		misc_free(FL, ctx->rs_park);
+		ctx->rs_park = NULL;
 	}
+	if (ctx->ld_park != NULL) {
+		memset(ctx->ld_park, 0, strlen(ctx->ld_park));
+		misc_free(FL, ctx->ld_park);
+		ctx->ld_park = NULL;
+	}
+	ldap_drop(ctx);
+
+	/*
+	** Close whatever is left of the session
+	*/
+	if (ctx->cli_data != NULL)
+		socket_kill(ctx->cli_data);
+	if (ctx->srv_data != NULL)
+		socket_kill(ctx->srv_data);
+	if (ctx->srv_ctrl != NULL)
+		socket_kill(ctx->srv_ctrl);
+	if (ctx->cli_ctrl != NULL)
+		socket_kill(ctx->cli_ctrl);
+	cmds_free_perm(ctx);
+	misc_free(FL, ctx);
 
-#if defined(COMPILE_DEBUG)
-	debug(1, "}}}}} %s client-exit", misc_getprog());
-#endif
-	exit(EXIT_SUCCESS);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_pipe_ok
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	1 if another pipelined command may
+**			be run now, 0 if it has to wait
+**
+**	Purpose.......: The next command line of a pipelining
+**			client is handled in the same step only
+**			while the server reply to the previous one
+**			does not change the session state (e.g.
+**			PASV, PORT, USER or ABOR). Otherwise it
+**			waits for the next step, as it always did.
+**
+** ------------------------------------------------------------ */
+
+static int client_pipe_ok(CONTEXT *ctx)
+{
+	if (ctx->pipe == 0)
+		return 0;
+
+	switch (ctx->expect) {
+		case EXP_IDLE:
+		case EXP_PTHR:
+		case EXP_XFER:
+			return 1;
+	}
+	return 0;
 }
 
 
@@ -506,10 +849,13 @@ void client_run(void)
 **
 ** ------------------------------------------------------------ */
 
-static void client_cli_ctrl_read(char *str)
+static void client_cli_ctrl_read(CONTEXT *ctx, char *str)
 {
-	char *arg;
+	char *arg, *dst;
 	CMD *cmd;
+#if defined(HAVE_REGEX)
+	void *regex;
+#endif
 	int c;
 
 	if (str == NULL) {		/* Basic sanity check	*/
@@ -520,9 +866,15 @@ static void client_cli_ctrl_read(char *str)
 	}
 
 	/*
-	** Handle a minimum amount of Telnet line control
+	** Handle a minimum amount of Telnet line control.
+	** The sequences are dropped in a single pass over
+	** the line, the rest is moved down behind them.
 	*/
-	while ((arg = strchr(str, IAC)) != NULL) {
+	for (arg = dst = strchr(str, IAC); arg != NULL && *arg != '\0'; ) {
+		if ((*arg & 255) != IAC) {
+			*dst++ = *arg++;
+			continue;
+		}
 		c = (arg[1] & 255);
 		switch (c) {
 			case WILL:
@@ -532,13 +884,10 @@ static void client_cli_ctrl_read(char *str)
 				*/
 				syslog_write(U_WRN,
 					"WILL/WONT refused for %s",
-					ctx.cli_ctrl->peer);
-				socket_printf(ctx.cli_ctrl,
+					ctx->cli_ctrl->peer);
+				socket_printf(ctx->cli_ctrl,
 					"%c%c%c", IAC, DONT, arg[2]);
-				if(arg[2])
-					memmove(arg, arg + 3, strlen(arg) - 2);
-				else
-					memmove(arg, arg + 1, strlen(arg));
+				arg += arg[2] ? 3 : 1;
 				break;
 
 			case DO:
@@ -548,31 +897,31 @@ static void client_cli_ctrl_read(char *str)
 				*/
 				syslog_write(U_WRN,
 					"DO/DONT refused for %s",
-					ctx.cli_ctrl->peer);
-				socket_printf(ctx.cli_ctrl,
+					ctx->cli_ctrl->peer);
+				socket_printf(ctx->cli_ctrl,
 					"%c%c%c", IAC, WONT, arg[2]);
-				if(arg[2])
-					memmove(arg, arg + 3, strlen(arg) - 2);
-				else
-					memmove(arg, arg + 1, strlen(arg));
+				arg += arg[2] ? 3 : 1;
 				break;
 
 			case IAC:
-				memmove(arg, arg + 1, strlen(arg));
+				*dst++ = arg[1];
+				arg += 2;
 				break;
 
 			case IP:
 			case DM:
 				syslog_write(U_INF, "IAC-%s from %s",
 						(c == IP) ? "IP" : "DM",
-						ctx.cli_ctrl->peer);
-				memmove(arg, arg + 2, strlen(arg) - 1);
+						ctx->cli_ctrl->peer);
+				arg += 2;
 				break;
 
 			default:
-				memmove(arg, arg + 1, strlen(arg));
+				arg += 1;
 		}
 	}
+	if (dst != NULL)
+		*dst = '\0';
 
 	/*
 	** If there is nothing left to process, please call again
@@ -598,7 +947,7 @@ static void client_cli_ctrl_read(char *str)
 
 #if defined(COMPILE_DEBUG)
 	debug(1, "from User-PI (%d): cmd='%.32s' arg='%.512s'",
-				ctx.cli_ctrl->sock, str, NIL(arg));
+				ctx->cli_ctrl->sock, str, NIL(arg));
 #endif
 
 	/*
@@ -606,25 +955,21 @@ static void client_cli_ctrl_read(char *str)
 	**   must be enabled in any case, since it's the one to
 	**   setup allow/deny (let's call it bootstrapping) ...
 	*/
-	for (cmd = cmds_get_list(); cmd->name != NULL; cmd++) {
-		if (strcasecmp("USER", cmd->name) == 0)
-			cmd->legal = 1;		/* Need this one! */
-		if (strcasecmp(str, cmd->name) != 0)
-			continue;
-		if ((cmd->legal == 0) && strcasecmp("QUIT", cmd->name)) {
-			client_respond(502, NULL, "'%.32s': "
+	if ((cmd = cmds_find(str)) != NULL) {
+		if (cmds_allowed(ctx, cmd) == 0) {
+			client_respond(ctx, 502, NULL, "'%.32s': "
 				"command not implemented", str);
 			syslog_write(U_WRN,
 				"'%.32s' from %s not allowed",
-				str, ctx.cli_ctrl->peer);
+				str, ctx->cli_ctrl->peer);
 			return;
 		}
 #if defined(HAVE_REGEX)
-		if (cmd->regex != NULL) {
+		if ((regex = cmds_get_regex(ctx, cmd)) != NULL) {
 			char *p;
-			p = cmds_reg_exec(cmd->regex, arg);
+			p = cmds_reg_exec(regex, arg);
 			if (p != NULL) {
-				client_respond(501, NULL,
+				client_respond(ctx, 501, NULL,
 					"'%.32s': syntax error "
 					"in arguments", str);
 				syslog_write(U_WRN,
@@ -632,22 +977,22 @@ static void client_cli_ctrl_read(char *str)
 					"'%s' from %s: %s", arg,
 					(strlen(arg) > 128) ?
 					"..." : "", cmd->name,
-					ctx.cli_ctrl->peer, p);
+					ctx->cli_ctrl->peer, p);
 				return;
 			}
 		}
 #endif
-		ctx.curr_cmd = str;
-		(*cmd->func)(&ctx, arg);
+		ctx->curr_cmd = str;
+		(*cmd->func)(ctx, arg);
 		return;
 	}
 
 	/*
 	** Arriving here means the command was not found...
 	*/
-	client_respond(500, NULL, "'%.32s': command unrecognized", str);
+	client_respond(ctx, 500, NULL, "'%.32s': command unrecognized", str);
 	syslog_write(U_WRN, "[ %s ] unknown '%.32s' from %s",
-					ctx.cli_ctrl->peer, str, ctx.cli_ctrl->peer);
+					ctx->cli_ctrl->peer, str, ctx->cli_ctrl->peer);
 }
 
 
@@ -663,7 +1008,7 @@ static void client_cli_ctrl_read(char *str)
 **
 ** ------------------------------------------------------------ */
 
-static void client_srv_ctrl_read(char *str)
+static void client_srv_ctrl_read(CONTEXT *ctx, char *str)
 {
 	int code, c1, c2;
 	char *arg;
@@ -671,12 +1016,14 @@ static void client_srv_ctrl_read(char *str)
 	if (str == NULL)		/* Basic sanity check	*/
 		return;
 
-	syslog_write(T_DBG, "[ %s ] from Server-PI (%d): '%.512s'",
-		     ctx.cli_ctrl->peer,
-	             ctx.srv_ctrl->sock, str);
+	if (syslog_want(T_DBG | L_CTRL)) {
+		syslog_write(T_DBG | L_CTRL, "[ %s ] from Server-PI "
+		             "(%d): '%.512s'", ctx->cli_ctrl->peer,
+		             ctx->srv_ctrl->sock, str);
+	}
 #if defined(COMPILE_DEBUG)
 	debug(1, "[ %s ] from Server-PI (%d): '%.512s'",
-				ctx.cli_ctrl->peer,ctx.srv_ctrl->sock, str);
+				ctx->cli_ctrl->peer,ctx->srv_ctrl->sock, str);
 #endif
 
 	/*
@@ -687,17 +1034,17 @@ static void client_srv_ctrl_read(char *str)
 		** If this is the destination host's
 		** welcome message let's discard it.
 		*/
-		if (ctx.expect == EXP_CONN)
+		if (ctx->expect == EXP_CONN)
 			return;
-		if (ctx.expect == EXP_USER && UAUTH_NONE != ctx.auth_mode)
+		if (ctx->expect == EXP_USER && UAUTH_NONE != ctx->auth_mode)
 			return;
 
 #if defined(COMPILE_DEBUG)
 		debug(2, "'%.4s'... forwarded to %s %d=%s", str,
-			ctx.cli_ctrl->ctyp, ctx.cli_ctrl->sock,
-			ctx.cli_ctrl->peer);
+			ctx->cli_ctrl->ctyp, ctx->cli_ctrl->sock,
+			ctx->cli_ctrl->peer);
 #endif
-		socket_printf(ctx.cli_ctrl, "%s\r\n", str);
+		socket_printf(ctx->cli_ctrl, "%s\r\n", str);
 		return;
 	}
 
@@ -706,7 +1053,7 @@ static void client_srv_ctrl_read(char *str)
 	*/
 	if ((code = atoi(str)) < 200 || code > 599) {
 		syslog_error("[ %s ] bad response %d from server for %s",
-					ctx.srv_ctrl->peer, code, ctx.srv_ctrl->peer);
+					ctx->srv_ctrl->peer, code, ctx->srv_ctrl->peer);
 		return;
 	}
 	c1 =  code / 100;
@@ -717,26 +1064,26 @@ static void client_srv_ctrl_read(char *str)
 	/*
 	** We have a response code, go see what we expected
 	*/
-	switch (ctx.expect) {
+	switch (ctx->expect) {
 		case EXP_CONN:
 			/*
 			** Waiting for a 220 Welcome
 			*/
 			if (c1 == 2) {
-				socket_printf(ctx.srv_ctrl,
+				socket_printf(ctx->srv_ctrl,
 				              "USER %s\r\n",
-				              ctx.username);
-				ctx.expect = EXP_USER;
+				              ctx->username);
+				ctx->expect = EXP_USER;
 			} else {
-				if(UAUTH_NONE != ctx.auth_mode) {
-					client_respond(530, NULL,
+				if(UAUTH_NONE != ctx->auth_mode) {
+					client_respond(ctx, 530, NULL,
 					               "Login incorrect");
 				} else {
-					socket_printf(ctx.cli_ctrl,
+					socket_printf(ctx->cli_ctrl,
 					              "%s\r\n", str);
 				}
-				ctx.expect = EXP_IDLE;
-				ctx.cli_ctrl->kill = 1;
+				ctx->expect = EXP_IDLE;
+				ctx->cli_ctrl->kill = 1;
 			}
 			break;
 
@@ -747,70 +1094,70 @@ static void client_srv_ctrl_read(char *str)
 			**	331=need password,
 			**	332=need password+account
 			*/
-			if(UAUTH_NONE != ctx.auth_mode) {
+			if(UAUTH_NONE != ctx->auth_mode) {
 				/*
 				** logged in, NO password needed
 				*/
 				if(c1 == 2 && c2 == 3) {
-					client_respond(230, NULL,
+					client_respond(ctx, 230, NULL,
 					               "User logged in, proceed.");
-					ctx.expect = EXP_IDLE;
+					ctx->expect = EXP_IDLE;
 					break;
 				} else
 				/*
 				** OK, password (+account) needed
 				*/
 				if(c1 == 3 && c2 == 3) {
-					if(ctx.userpass) {
-						socket_printf(ctx.srv_ctrl,
+					if(ctx->userpass) {
+						socket_printf(ctx->srv_ctrl,
 						              "PASS %s\r\n",
-						              ctx.userpass);
-						misc_free(FL, ctx.userpass);
-						ctx.userpass = NULL;
+						              ctx->userpass);
+						misc_free(FL, ctx->userpass);
+						ctx->userpass = NULL;
 					} else {
-						socket_printf(ctx.srv_ctrl,
+						socket_printf(ctx->srv_ctrl,
 						              "PASS \r\n");
 					}
-					ctx.expect = EXP_PTHR;
+					ctx->expect = EXP_PTHR;
 					break;
 				}
 			}
 			/*
 			** pass server response through to client
 			*/
-			socket_printf(ctx.cli_ctrl, "%s\r\n", str);
+			socket_printf(ctx->cli_ctrl, "%s\r\n", str);
 			if (c1 != 2 && c1 != 3) {
-				ctx.cli_ctrl->kill = 1;
+				ctx->cli_ctrl->kill = 1;
 			}
-			ctx.expect = EXP_IDLE;
+			ctx->expect = EXP_IDLE;
 			break;
 
 		case EXP_ABOR:
 			if (c1 == 2) {
-				client_data_reset(MOD_RESET);
-				ctx.expect = EXP_IDLE;
+				client_data_reset(ctx, MOD_RESET);
+				ctx->expect = EXP_IDLE;
 			}
 			break;
 
 		case EXP_PASV:
 			if (code == 227 && *arg != '\0') {
-				client_srv_passive(arg);
+				client_srv_passive(ctx, arg);
 			} else {
-				socket_printf(ctx.cli_ctrl,
+				socket_printf(ctx->cli_ctrl,
 						"%s\r\n", str);
-				client_data_reset(MOD_RESET);
-				ctx.expect = EXP_IDLE;
+				client_data_reset(ctx, MOD_RESET);
+				ctx->expect = EXP_IDLE;
 			}
 			break;
 
 		case EXP_PORT:
 			if (code == 200) {
-				client_xfer_fireup();
+				client_xfer_fireup(ctx);
 			} else {
-				socket_printf(ctx.cli_ctrl,
+				socket_printf(ctx->cli_ctrl,
 						"%s\r\n", str);
-				client_data_reset(MOD_RESET);
-				ctx.expect = EXP_IDLE;
+				client_data_reset(ctx, MOD_RESET);
+				ctx->expect = EXP_IDLE;
 			}
 			break;
 
@@ -819,32 +1166,32 @@ static void client_srv_ctrl_read(char *str)
 			** Distinguish between success and failure
 			*/
 			if (c1 == 2) {
-				misc_strncpy(ctx.xfer_rep, str,
-					sizeof(ctx.xfer_rep));
+				misc_strncpy(ctx->xfer_rep, str,
+					sizeof(ctx->xfer_rep));
 			} else {
-				socket_printf(ctx.cli_ctrl,
+				socket_printf(ctx->cli_ctrl,
 						"%s\r\n", str);
 				if(config_bool(NULL,"FailResetsPasv", 0)) {
-					client_data_reset(MOD_RESET);
+					client_data_reset(ctx, MOD_RESET);
 				} else {
-					client_data_reset(ctx.cli_mode);
+					client_data_reset(ctx, ctx->cli_mode);
 				}
 			}
-			ctx.expect = EXP_IDLE;
+			ctx->expect = EXP_IDLE;
 			break;
 
 		case EXP_PTHR:
-			socket_printf(ctx.cli_ctrl, "%s\r\n", str);
-			ctx.expect = EXP_IDLE;
+			socket_printf(ctx->cli_ctrl, "%s\r\n", str);
+			ctx->expect = EXP_IDLE;
 			break;
 
 		case EXP_IDLE:
-			socket_printf(ctx.cli_ctrl, "%s\r\n", str);
+			socket_printf(ctx->cli_ctrl, "%s\r\n", str);
 			if (code == 421) {
-				syslog_write(T_WRN, "[ %s ] server closed connection for %s", ctx.cli_ctrl->peer, ctx.cli_ctrl->peer);
-				ctx.cli_ctrl->kill = 1;
+				syslog_write(T_WRN, "[ %s ] server closed connection for %s", ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
+				ctx->cli_ctrl->kill = 1;
 			} else {
-				syslog_write(T_WRN, "[ %s ] bogus '%.512s' from Server-PI for %s", ctx.cli_ctrl->peer, ctx.cli_ctrl->peer, str);
+				syslog_write(T_WRN, "[ %s ] bogus '%.512s' from Server-PI for %s", ctx->cli_ctrl->peer, ctx->cli_ctrl->peer, str);
 			}
 			break;
 	}
@@ -863,7 +1210,7 @@ static void client_srv_ctrl_read(char *str)
 **
 ** ------------------------------------------------------------ */
 
-static void client_srv_passive(char *arg)
+static void client_srv_passive(CONTEXT *ctx, char *arg)
 {
 	int h1, h2, h3, h4, p1, p2;
 	u_int32_t addr, ladr;
@@ -881,15 +1228,20 @@ static void client_srv_passive(char *arg)
 		arg++;
 	if (sscanf(arg, "%d,%d,%d,%d,%d,%d",
 			&h1, &h2, &h3, &h4, &p1, &p2) != 6) {
-		syslog_error("[ %s ] bad PASV 277 response from server for %s",ctx.cli_ctrl->peer,ctx.cli_ctrl->peer);
-		client_respond(425, NULL, "Can't open data connection");
-		client_data_reset(MOD_RESET);
-		ctx.expect = EXP_IDLE;
+		syslog_error("[ %s ] bad PASV 277 response from server for %s",ctx->cli_ctrl->peer,ctx->cli_ctrl->peer);
+		client_respond(ctx, 425, NULL, "Can't open data connection");
+		client_data_reset(ctx, MOD_RESET);
+		ctx->expect = EXP_IDLE;
 		return;
 	}
 	addr = (u_int32_t) ((h1 << 24) + (h2 << 16) + (h3 << 8) + h4);
 	port = (u_int16_t) ((p1 <<  8) +  p2);
-	syslog_write(T_DBG, "[ %s ] got SRV-PASV %s:%d for %s:%d",ctx.cli_ctrl->peer, socket_addr2str(addr), port, ctx.cli_ctrl->peer, ctx.cli_ctrl->port);
+	if (syslog_want(T_DBG | L_DATA)) {
+		syslog_write(T_DBG | L_DATA, "[ %s ] got SRV-PASV %s:%d "
+		             "for %s:%d", ctx->cli_ctrl->peer,
+		             socket_addr2str(addr), port,
+		             ctx->cli_ctrl->peer, ctx->cli_ctrl->port);
+	}
 
 	/*
 	** should we bind a rand(port-range) or increment?
@@ -899,22 +1251,22 @@ static void client_srv_passive(char *arg)
 	/*
 	** Open a connection to the server at the given port
 	*/
-	ladr = socket_sck2addr(ctx.srv_ctrl->sock, LOC_END, NULL);
-	if (socket_d_connect(addr, port, ladr, ctx.srv_lrng,
-			ctx.srv_urng, &(ctx.srv_data),
+	ladr = socket_sck2addr(ctx->srv_ctrl->sock, LOC_END, NULL);
+	if (socket_d_connect(addr, port, ladr, ctx->srv_lrng,
+			ctx->srv_urng, &(ctx->srv_data),
 			"Srv-Data", incr) == 0)
 	{
-		syslog_error("[ %s ] can't connect Srv-Data for %s",ctx.cli_ctrl->peer,ctx.cli_ctrl->peer);
-		client_respond(425, NULL, "Can't open data connection");
-		client_data_reset(MOD_RESET);
-		ctx.expect = EXP_IDLE;
+		syslog_error("[ %s ] can't connect Srv-Data for %s",ctx->cli_ctrl->peer,ctx->cli_ctrl->peer);
+		client_respond(ctx, 425, NULL, "Can't open data connection");
+		client_data_reset(ctx, MOD_RESET);
+		ctx->expect = EXP_IDLE;
 		return;
 	}
 
 	/*
 	** Finally send the original command from the client
 	*/
-	client_xfer_fireup();
+	client_xfer_fireup(ctx);
 }
 
 
@@ -933,7 +1285,7 @@ static void client_srv_passive(char *arg)
 **
 ** ------------------------------------------------------------ */
 
-static void client_xfer_fireup(void)
+static void client_xfer_fireup(CONTEXT *ctx)
 {
 	u_int32_t ladr = INADDR_ANY;
 	int       incr;
@@ -946,7 +1298,7 @@ static void client_xfer_fireup(void)
 	/*
 	** If appropriate, connect to the client's data port
 	*/
-	if (ctx.cli_mode == MOD_ACT_FTP) {
+	if (ctx->cli_mode == MOD_ACT_FTP) {
 		/*
 		** TransProxy mode: check if we can use our real
 		** ip instead of the server's one as our local ip,
@@ -957,19 +1309,19 @@ static void client_xfer_fireup(void)
 					(u_int32_t)INADDR_ANY);
 		}
 		if(INADDR_ANY == ladr) {
-			ladr = socket_sck2addr(ctx.cli_ctrl->sock,
+			ladr = socket_sck2addr(ctx->cli_ctrl->sock,
 						LOC_END, NULL);
 		}
-		if (socket_d_connect(ctx.cli_addr, ctx.cli_port,
-				ladr, ctx.act_lrng, ctx.act_urng,
-				&(ctx.cli_data), "Cli-Data", incr) == 0)
+		if (socket_d_connect(ctx->cli_addr, ctx->cli_port,
+				ladr, ctx->act_lrng, ctx->act_urng,
+				&(ctx->cli_data), "Cli-Data", incr) == 0)
 		{
-			syslog_error("[ %s ] can't connect Cli-Data for %s",ctx.cli_ctrl->peer,
-						ctx.cli_ctrl->peer);
-			client_respond(425, NULL,
+			syslog_error("[ %s ] can't connect Cli-Data for %s",ctx->cli_ctrl->peer,
+						ctx->cli_ctrl->peer);
+			client_respond(ctx, 425, NULL,
 					"Can't open data connection");
-			client_data_reset(MOD_RESET);
-			ctx.expect = EXP_IDLE;
+			client_data_reset(ctx, MOD_RESET);
+			ctx->expect = EXP_IDLE;
 			return;
 		}
 	}
@@ -977,24 +1329,24 @@ static void client_xfer_fireup(void)
 	/*
 	** Send the original command from the client
 	*/
-	if (ctx.xfer_arg[0] != '\0') {
-		socket_printf(ctx.srv_ctrl, "%s %s\r\n",
-				ctx.xfer_cmd, ctx.xfer_arg);
-		syslog_write(T_INF, "[ %s ] '%s %s' sent for %s",
-			ctx.cli_ctrl->peer,ctx.xfer_cmd, ctx.xfer_arg, ctx.cli_ctrl->peer);
+	if (ctx->xfer_arg[0] != '\0') {
+		socket_printf(ctx->srv_ctrl, "%s %s\r\n",
+				ctx->xfer_cmd, ctx->xfer_arg);
+		syslog_write(T_INF | L_DATA, "[ %s ] '%s %s' sent for %s",
+			ctx->cli_ctrl->peer,ctx->xfer_cmd, ctx->xfer_arg, ctx->cli_ctrl->peer);
 	} else {
-		socket_printf(ctx.srv_ctrl, "%s\r\n", ctx.xfer_cmd);
-		syslog_write(T_INF, "[ %s ] '%s' sent for %s",
-			ctx.cli_ctrl->peer,ctx.xfer_cmd, ctx.cli_ctrl->peer);
+		socket_printf(ctx->srv_ctrl, "%s\r\n", ctx->xfer_cmd);
+		syslog_write(T_INF | L_DATA, "[ %s ] '%s' sent for %s",
+			ctx->cli_ctrl->peer,ctx->xfer_cmd, ctx->cli_ctrl->peer);
 	}
 
 	/*
 	** Prepare the handling and statistics buffers
 	*/
-	memset(ctx.xfer_rep, 0, sizeof(ctx.xfer_rep));
-	ctx.xfer_beg = time(NULL);
+	memset(ctx->xfer_rep, 0, sizeof(ctx->xfer_rep));
+	ctx->xfer_beg = time(NULL);
 
-	ctx.expect = EXP_XFER;		/* Expect 226 complete	*/
+	ctx->expect = EXP_XFER;		/* Expect 226 complete	*/
 }
 
 
@@ -1012,7 +1364,7 @@ static void client_xfer_fireup(void)
 **
 ** ------------------------------------------------------------ */
 
-void client_respond(int code, char *file, char *fmt, ...)
+void client_respond(CONTEXT *ctx, int code, char *file, char *fmt, ...)
 {
 	va_list aptr;
 	char str[MAX_PATH_SIZE * 2], *p, *q;
@@ -1026,7 +1378,7 @@ void client_respond(int code, char *file, char *fmt, ...)
 			p = socket_msgline(str);
 			if ((q = strchr(p, '\n')) != NULL)
 				*q = '\0';
-			socket_printf(ctx.cli_ctrl,
+			socket_printf(ctx->cli_ctrl,
 					"%03d-%s\r\n", code, p);
 		}
 		fclose(fp);
@@ -1042,7 +1394,7 @@ void client_respond(int code, char *file, char *fmt, ...)
 	vsprintf(str, fmt, aptr);
 #endif
 	va_end(aptr);
-	socket_printf(ctx.cli_ctrl, "%03d %s.\r\n", code, str);
+	socket_printf(ctx->cli_ctrl, "%03d %s.\r\n", code, str);
 }
 
 
@@ -1058,43 +1410,43 @@ void client_respond(int code, char *file, char *fmt, ...)
 **
 ** ------------------------------------------------------------ */
 
-void client_reinit(void)
+void client_reinit(CONTEXT *ctx)
 {
 	/*
 	** Remove any server or data connections
 	*/
-	if (ctx.srv_data != NULL) {
-		socket_kill(ctx.srv_data);
-		ctx.srv_data = NULL;
+	if (ctx->srv_data != NULL) {
+		socket_kill(ctx->srv_data);
+		ctx->srv_data = NULL;
 	}
-	if (ctx.cli_data != NULL) {
-		socket_kill(ctx.cli_data);
-		ctx.cli_data = NULL;
+	if (ctx->cli_data != NULL) {
+		socket_kill(ctx->cli_data);
+		ctx->cli_data = NULL;
 	}
-	if (ctx.srv_ctrl != NULL) {
-		socket_kill(ctx.srv_ctrl);
-		ctx.srv_ctrl = NULL;
+	if (ctx->srv_ctrl != NULL) {
+		socket_kill(ctx->srv_ctrl);
+		ctx->srv_ctrl = NULL;
 	}
-	client_data_reset(MOD_RESET);
+	client_data_reset(ctx, MOD_RESET);
 
 	/*
 	** Remove the current user and status
 	*/
-	ctx.auth_mode  = UAUTH_NONE;
-	ctx.magic_auth = 0;
-	if (ctx.userauth != NULL) {
-		misc_free(FL, ctx.userauth);
-		ctx.userauth = NULL;
+	ctx->auth_mode  = UAUTH_NONE;
+	ctx->magic_auth = 0;
+	if (ctx->userauth != NULL) {
+		misc_free(FL, ctx->userauth);
+		ctx->userauth = NULL;
 	}
-	if (ctx.username != NULL) {
-		misc_free(FL, ctx.username);
-		ctx.username = NULL;
+	if (ctx->username != NULL) {
+		misc_free(FL, ctx->username);
+		ctx->username = NULL;
 	}
-	if(ctx.userpass != NULL) {
-		misc_free(FL, ctx.userpass);
-		ctx.userpass = NULL;
+	if(ctx->userpass != NULL) {
+		misc_free(FL, ctx->userpass);
+		ctx->userpass = NULL;
 	}
-	ctx.expect = EXP_IDLE;
+	ctx->expect = EXP_IDLE;
 }
 
 
@@ -1111,11 +1463,11 @@ void client_reinit(void)
 **
 ** ------------------------------------------------------------ */
 
-void client_data_reset(int mode)
+void client_data_reset(CONTEXT *ctx, int mode)
 {
-	memset(ctx.xfer_cmd, 0, sizeof(ctx.xfer_cmd));
-	memset(ctx.xfer_arg, 0, sizeof(ctx.xfer_arg));
-	ctx.xfer_beg = 0;
+	memset(ctx->xfer_cmd, 0, sizeof(ctx->xfer_cmd));
+	memset(ctx->xfer_arg, 0, sizeof(ctx->xfer_arg));
+	ctx->xfer_beg = 0;
 
 	/*
 	** reset client transfer mode to the specified one
@@ -1123,11 +1475,11 @@ void client_data_reset(int mode)
 	**
 	** Note: a reset to default is the normal behaviour
 	*/
-	ctx.cli_mode = mode ? mode : MOD_ACT_FTP;
+	ctx->cli_mode = mode ? mode : MOD_ACT_FTP;
 
-	if (ctx.cli_ctrl != NULL) {
-		ctx.cli_addr = ctx.cli_ctrl->addr;
-		ctx.cli_port = ctx.cli_ctrl->port;
+	if (ctx->cli_ctrl != NULL) {
+		ctx->cli_addr = ctx->cli_ctrl->addr;
+		ctx->cli_port = ctx->cli_ctrl->port;
 	}
 }
 
@@ -1137,170 +1489,45 @@ void client_data_reset(int mode)
 **	Function......:	client_srv_open
 **
 **	Parameters....:	(none)
-**
-**	Return........:	(none)
-**
-**	Purpose.......: Open control connection to the server.
-**
-** ------------------------------------------------------------ */
-
-void client_srv_open(void)
-{
-	struct sockaddr_in saddr;
-	u_int16_t          lprt, lowrng, res;
-	int                sock, incr, retry;
-
-	/*
-	** should we bind a rand(port-range) or increment?
-	*/
-	incr = !config_bool(NULL,"SockBindRand", 0);
-
-	/*
-	** mark socket invalid
-	*/
-	sock = -1;
-
-	/*
-	** Forward connection to destination
-	*/
-	retry = MAX_RETRIES;
-	lprt  = ctx.srv_lrng;
-	while(0 <= retry--) {
-		/*
-		** First of all, get a socket
-		*/
-		if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-			syslog_error("Srv-Ctrl: can't create socket for %s",
-			             ctx.cli_ctrl->peer);
-			exit(EXIT_FAILURE);
-		}
-		socket_opts(sock, SK_CONTROL);
-
-		/*
-		** check if we have to take care to a port range
-		*/
-		if( !(INPORT_ANY == ctx.srv_lrng &&
-                      INPORT_ANY == ctx.srv_urng))
-		{
-			u_int32_t ladr = INADDR_ANY;
-
-			/*
-			** bind the socket, taking care of a given port range
-			*/
-			if(incr) {
-				lowrng = lprt;
-#if defined(COMPILE_DEBUG)
-				debug(2, "Srv-Ctrl: "
-				         "about to bind to %s:range(%d-%d)",
-				         socket_addr2str(ladr),
-				         lowrng, ctx.srv_urng);
-#endif
-				res = socket_d_bind(sock, ladr,
-				       lowrng, ctx.srv_urng, incr);
-			} else {
-				lowrng = ctx.srv_lrng;
-#if defined(COMPILE_DEBUG)
-				debug(2, "Srv-Ctrl: "
-				         "about to bind to %s:range(%d-%d)",
-				         socket_addr2str(ladr),
-				         lowrng, ctx.srv_urng);
-#endif
-				res = socket_d_bind(sock, ladr,
-				           lowrng, ctx.srv_urng, incr);
-			}
-
-			if (INPORT_ANY == res) {
-				/* nothing found? */
-				close(sock);
-				syslog_error("Srv-Ctrl: can't bind to"
-				             " %s:%d for %s",
-					     socket_addr2str(ladr),
-					     (int)lprt, ctx.cli_ctrl->peer);
-				exit(EXIT_FAILURE);
-			} else {
-				lprt = res;
-			}
-		} else lprt = INPORT_ANY;
-
-		/*
-		** Okay, now try the actual connect to the server
-		*/
-		memset(&saddr, 0, sizeof(saddr));
-		saddr.sin_addr.s_addr = htonl(ctx.srv_addr);
-		saddr.sin_family      = AF_INET;
-		saddr.sin_port        = htons(ctx.srv_port);
-
-		if (connect(sock, (struct sockaddr *)&saddr,
-		            sizeof(saddr)) < 0)
-		{
-#if defined(COMPILE_DEBUG)
-				debug(2, "Srv-Ctrl: connect failed with '%s'",
-				      strerror(errno));
-#endif
-			close(sock);
-			sock = -1;
-			/* check if is makes sense to retry?
-			** perhaps we only need an other
-			** local port (EADDRNOTAVAIL) for
-			** this destination?
-			*/
-			if( !(EINTR == errno ||
-			      EAGAIN == errno ||
-			      EADDRINUSE == errno ||
-			      EADDRNOTAVAIL == errno))
-			{
-				/*
-				** an other (real) error ocurred
-				*/
-				syslog_error("Srv-Ctrl: "
-				             "can't connect %s:%d for %s",
-				             socket_addr2str(ctx.srv_addr),
-				             (int) ctx.srv_port,
-				             ctx.cli_ctrl->peer);
-				exit(EXIT_FAILURE);
-			}
-			if(incr && INPORT_ANY != lprt) {
-				/* increment lower range if we use
-				** increment mode and have a range
-				*/
-				if(lprt < ctx.srv_urng) {
-					lprt++;
-				} else {
-				/*
-				** no more ports in range we can try
-				*/
-				syslog_error("Srv-Ctrl: "
-				             "can't connect %s:%d for %s",
-				             socket_addr2str(ctx.srv_addr),
-				             (int) ctx.srv_port,
-				             ctx.cli_ctrl->peer);
-				exit(EXIT_FAILURE);
-				}
-			}
-		} else break;
-	}
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Open control connection to the server.
+**
+** ------------------------------------------------------------ */
+
+void client_srv_open(CONTEXT *ctx)
+{
+	int incr;
 
 	/*
-	** check if we have a valid, connected socket
+	** should we bind a rand(port-range) or increment?
+	*/
+	incr = !config_bool(NULL,"SockBindRand", 0);
+
+	/*
+	** Forward connection to destination; the connect
+	** completes (or fails) in the main loop
 	*/
-	if(-1 == sock) {
+	if (socket_c_connect(ctx->srv_addr, ctx->srv_port, INADDR_ANY,
+	                     ctx->srv_lrng, ctx->srv_urng,
+	                     &(ctx->srv_ctrl), "Srv-Ctrl", incr) == 0) {
 		syslog_error("Srv-Ctrl: can't connect %s:%d for %s",
-		             socket_addr2str(ctx.srv_addr),
-		             (int) ctx.srv_port,
-		             ctx.cli_ctrl->peer);
-		exit(EXIT_FAILURE);
+		             socket_addr2str(ctx->srv_addr),
+		             (int) ctx->srv_port,
+		             ctx->cli_ctrl->peer);
+		client_respond(ctx, 421, NULL, "Service not available, "
+		               "closing control connection");
+		ctx->cli_ctrl->kill = 1;
+		return;
 	}
 
-	if ((ctx.srv_ctrl = socket_init(sock)) == NULL)
-		misc_die(FL, "cmds_user: ?srv_ctrl?");
-	ctx.srv_ctrl->ctyp = "Srv-Ctrl";
-
 #if defined(COMPILE_DEBUG)
 		debug(2, "Srv-Ctrl is %s:%d",
-			ctx.srv_ctrl->peer, (int) ctx.srv_port);
+			ctx->srv_ctrl->peer, (int) ctx->srv_port);
 #endif
 
-	ctx.expect = EXP_CONN;		/* Expect Welcome	*/
+	ctx->expect = EXP_CONN;		/* Expect Welcome	*/
 }
 
 
@@ -1310,34 +1537,36 @@ void client_srv_open(void)
 **
 **	Parameters....:	pwd	client / user password
 **
-**	Return........:	0 on success
+**	Return........:	0 on success, 1 while the LDAP
+**			lookup is running (see cmds_login)
 **
 **	Purpose.......: setup user-profile and preform auth
 **	                if configured...
 **
 ** ------------------------------------------------------------ */
 
-int client_setup(char *pwd)
+int client_setup(CONTEXT *ctx, char *pwd)
 {
 	char      *type;
 	char      *who;
+	int        rc;
 
 	/*
 	** Setup defaults for the client's DTP process
 	*/
-	ctx.cli_mode = MOD_ACT_FTP;
-	ctx.cli_addr = ctx.cli_ctrl->addr;
-	ctx.cli_port = ctx.cli_ctrl->port;
-	ctx.srv_addr = INADDR_ANY;
-	ctx.srv_port = INPORT_ANY;
+	ctx->cli_mode = MOD_ACT_FTP;
+	ctx->cli_addr = ctx->cli_ctrl->addr;
+	ctx->cli_port = ctx->cli_ctrl->port;
+	ctx->srv_addr = INADDR_ANY;
+	ctx->srv_port = INPORT_ANY;
 
 	/*
 	** select the proper name for user specific setup...
 	*/
-	if(NULL != ctx.userauth) {
-		who = ctx.userauth;
+	if(NULL != ctx->userauth) {
+		who = ctx->userauth;
 	} else {
-		who = ctx.username;
+		who = ctx->username;
 	}
 
 	/*
@@ -1352,15 +1581,15 @@ int client_setup(char *pwd)
 		rule = config_str(NULL, "UserNameRule",
 		       "^[[:alnum:]]+([%20@/\\._-][[:alnum:]]+)*$");
 		       
-		syslog_write(T_DBG, "[ %s ] compiling UserNameRule: '%.1024s'",ctx.cli_ctrl->peer, rule);
+		syslog_write(T_DBG | L_RULE, "[ %s ] compiling UserNameRule: '%.1024s'",ctx->cli_ctrl->peer, rule);
 		if(NULL == (ptr = cmds_reg_comp(&preg, rule))) {
 		    return -1;
 		}
-		syslog_write(T_DBG, "[ %s ] DeHTMLized UserNameRule: '%.1024s'",ctx.cli_ctrl->peer, ptr);
+		syslog_write(T_DBG | L_RULE, "[ %s ] DeHTMLized UserNameRule: '%.1024s'",ctx->cli_ctrl->peer, ptr);
 
 		ptr = cmds_reg_exec(preg, who);
 		if(NULL != ptr) {
-			syslog_write(U_WRN, "[ %s ] invalid user name '%.128s'%s: %s",ctx.cli_ctrl->peer, 
+			syslog_write(U_WRN, "[ %s ] invalid user name '%.128s'%s: %s",ctx->cli_ctrl->peer, 
 			             who, (strlen(who)>128 ? "..." : ""), ptr);
 			cmds_reg_comp(&preg, NULL); /* free regex ptr */
 			return -1;
@@ -1372,16 +1601,16 @@ int client_setup(char *pwd)
 		** Simplified "emulation" of the above regex:
 		*/
 		if( !(isalnum(who[0]) && isalnum(who[strlen(who)-1]))) {
-		    syslog_write(U_ERR, "[ %s ] invalid user name '%.128s'%s", ctx.cli_ctrl->peer,
+		    syslog_write(U_ERR, "[ %s ] invalid user name '%.128s'%s", ctx->cli_ctrl->peer,
 		                 who, (strlen(who)>128 ? "..." : ""));
-		    return 1;
+		    return -1;
 		}
 		for(ptr=who+1; *ptr; ptr++) {
 		    if( !(isalnum(*ptr) ||
 		           ' ' == *ptr  || '@' == *ptr || '/' == *ptr ||
 		           '.' == *ptr  || '_' == *ptr || '-' == *ptr))
 		    {
-			syslog_write(U_ERR, "[ %s ] invalid user name '%.128s'%s", ctx.cli_ctrl->peer,
+			syslog_write(U_ERR, "[ %s ] invalid user name '%.128s'%s", ctx->cli_ctrl->peer,
 			             who, (strlen(who)>128 ? "..." : ""));
 			return -1;
 		    }
@@ -1389,7 +1618,7 @@ int client_setup(char *pwd)
 #endif
 	} else {
 		/* HUH ?! */
-		syslog_write(U_ERR, "[ %s ] empty user name", ctx.cli_ctrl->peer);
+		syslog_write(U_ERR, "[ %s ] empty user name", ctx->cli_ctrl->peer);
 		return -1;
 	}
 
@@ -1397,7 +1626,7 @@ int client_setup(char *pwd)
 	** user specific setup from config file
 	** with fallback to default values
 	*/
-	if(0 != client_setup_file(&ctx, who)) {
+	if(0 != client_setup_file(ctx, who)) {
 		return -1;
 	}
 
@@ -1421,8 +1650,9 @@ int client_setup(char *pwd)
 			/*
 			** ldap auth + setup
 			*/
-			if(0 != ldap_setup_user(&ctx, who, pwd ? pwd : ""))
-				return -1;
+			rc = ldap_setup_user(ctx, who, pwd ? pwd : "");
+			if(0 != rc)
+				return rc;
 		} else {
 			misc_die(FL, "client_setup: unknown ?UserAuthType?");
 		}
@@ -1430,7 +1660,7 @@ int client_setup(char *pwd)
 	} /* else {
 		** Fred Patch: with this block ftp-proxy doesn't work without ldap ...
 		** try ldap setup only
-		ldap_setup_user(&ctx, who, NULL);
+		ldap_setup_user(ctx, who, NULL);
 		**
 	} */
 
@@ -1438,12 +1668,12 @@ int client_setup(char *pwd)
 	** Evaluate mandatory settings or refuse to run.
 	*/
 	errno = 0;
-	if(INADDR_ANY == ctx.srv_addr || INADDR_BROADCAST == ctx.srv_addr) {
-		syslog_error("[ %s ] can't eval DestAddr for %s", ctx.cli_ctrl->peer, ctx.cli_ctrl->peer);
+	if(INADDR_ANY == ctx->srv_addr || INADDR_BROADCAST == ctx->srv_addr) {
+		syslog_error("[ %s ] can't eval DestAddr for %s", ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
 		return -1;
 	}
-	if(INPORT_ANY == ctx.srv_port) {
-		syslog_error("[ %s ] can't eval DestPort for %s",ctx.cli_ctrl->peer, ctx.cli_ctrl->peer);
+	if(INPORT_ANY == ctx->srv_port) {
+		syslog_error("[ %s ] can't eval DestPort for %s",ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
 		return -1;
 	}
 
@@ -1466,9 +1696,10 @@ int client_setup(char *pwd)
 
 static int client_setup_file(CONTEXT *ctx, char *who)
 {
-	char      *p;
-
-	u_int16_t  l, u;
+	PROFILE   *prof;
+	char       ipsrc[ACL_LINE];
+	char       ipdest[ACL_LINE];
+	int        rank, net, grp;
 
 	/*
 	** little bit sanity check
@@ -1483,15 +1714,33 @@ static int client_setup_file(CONTEXT *ctx, char *who)
 	syslog_write(U_INF, "[ %s ] reading data for '%s' from cfg-file", ctx->cli_ctrl->peer, who);
 
 	/*
-	** Evaluate DestinationAddress, except we have magic_addr
+	** Pick the profile compiled for the user's section
+	*/
+	if (prof_gen != config_gen())
+		client_profiles();
+	prof = &profiles[config_sect_id(who)];
+
+	if (MOD_CLI_FTP != prof->srv_mode && MOD_ACT_FTP != prof->srv_mode &&
+	    MOD_PAS_FTP != prof->srv_mode) {
+		syslog_error("can't eval DestMode for %s",
+		             ctx->cli_ctrl->peer);
+		return -1;
+	}
+
+	/*
+	** Evaluate DestinationAddress, except we have magic_addr;
+	** a host name that did not resolve at load time is
+	** retried here
 	*/
 	if (INADDR_ANY != ctx->magic_addr) {
 		ctx->srv_addr = ctx->magic_addr;
 	} else {
-		ctx->srv_addr = config_addr(who, "DestinationAddress",
-		                                 INADDR_ANY);
+		ctx->srv_addr = prof->srv_addr;
+		if (INADDR_ANY == ctx->srv_addr && NULL != prof->dst_name)
+			ctx->srv_addr = socket_str2addr(prof->dst_name,
+			                                INADDR_ANY);
 #if defined(COMPILE_DEBUG)
-		debug(2, "[ %s ] file DestAddr for %s: '%s'", ctx->cli_ctrl->peer,
+		debug(2, "[ %s ] file DestAddr for %s: '%s'", ctx->cli_ctrl->peer,
 		      ctx->cli_ctrl->peer, socket_addr2str(ctx->srv_addr));
 #endif
 	}
@@ -1502,192 +1751,546 @@ static int client_setup_file(CONTEXT *ctx, char *who)
 	if (INPORT_ANY != ctx->magic_port) {
 		ctx->srv_port = ctx->magic_port;
 	} else {
-		ctx->srv_port = config_port(who, "DestinationPort",
-		                                 IPPORT_FTP);
+		ctx->srv_port = prof->srv_port;
 #if defined(COMPILE_DEBUG)
 		debug(2, "[ %s ] file DestPort for %s: %d", ctx->cli_ctrl->peer,
 		      ctx->cli_ctrl->peer, (int) ctx->srv_port);
 #endif
 	}
 
+	/*
+	** Copy the remaining settings
+	*/
+	ctx->srv_mode = prof->srv_mode;
+	ctx->srv_lrng = prof->srv_lrng;
+	ctx->srv_urng = prof->srv_urng;
+	ctx->act_lrng = prof->act_lrng;
+	ctx->act_urng = prof->act_urng;
+	ctx->pas_lrng = prof->pas_lrng;
+	ctx->pas_urng = prof->pas_urng;
+	ctx->same_adr = prof->same_adr;
+	ctx->timeout  = prof->timeout;
+
+	/*
+	** do not try to bind a port < 1024 if running as UID != 0;
+	** the uid may have been dropped after the profiles were made
+	*/
+	if (INPORT_ANY == prof->act_lrng && 0 == getuid()) {
+		ctx->act_lrng = (IPPORT_FTP - 1);
+		ctx->act_urng = (IPPORT_FTP - 1);
+	}
+#if defined(COMPILE_DEBUG)
+	debug(2, "file DestMode for %s: %d", ctx->cli_ctrl->peer,
+	         ctx->srv_mode);
+	debug(2, "file DestRange for %s: %u-%u", ctx->cli_ctrl->peer,
+	         ctx->srv_lrng, ctx->srv_urng);
+	debug(2, "file ActiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
+	         ctx->act_lrng, ctx->act_urng);
+	debug(2, "file PassiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
+	         ctx->pas_lrng, ctx->pas_urng);
+	debug(2, "file SameAddress for %s: %s", ctx->cli_ctrl->peer,
+	                                        ctx->same_adr ? "yes" : "no");
+	debug(2, "file TimeOut for %s: %d", ctx->cli_ctrl->peer, ctx->timeout);
+#endif
+
+	/*
+	** Adjust the allow/deny flags for the commands according
+	** to the group rules matching the source or destination
+	*/
+	misc_strncpy(ipsrc, ctx->cli_ctrl->peer, sizeof(ipsrc));
+	misc_strncpy(ipdest, socket_addr2str(ctx->srv_addr), sizeof(ipdest));
+	syslog_write(U_INF | L_RULE, "[ %s ] group rules dest: %s src: %s", ipsrc, ipdest, ipsrc);
+
+	rank = client_acl_find(prof, ipsrc, ipdest, &net);
+	if (0 != rank) {
+		grp = prof->acl->rule[rank - 1];
+		cmds_set_allow(ctx, prof->grp_cmds[grp]);
+		if (net) {
+			syslog_write(U_INF | L_RULE, "[ %s ] Apply rules for Network: %s src: %s",
+			             ipsrc, ipdest, ipsrc);
+		} else {
+			syslog_write(U_INF | L_RULE, "[ %s ] Apply rules for: %s dst: %s",
+			             ipsrc, ipsrc, ipdest);
+		}
+		syslog_write(U_INF | L_RULE, "[ %s ] Server match %s ", ipsrc,
+		             prof->acl->file[grp]);
+		return 0;
+	}
+	if (0 != prof->acl->miss) {
+		syslog_write(U_INF | L_RULE, "[ %s ] group file '%s' not found", ipsrc,
+		             prof->acl->file[prof->acl->miss]);
+		return 0;
+	}
+	syslog_write(U_INF | L_RULE, "[ %s ] no group rule found -> defaultrules", ipsrc);
+	cmds_set_allow(ctx, prof->dflt_cmds);
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_profiles
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Compile the per-user settings of every
+**			config section (and the global one) into
+**			a profile, so a login only has to copy
+**			them. The new table replaces the old one
+**			in one step and is tagged with the config
+**			generation it was made from.
+**
+** ------------------------------------------------------------ */
+
+void client_profiles(void)
+{
+	PROFILE *prof;
+	int      cnt, id;
+#if defined(HAVE_REGEX)
+	void    *preg = NULL;
+#endif
+
+	cnt  = config_sect_cnt();
+	prof = (PROFILE *) misc_alloc(FL, (cnt > 0 ? cnt : 1) *
+	                                  sizeof(PROFILE));
+
+	client_prof_make(&prof[0], NULL);
+	cmds_prep_allow(config_str(NULL, "ValidCommands", NULL));
+#if defined(HAVE_REGEX)
+	/*
+	** Have the argument filters built before the children
+	** are forked, so they inherit them instead of each
+	** compiling its own copy on the first USER command
+	*/
+	if (NULL != cmds_reg_comp(&preg, config_str(NULL, "UserNameRule",
+	                   "^[[:alnum:]]+([%20@/\\._-][[:alnum:]]+)*$")))
+		cmds_reg_comp(&preg, NULL);
+#endif
+	for (id = 1; id < cnt; id++) {
+		prof[id].acl = prof[0].acl;
+		client_prof_make(&prof[id], config_sect_name(id));
+	}
+
+	if (NULL != profiles) {
+		for (id = prof_cnt - 1; id >= 0; id--)
+			client_prof_free(&profiles[id]);
+		misc_free(FL, profiles);
+	}
+	profiles = prof;
+	prof_cnt = cnt;
+	prof_gen = config_gen();
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "compiled %d user profiles, generation %d",
+	         prof_cnt, prof_gen);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_prof_make
+**
+**	Parameters....:	prof	Profile to fill in
+**			snam	Section name (NULL=global)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Evaluate the config settings read by
+**			client_setup_file for one section. An
+**			invalid DestinationTransferMode leaves
+**			srv_mode at -1 and is refused at login.
+**
+** ------------------------------------------------------------ */
+
+static void client_prof_make(PROFILE *prof, char *snam)
+{
+	char      *p, name[32];
+	u_int16_t  l, u;
+	ACL       *share;
+	int        grp;
+
+	/*
+	** Evaluate DestinationAddress and DestinationPort
+	*/
+	prof->dst_name = config_str (snam, "DestinationAddress", NULL);
+	prof->srv_addr = config_addr(snam, "DestinationAddress",
+	                             INADDR_ANY);
+	prof->srv_port = config_port(snam, "DestinationPort",
+	                             IPPORT_FTP);
+
 	/*
 	** Evaluate the destination transfer mode
 	*/
-	p = config_str(who, "DestinationTransferMode", "client");
+	p = config_str(snam, "DestinationTransferMode", "client");
 	if(0 == strcasecmp(p, "active")) {
-		ctx->srv_mode = MOD_ACT_FTP;
+		prof->srv_mode = MOD_ACT_FTP;
 	} else
 	if(0 == strcasecmp(p, "passive")) {
-		ctx->srv_mode = MOD_PAS_FTP;
+		prof->srv_mode = MOD_PAS_FTP;
 	} else
 	if(0 == strcasecmp(p, "client")) {
-		ctx->srv_mode = MOD_CLI_FTP;
+		prof->srv_mode = MOD_CLI_FTP;
 	} else {
-		syslog_error("can't eval DestMode for %s",
-		             ctx->cli_ctrl->peer);
-		return -1;
+		prof->srv_mode = -1;
 	}
-#if defined(COMPILE_DEBUG)
-	debug(2, "file DestMode for %s: %s", ctx->cli_ctrl->peer, p);
-#endif
 
 	/*
 	** Evaluate min/max destination port range
 	*/
-	l = config_port(who, "DestinationMinPort", INPORT_ANY);
-	u = config_port(who, "DestinationMaxPort", INPORT_ANY);
+	l = config_port(snam, "DestinationMinPort", INPORT_ANY);
+	u = config_port(snam, "DestinationMaxPort", INPORT_ANY);
 	if (l > 0 && u > 0 && u >= l) {
-		ctx->srv_lrng = l;
-		ctx->srv_urng = u;
+		prof->srv_lrng = l;
+		prof->srv_urng = u;
 	} else {
-		ctx->srv_lrng = INPORT_ANY;
-		ctx->srv_urng = INPORT_ANY;
+		prof->srv_lrng = INPORT_ANY;
+		prof->srv_urng = INPORT_ANY;
 	}
-#if defined(COMPILE_DEBUG)
-	debug(2, "file DestRange for %s: %u-%u", ctx->cli_ctrl->peer,
-	         ctx->srv_lrng, ctx->srv_urng);
-#endif
 
 	/*
-	** Evaluate min/max active port range
+	** Evaluate min/max active port range; the
+	** root default is applied at login time
 	*/
-	l = config_port(who, "ActiveMinDataPort", INPORT_ANY);
-	u = config_port(who, "ActiveMaxDataPort", INPORT_ANY);
+	l = config_port(snam, "ActiveMinDataPort", INPORT_ANY);
+	u = config_port(snam, "ActiveMaxDataPort", INPORT_ANY);
 	if (l > 0 && u > 0 && u >= l) {
-		ctx->act_lrng = l;
-		ctx->act_urng = u;
+		prof->act_lrng = l;
+		prof->act_urng = u;
 	} else {
-		/* do not try to bind a port < 1024 if running as UID != 0 */
-		if(0 == getuid()) {
-			ctx->act_lrng = (IPPORT_FTP - 1);
-			ctx->act_urng = (IPPORT_FTP - 1);
-		} else {
-			ctx->act_lrng = INPORT_ANY;
-			ctx->act_urng = INPORT_ANY;
-		}
+		prof->act_lrng = INPORT_ANY;
+		prof->act_urng = INPORT_ANY;
 	}
-#if defined(COMPILE_DEBUG)
-	debug(2, "file ActiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
-	         ctx->act_lrng, ctx->act_urng);
-#endif
 
 	/*
 	** Evaluate min/max passive port range
 	*/
-	l = config_port(who, "PassiveMinDataPort", INPORT_ANY);
-	u = config_port(who, "PassiveMaxDataPort", INPORT_ANY);
+	l = config_port(snam, "PassiveMinDataPort", INPORT_ANY);
+	u = config_port(snam, "PassiveMaxDataPort", INPORT_ANY);
 	if (l > 0 && u > 0 && u >= l) {
-		ctx->pas_lrng = l;
-		ctx->pas_urng = u;
+		prof->pas_lrng = l;
+		prof->pas_urng = u;
 	} else {
-		ctx->pas_lrng = INPORT_ANY;
-		ctx->pas_urng = INPORT_ANY;
+		prof->pas_lrng = INPORT_ANY;
+		prof->pas_urng = INPORT_ANY;
 	}
-#if defined(COMPILE_DEBUG)
-	debug(2, "file PassiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
-	         ctx->pas_lrng, ctx->pas_urng);
-#endif
 
 	/*
 	** Setup other configuration options
 	*/
-	ctx->same_adr = config_bool(who, "SameAddress", 1);
-	ctx->timeout  = config_int (who, "TimeOut",   900);
-#if defined(COMPILE_DEBUG)
-	debug(2, "file SameAddress for %s: %s", ctx->cli_ctrl->peer,
-	                                        ctx->same_adr ? "yes" : "no");
-	debug(2, "file TimeOut for %s: %d", ctx->cli_ctrl->peer, ctx->timeout);
-#endif
+	prof->same_adr = config_bool(snam, "SameAddress", 1);
+	prof->timeout  = config_int (snam, "TimeOut",   900);
 
-/*** Adjust the allow/deny flags for the commands ** Fred patch */
-	
-	char dest[17];
-	char ipdest[17];
-	char ipsrc[17];
-	strcpy (ipsrc,ctx->cli_ctrl->peer);
-	strcpy (ipdest, socket_addr2str(ctx->srv_addr));
-	syslog_write(U_INF, "\n");	
-	syslog_write(U_INF, "[ %s ] Fred Patch rules dest: %s src: %s", ipsrc, ipdest, ipsrc);	
-
-	char groupname[]="group";
-	char commandename[]="ValidCommands";
-	char *group;
-	FILE *fp;
-	group = "group1";
-	int ix;
-	int ix2;
-	u_int32_t dnsaddr;
-	for(ix=1; group != NULL; ix++) {
-		sprintf (&groupname[5],"%d",ix);
-		group = config_str(who, groupname, NULL);
+	/*
+	** Compile the group rules, unless the section uses
+	** the same group files as the global one
+	*/
+	share         = prof->acl;
+	prof->acl     = client_acl_make(snam, share);
+	prof->acl_own = (prof->acl != share);
+
+	/*
+	** The command lists may differ even if the files don't
+	*/
+	prof->grp_cmds = (char **) misc_alloc(FL, (prof->acl->cnt + 1) *
+	                                          sizeof(char *));
+	for (grp = 1; grp <= prof->acl->cnt; grp++) {
+		sprintf(name, "ValidCommands%d", grp);
+		prof->grp_cmds[grp] = config_str(snam, name, NULL);
+		cmds_prep_allow(prof->grp_cmds[grp]);
+	}
+	prof->dflt_cmds = config_str(snam, "defaultrules", NULL);
+	cmds_prep_allow(prof->dflt_cmds);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_prof_free
+**
+**	Parameters....:	prof	Profile to release
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release what client_prof_make allocated.
+**
+** ------------------------------------------------------------ */
+
+static void client_prof_free(PROFILE *prof)
+{
+	if (NULL != prof->grp_cmds)
+		misc_free(FL, prof->grp_cmds);
+	if (NULL != prof->acl && prof->acl_own) {
+		client_acl_free(&prof->acl->root);
+		if (NULL != prof->acl->file)
+			misc_free(FL, prof->acl->file);
+		if (NULL != prof->acl->rule)
+			misc_free(FL, prof->acl->rule);
+		misc_free(FL, prof->acl);
+	}
+	prof->grp_cmds = NULL;
+	prof->acl      = NULL;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_acl_make
+**
+**	Parameters....:	snam	Section name (NULL=global)
+**			share	Rules compiled for the global
+**				section or NULL
+**
+**	Return........:	Compiled group rules
+**
+**	Purpose.......: Read the group1..groupN files of the
+**			section. Every line is resolved once
+**			here (host names to a dotted quad) and
+**			entered into the trie in file order. The
+**			first file that can't be opened ends the
+**			list, as later groups are never reached.
+**
+** ------------------------------------------------------------ */
+
+static ACL *client_acl_make(char *snam, ACL *share)
+{
+	char      name[32], line[ACL_LINE], *c;
+	char      *files[MAX_GROUPS + 1];
+	int       cnt, grp;
+	ACL       *acl;
+	FILE      *fp;
+	u_int32_t addr;
+
+	/*
+	** Collect group1..groupN up to the first gap
+	*/
+	for (cnt = 0; cnt < MAX_GROUPS; cnt++) {
+		sprintf(name, "group%d", cnt + 1);
+		if (NULL == (files[cnt + 1] = config_str(snam, name, NULL)))
+			break;
+	}
+
+	/*
+	** A section inheriting all files from the
+	** global one inherits its compiled rules
+	*/
+	if (NULL != share && share->cnt == cnt) {
+		for (grp = 1; grp <= cnt; grp++) {
+			if (files[grp] != share->file[grp])
+				break;
 		}
-	
-	syslog_write(U_INF, "[ %s ] Number of groups: %d", ipsrc, ix-2);
-		
-	for (ix2=1; ix2 <= ix-2; ix2++) {
-		sprintf (&groupname[5],"%d",ix2);
-		group = config_str(who, groupname, NULL);
-		syslog_write(U_INF, "[ %s ] Reading: %s",ipsrc, group );
-		if ((fp = fopen(group, "r")) == NULL)
-			{
-			syslog_write(U_INF, "File not found");
-			return 0;
-			}
-		else
-			{	
-			fseek(fp, 0, SEEK_SET);
-			while (fgets(dest, 17 , fp) != NULL)
-				{	
-				// Pour une IP
-				// Correction Bug Ligne sans \n 
-					dest[16] = '\n';
-					char *c = strchr (dest, '\n');
-					*c = 0;
-					/*  Dns resolution */
-					if (ipdest != dest) {
-						dnsaddr = socket_str2addr(dest, INADDR_ANY);
-						if (dnsaddr != 0) 
-							strcpy (dest, socket_addr2str(dnsaddr));
-						}
-					if (strcmp(dest,ipdest) == 0 || strcmp(dest,ipsrc) == 0)
-					{
-						sprintf (&commandename[13],"%d",ix);
-						p = config_str(who,commandename, NULL);
-						cmds_set_allow(p);
-						syslog_write(U_INF, "[ %s ] Apply rules for: %s dst: %s",ipsrc, ipsrc, ipdest);
-						syslog_write(U_INF, "[ %s ] Server match %s ",ipsrc, group );
-						syslog_write(U_INF, "\n");
-						fclose(fp);
-						return 0;
-					}
-			// Network
-				if (strchr(dest, 'x') != NULL)
-					{ 
-						char *c = strchr(dest, 'x');
-						*c = 0;
-						int longueur;
-						longueur = strlen(dest);
-						if (strncmp(dest,ipdest,longueur) == 0 || strncmp(dest,ipsrc,longueur) == 0)
-						{
-							sprintf (&commandename[13],"%d",ix);
-							p = config_str(who,commandename, NULL);
-							cmds_set_allow(p);
-							syslog_write(U_INF, "[ %s ] Apply rules for Network: %s src: %s",ipsrc, ipdest, ipsrc);
-							syslog_write(U_INF, "[ %s ] Server match %s ",ipsrc, group );
-							syslog_write(U_INF, "\n");
-							fclose(fp);
-							return 0;
-						}
-					}
+		if (grp > cnt)
+			return share;
+	}
+
+	acl = (ACL *) misc_alloc(FL, sizeof(ACL));
+	acl->cnt  = cnt;
+	acl->file = (char **) misc_alloc(FL, (cnt + 1) * sizeof(char *));
+	for (grp = 1; grp <= cnt; grp++)
+		acl->file[grp] = files[grp];
+
+	for (grp = 1; grp <= cnt; grp++) {
+		syslog_write(T_DBG | L_RULE, "compiling group file %s", files[grp]);
+		if (NULL == (fp = fopen(files[grp], "r"))) {
+			syslog_write(T_WRN, "can't open group file '%.1024s'",
+			             files[grp]);
+			acl->miss = grp;
+			break;
+		}
+
+		/*
+		** Lines are read in chunks of up to 16 chars
+		*/
+		while (NULL != fgets(line, sizeof(line), fp)) {
+			if (NULL != (c = strchr(line, '\n')))
+				*c = '\0';
+
+			/*
+			** Grow the rank -> group map
+			*/
+			if (acl->nrule == acl->arule) {
+				int *rule;
+
+				acl->arule = acl->arule ? acl->arule * 2 : 64;
+				rule = (int *) misc_alloc(FL, acl->arule *
+				                              sizeof(int));
+				if (NULL != acl->rule) {
+					memcpy(rule, acl->rule,
+					       acl->nrule * sizeof(int));
+					misc_free(FL, acl->rule);
 				}
+				acl->rule = rule;
+			}
+			acl->rule[acl->nrule++] = grp;
 
-			fclose(fp);
-			}	
+			/*
+			** Host names and dotted quads are compared
+			** as resolved dotted quads, anything else
+			** before an 'x' is a text prefix
+			*/
+			addr = socket_str2addr(line, INADDR_ANY);
+			if (INADDR_ANY != addr)
+				misc_strncpy(line, socket_addr2str(addr),
+				             sizeof(line));
+			client_acl_add(acl, line, strlen(line), 0);
+			if (NULL != (c = strchr(line, 'x')))
+				client_acl_add(acl, line, c - line, 1);
 		}
-	syslog_write(U_INF, "[ %s ] Oh, Oh, no rule found -> defaultrules", ipsrc) ;
-	p = config_str(who, "defaultrules", NULL);
-	cmds_set_allow(p); 
-	return 0;
+		fclose(fp);
+	}
+	syslog_write(T_DBG | L_RULE, "compiled %d group files, %d rules",
+	             grp - 1, acl->nrule);
+	return acl;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_acl_add
+**
+**	Parameters....:	acl	Rules to extend
+**			text	Line text
+**			len	Length of the text to enter
+**			pref	1=text is an 'x' prefix
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Enter the current (last) rank for a line
+**			into the trie. Text with characters not
+**			found in a dotted quad can never match
+**			and is skipped.
+**
+** ------------------------------------------------------------ */
+
+static void client_acl_add(ACL *acl, char *text, int len, int pref)
+{
+	ACLNODE *node;
+	int      i, idx;
+
+	for (i = 0; i < len; i++) {
+		if ('.' != text[i] && !isdigit((unsigned char) text[i]))
+			return;
+	}
+
+	for (node = &acl->root, i = 0; i < len; i++) {
+		idx = ('.' == text[i]) ? 10 : text[i] - '0';
+		if (NULL == node->next[idx]) {
+			node->next[idx] = (ACLNODE *)
+			                  misc_alloc(FL, sizeof(ACLNODE));
+		}
+		node = node->next[idx];
+	}
+
+	/*
+	** Keep the first line; it wins at lookup
+	*/
+	if (pref) {
+		if (0 == node->pref)
+			node->pref = acl->nrule;
+	} else {
+		if (0 == node->exact)
+			node->exact = acl->nrule;
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_acl_walk
+**
+**	Parameters....:	node	Trie root
+**			addr	Dotted quad to look up
+**			net	Set to 1 if an 'x' line matched
+**
+**	Return........:	Rank of the first matching line or 0
+**
+**	Purpose.......: Walk the address text down the trie,
+**			keeping the lowest rank of the prefix
+**			lines passed and of the exact line at
+**			the end of the text.
+**
+** ------------------------------------------------------------ */
+
+static int client_acl_walk(ACLNODE *node, char *addr, int *net)
+{
+	int best = 0, idx;
+
+	for (;;) {
+		if (0 != node->pref && (0 == best || node->pref < best)) {
+			best = node->pref;
+			*net = 1;
+		}
+		if ('\0' == *addr)
+			break;
+		idx = ('.' == *addr) ? 10 : *addr - '0';
+		if (idx < 0 || idx >= ACL_FANOUT ||
+		    NULL == (node = node->next[idx]))
+			return best;
+		addr++;
+	}
+	if (0 != node->exact && (0 == best || node->exact < best)) {
+		best = node->exact;
+		*net = 0;
+	}
+	return best;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_acl_find
+**
+**	Parameters....:	prof	User profile
+**			src	Dotted client address
+**			dst	Dotted server address
+**			net	Set to 1 if an 'x' line matched
+**
+**	Return........:	Rank of the first line matching either
+**			address or 0 if none does
+**
+**	Purpose.......: Lookup for client_setup_file.
+**
+** ------------------------------------------------------------ */
+
+static int client_acl_find(PROFILE *prof, char *src, char *dst, int *net)
+{
+	int rs, rd, ns = 0, nd = 0;
+
+	rd = client_acl_walk(&prof->acl->root, dst, &nd);
+	rs = client_acl_walk(&prof->acl->root, src, &ns);
+	if (0 != rs && (0 == rd || rs < rd)) {
+		*net = ns;
+		return rs;
+	}
+	*net = nd;
+	return rd;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	client_acl_free
+**
+**	Parameters....:	node	Trie node
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release the children of a trie node.
+**
+** ------------------------------------------------------------ */
+
+static void client_acl_free(ACLNODE *node)
+{
+	int idx;
+
+	for (idx = 0; idx < ACL_FANOUT; idx++) {
+		if (NULL != node->next[idx]) {
+			client_acl_free(node->next[idx]);
+			misc_free(FL, node->next[idx]);
+		}
+	}
 }
 
 
@@ -1704,7 +2307,7 @@ static int client_setup_file(CONTEXT *ctx, char *who)
  * Revision 1.9.2.1  2003/05/07 11:11:33  mt
  * removed broken ABOR sending on error while srv_data xfer still runs
  * moved user config-profile reading from ftp-ldap to client_setup_file()
- * changed to use new ctx.auth_mode flags to check if in user-auth mode
+ * changed to use new ctx->auth_mode flags to check if in user-auth mode
  *
  * Revision 1.9  2002/05/02 13:15:36  mt
  * implemented simple (ldap based) user auth
@@ -104,6 +104,9 @@ typedef struct {
 
 	u_int32_t magic_addr;	/* The "real" destination ...	*/
 	u_int16_t magic_port;	/* ... and corresponding port	*/
+	char *rs_park;		/* USER argument waiting for ...*/
+	char  rs_name[256];	/* ... this name to resolve	*/
+	char *ld_park;		/* PASS waiting for LDAP lookup	*/
 
 	int cli_mode;		/* Transfer mode to client	*/
 	u_int32_t cli_addr;	/* Address from client PORT	*/
@@ -124,10 +127,14 @@ typedef struct {
 
 	char *curr_cmd;		/* Current outstanding command	*/
 	int expect;		/* Expected answer from server	*/
+	int pipe;		/* 1=drain all lines per step	*/
+	void *cmd_perm;		/* Allowed commands (ftp-cmds.c)*/
 
 	int timeout;		/* Inactivity timeout in secs	*/
 
 	time_t sess_beg;	/* Start time of session	*/
+	time_t sess_act;	/* Time of last socket activity	*/
+	size_t sess_io;		/* Socket byte count at sess_act*/
 
 	char   xfer_cmd[16];	/* Outstanding transfer cmd	*/
 	char   xfer_arg[1024];	/* Argument for xfer_cmd	*/
@@ -137,18 +144,27 @@ typedef struct {
 	size_t xfer_rsec;	/* secs, read transfers		*/
 	size_t xfer_wcnt;	/* bytes, write transfers	*/
 	size_t xfer_wsec;	/* secs, write transfers	*/
+	size_t xfer_qpek;	/* bytes, peak output queued	*/
 } CONTEXT;
 
 
 /* ------------------------------------------------------------ */
 
 void client_run    (void);
-void client_reinit (void);
-void client_respond(int code, char *file, char *fmt, ...);
-void client_data_reset(int mode);
+int  client_session(void);
 
-int  client_setup(char *pwd);
-void client_srv_open(void);
+CONTEXT *client_open(int sock);
+int  client_step   (CONTEXT *ctx);
+int  client_idle   (CONTEXT *ctx, time_t now);
+void client_close  (CONTEXT *ctx);
+
+void client_reinit (CONTEXT *ctx);
+void client_respond(CONTEXT *ctx, int code, char *file, char *fmt, ...);
+void client_data_reset(CONTEXT *ctx, int mode);
+
+int  client_setup(CONTEXT *ctx, char *pwd);
+void client_srv_open(CONTEXT *ctx);
+void client_profiles(void);
 
 /* ------------------------------------------------------------ */
 
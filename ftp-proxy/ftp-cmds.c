@@ -72,16 +72,19 @@ static char rcsid[] = "$Id: ftp-cmds.c,v 1.10.2.2 2004/03/10 16:00:49 mt Exp $";
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-resolv.h"
 #include "com-socket.h"
 #include "com-syslog.h"
 #include "ftp-client.h"
 #include "ftp-cmds.h"
+#include "ftp-match.h"
 
 
 /* ------------------------------------------------------------ */
 
 static void cmds_pthr(CONTEXT *ctx, char *arg);
 static void cmds_user(CONTEXT *ctx, char *arg);
+static void cmds_user_exec(CONTEXT *ctx, char *arg);
 static void cmds_pass(CONTEXT *ctx, char *arg);
 static void cmds_quit(CONTEXT *ctx, char *arg);
 static void cmds_rein(CONTEXT *ctx, char *arg);
@@ -110,11 +113,7 @@ static int  parse_magic_user(CONTEXT *ctx, char *uarg,
 
 /* ------------------------------------------------------------ */
 
-#if defined(HAVE_REGEX)
-#  define REST		NULL, 0, 0
-#else
-#  define REST		0, 0
-#endif
+#define REST		0
 
 static CMD cmdlist[] = {
 	{ "USER", cmds_user, REST },	/* Access control	*/
@@ -180,21 +179,252 @@ static CMD cmdlist[] = {
 };
 
 
+/* ------------------------------------------------------------ */
+
+#define CMD_MAX		64	/* Max. commands in cmdlist	*/
+#define CMD_WORDS	((CMD_MAX + 31) / 32)
+#define CMD_HBITS	8	/* Dispatch table: 256 slots	*/
+#define CMD_HSIZE	(1 << CMD_HBITS)
+
+#define CMD_HASH(k, m)	((u_int32_t) ((k) * (m)) >> (32 - CMD_HBITS))
+#define CMD_SET(b, i)	((b)[(i) >> 5] |= (1U << ((i) & 31)))
+#define CMD_ISSET(b, i)	((b)[(i) >> 5] &  (1U << ((i) & 31)))
+
+#define ALLOW_HASH	64	/* Buckets of compiled lists	*/
+#define ALLOW_MAX	256	/* Max. lists kept per process	*/
+
+/*
+** A "ValidCommands" list compiled into a bitset over
+** cmdlist and the argument RegEx of each command. The
+** shared ones stay in the cache for the process life
+** and are never changed once built.
+*/
+typedef struct allow_t {
+	struct allow_t *next;	/* Next list in hash bucket	*/
+	u_int32_t hash;		/* Hash of the list text	*/
+	char     *text;		/* The list text		*/
+	int       shared;	/* 1=in cache, 0=session owned	*/
+	u_int32_t bits[CMD_WORDS]; /* Allowed commands		*/
+#if defined(HAVE_REGEX)
+	void    **regex;	/* Argument RegEx per command	*/
+#endif
+} ALLOW;
+
+static int       cmd_cnt  = 0;	/* Commands in cmdlist		*/
+static u_int32_t cmd_mult = 0;	/* Multiplier of the hash	*/
+static u_char    cmd_htab[CMD_HSIZE]; /* Slot -> cmdlist index + 1	*/
+static u_int32_t cmd_always[CMD_WORDS]; /* USER and QUIT		*/
+
+static ALLOW     allow_all;	/* No list: anything goes	*/
+static ALLOW    *allow_tab[ALLOW_HASH];
+static int       allow_cnt = 0;
+
+static void      cmds_init (void);
+static u_int32_t cmds_key  (char *name, int len);
+static ALLOW    *cmds_allow_get (char *allow);
+static ALLOW    *cmds_allow_make(char *allow, u_int32_t hash);
+static void      cmds_allow_free(ALLOW *al);
+
+
 /* ------------------------------------------------------------ **
 **
-**	Function......:	cmds_get_list
+**	Function......:	cmds_key
+**
+**	Parameters....:	name		Command verb
+**			len		Its length
+**
+**	Return........:	Verb packed into 32 bits (upper
+**			case), 0 if it can't be a command
+**
+**	Purpose.......: All FTP verbs have up to four letters,
+**			so one compare identifies them.
+**
+** ------------------------------------------------------------ */
+
+static u_int32_t cmds_key(char *name, int len)
+{
+	u_int32_t key = 0;
+	int i, c;
+
+	if (len < 1 || len > 4)
+		return 0;
+	for (i = 0; i < 4; i++) {
+		c = (i < len) ? (u_char) name[i] : 0;
+		if (i < len && isalpha(c) == 0)
+			return 0;
+		key = (key << 8) | (u_int32_t) (c & ~0x20);
+	}
+	return key;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_init
 **
 **	Parameters....:	(none)
 **
-**	Return........:	Pointer to command list
+**	Return........:	(none)
 **
-**	Purpose.......: Make command list known to others.
+**	Purpose.......: Build the dispatch table on first use:
+**			search a multiplier that hashes all verbs
+**			of cmdlist to distinct slots. The result
+**			only depends on cmdlist, i.e. on the
+**			features compiled in.
 **
 ** ------------------------------------------------------------ */
 
-CMD *cmds_get_list(void)
+static void cmds_init(void)
 {
-	return cmdlist;
+	u_int32_t mult, slot;
+	int i;
+
+	if (cmd_mult != 0)
+		return;
+
+	for (cmd_cnt = 0; cmdlist[cmd_cnt].name != NULL; cmd_cnt++) {
+		if (cmd_cnt >= CMD_MAX)
+			misc_die(FL, "cmds_init: ?CMD_MAX?");
+		cmdlist[cmd_cnt].key = cmds_key(cmdlist[cmd_cnt].name,
+		                       strlen(cmdlist[cmd_cnt].name));
+		CMD_SET(allow_all.bits, cmd_cnt);
+		if (strcasecmp(cmdlist[cmd_cnt].name, "USER") == 0 ||
+		    strcasecmp(cmdlist[cmd_cnt].name, "QUIT") == 0)
+			CMD_SET(cmd_always, cmd_cnt);
+	}
+	allow_all.shared = 1;
+
+	for (mult = 2654435761U; ; mult += 2) {
+		memset(cmd_htab, 0, sizeof(cmd_htab));
+		for (i = 0; i < cmd_cnt; i++) {
+			slot = CMD_HASH(cmdlist[i].key, mult);
+			if (cmd_htab[slot] != 0)
+				break;
+			cmd_htab[slot] = (u_char) (i + 1);
+		}
+		if (i == cmd_cnt)
+			break;
+	}
+	cmd_mult = mult;
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "command table: %d verbs, multiplier %u",
+	         cmd_cnt, cmd_mult);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_find
+**
+**	Parameters....:	name		Command verb
+**
+**	Return........:	Entry in the command list or NULL
+**
+**	Purpose.......: Look up a command (case insensitive).
+**
+** ------------------------------------------------------------ */
+
+CMD *cmds_find(char *name)
+{
+	u_int32_t key;
+	int idx;
+
+	if (cmd_mult == 0)
+		cmds_init();
+
+	if (name == NULL || (key = cmds_key(name, strlen(name))) == 0)
+		return NULL;
+	idx = cmd_htab[CMD_HASH(key, cmd_mult)];
+	if (idx == 0 || cmdlist[idx - 1].key != key)
+		return NULL;
+	return &cmdlist[idx - 1];
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_allowed
+**
+**	Parameters....:	ctx		Pointer to user context
+**			cmd		Entry in the command list
+**
+**	Return........:	1 if the command is allowed
+**
+**	Purpose.......: Check the session's allow list. Before
+**			the first list is set, everything is
+**			forbidden; USER (to bootstrap the list)
+**			and QUIT are always allowed.
+**
+** ------------------------------------------------------------ */
+
+int cmds_allowed(CONTEXT *ctx, CMD *cmd)
+{
+	ALLOW *al;
+	int idx;
+
+	if (ctx == NULL || cmd == NULL)	/* Basic sanity check	*/
+		misc_die(FL, "cmds_allowed: ?ctx?");
+
+	idx = (int) (cmd - cmdlist);
+	if (CMD_ISSET(cmd_always, idx))
+		return 1;
+	if ((al = (ALLOW *) ctx->cmd_perm) == NULL)
+		return 0;
+	return CMD_ISSET(al->bits, idx) ? 1 : 0;
+}
+
+
+#if defined(HAVE_REGEX)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_get_regex
+**
+**	Parameters....:	ctx		Pointer to user context
+**			cmd		Entry in the command list
+**
+**	Return........:	Argument RegEx of the command or NULL
+**
+**	Purpose.......: Get the RegEx from the session's list.
+**
+** ------------------------------------------------------------ */
+
+void *cmds_get_regex(CONTEXT *ctx, CMD *cmd)
+{
+	ALLOW *al;
+
+	if (ctx == NULL || cmd == NULL)	/* Basic sanity check	*/
+		misc_die(FL, "cmds_get_regex: ?ctx?");
+
+	if ((al = (ALLOW *) ctx->cmd_perm) == NULL || al->regex == NULL)
+		return NULL;
+	return al->regex[cmd - cmdlist];
+}
+#endif
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_free_perm
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release the session's command permissions.
+**
+** ------------------------------------------------------------ */
+
+void cmds_free_perm(CONTEXT *ctx)
+{
+	ALLOW *al;
+
+	if (ctx == NULL || (al = (ALLOW *) ctx->cmd_perm) == NULL)
+		return;
+	if (al->shared == 0)
+		cmds_allow_free(al);
+	ctx->cmd_perm = NULL;
 }
 
 
@@ -202,22 +432,26 @@ CMD *cmds_get_list(void)
 **
 **	Function......:	cmds_set_allow
 **
-**	Parameters....:	allow		List of allowd commands
+**	Parameters....:	ctx		Pointer to user context
+**			allow		List of allowd commands
 **					(comma/space delimited)
 **
 **	Return........:	(none)
 **
-**	Purpose.......: Setup allowed/forbidden command flags
-**			according to a "ValidCommands" config
-**			string (from file or LDAP Server).
+**	Purpose.......: Setup the session's allowed/forbidden
+**			command flags according to a "ValidCommands"
+**			config string (from file or LDAP Server).
+**			Each list is compiled once per process and
+**			shared by all sessions using it.
 **
 ** ------------------------------------------------------------ */
 
-void cmds_set_allow(char *allow)
+void cmds_set_allow(CONTEXT *ctx, char *allow)
 {
-	CMD *cmd;
-	char *p, *q;
-	int i;
+	if (ctx == NULL)		/* Basic sanity check	*/
+		misc_die(FL, "cmds_set_allow: ?ctx?");
+
+	cmds_free_perm(ctx);
 
 	/*
 	** Base line: if no option is given, then anything
@@ -225,37 +459,109 @@ void cmds_set_allow(char *allow)
 	**   is forbidden except those items on the list.
 	*/
 	if (allow == NULL) {
-		for (cmd = cmdlist; cmd->name != NULL; cmd++) {
-#if defined(HAVE_REGEX)
-			if (cmd->regex != NULL) {
-				regfree((regex_t *) cmd->regex);
-				misc_free(FL, cmd->regex);
-				cmd->regex = NULL;
-			}
-#endif
-			cmd->legal = 1;
-			cmd->len   = strlen(cmd->name);
-		}
+		ctx->cmd_perm = (void *) &allow_all;
 #if defined(COMPILE_DEBUG)
 		debug(2, "allowed: '(all)'");
 #endif
 		return;
 	}
+	ctx->cmd_perm = (void *) cmds_allow_get(allow);
+}
 
-	/*
-	** Initially deny everything
-	*/
-	for (cmd = cmdlist; cmd->name != NULL; cmd++) {
-#if defined(HAVE_REGEX)
-		if (cmd->regex != NULL) {
-			regfree((regex_t *) cmd->regex);
-			misc_free(FL, cmd->regex);
-			cmd->regex = NULL;
-		}
-#endif
-		cmd->legal = 0;
-		cmd->len   = strlen(cmd->name);
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_prep_allow
+**
+**	Parameters....:	allow		List of allowd commands
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Compile a list into the cache ahead of
+**			its first use, e.g. while the profiles
+**			are made before the children are forked.
+**
+** ------------------------------------------------------------ */
+
+void cmds_prep_allow(char *allow)
+{
+	ALLOW *al;
+
+	if (allow == NULL)
+		return;
+	if ((al = cmds_allow_get(allow))->shared == 0)
+		cmds_allow_free(al);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_allow_get
+**
+**	Parameters....:	allow		List of allowd commands
+**
+**	Return........:	Compiled list
+**
+**	Purpose.......: Look the list up in the cache; if it is
+**			not there, compile and keep it, unless too
+**			many (e.g. per user lists from LDAP) are
+**			around already - then it is the caller's.
+**
+** ------------------------------------------------------------ */
+
+static ALLOW *cmds_allow_get(char *allow)
+{
+	ALLOW *al;
+	u_int32_t hash;
+	char *p;
+
+	if (cmd_mult == 0)
+		cmds_init();
+
+	for (hash = 2166136261U, p = allow; *p != '\0'; p++) {
+		hash ^= (u_int32_t) (u_char) *p;
+		hash *= 16777619U;
 	}
+	for (al = allow_tab[hash % ALLOW_HASH]; al; al = al->next) {
+		if (al->hash == hash && strcmp(al->text, allow) == 0)
+			return al;
+	}
+
+	al = cmds_allow_make(allow, hash);
+	if (allow_cnt < ALLOW_MAX) {
+		al->shared = 1;
+		al->next   = allow_tab[hash % ALLOW_HASH];
+		allow_tab[hash % ALLOW_HASH] = al;
+		allow_cnt++;
+	}
+	return al;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_allow_make
+**
+**	Parameters....:	allow		List of allowd commands
+**			hash		Hash of the list
+**
+**	Return........:	Compiled list
+**
+**	Purpose.......: Parse a "ValidCommands" list into the
+**			bitset and argument RegEx's.
+**
+** ------------------------------------------------------------ */
+
+static ALLOW *cmds_allow_make(char *allow, u_int32_t hash)
+{
+	ALLOW *al;
+	char *p, *q;
+	u_int32_t key;
+	int idx;
+
+	al = (ALLOW *) misc_alloc(FL, sizeof(ALLOW));
+	al->hash = hash;
+	al->text = misc_strdup(FL, allow);
 
 	/*
 	** Scan the allow list and enable accordingly
@@ -265,34 +571,68 @@ void cmds_set_allow(char *allow)
 			p++;
 		if (*p == '\0')
 			break;
-		for (q = p, i = 0; isalpha((int)*q); q++, i++)
+		for (q = p; isalpha((int)*q); q++)
 			;
-		for (cmd = cmdlist; cmd->name; cmd++) {
-			if (cmd->len != i)
-				continue;
-			if (strncasecmp(cmd->name, p, i) != 0)
-				continue;
-			cmd->legal = 1;
+		key = cmds_key(p, (int) (q - p));
+		idx = (key != 0) ? cmd_htab[CMD_HASH(key, cmd_mult)] : 0;
+		if (idx != 0 && cmdlist[idx - 1].key == key) {
+			idx--;
+			CMD_SET(al->bits, idx);
 #if defined(HAVE_REGEX)
 			if (*q == '=') {	/* RegEx to follow? */
 				char *r;
-				r = cmds_reg_comp(&(cmd->regex), ++q);
+				if (al->regex == NULL) {
+					al->regex = (void **) misc_alloc(FL,
+					            cmd_cnt * sizeof(void *));
+				}
+				r = cmds_reg_comp(&(al->regex[idx]), ++q);
 #if defined(COMPILE_DEBUG)
 				debug(2, "allowed: '%s' -> '%s'",
-						cmd->name, NIL(r));
+						cmdlist[idx].name, NIL(r));
 #endif
 				while (*q && *q != ' ' && *q != '\t')
 					q++;
-				break;
+				p = q;
+				continue;
 			}
 #endif
 #if defined(COMPILE_DEBUG)
-			debug(2, "allowed: '%s'", cmd->name);
+			debug(2, "allowed: '%s'", cmdlist[idx].name);
 #endif
-			break;
 		}
 		p = q;
 	}
+	return al;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_allow_free
+**
+**	Parameters....:	al		Compiled list
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release a session owned list.
+**
+** ------------------------------------------------------------ */
+
+static void cmds_allow_free(ALLOW *al)
+{
+#if defined(HAVE_REGEX)
+	int idx;
+
+	if (al->regex != NULL) {
+		for (idx = 0; idx < cmd_cnt; idx++) {
+			if (al->regex[idx] != NULL)
+				match_free(al->regex[idx]);
+		}
+		misc_free(FL, al->regex);
+	}
+#endif
+	misc_free(FL, al->text);
+	misc_free(FL, al);
 }
 
 
@@ -319,7 +659,7 @@ static void cmds_pthr(CONTEXT *ctx, char *arg)
 		misc_die(FL, "cmds_pthr: ?curr_cmd?");
 
 	if (ctx->srv_ctrl == NULL) {
-		client_respond(530, NULL, "Not logged in");
+		client_respond(ctx, 530, NULL, "Not logged in");
 		syslog_write(U_WRN, "[ %s ] '%s' without login from %s",
 				ctx->cli_ctrl->peer,cmd, ctx->cli_ctrl->peer);
 		return;
@@ -327,11 +667,11 @@ static void cmds_pthr(CONTEXT *ctx, char *arg)
 
 	if (arg == NULL || *arg == '\0') {
 		socket_printf(ctx->srv_ctrl, "%s\r\n", cmd);
-		syslog_write(U_INF, "[ %s ] '%s' from %s",
+		syslog_write(U_INF | L_CTRL, "[ %s ] '%s' from %s",
 					ctx->cli_ctrl->peer, cmd, ctx->cli_ctrl->peer);
 	} else {
 		socket_printf(ctx->srv_ctrl, "%s %.1024s\r\n", cmd, arg);
-		syslog_write(U_INF, "[ %s ] '%s %.1024s' from %s",
+		syslog_write(U_INF | L_CTRL, "[ %s ] '%s %.1024s' from %s",
 					ctx->cli_ctrl->peer, cmd, arg, ctx->cli_ctrl->peer);
 	}
 
@@ -348,22 +688,64 @@ static void cmds_pthr(CONTEXT *ctx, char *arg)
 **
 **	Return........:	(none)
 **
-**	Purpose.......: Act upon the 'USER' command.
+**	Purpose.......: Act upon the 'USER' command. If the
+**			magic destination is still being looked
+**			up, the argument is parked in the context
+**			and client_step runs the command again as
+**			soon as the resolver has the answer.
 **
 ** ------------------------------------------------------------ */
 
 static void cmds_user(CONTEXT *ctx, char *arg)
 {
-	CMD  *cmd;
+	char *line;
 
 	if (ctx == NULL)		/* Basic sanity check	*/
 		misc_die(FL, "cmds_user: ?ctx?");
 
+	line = (arg != NULL) ? misc_strdup(FL, arg) : NULL;
+	memset(ctx->rs_name, 0, sizeof(ctx->rs_name));
+
+	cmds_user_exec(ctx, arg);
+
+	if (ctx->rs_name[0] != '\0' && line != NULL) {
+		syslog_write(T_DBG | L_AUTH, "[ %s ] 'USER' waits for '%.256s'",
+		             ctx->cli_ctrl->peer, ctx->rs_name);
+		ctx->rs_park = line;
+		return;
+	}
+	if (line != NULL)
+		misc_free(FL, line);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_user_exec
+**
+**	Parameters....:	ctx		Pointer to user context
+**			arg		Command argument(s)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Check the 'USER' command; sets rs_name
+**			in the context if it has to wait for the
+**			resolver.
+**
+** ------------------------------------------------------------ */
+
+static void cmds_user_exec(CONTEXT *ctx, char *arg)
+{
+#if defined(HAVE_REGEX)
+	CMD  *cmd;
+	void *regex;
+#endif
+
 	/*
 	** Check for the user name
 	*/
 	if (arg == NULL || *arg == '\0') {
-		client_respond(501, NULL, "Missing user name");
+		client_respond(ctx, 501, NULL, "Missing user name");
 		syslog_write(U_WRN, "[ %s ] 'USER' without name from %s",
 				ctx->cli_ctrl->peer,ctx->cli_ctrl->peer);
 		return;
@@ -372,21 +754,18 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 	/*
 	** Abort any previous service
 	*/
-	client_reinit();
+	client_reinit(ctx);
 
 #if defined(HAVE_REGEX)
 	/*
 	** Check for a RegEx constraint on the USER command
 	*/
-	cmds_set_allow(config_str(NULL, "ValidCommands", NULL));
-	for (cmd = cmdlist; cmd->name != NULL; cmd++) {
+	cmds_set_allow(ctx, config_str(NULL, "ValidCommands", NULL));
+	if ((cmd = cmds_find("USER")) != NULL &&
+	    (regex = cmds_get_regex(ctx, cmd)) != NULL) {
 		char *p;
-		if (strcasecmp("USER", cmd->name) != 0)
-			continue;
-		if (cmd->regex == NULL)
-			break;
-		if ((p = cmds_reg_exec(cmd->regex, arg)) != NULL) {
-			client_respond(501, NULL,
+		if ((p = cmds_reg_exec(regex, arg)) != NULL) {
+			client_respond(ctx, 501, NULL,
 				"'USER': syntax error in arguments");
 			syslog_write(U_WRN,
 				"[ %s ] bad arg '%.128s'%s for "
@@ -395,7 +774,6 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 				ctx->cli_ctrl->peer, p);
 			return;
 		}
-		break;
 	}
 #endif
 
@@ -438,13 +816,13 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 				ctx->magic_port, ctx->cli_ctrl->peer);
 			break;
 			default:
-			syslog_write(T_DBG,
+			syslog_write(T_DBG | L_CTRL,
 				"requested transparent destination %s is local",
 				socket_addr2str(ntohl(addr)));
 			break;
 			}
 		} else {
-			syslog_write(T_DBG,
+			syslog_write(T_DBG | L_CTRL,
 				"no transparent proxy destination found");
 		}
 	}
@@ -458,8 +836,8 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 		if(NULL != ctx->magic_auth) {
 			if( sizeof("auth") != strlen(ctx->magic_auth)) {
 				syslog_write(T_ERR, "invalid UserAuthMagic");
-				client_respond(530, NULL, "Not logged in");
-				client_reinit();
+				client_respond(ctx, 530, NULL, "Not logged in");
+				client_reinit(ctx);
 				return;
 			}
 			if(strncasecmp(ctx->magic_auth, "auth", sizeof("auth")-1))
@@ -501,6 +879,8 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 			                         0,        0);
 		}
 
+		if(2 == is_ok)
+			return;		/* Wait for the resolver */
 		if(is_ok || NULL == ctx->userauth || NULL == ctx->username ||
 		            '\0' == ctx->userauth || '\0' == ctx->username) {
 			if(1 == is_ok) {
@@ -512,8 +892,8 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 				             "[ %s ] invalid magic in 'USER' from %s, bad Server name ?", ctx->cli_ctrl->peer,
 				             ctx->cli_ctrl->peer);
 			}
-			client_respond(530, NULL, "Not logged in");
-			client_reinit();
+			client_respond(ctx, 530, NULL, "Not logged in");
+			client_reinit(ctx);
 			return;
 		}
 	} else {
@@ -523,45 +903,51 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 		if(config_bool(NULL, "ForceMagicUser", 0) != 0) {
 			char *p, *u_sep = config_str(NULL, "UserMagicChar",
 			                  config_str(NULL, "UseMagicChar", "@"));
+			int   rc;
 			if( (p = strrchr(arg, u_sep[0]))) {
 				*p++ = '\0';
-				if(-1 == parse_magic_dest(ctx, p)) {
+				if(2 == (rc = parse_magic_dest(ctx, p)))
+					return;	/* Wait for the resolver */
+				if(-1 == rc) {
 					syslog_write(U_ERR,
 					             "[ %s ] invalid magic in 'USER' from %s", ctx->cli_ctrl->peer,
 					             ctx->cli_ctrl->peer);
-					client_respond(530, NULL,
+					client_respond(ctx, 530, NULL,
 					               "Not logged in");
-					client_reinit();
+					client_reinit(ctx);
 					return;
 				}
 			} else {
 				syslog_write(U_ERR,
 					"[ %s ] magic dest missed in 'USER' from %s", ctx->cli_ctrl->peer,
 					ctx->cli_ctrl->peer);
-				client_respond(530, NULL, "Not logged in");
-				client_reinit();
+				client_respond(ctx, 530, NULL, "Not logged in");
+				client_reinit(ctx);
 				return;
 			}
 		} else
 		if(config_bool(NULL, "AllowMagicUser", 0) != 0) {
 			char *p, *u_sep = config_str(NULL, "UserMagicChar",
 			                  config_str(NULL, "UseMagicChar", "@"));
+			int   rc;
 			if( (p = strrchr(arg, u_sep[0]))) {
 				*p++ = '\0';
-				if(-1 == parse_magic_dest(ctx, p)) {
+				if(2 == (rc = parse_magic_dest(ctx, p)))
+					return;	/* Wait for the resolver */
+				if(-1 == rc) {
 					syslog_write(U_ERR,
 					             "[ %s ] invalid magic in 'USER' from %s", ctx->cli_ctrl->peer,
 					             ctx->cli_ctrl->peer);
-					client_respond(530, NULL,
+					client_respond(ctx, 530, NULL,
 					               "Not logged in");
-					client_reinit();
+					client_reinit(ctx);
 					return;
 				}
 			}
 		}
 		ctx->username = misc_strdup(FL, arg);
 		if(NULL == ctx->username || '\0' == ctx->username) {
-			client_respond(501, NULL, "Missing user name");
+			client_respond(ctx, 501, NULL, "Missing user name");
 			syslog_write(U_WRN, "[ %s ] 'USER' without name from %s", ctx->cli_ctrl->peer,
 			                    ctx->cli_ctrl->peer);
 			return;
@@ -574,17 +960,17 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 	if (ctx->magic_addr != INADDR_ANY &&
 	    ctx->magic_addr != INADDR_NONE)
 	{
-		syslog_write(U_INF, "[ %s ] 'USER %s' dest %s:%d from %s", ctx->cli_ctrl->peer,
+		syslog_write(U_INF | L_AUTH, "[ %s ] 'USER %s' dest %s:%d from %s", ctx->cli_ctrl->peer,
 				arg, socket_addr2str(ctx->magic_addr),
 				(int)ctx->magic_port, ctx->cli_ctrl->peer);
 	} else
 	if(config_str(NULL, "DestinationAddress", NULL) == NULL) {
 		syslog_write(U_ERR, "[ %s ] unknown destination address", ctx->cli_ctrl->peer);
-		client_respond(501, NULL,"Unknown destination address");
-		client_reinit();
+		client_respond(ctx, 501, NULL,"Unknown destination address");
+		client_reinit(ctx);
 		return;
 	} else {
-		syslog_write(U_INF, "[ %s ] 'USER %s' from %s",ctx->cli_ctrl->peer,
+		syslog_write(U_INF | L_AUTH, "[ %s ] 'USER %s' from %s",ctx->cli_ctrl->peer,
 				arg, ctx->cli_ctrl->peer);
 	}
 
@@ -592,27 +978,19 @@ static void cmds_user(CONTEXT *ctx, char *arg)
 		/*
 		** anable PASS command only...
 		*/
-		cmds_set_allow("PASS");
+		cmds_set_allow(ctx, "PASS");
 
 		/*
 		** hmm... a USER name is there, but we need
 		** PASS+auth as well, because it may be needed
 		** for auth itself and for profile reading...
 		*/
-		client_respond(331, NULL, "User name okay, need password.");
+		client_respond(ctx, 331, NULL, "User name okay, need password.");
 	} else {
 		/*
 		** read user's profile, connect the server
 		*/
-		if(0 == client_setup(NULL)) {
-			client_srv_open();
-		} else {
-			/*
-			** FIXME: client_respond required? checkit!!
-			*/
-			client_respond(530, NULL, "Not logged in");
-			client_reinit();
-		}
+		cmds_login(ctx, NULL);
 	}
 }
 
@@ -640,7 +1018,7 @@ static void cmds_pass(CONTEXT *ctx, char *arg)
 	/*
 	** inform auditor...
 	*/
-	syslog_write(U_INF, "[ %s ] 'PASS XXXX' from %s",ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
+	syslog_write(U_INF | L_AUTH, "[ %s ] 'PASS XXXX' from %s",ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
 	/*
 	** should never be NULL, but ...
 	** if no password supplied, send none either
@@ -684,8 +1062,8 @@ static void cmds_pass(CONTEXT *ctx, char *arg)
 				syslog_write(U_ERR,
 				             "invalid magic in 'PASS' from %s",
 				             ctx->cli_ctrl->peer);
-				client_respond(530, NULL, "Not logged in");
-				client_reinit();
+				client_respond(ctx, 530, NULL, "Not logged in");
+				client_reinit(ctx);
 				return;
 			}
 		}
@@ -694,18 +1072,13 @@ static void cmds_pass(CONTEXT *ctx, char *arg)
 		** OK, we have all data to auth user, read his
 		** proxy-profile (if any) and connect to server
 		*/
-		if(0 == client_setup(pass)) {
-			client_srv_open();
-		} else {
-			client_respond(530, NULL, "Not logged in");
-			client_reinit();
-		}
+		cmds_login(ctx, pass);
 	} else {
 		/*
 		** paranoia check...
 		*/
 		if (ctx->srv_ctrl == NULL) {
-			client_respond(530, NULL, "Not logged in");
+			client_respond(ctx, 530, NULL, "Not logged in");
 			syslog_write(U_WRN, "'PASS' without login from %s",
 			             ctx->cli_ctrl->peer);
 			return;
@@ -715,7 +1088,7 @@ static void cmds_pass(CONTEXT *ctx, char *arg)
 		** Send to server, but do not display
 		*/
 		socket_printf(ctx->srv_ctrl, "PASS %.1024s\r\n", pass);
-		syslog_write(U_INF, "'PASS XXXX' from %s",
+		syslog_write(U_INF | L_AUTH, "'PASS XXXX' from %s",
 		             ctx->cli_ctrl->peer);
 
 		/* Expect Response */
@@ -724,6 +1097,41 @@ static void cmds_pass(CONTEXT *ctx, char *arg)
 }
 
 
+/* ------------------------------------------------------------ **
+**
+**	Function......:	cmds_login
+**
+**	Parameters....:	ctx		Pointer to user context
+**			pwd		User (auth) password or NULL
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Read the user's profile and connect to
+**			the server. If the LDAP lookup for it is
+**			still running, the password is parked
+**			and client_step calls again once the
+**			answer is in.
+**
+** ------------------------------------------------------------ */
+
+void cmds_login(CONTEXT *ctx, char *pwd)
+{
+	int rc;
+
+	if (ctx == NULL)		/* Basic sanity check	*/
+		misc_die(FL, "cmds_login: ?ctx?");
+
+	if ((rc = client_setup(ctx, pwd)) == 0) {
+		client_srv_open(ctx);
+	} else if (rc > 0) {
+		ctx->ld_park = misc_strdup(FL, pwd ? pwd : "");
+	} else {
+		client_respond(ctx, 530, NULL, "Not logged in");
+		client_reinit(ctx);
+	}
+}
+
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	cmds_rein
@@ -748,7 +1156,7 @@ static void cmds_rein(CONTEXT *ctx, char *arg)
 	/*
 	** Abort any running service
 	*/
-	client_reinit();
+	client_reinit(ctx);
 }
 
 
@@ -790,7 +1198,7 @@ static void cmds_quit(CONTEXT *ctx, char *arg)
 	/*
 	** Say good-bye
 	*/
-	client_respond(221, NULL, "Goodbye");
+	client_respond(ctx, 221, NULL, "Goodbye");
 	syslog_write(U_INF, "[ %s ] 'QUIT' from %s", ctx->cli_ctrl->peer, ctx->cli_ctrl->peer);
 	ctx->expect = EXP_IDLE;
 	ctx->cli_ctrl->kill = 1;
@@ -828,11 +1236,11 @@ static void cmds_port(CONTEXT *ctx, char *arg)
 			h1 < 0 || h1 > 255 || h2 < 0 || h2 > 255 ||
 			h3 < 0 || h3 > 255 || h4 < 0 || h4 > 255 ||
 			p1 < 0 || p1 > 255 || p2 < 0 || p2 > 255) {
-		client_respond(501, NULL, "Syntax error in arguments");
+		client_respond(ctx, 501, NULL, "Syntax error in arguments");
 		syslog_write(U_WRN,
 			"syntax error in 'PORT' from %s",
 			ctx->cli_ctrl->peer);
-		client_data_reset(MOD_RESET);
+		client_data_reset(ctx, MOD_RESET);
 		return;
 	}
 	addr = (h1 << 24) + (h2 << 16) + (h3 << 8) + h4;
@@ -843,12 +1251,12 @@ static void cmds_port(CONTEXT *ctx, char *arg)
 	** If requested, validate the IP address
 	*/
 	if (ctx->same_adr != 0 && addr != ctx->cli_ctrl->addr) {
-		client_respond(501, NULL,
+		client_respond(ctx, 501, NULL,
 			"PORT address does not match originator");
 		syslog_write(U_WRN,
 			"different address in 'PORT' from %s",
 			ctx->cli_ctrl->peer);
-		client_data_reset(MOD_RESET);
+		client_data_reset(ctx, MOD_RESET);
 		return;
 	}
 
@@ -873,8 +1281,8 @@ static void cmds_port(CONTEXT *ctx, char *arg)
 	ctx->cli_addr = addr;
 	ctx->cli_port = port;
 
-	client_respond(200, NULL, "PORT command successful");
-	syslog_write(U_INF, "[ %s ] 'PORT %s:%d' from %s",
+	client_respond(ctx, 200, NULL, "PORT command successful");
+	syslog_write(U_INF | L_DATA, "[ %s ] 'PORT %s:%d' from %s",
 			ctx->cli_ctrl->peer, peer, (int) port, ctx->cli_ctrl->peer);
 }
 
@@ -941,7 +1349,7 @@ static void cmds_pasv(CONTEXT *ctx, char *arg)
 		syslog_error("Cli-Data: can't bind to %s:%d-%d for %s",
 			socket_addr2str(addr), (int) ctx->pas_lrng,
 			(int) ctx->pas_urng, ctx->cli_ctrl->peer);
-		client_respond(425, NULL, "Can't open data connection");
+		client_respond(ctx, 425, NULL, "Can't open data connection");
 		return;
 	}
 
@@ -977,7 +1385,7 @@ static void cmds_pasv(CONTEXT *ctx, char *arg)
 	/*
 	** Tell the user where we are listening
 	*/
-	client_respond(227, NULL,
+	client_respond(ctx, 227, NULL,
 			"Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
 			(int) ((addr >> 24) & 0xff),
 			(int) ((addr >> 16) & 0xff),
@@ -985,7 +1393,7 @@ static void cmds_pasv(CONTEXT *ctx, char *arg)
 			(int) ( addr        & 0xff),
 			(int) ((port >>  8) & 0xff),
 			(int) ( port        & 0xff));
-	syslog_write(U_INF, "[ %s ] PASV set to %s:%d for %s",
+	syslog_write(U_INF | L_DATA, "[ %s ] PASV set to %s:%d for %s",
 		ctx->cli_ctrl->peer,socket_addr2str(addr), (int) port,
 			ctx->cli_ctrl->peer);
 
@@ -1026,10 +1434,10 @@ static void cmds_xfer(CONTEXT *ctx, char *arg)
 	** server.
 	*/
 	if (*arg == '\0') {
-		syslog_write(U_INF, "[ %s ] '%s' from %s",
+		syslog_write(U_INF | L_DATA, "[ %s ] '%s' from %s",
 				ctx->cli_ctrl->peer, cmd, ctx->cli_ctrl->peer);
 	} else {
-		syslog_write(U_INF, "[ %s ] '%s %.*s' from %s",ctx->cli_ctrl->peer, cmd,
+		syslog_write(U_INF | L_DATA, "[ %s ] '%s %.*s' from %s",ctx->cli_ctrl->peer, cmd,
 			MAX_PATH_SIZE, arg, ctx->cli_ctrl->peer);
 	}
 	misc_strncpy(ctx->xfer_cmd, cmd, sizeof(ctx->xfer_cmd));
@@ -1071,9 +1479,9 @@ static void cmds_xfer(CONTEXT *ctx, char *arg)
 					(int) ctx->srv_lrng,
 					(int) ctx->srv_urng,
 					ctx->cli_ctrl->peer);
-			client_respond(425, NULL,
+			client_respond(ctx, 425, NULL,
 					"Can't open data connection");
-			client_data_reset(MOD_RESET);
+			client_data_reset(ctx, MOD_RESET);
 			return;
 		}
 
@@ -1088,7 +1496,7 @@ static void cmds_xfer(CONTEXT *ctx, char *arg)
 				(int) ( addr        & 0xff),
 				(int) ((port >>  8) & 0xff),
 				(int) ( port        & 0xff));
-		syslog_write(T_INF, "[ %s ] 'PORT %s:%d' for %s",
+		syslog_write(T_INF | L_DATA, "[ %s ] 'PORT %s:%d' for %s",
 				ctx->cli_ctrl->peer,
 				socket_addr2str(addr), (int) port,
 				ctx->cli_ctrl->peer);
@@ -1130,13 +1538,13 @@ static void cmds_abor(CONTEXT *ctx, char *arg)
 	/*
 	** Reset data connection variables (esp. PASV)
 	*/
-	client_data_reset(MOD_RESET);
+	client_data_reset(ctx, MOD_RESET);
 
 	/*
 	** If no transfer is in progress, don't worry
 	*/
 	if (ctx->cli_data == NULL && ctx->srv_data == NULL) {
-		client_respond(225, NULL, "ABOR command successful");
+		client_respond(ctx, 225, NULL, "ABOR command successful");
 		return;
 	}
 
@@ -1146,9 +1554,9 @@ static void cmds_abor(CONTEXT *ctx, char *arg)
 	if (ctx->cli_data != NULL) {
 		socket_kill(ctx->cli_data);
 		ctx->cli_data = NULL;
-		client_respond(426, NULL,
+		client_respond(ctx, 426, NULL,
 			"Connection closed; transfer aborted");
-		client_respond(226, NULL, "ABOR command successful");
+		client_respond(ctx, 226, NULL, "ABOR command successful");
 	}
 
 	/*
@@ -1266,7 +1674,7 @@ static void cmds_auth(CONTEXT *ctx, char *arg)
 		misc_die(FL, "cmds_auth: ?ctx?");
 
 	if (arg == NULL || strcasecmp(arg, "SSL") != 0) {
-		client_respond(501, NULL,
+		client_respond(ctx, 501, NULL,
 				"Missing or bad auth method");
 		return;
 	}
@@ -1296,17 +1704,16 @@ char *cmds_reg_comp(void **ppre, char *ptr)
 	char tmp[1024];
 	int c;
 	size_t i;
-	regex_t *re;
+	void *re;
 
 	if (ppre == NULL)		/* Basic sanity check	*/
 		misc_die(FL, "cmds_reg_comp: ?ppre?");
 
 	/*
-	** Remove any previous pattern buffer
+	** Release any previous pattern
 	*/
 	if (*ppre != NULL) {
-		regfree((regex_t *) *ppre);
-		misc_free(FL, *ppre);
+		match_free(*ppre);
 		*ppre = NULL;
 	}
 
@@ -1342,22 +1749,18 @@ char *cmds_reg_comp(void **ppre, char *ptr)
 	}
 
 	/*
-	** Time to do the actual compilation
+	** Time to do the actual compilation (or to find
+	** the pattern compiled already)
 	*/
-	re = (regex_t *) misc_alloc(FL, sizeof(regex_t));
-	if ((i = regcomp(re, str, REG_EXTENDED | REG_NEWLINE |
-						REG_NOSUB)) != 0) {
-		regerror(i, re, tmp, sizeof(tmp));
+	if ((re = match_comp(str, tmp, sizeof(tmp))) == NULL) {
 		syslog_error("can't eval RegEx '%s': %s", str, tmp);
-		regfree(re);
-		misc_free(FL, (void *) re);
 		return NULL;
 	}
 
 	/*
 	** all is well
 	*/
-	*ppre = (void *) re;
+	*ppre = re;
 	return str;
 }
 
@@ -1377,19 +1780,14 @@ char *cmds_reg_comp(void **ppre, char *ptr)
 
 char *cmds_reg_exec(void *regex, char *str)
 {
-	static char err[1024];
-	int i;
-
 	if (regex == NULL || str == NULL)	/* Sanity check	*/
 		misc_die(FL, "cmds_reg_exec: ?regex? ?str?");
 
 #if defined(COMPILE_DEBUG)
 	debug(2, "trying RegEx for '%.*s'", MAX_PATH_SIZE, str);
 #endif
-	if ((i = regexec((regex_t *) regex, str, 0, NULL, 0)) != 0) {
-		regerror(i, (regex_t *) regex, err, sizeof(err));
-		return err;
-	}
+	if (match_exec(regex, str) == 0)
+		return "No match";
 
 	/*
 	** All is well
@@ -1403,6 +1801,7 @@ static int parse_magic_user(CONTEXT *ctx, char *uarg,
                             char u_sep, int u_force)
 {
 	char *p, *q;
+	int   rc;
 
 	if(NULL == uarg || '\0' == uarg || '\0' == a_sep) {
 		misc_die(FL, "parse_magic_user: ?uarg? ?a_sep?");
@@ -1495,8 +1894,8 @@ static int parse_magic_user(CONTEXT *ctx, char *uarg,
 #endif
 				return -1;
 			}
-			if(-1 == parse_magic_dest(ctx, q))
-				return -1;
+			if(0 != (rc = parse_magic_dest(ctx, q)))
+				return rc;
 		}
 		ctx->userauth = misc_strdup(FL, uarg);
 		ctx->username = misc_strdup(FL, p);
@@ -1542,8 +1941,8 @@ static int parse_magic_user(CONTEXT *ctx, char *uarg,
 #endif
 				return -1;
 			}
-			if(-1 == parse_magic_dest(ctx, p))
-				return -1;
+			if(0 != (rc = parse_magic_dest(ctx, p)))
+				return rc;
 			ctx->username = misc_strdup(FL, uarg);
 			ctx->userauth = misc_strdup(FL, q);
 		}
@@ -1563,8 +1962,8 @@ static int parse_magic_user(CONTEXT *ctx, char *uarg,
 #endif
 				return -1;
 			}
-			if(-1 == parse_magic_dest(ctx, q))
-				return -1;
+			if(0 != (rc = parse_magic_dest(ctx, q)))
+				return rc;
 		}
 		ctx->username = misc_strdup(FL, uarg);
 		ctx->userauth = misc_strdup(FL, p);
@@ -1587,7 +1986,13 @@ static int parse_magic_dest(CONTEXT *ctx, char *dest)
 		} else {
 			ctx->magic_port = IPPORT_FTP;
 		}
-		ctx->magic_addr = socket_str2addr(dest, INADDR_ANY);
+		if(RS_WAIT == resolv_addr(dest, &ctx->magic_addr)) {
+			misc_strncpy(ctx->rs_name, dest,
+			             sizeof(ctx->rs_name));
+			return 2;
+		}
+		if(INADDR_NONE == ctx->magic_addr)
+			ctx->magic_addr = INADDR_ANY;
 #if defined(COMPILE_DEBUG)
 		debug(2, "parse magic host='%.256s' port='%d'",
 		         socket_addr2str(ctx->magic_addr),
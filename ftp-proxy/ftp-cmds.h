@@ -39,22 +39,22 @@ typedef struct {
 	void (*func)(CONTEXT *, char *);
 				/* ..and corresponding function	*/
 
-#if defined(HAVE_REGEX)
-	void *regex;		/* Regular expr. for argument	*/
-#endif
-
-	int legal;		/* 1=command allowed, 0=nope	*/
-	int len;		/* Length of name (for speed)	*/
+	u_int32_t key;		/* Name packed (see cmds_key)	*/
 } CMD;
 
 
 /* ------------------------------------------------------------ */
 
-CMD *cmds_get_list(void);
+CMD  *cmds_find(char *name);
+int   cmds_allowed(CONTEXT *ctx, CMD *cmd);
 
-void cmds_set_allow(char *allow);
+void cmds_set_allow(CONTEXT *ctx, char *allow);
+void cmds_prep_allow(char *allow);
+void cmds_free_perm(CONTEXT *ctx);
+void cmds_login(CONTEXT *ctx, char *pwd);
 
 #if defined(HAVE_REGEX)
+void *cmds_get_regex(CONTEXT *ctx, CMD *cmd);
 char *cmds_reg_comp(void **ppre, char *ptr);
 char *cmds_reg_exec(void *regex, char *str);
 #endif
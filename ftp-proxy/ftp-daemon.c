@@ -86,6 +86,16 @@ static char rcsid[] = "$Id: ftp-daemon.c,v 1.4 2002/01/14 19:31:14 mt Exp $";
 #   define _PATH_DEVNULL   "/dev/null"
 #endif
 
+#if defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#endif
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+#  define HAVE_PREFORK	1
+#endif
+
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -94,29 +104,132 @@ static char rcsid[] = "$Id: ftp-daemon.c,v 1.4 2002/01/14 19:31:14 mt Exp $";
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-resolv.h"
 #include "com-socket.h"
 #include "com-syslog.h"
 #include "ftp-client.h"
 #include "ftp-daemon.h"
+#include "ftp-ldap.h"
 #include "ftp-main.h"
 
+/*
+** The source table is shared where misc_spin can lock
+** it; else each worker counts its own clients
+*/
+#if defined(HAVE_PREFORK) && defined(HAVE_SPIN)
+#  define HAVE_SHARED	1
+#endif
+
 /* ------------------------------------------------------------ */
 
-#define MAX_CLIENTS	512	/* Max. concurrent user limit	*/
+#define MAX_CLIENTS	65536	/* Max. concurrent user limit	*/
+#define DFL_CLIENTS	512	/* Default MaxClients		*/
+#define CL_CHUNK	256	/* Child table growth unit	*/
+#define CL_CHUNKS	(MAX_CLIENTS / CL_CHUNK)
 #define LISTEN_WAIT	30	/* Wait up to 30sec for listen	*/
 
 #define FORK_INTERVAL	60	/* Interval for ForkLimit	*/
 #define MAX_FORKS	40	/* Default fork-resource-limit	*/
 
+#define PF_SESSIONS	100	/* Default PreforkMaxSessions	*/
+#define PF_WAIT		60	/* Max. wait of a mux worker	*/
+
+#define SRC_ENTRIES	131072	/* Default SourceTableSize	*/
+#define SRC_PROBE	8	/* Entries probed per lookup	*/
+
+#define PF_IDLE		0	/* Worker waits in accept	*/
+#define PF_BUSY		1	/* Worker serves a client	*/
+#define PF_GONE		2	/* Worker was told to exit	*/
+
 typedef struct {
-	pid_t pid;		/* Proc-id of child (0=empty)	*/
-	char  peer[PEER_LEN];	/* Dotted decimal IP address	*/
+	pid_t  pid;		/* Proc-id of child (0=empty)	*/
+	int    link;		/* Hash chain / free list link	*/
+	time_t start;		/* Start time of the child	*/
+	u_int32_t skey;		/* Source admitted (0=none)	*/
+	char   peer[PEER_LEN];	/* Dotted decimal IP address	*/
 } CLIENT;
 
+/*
+** Per-child data updated by the child itself; it
+** lives in shared chunks that never move, so the
+** child's pointer stays valid while the table grows
+*/
+typedef struct {
+	char   stat;		/* PF_... state of a worker	*/
+	char   shard;		/* Listener shard it accepts on	*/
+	u_long tally;		/* Clients it accepted so far	*/
+	double bytes;		/* Data bytes it transferred	*/
+	u_int32_t skey;		/* Source of its session	*/
+} SLOT;
+
+#define CL_SLOT(i)	(&cl_slot[(i) / CL_CHUNK][(i) % CL_CHUNK])
+
+/*
+** Per-source admission state: a token bucket for
+** the connection rate and the running sessions.
+** An entry with stamp 0 is empty.
+*/
+typedef struct {
+	u_int32_t addr;		/* Source (network) address	*/
+	u_int32_t stamp;	/* Time of the last refill	*/
+	float     tokens;	/* Connections left in bucket	*/
+	int       conns;	/* Sessions running		*/
+} SOURCE;
+
+/*
+** The source table is shared with the workers
+** and guarded by a spin lock
+*/
+typedef struct {
+	volatile int lock;	/* Spin lock of the table	*/
+	u_int32_t mask;		/* Number of entries - 1	*/
+	u_long    full;		/* Lookups without free entry	*/
+	SOURCE    ent[1];	/* The entries (mask + 1)	*/
+} SRCTAB;
+
+/*
+** Scoreboard shared between the daemon and its
+** pre-forked workers
+*/
+typedef struct {
+	int    gen;			/* Bumped on config reload	*/
+	time_t slice;			/* ForkLimit time slice		*/
+	int    count;			/* Accepts in this slice	*/
+} PFBOARD;
+
 /* ------------------------------------------------------------ */
 
 static RETSIGTYPE daemon_signal(int signo);
 
+static int  daemon_slots  (void);
+static int  daemon_limit  (char *peer);
+static void daemon_astat  (void);
+
+static void daemon_block  (int how);
+static int  daemon_grow   (void);
+static int  daemon_get    (void);
+static void daemon_put    (int idx, pid_t pid, char *peer);
+static void daemon_drop   (int idx);
+static void daemon_reap   (void);
+
+static void daemon_reject (int sock, char *peer, char *why, int lim);
+static void daemon_sinit  (void);
+static void daemon_slock  (int on);
+static SOURCE *daemon_sfind(u_int32_t key, int make);
+static int  daemon_admit  (int sock, char *peer, u_int32_t *key);
+static void daemon_leave  (u_int32_t key);
+#if defined(HAVE_PREFORK)
+static RETSIGTYPE worker_signal(int signo);
+static void worker_catch  (int signo);
+
+static int  daemon_spawn  (int shard);
+static void daemon_retire (int idx);
+static void daemon_worker (void);
+static void daemon_mux    (int gen, int max);
+static void daemon_take   (int sock);
+static void daemon_mdone  (int idx);
+#endif
+
 static void daemon_cleanup(void);
 
 
@@ -127,7 +240,34 @@ static pid_t  daemon_pid = 0;   /* Daemon PID for cleanups, ... */
 static time_t last_slice = 0;	/* Last time slice with clients	*/
 static int    last_count = 0;	/* Clients in last_slice	*/
 
-static CLIENT clients[MAX_CLIENTS];
+static CLIENT *clients = NULL;	/* Child table, grows on demand	*/
+static int    *cl_hash = NULL;	/* Hash buckets: pid -> index	*/
+static int     cl_size = 0;	/* Entries in the child table	*/
+static int     cl_used = 0;	/* Entries not on the free list	*/
+static int     cl_free = -1;	/* Free list of entries		*/
+static volatile int cl_dead = -1; /* Reaped, not yet recycled	*/
+static double  cl_bytes = 0.0;	/* Data bytes of gone children	*/
+
+static volatile SLOT *cl_slot[CL_CHUNKS]; /* Per-child data	*/
+static volatile SLOT *cl_self = NULL;	  /* Child: own entry	*/
+
+static SRCTAB *srctab = NULL;	/* Per-source admission table	*/
+
+static volatile PFBOARD *board = NULL;	/* Prefork scoreboard	*/
+static volatile int wterm = 0;	/* Worker termination signal	*/
+
+static int       wsess = 1;	/* Sessions per worker process	*/
+static CONTEXT **wctx  = NULL;	/* Sessions of a mux worker	*/
+static u_int32_t *wkey = NULL;	/* Admitted sources of wctx	*/
+static int       wcnt  = 0;	/* Number of sessions in wctx	*/
+static int       wtot  = 0;	/* Sessions accepted in total	*/
+static int       wacpt = 0;	/* Mux worker serves listener	*/
+static int       wmax  = 0;	/* Mux worker's session limit	*/
+
+static int    lshards = 1;	/* Number of listener shards	*/
+static u_long lacc[MAX_SHARDS];	/* Accepts of gone workers	*/
+static u_long lprev[MAX_SHARDS];/* Accepts at the last report	*/
+static time_t lstamp = 0;	/* Time of the last report	*/
 
 
 /* ------------------------------------------------------------ **
@@ -146,8 +286,7 @@ static RETSIGTYPE daemon_signal(int signo)
 {
 	int tmperr = errno;		/* Save errno for later	*/
 	pid_t pid;
-	int i, status;
-	CLIENT *clp;
+	int i, *ip, status;
 
 #if defined(HAVE_WAITPID)
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
@@ -157,17 +296,25 @@ static RETSIGTYPE daemon_signal(int signo)
 	if ((pid = wait(&status)) > 0)
 #endif
 	{
-		for (i = 0, clp = clients; i < MAX_CLIENTS; i++, clp++) {
-			if (clp->pid == pid) {
-				clp->pid = (pid_t) 0;
+		if (ldap_pool_gone(pid) || syslog_gone(pid) || cl_size == 0)
+			continue;
+
+		/*
+		** Unhash the child; daemon_reap recycles it
+		*/
+		ip = &cl_hash[(u_int) pid & (cl_size - 1)];
+		while ((i = *ip) != -1 && clients[i].pid != pid)
+			ip = &clients[i].link;
+		if (i == -1)
+			continue;
+		*ip = clients[i].link;
+		clients[i].pid  = (pid_t) 0;
+		clients[i].link = cl_dead;
+		cl_dead = i;
 #if defined(COMPILE_DEBUG)
-				debug(1, "client pid=%d (%s) gone",
-						(int) pid, clp->peer);
+		debug(1, "client pid=%d (%s) gone",
+				(int) pid, clients[i].peer);
 #endif
-				memset(clp->peer, 0, PEER_LEN);
-				break;
-			}
-		}
 	}
 
 	signal(signo, daemon_signal);
@@ -236,14 +383,6 @@ void daemon_init(int detach)
 	char     *p;
 	int       i;
 
-	/*
-	** Cleanup the client array
-	*/
-	for (i = 0; i < MAX_CLIENTS; i++) {
-		clients[i].pid = (pid_t) 0;
-		memset(clients[i].peer, 0, PEER_LEN);
-	}
-
 	/*
 	** 1. STEP: Fork, if requested
 	*/
@@ -306,6 +445,21 @@ void daemon_init(int detach)
 		initflag = 1;
 	}
 
+	/*
+	** Pre-forked workers may accept from several
+	** SO_REUSEPORT listeners, one shard each
+	*/
+	if (config_int(NULL, "PreforkMinSpare", 0) > 0) {
+		if ((lshards = config_int(NULL, "ListenShards", 1)) < 1)
+			lshards = 1;
+		else if (lshards > MAX_SHARDS)
+			lshards = MAX_SHARDS;
+#if !defined(HAVE_PREFORK)
+		lshards = 1;
+#endif
+		socket_lshards(lshards);
+	}
+
 	/*
 	** Open a listening socket
 	*/
@@ -321,6 +475,54 @@ void daemon_init(int detach)
 		exit(EXIT_FAILURE);
 	}
 
+	/*
+	** Leave the accepts to a pool of pre-forked
+	** workers if requested; see daemon_check
+	*/
+	if (config_int(NULL, "PreforkMinSpare", 0) > 0) {
+#if defined(HAVE_PREFORK)
+		board = (volatile PFBOARD *) mmap(NULL, sizeof(PFBOARD),
+		                         PROT_READ | PROT_WRITE,
+		                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (board == (volatile PFBOARD *) MAP_FAILED) {
+			syslog_error("can't map prefork scoreboard");
+			exit(EXIT_FAILURE);
+		}
+		memset((void *) board, 0, sizeof(PFBOARD));
+		socket_lserve(NULL);
+
+		/*
+		** Each worker may multiplex several sessions
+		*/
+		if ((wsess = config_int(NULL, "WorkerSessions", 1)) < 1)
+			wsess = 1;
+
+		/*
+		** Workers taking a client wake us up
+		*/
+		signal(SIGUSR2, daemon_signal);
+#else
+		syslog_write(T_WRN, "prefork not supported - "
+		                    "forking per connection");
+#endif
+	}
+
+	/*
+	** Per-source admission, shared with the workers
+	*/
+	daemon_sinit();
+
+	/*
+	** The resolver cache, shared with the children;
+	** resolv.conf is read while it is still in reach
+	*/
+	resolv_init();
+
+	/*
+	** The LDAP answer cache, shared with the children
+	*/
+	ldap_cache_init();
+
 	/*
 	** Install the signal handler
 	*/
@@ -403,6 +605,11 @@ void daemon_init(int detach)
 	             "daemon runs in '%.1024s' with uid=%d gid=%d",
                      config_str(NULL, "ServerRoot", "/"),
 	             (int) getuid(), (int) getgid());
+
+	/*
+	** 3. STEP: Let a logger process do the writes
+	*/
+	syslog_spool(config_int(NULL, "LogBuffer", 1024));
 }
 
 
@@ -420,94 +627,60 @@ void daemon_init(int detach)
 
 void daemon_accept(int sock)
 {
-	time_t slice;
+	u_int32_t key;
 	int cnt, i;
-	CLIENT *clp;
-	char str[1024], *p, *q, *peer;
-	FILE *fp;
+	pid_t pid;
+	char *peer;
 
 	/*
 	** Get the peer address for diagnostic output
 	*/
 	peer = socket_addr2str(socket_sck2addr(sock, REM_END, NULL));
+	lacc[0]++;
 
 	/*
 	** Check whether to limit the number of incoming
-	** client connections per minute. Use half values
-	** each to avoid "neighborhood effects". This is
-	** effectively a Denial of Service prevention.
-	*/
-	if ((cnt = config_int(NULL, "ForkLimit", MAX_FORKS)) > 0) {
-		slice = time(NULL) / (FORK_INTERVAL / 2);
-		if (slice != last_slice) {
-			last_slice = slice;
-			last_count = 0;
-		}
-		if (++last_count >= (cnt / 2)) {
-			close(sock);
-			syslog_write(U_ERR,
-				"reject: '%s' (ForkLimit %d)",
-				peer, cnt);
-			return;
-		}
+	** client connections per minute.
+	*/
+	if (daemon_limit(peer) != 0) {
+		close(sock);
+		return;
 	}
 
 	/*
-	** Check if we are fully loaded already
+	** Check if we are fully loaded already; the
+	** SIGCHLD handler stays away from the table
+	** until the new child is entered
 	*/
-	if ((cnt = config_int(NULL, "MaxClients", MAX_CLIENTS)) < 1)
-		cnt = 1;
-	else if (cnt > MAX_CLIENTS)
-		cnt = MAX_CLIENTS;
-	for (i = 0, clp = clients; i < cnt; i++, clp++) {
-		/*
-		** santoniu@libertysurf.fr:
-		** Verifying if the child is alive or not.
-		*/
-		if ((clp->pid != (pid_t) 0) && (kill(clp->pid, 0)!=0) ) {
-			syslog_write(T_WRN,
-				"[ %s ] child with PID %d went away (removing it)",
-			clp->peer, (pid_t)clp->pid);
-			clp->pid = 0;
-			break;
-		}
-		if (clp->pid == (pid_t) 0)
-			break;
+	daemon_reap();
+	cnt = daemon_slots();
+	if (cl_used >= cnt) {
+		daemon_reject(sock, peer, "MaxClients", cnt);
+		return;
 	}
-	if (i >= cnt) {
-		p = config_str(NULL, "MaxClientsMessage", NULL);
-		if (p != NULL && (fp = fopen(p, "r")) != NULL) {
-			while (fgets(str, sizeof(str) - 4, fp) != NULL) {
-				p = socket_msgline(str);
-				if ((q = strchr(p, '\n')) != NULL)
-					strcpy(q, "\r\n");
-				else
-					strcat(p, "\r\n");
-				send(sock, "421-", 4, 0);
-				send(sock, p, strlen(p), 0);
-			}
-			fclose(fp);
-		}
-		if ((p = config_str(NULL,
-				"MaxClientsString", NULL)) != NULL)
-			p = socket_msgline(p);
-		else
-			p = "Service not available";
-		send(sock, "421 ", 4, 0);
-		send(sock, p, strlen(p), 0);
-		send(sock, ".\r\n", 3, 0);
-		close(sock);
-		syslog_write(U_ERR,
-			"reject: '%s' (MaxClients %d)", peer, cnt);
+
+	/*
+	** Check the limits of the client's source
+	*/
+	if (daemon_admit(sock, peer, &key) != 0)
+		return;
+
+	daemon_block(SIG_BLOCK);
+	if ((i = daemon_get()) < 0) {
+		daemon_block(SIG_UNBLOCK);
+		daemon_leave(key);
+		daemon_reject(sock, peer, "MaxClients", cnt);
 		return;
 	}
 
 	/*
-	** Fork a new client process (clp is still valid)
+	** Fork a new client process (entry i is reserved)
 	*/
-	switch (clp->pid = fork()) {
+	switch (pid = fork()) {
 		case -1:
-			clp->pid = (pid_t) 0;
+			daemon_drop(i);
+			daemon_block(SIG_UNBLOCK);
+			daemon_leave(key);
 			if (errno != EAGAIN) {
 				syslog_error("can't fork client");
 			}
@@ -516,14 +689,18 @@ void daemon_accept(int sock)
 			return;
 		case 0:
 			/******** child ********/
+			cl_self = CL_SLOT(i);
+			daemon_block(SIG_UNBLOCK);
 			break;
 		default:
 			/******** parent ********/
+			daemon_put(i, pid, peer);
+			clients[i].skey = key;
+			daemon_block(SIG_UNBLOCK);
 			close(sock);
-			strcpy(clp->peer, peer);
 #if defined(COMPILE_DEBUG)
 			debug(1, "client pid=%d (%s) added",
-					(int) clp->pid, clp->peer);
+					(int) pid, peer);
 #endif
 			return;
 	}
@@ -559,23 +736,1218 @@ void daemon_accept(int sock)
 
 /* ------------------------------------------------------------ **
 **
-**	Function......:	daemon_cleanup
+**	Function......:	daemon_slots
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Number of usable client slots
+**
+**	Purpose.......: Get the MaxClients limit.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_slots(void)
+{
+	int cnt;
+
+	if ((cnt = config_int(NULL, "MaxClients", DFL_CLIENTS)) < 1)
+		cnt = 1;
+	else if (cnt > MAX_CLIENTS)
+		cnt = MAX_CLIENTS;
+	return cnt;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_limit
+**
+**	Parameters....:	peer		Client address for logs
+**
+**	Return........:	0=accept, -1=reject the client
+**
+**	Purpose.......: Check whether to limit the number of
+**			incoming client connections per minute.
+**			Use half values each to avoid "neighbor-
+**			hood effects". This is effectively a
+**			Denial of Service prevention.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_limit(char *peer)
+{
+	volatile time_t *lsp = &last_slice;
+	volatile int    *lcp = &last_count;
+	time_t slice;
+	int cnt;
+
+	if ((cnt = config_int(NULL, "ForkLimit", MAX_FORKS)) <= 0)
+		return 0;
+
+	/*
+	** The workers share their counter on the
+	** scoreboard; a lost update is harmless
+	*/
+	if (board != NULL) {
+		lsp = &(board->slice);
+		lcp = &(board->count);
+	}
+
+	slice = time(NULL) / (FORK_INTERVAL / 2);
+	if (slice != *lsp) {
+		*lsp = slice;
+		*lcp = 0;
+	}
+	if (++(*lcp) >= (cnt / 2)) {
+		syslog_write(U_ERR,
+			"reject: '%s' (ForkLimit %d)", peer, cnt);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_reject
+**
+**	Parameters....:	sock		Accepted socket descriptor
+**			peer		Client address for logs
+**			why		Name of the limit hit
+**			lim		Value of the limit
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Turn a client away with the 421 reply
+**			built from MaxClientsMessage and
+**			MaxClientsString, then close it.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_reject(int sock, char *peer, char *why, int lim)
+{
+	char str[1024], *p, *q;
+	FILE *fp;
+
+	p = config_str(NULL, "MaxClientsMessage", NULL);
+	if (p != NULL && (fp = fopen(p, "r")) != NULL) {
+		while (fgets(str, sizeof(str) - 4, fp) != NULL) {
+			p = socket_msgline(str);
+			if ((q = strchr(p, '\n')) != NULL)
+				strcpy(q, "\r\n");
+			else
+				strcat(p, "\r\n");
+			send(sock, "421-", 4, 0);
+			send(sock, p, strlen(p), 0);
+		}
+		fclose(fp);
+	}
+	if ((p = config_str(NULL,
+			"MaxClientsString", NULL)) != NULL)
+		p = socket_msgline(p);
+	else
+		p = "Service not available";
+	send(sock, "421 ", 4, 0);
+	send(sock, p, strlen(p), 0);
+	send(sock, ".\r\n", 3, 0);
+	close(sock);
+	syslog_write(U_ERR, "reject: '%s' (%s %d)", peer, why, lim);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_sinit
 **
 **	Parameters....:	(none)
 **
 **	Return........:	(none)
 **
-**	Purpose.......: Clean up the daemon related data.
+**	Purpose.......: Create the per-source admission table,
+**			if SourceRate or SourceMaxClients is set.
+**			With pre-forked workers it is shared.
 **
 ** ------------------------------------------------------------ */
 
-static void daemon_cleanup(void)
+static void daemon_sinit(void)
+{
+	size_t len;
+	int cnt;
+
+	if (srctab != NULL)
+		return;
+	if (config_int(NULL, "SourceRate", 0) <= 0 &&
+	    config_int(NULL, "SourceMaxClients", 0) <= 0)
+		return;
+
+	/*
+	** Round the size up to a power of two
+	*/
+	cnt = config_int(NULL, "SourceTableSize", SRC_ENTRIES);
+	if (cnt < 1024)
+		cnt = 1024;
+	else if (cnt > (1 << 24))
+		cnt = (1 << 24);
+	for (len = 1024; len < (size_t) cnt; len <<= 1)
+		;
+	cnt = (int) len;
+	len = sizeof(SRCTAB) + (cnt - 1) * sizeof(SOURCE);
+
+#if defined(HAVE_SHARED)
+	srctab = (SRCTAB *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (srctab == (SRCTAB *) MAP_FAILED) {
+		syslog_error("can't map source table");
+		exit(EXIT_FAILURE);
+	}
+	memset((void *) srctab, 0, len);
+#else
+	srctab = (SRCTAB *) misc_alloc(FL, len);
+#endif
+	srctab->mask = (u_int32_t) (cnt - 1);
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "source table: %d entries, %lu bytes",
+			cnt, (u_long) len);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_slock
+**
+**	Parameters....:	on		1=lock, 0=unlock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Lock or unlock the source table against
+**			the other workers.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_slock(int on)
+{
+#if defined(HAVE_SHARED)
+	misc_spin(&srctab->lock, on);
+#else
+	on = on;		/* A private table needs none	*/
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_sfind
+**
+**	Parameters....:	key		Source (network) address
+**			make		Create a missing entry
+**
+**	Return........:	Entry of the source or NULL
+**
+**	Purpose.......: Find or create the entry of a source;
+**			the table must be locked. Only a few
+**			entries are probed; a new source takes
+**			an empty one or the one idle longest.
+**
+** ------------------------------------------------------------ */
+
+static SOURCE *daemon_sfind(u_int32_t key, int make)
 {
+	SOURCE *ent, *vic = NULL;
+	u_int32_t idx;
 	int i;
-	CLIENT *clp;
+
+	idx = (key * 2654435761U) ^ (key >> 15);
+	for (i = 0; i < SRC_PROBE; i++, idx++) {
+		ent = &srctab->ent[idx & srctab->mask];
+		if (ent->stamp == 0) {
+			if (vic == NULL || vic->stamp != 0)
+				vic = ent;
+			continue;
+		}
+		if (ent->addr == key)
+			return ent;
+		if (ent->conns == 0 && (vic == NULL ||
+		    (vic->stamp != 0 && ent->stamp < vic->stamp)))
+			vic = ent;
+	}
+
+	if (make == 0)
+		return NULL;
+	if (vic == NULL) {
+		srctab->full++;
+		return NULL;
+	}
+	memset(vic, 0, sizeof(SOURCE));
+	vic->addr   = key;
+	vic->tokens = -1.0;		/* A fresh bucket	*/
+	return vic;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_admit
+**
+**	Parameters....:	sock		Accepted socket descriptor
+**			peer		Client address for logs
+**			key		Pointer for the source
+**					to pass to daemon_leave
+**
+**	Return........:	0=accept, -1=rejected and closed
+**
+**	Purpose.......: Apply the per-source limits: SourceRate
+**			connections per minute with a burst of
+**			SourceBurst, and SourceMaxClients at once.
+**			A source is an address or, with
+**			SourcePrefix below 32, a network.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_admit(int sock, char *peer, u_int32_t *key)
+{
+	int rate, burst, max, bits;
+	u_int32_t now;
+	SOURCE *ent;
+	char *why = NULL;
+	int lim = 0;
+
+	*key = 0;
+	if (srctab == NULL)
+		return 0;
+
+	rate  = config_int(NULL, "SourceRate", 0);
+	burst = config_int(NULL, "SourceBurst", rate);
+	max   = config_int(NULL, "SourceMaxClients", 0);
+	bits  = config_int(NULL, "SourcePrefix", 32);
+	if (rate <= 0 && max <= 0)
+		return 0;
+	if (burst < 1)
+		burst = 1;
+	if (bits < 1 || bits > 32)
+		bits = 32;
+
+	*key = socket_sck2addr(sock, REM_END, NULL);
+	if (bits < 32)
+		*key &= ~((u_int32_t) 0xffffffff >> bits);
+	if (*key == 0)
+		*key = 1;		/* 0 means "none"	*/
+	now = (u_int32_t) time(NULL);
+
+	daemon_slock(1);
+	if ((ent = daemon_sfind(*key, 1)) == NULL) {
+		/*
+		** No room to track it - let it pass
+		*/
+		daemon_slock(0);
+		*key = 0;
+		return 0;
+	}
+
+	/*
+	** Refill the bucket for the time passed
+	*/
+	if (rate > 0) {
+		if (ent->tokens < 0.0 || now < ent->stamp)
+			ent->tokens = (float) burst;
+		else
+			ent->tokens += (float) (now - ent->stamp) *
+			               (float) rate / 60.0;
+		if (ent->tokens > (float) burst)
+			ent->tokens = (float) burst;
+	}
+	ent->stamp = now;
+
+	if (rate > 0 && ent->tokens < 1.0) {
+		why = "SourceRate";
+		lim = rate;
+	} else
+	if (max > 0 && ent->conns >= max) {
+		why = "SourceMaxClients";
+		lim = max;
+	} else {
+		if (rate > 0)
+			ent->tokens -= 1.0;
+		ent->conns++;
+	}
+	daemon_slock(0);
+
+	if (why != NULL) {
+		*key = 0;
+		daemon_reject(sock, peer, why, lim);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_leave
+**
+**	Parameters....:	key		Source from daemon_admit
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Count the end of a session of a source.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_leave(u_int32_t key)
+{
+	SOURCE *ent;
+
+	if (key == 0 || srctab == NULL)
+		return;
+
+	daemon_slock(1);
+	if ((ent = daemon_sfind(key, 0)) != NULL && ent->conns > 0)
+		ent->conns--;
+	daemon_slock(0);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_check
+**
+**	Parameters....:	renew		Replace the workers, e.g.
+**					after a config reload
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Keep the number of idle pre-forked
+**			workers between PreforkMinSpare and
+**			PreforkMaxSpare. Called from the main
+**			loop; a no-op if prefork is disabled.
+**
+** ------------------------------------------------------------ */
+
+void daemon_check(int renew)
+{
+#if defined(HAVE_PREFORK)
+	int sidle[MAX_SHARDS];
+	int cnt, min, max, idle, i, j, k;
+	CLIENT *clp;
+#endif
+
+	daemon_reap();
+	daemon_astat();
+	syslog_check();
+	ldap_pool_check(renew);
+	if (renew)
+		ldap_cache_flush();
+
+#if defined(HAVE_PREFORK)
+	if (board == NULL)
+		return;
+
+	/*
+	** Idle workers are told to exit now, busy
+	** ones notice the new generation when done
+	*/
+	if (renew) {
+		board->gen++;
+		for (i = 0, clp = clients; i < cl_size; i++, clp++) {
+			if (clp->pid != (pid_t) 0 &&
+			    CL_SLOT(i)->stat == PF_IDLE)
+				daemon_retire(i);
+		}
+	}
+
+	cnt = daemon_slots();
+	if ((min = config_int(NULL, "PreforkMinSpare", 0)) < 1)
+		min = 1;
+	else if (min > cnt)
+		min = cnt;
+	if ((max = config_int(NULL, "PreforkMaxSpare", 2 * min)) < min)
+		max = min;
+
+	/*
+	** Count the idle workers and retire the ones
+	** exceeding PreforkMaxSpare; each listener
+	** shard keeps at least one of them
+	*/
+	memset(sidle, 0, sizeof(sidle));
+	for (i = 0, idle = 0, clp = clients; i < cl_size; i++, clp++) {
+		if (clp->pid == (pid_t) 0 || CL_SLOT(i)->stat != PF_IDLE)
+			continue;
+		k = CL_SLOT(i)->shard;
+		if (idle >= max && sidle[k] > 0) {
+			daemon_retire(i);
+			continue;
+		}
+		idle++;
+		sidle[k]++;
+	}
+
+	/*
+	** Spawn workers up to PreforkMinSpare and until
+	** every shard has one, filling the emptiest first
+	*/
+	while (cl_used < cnt) {
+		for (j = 1, k = 0; j < lshards; j++) {
+			if (sidle[j] < sidle[k])
+				k = j;
+		}
+		if (idle >= min && sidle[k] > 0)
+			break;
+		if (daemon_spawn(k) != 0)
+			break;
+		idle++;
+		sidle[k]++;
+	}
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_astat
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log the accept rate of each listener
+**			shard every AcceptStatInterval seconds.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_astat(void)
+{
+	u_long sum[MAX_SHARDS];
+	time_t now;
+	int ival, i;
+
+	if ((ival = config_int(NULL, "AcceptStatInterval", 0)) <= 0)
+		return;
+
+	now = time(NULL);
+	if (lstamp == 0 || now < lstamp) {
+		lstamp = now;
+		return;
+	}
+	if (now - lstamp < ival)
+		return;
+
+	/*
+	** The workers count their accepts on the
+	** scoreboard; gone ones were folded in lacc
+	*/
+	memcpy(sum, lacc, sizeof(sum));
+	if (board != NULL) {
+		for (i = 0; i < cl_size; i++)
+			sum[(int) CL_SLOT(i)->shard] += CL_SLOT(i)->tally;
+	}
+	for (i = 0; i < lshards; i++) {
+		syslog_write(T_INF, "listener %d: %lu accepts, %.2f/s",
+		             i, sum[i], (double) (sum[i] - lprev[i]) /
+		                        (double) (now - lstamp));
+		lprev[i] = sum[i];
+	}
+	syslog_write(T_INF, "children: %d running, %.0f bytes "
+	             "transferred by gone ones", cl_used, cl_bytes);
+	resolv_stats();
+	ldap_cache_stats();
+	syslog_stats();
+	lstamp = now;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_count
+**
+**	Parameters....:	bytes		Data bytes of a session
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Add the data bytes of a finished session
+**			to the child's entry in the child table.
+**			A no-op if not a child of the daemon.
+**
+** ------------------------------------------------------------ */
+
+void daemon_count(double bytes)
+{
+	if (cl_self != NULL)
+		cl_self->bytes += bytes;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_block
+**
+**	Parameters....:	how		SIG_BLOCK or SIG_UNBLOCK
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Keep the SIGCHLD handler off the child
+**			table while it is changed.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_block(int how)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(how, &set, NULL);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_grow
+**
+**	Parameters....:	(none)
+**
+**	Return........:	0=success, -1=at MAX_CLIENTS
+**
+**	Purpose.......: Double the child table and its hash;
+**			the new entries go to the free list.
+**			SIGCHLD must be blocked by the caller.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_grow(void)
+{
+	CLIENT *tab;
+	int *hash, size, i, k;
+
+	size = (cl_size > 0) ? 2 * cl_size : CL_CHUNK;
+	if (size > MAX_CLIENTS)
+		return -1;
+
+	/*
+	** Add the per-child data first; the children
+	** update it, so it is shared where possible
+	*/
+	for (k = cl_size / CL_CHUNK; k < size / CL_CHUNK; k++) {
+		if (cl_slot[k] != NULL)
+			continue;
+#if defined(HAVE_PREFORK)
+		cl_slot[k] = (volatile SLOT *) mmap(NULL,
+		                         CL_CHUNK * sizeof(SLOT),
+		                         PROT_READ | PROT_WRITE,
+		                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (cl_slot[k] == (volatile SLOT *) MAP_FAILED) {
+			cl_slot[k] = NULL;
+			syslog_error("can't map child table");
+			return -1;
+		}
+		memset((void *) cl_slot[k], 0, CL_CHUNK * sizeof(SLOT));
+#else
+		cl_slot[k] = (volatile SLOT *) misc_alloc(FL,
+		                         CL_CHUNK * sizeof(SLOT));
+#endif
+	}
+
+	tab  = (CLIENT *) misc_alloc(FL, size * sizeof(CLIENT));
+	hash = (int *) misc_alloc(FL, size * sizeof(int));
+	for (i = 0; i < size; i++)
+		hash[i] = -1;
+
+	/*
+	** Rehash the children; the links of the free
+	** and dead entries stay as they are
+	*/
+	for (i = 0; i < cl_size; i++) {
+		tab[i] = clients[i];
+		if (tab[i].pid == (pid_t) 0)
+			continue;
+		k = (u_int) tab[i].pid & (size - 1);
+		tab[i].link = hash[k];
+		hash[k] = i;
+	}
+	for (i = size - 1; i >= cl_size; i--) {
+		tab[i].link = cl_free;
+		cl_free = i;
+	}
+
+	if (clients != NULL) {
+		misc_free(FL, clients);
+		misc_free(FL, cl_hash);
+	}
+	clients = tab;
+	cl_hash = hash;
+	cl_size = size;
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "child table grown to %d entries", size);
+#endif
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_get
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Index of a free entry or -1
+**
+**	Purpose.......: Reserve an entry of the child table for
+**			a fork. SIGCHLD must be blocked by the
+**			caller until daemon_put or daemon_drop.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_get(void)
+{
+	int idx;
+
+	if (cl_free == -1 && daemon_grow() != 0)
+		return -1;
+
+	idx = cl_free;
+	cl_free = clients[idx].link;
+	clients[idx].link = -1;
+	cl_used++;
+
+	memset((void *) CL_SLOT(idx), 0, sizeof(SLOT));
+	return idx;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_put
+**
+**	Parameters....:	idx		Entry from daemon_get
+**			pid		Proc-id of the new child
+**			peer		Client address or a tag
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Enter a new child into the pid hash.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_put(int idx, pid_t pid, char *peer)
+{
+	CLIENT *clp = &clients[idx];
+	int k;
+
+	clp->pid   = pid;
+	clp->start = time(NULL);
+	clp->skey  = 0;
+	misc_strncpy(clp->peer, peer, sizeof(clp->peer));
+
+	k = (u_int) pid & (cl_size - 1);
+	clp->link  = cl_hash[k];
+	cl_hash[k] = idx;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_drop
+**
+**	Parameters....:	idx		Entry from daemon_get
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Return an unused entry (fork failed).
+**
+** ------------------------------------------------------------ */
+
+static void daemon_drop(int idx)
+{
+	clients[idx].link = cl_free;
+	cl_free = idx;
+	cl_used--;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_reap
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Recycle the entries of the children the
+**			SIGCHLD handler reaped, keeping their
+**			statistics.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_reap(void)
+{
+	volatile SLOT *slp;
+	CLIENT *clp;
+	int idx;
+
+	if (cl_dead == -1)
+		return;
+
+	daemon_block(SIG_BLOCK);
+	while ((idx = cl_dead) != -1) {
+		clp = &clients[idx];
+		slp = CL_SLOT(idx);
+		cl_dead = clp->link;
+
+		syslog_write(T_DBG, "child %s gone after %ld secs, "
+		             "%lu accepts, %.0f bytes", clp->peer,
+		             (long) (time(NULL) - clp->start),
+		             slp->tally, slp->bytes);
+		lacc[(int) slp->shard] += slp->tally;
+		cl_bytes += slp->bytes;
+
+		/*
+		** A child may end without leaving its source
+		*/
+		daemon_leave(clp->skey);
+		daemon_leave(slp->skey);
+		clp->skey = 0;
+		memset((void *) slp, 0, sizeof(SLOT));
+		memset(clp->peer, 0, sizeof(clp->peer));
+
+		clp->link = cl_free;
+		cl_free = idx;
+		cl_used--;
+	}
+	daemon_block(SIG_UNBLOCK);
+}
+
+
+#if defined(HAVE_PREFORK)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	worker_signal
+**
+**	Parameters....:	signo		Signal to be handled
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Handler for termination signals in an
+**			idle worker; SIGUSR2 just interrupts the
+**			wait to check the scoreboard.
+**
+** ------------------------------------------------------------ */
+
+static RETSIGTYPE worker_signal(int signo)
+{
+	if (signo != SIGUSR2)
+		wterm = signo;
+#if RETSIGTYPE != void
+	return 0;
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	worker_catch
+**
+**	Parameters....:	signo		Signal to be handled
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Install worker_signal without restart
+**			semantics, so the signal interrupts the
+**			blocking accept of an idle worker.
+**
+** ------------------------------------------------------------ */
+
+static void worker_catch(int signo)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = worker_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(signo, &sa, NULL);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_spawn
+**
+**	Parameters....:	shard		Listener shard to serve
+**
+**	Return........:	0=success, -1=failure
+**
+**	Purpose.......: Fork a new pre-forked worker.
+**
+** ------------------------------------------------------------ */
+
+static int daemon_spawn(int shard)
+{
+	pid_t pid;
+	int idx;
+
+	daemon_block(SIG_BLOCK);
+	if ((idx = daemon_get()) < 0) {
+		daemon_block(SIG_UNBLOCK);
+		return -1;
+	}
+	CL_SLOT(idx)->shard = shard;
+	CL_SLOT(idx)->stat  = PF_IDLE;
+
+	switch (pid = fork()) {
+		case -1:
+			daemon_drop(idx);
+			daemon_block(SIG_UNBLOCK);
+			if (errno != EAGAIN) {
+				syslog_error("can't fork worker");
+			}
+			syslog_write(T_WRN, "can't fork worker now");
+			return -1;
+		case 0:
+			/******** child ********/
+			cl_self = CL_SLOT(idx);
+			daemon_block(SIG_UNBLOCK);
+			daemon_worker();
+			exit(EXIT_SUCCESS);
+		default:
+			/******** parent ********/
+			daemon_put(idx, pid, "worker");
+			daemon_block(SIG_UNBLOCK);
+#if defined(COMPILE_DEBUG)
+			debug(1, "worker pid=%d (slot %d) added",
+					(int) pid, idx);
+#endif
+			return 0;
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_retire
+**
+**	Parameters....:	idx		clients[] index of worker
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Tell an idle worker to exit. A worker
+**			multiplexing sessions stops to accept
+**			and exits once its sessions are done.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_retire(int idx)
+{
+	CL_SLOT(idx)->stat = PF_GONE;
+	kill(clients[idx].pid, (wsess > 1) ? SIGUSR2 : SIGTERM);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_worker
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none, exits)
+**
+**	Purpose.......: Main loop of a pre-forked worker: take
+**			a client from its listener (shard) and
+**			serve it, up to PreforkMaxSessions.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_worker(void)
+{
+	u_int32_t key;
+	int sock, null, gen, max, cnt;
+	char *peer;
+
+	/*
+	** Maintain the init/exit message balance
+	*/
+	misc_setprog("ftp-child", NULL);
+#if defined(COMPILE_DEBUG)
+	debug(1, "{{{{{ %s worker-fork", misc_getprog());
+#endif
+	misc_forget();
+
+	/*
+	** Between the sessions stdin/stdout point
+	** to the null device, so that accept never
+	** hands out those descriptors
+	*/
+	if ((null = open(_PATH_DEVNULL, O_RDWR)) < 0) {
+		syslog_error("can't open %s", _PATH_DEVNULL);
+		exit(EXIT_FAILURE);
+	}
+	socket_lshard(cl_self->shard);
+
+	gen = board->gen;
+	max = config_int(NULL, "PreforkMaxSessions", PF_SESSIONS);
+
+	if (wsess > 1) {
+		daemon_mux(gen, max);
+		exit(EXIT_SUCCESS);
+	}
+
+	for (cnt = 0; wterm == 0 && (max <= 0 || cnt < max); ) {
+		worker_catch(SIGINT);
+		worker_catch(SIGTERM);
+		worker_catch(SIGQUIT);
+		worker_catch(SIGHUP);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGUSR1, SIG_IGN);
+		signal(SIGUSR2, SIG_IGN);
+
+		if (board->gen != gen || cl_self->stat == PF_GONE)
+			break;
+		cl_self->stat = PF_IDLE;
+
+		if ((sock = socket_lwait()) < 0) {
+			/*
+			** Don't spin on a lasting error
+			** (e.g. out of descriptors)
+			*/
+			if (errno != EINTR && errno != ECONNABORTED)
+				sleep(1);
+			continue;
+		}
+		cl_self->stat = PF_BUSY;
+		cl_self->tally++;
+		kill(daemon_pid, SIGUSR2);
+		cnt++;
+
+		peer = socket_addr2str(socket_sck2addr(sock, REM_END, NULL));
+		if (daemon_limit(peer) != 0) {
+			close(sock);
+			continue;
+		}
+		if (daemon_admit(sock, peer, &key) != 0)
+			continue;
+		cl_self->skey = key;
+
+		/*
+		** To be consistent with inetd-mode, make the
+		** client socket our standard path.
+		*/
+		dup2(sock, fileno(stdin));
+		dup2(sock, fileno(stdout));
+		close(sock);
+
+		if (client_session() != 0)
+			wterm = 1;
+
+		cl_self->skey = 0;
+		daemon_leave(key);
+
+		dup2(null, fileno(stdin));
+		dup2(null, fileno(stdout));
+	}
+
+#if defined(COMPILE_DEBUG)
+	debug(1, "}}}}} %s worker-exit after %d sessions",
+			misc_getprog(), cnt);
+#endif
+	exit(EXIT_SUCCESS);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_mux
+**
+**	Parameters....:	gen		Scoreboard generation
+**			max		PreforkMaxSessions
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Main loop of a worker serving up to
+**			WorkerSessions sessions at once from one
+**			socket_exec loop. The listener is served
+**			while there is room for another session.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_mux(int gen, int max)
+{
+	int stat, pend, wait, left, rc, i;
+	CONTEXT *ctx;
+	time_t now;
+
+	worker_catch(SIGINT);
+	worker_catch(SIGTERM);
+	worker_catch(SIGQUIT);
+	worker_catch(SIGHUP);
+	worker_catch(SIGUSR2);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+
+	/*
+	** A peer going away must not kill the others
+	*/
+	signal(SIGPIPE, SIG_IGN);
+
+	wctx = (CONTEXT **) misc_alloc(FL, wsess * sizeof(CONTEXT *));
+	wkey = (u_int32_t *) misc_alloc(FL, wsess * sizeof(u_int32_t));
+	wtot = 0;
+	wmax = max;
+	wcnt = 0;
+
+	for (wacpt = -1, pend = 0; wterm == 0; ) {
+		/*
+		** Accept while there is room, unless we are
+		** due for recycling or were told to exit
+		*/
+		stat = (wcnt < wsess) ? PF_IDLE : PF_BUSY;
+		if ((max > 0 && wtot >= max) || board->gen != gen ||
+		    cl_self->stat == PF_GONE)
+			stat = PF_GONE;
+		if (stat == PF_GONE && wcnt == 0)
+			break;
+		if (wacpt != (stat == PF_IDLE)) {
+			wacpt = (stat == PF_IDLE);
+			socket_lserve(wacpt ? daemon_take : NULL);
+		}
+		if (cl_self->stat != PF_GONE && cl_self->stat != stat) {
+			cl_self->stat = stat;
+			if (stat != PF_IDLE)
+				kill(daemon_pid, SIGUSR2);
+		}
+
+		/*
+		** Wait no longer than the next session timeout
+		*/
+		now  = time(NULL);
+		wait = pend ? 0 : PF_WAIT;
+		for (i = 0; i < wcnt; i++) {
+			ctx = wctx[i];
+			if ((left = client_idle(ctx, now)) == 0) {
+				syslog_write(U_INF, "[ %s ] Timeout closing "
+				             "connection [%d s]",
+				             ctx->cli_ctrl->peer, ctx->timeout);
+				daemon_mdone(i--);
+				continue;
+			}
+			if (left < wait)
+				wait = left;
+		}
+
+		socket_exec(wait, NULL);
+
+		for (i = 0, pend = 0; i < wcnt; i++) {
+			if ((rc = client_step(wctx[i])) < 0)
+				daemon_mdone(i--);
+			else if (rc > 0)
+				pend = 1;
+		}
+	}
+
+	/*
+	** Terminated: close the sessions still open
+	*/
+	while (wcnt > 0)
+		daemon_mdone(wcnt - 1);
+	misc_free(FL, wctx);
+	misc_free(FL, wkey);
+	wctx = NULL;
+	wkey = NULL;
+
+#if defined(COMPILE_DEBUG)
+	debug(1, "}}}}} %s worker-exit after %d sessions",
+			misc_getprog(), wtot);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_take
+**
+**	Parameters....:	sock		Accepted socket descriptor
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Accept callback of a mux worker; starts
+**			a new session on the accepted socket.
+**			Stops serving the listener when full,
+**			so the remaining clients stay queued.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_take(int sock)
+{
+	u_int32_t key;
+	CONTEXT *ctx;
+	char *peer;
+
+	wtot++;
+	cl_self->tally++;
+	peer = socket_addr2str(socket_sck2addr(sock, REM_END, NULL));
+	if (daemon_limit(peer) != 0 || wcnt >= wsess)
+		close(sock);
+	else if (daemon_admit(sock, peer, &key) != 0)
+		;			/* Rejected and closed	*/
+	else if ((ctx = client_open(sock)) != NULL) {
+		wkey[wcnt]   = key;
+		wctx[wcnt++] = ctx;
+	} else
+		daemon_leave(key);
+
+	if (wcnt >= wsess || (wmax > 0 && wtot >= wmax)) {
+		wacpt = 0;
+		socket_lserve(NULL);
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_mdone
+**
+**	Parameters....:	idx		Index into wctx
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Close a session of a mux worker; the
+**			last session takes over its place.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_mdone(int idx)
+{
+	client_close(wctx[idx]);
+	daemon_leave(wkey[idx]);
+
+	wcnt--;
+	wctx[idx] = wctx[wcnt];
+	wkey[idx] = wkey[wcnt];
+}
+#endif
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	daemon_cleanup
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Clean up the daemon related data.
+**
+** ------------------------------------------------------------ */
+
+static void daemon_cleanup(void)
+{
+	int i;
+	CLIENT *clp;
+
+	if(getpid() == daemon_pid) /* stop the LDAP helpers */
+		ldap_pool_stop();
 
 	if(getpid() == daemon_pid) /* clean up our childs list */
-	for (i = 0, clp = clients; i < MAX_CLIENTS; i++, clp++) {
+	for (i = 0, clp = clients; i < cl_size; i++, clp++) {
 		if (clp->pid == (pid_t) 0)
 			continue;
 
@@ -36,6 +36,8 @@
 
 void daemon_init  (int detach);
 void daemon_accept(int sock);
+void daemon_check (int renew);
+void daemon_count (double bytes);
 
 
 /* ------------------------------------------------------------ */
@@ -61,9 +61,28 @@ static char rcsid[] = "$Id: ftp-ldap.c,v 1.7.2.3 2004/03/10 16:07:13 mt Exp $";
 #  endif
 #endif
 
+#if defined(HAVE_SYS_SELECT_H)
+#  include <sys/select.h>
+#endif
+
+#if defined(HAVE_FCNTL_H)
+#  include <fcntl.h>
+#elif defined(HAVE_SYS_FCNTL_H)
+#  include <sys/fcntl.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+#  include <sys/mman.h>
+#endif
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+#include <signal.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #if defined(HAVE_LIBLDAP)
@@ -85,6 +104,13 @@ static char rcsid[] = "$Id: ftp-ldap.c,v 1.7.2.3 2004/03/10 16:07:13 mt Exp $";
 #include "ftp-cmds.h"
 #include "ftp-ldap.h"
 
+/*
+** The cache is shared where misc_spin can lock it
+*/
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS) && defined(HAVE_SPIN)
+#  define HAVE_SHARED	1
+#endif
+
 /* ------------------------------------------------------------ */
 
 #if defined(HAVE_LIBLDAP)
@@ -120,17 +146,216 @@ static char rcsid[] = "$Id: ftp-ldap.c,v 1.7.2.3 2004/03/10 16:07:13 mt Exp $";
 /* ------------------------------------------------------------ */
 
 #if defined(HAVE_LIBLDAP)
-static int   ldap_fetch(LDAP *ld, CONTEXT *ctx, char *who, char *pwd);
+
+#define LDAP_POOLMAX	16	/* Max. number of helpers	*/
+#define LDAP_WAIT	30	/* Default helper answer wait	*/
+#define LDAP_SRVMAX	8	/* Max. number of LDAPServers	*/
+#define LDAP_OPWAIT	10	/* Default operation wait	*/
+#define LDAP_REST	30	/* Secs a dead server is skipped*/
+#define LDAP_DATSIZ	MAX_PATH_SIZE	/* Room for the values	*/
+
+#define LC_ENTRIES	256	/* Default cache entries	*/
+#define LC_MINSIZE	16	/* Min. cache entries		*/
+#define LC_PROBE	8	/* Cache slots probed per user	*/
+#define LC_TTL		60	/* Default positive TTL (secs)	*/
+#define LC_NEGTTL	10	/* Default negative TTL (secs)	*/
+#define LC_LIVE(e,t)	((e)->expire > (t) && (e)->gen == lctab->gen)
+
+#define LB_NONE		0	/* Connection is not bound	*/
+#define LB_SERV		1	/* Bound as the proxy itself	*/
+#define LB_USER		2	/* Bound as a login user	*/
+
+#define LO_BIND		1	/* Operation: simple bind	*/
+#define LO_FIND		2	/* Operation: subtree search	*/
+
+#if !defined(LDAP_MSG_ALL)
+#  define LDAP_MSG_ALL	1
+#endif
+#if defined(LDAP_TIMEOUT)
+#  define LD_TMOUT	LDAP_TIMEOUT
+#else
+#  define LD_TMOUT	LDAP_SERVER_DOWN
+#endif
+
+/*
+** The user profile attributes, see ldap_apply
+*/
+#define LA_DADDR	0	/* DestinationAddress		*/
+#define LA_DPORT	1	/* DestinationPort		*/
+#define LA_DMODE	2	/* DestinationTransferMode	*/
+#define LA_DMINP	3	/* DestinationMinPort		*/
+#define LA_DMAXP	4	/* DestinationMaxPort		*/
+#define LA_AMINP	5	/* ActiveMinDataPort		*/
+#define LA_AMAXP	6	/* ActiveMaxDataPort		*/
+#define LA_PMINP	7	/* PassiveMinDataPort		*/
+#define LA_PMAXP	8	/* PassiveMaxDataPort		*/
+#define LA_SADDR	9	/* SameAddress			*/
+#define LA_TMOUT	10	/* TimeOut			*/
+#define LA_VCMDS	11	/* ValidCommands		*/
+#define LA_CNT		12
+
+static char *ldap_attrs[LA_CNT] = {
+	"DestinationAddress",	"DestinationPort",
+	"DestinationTransferMode",
+	"DestinationMinPort",	"DestinationMaxPort",
+	"ActiveMinDataPort",	"ActiveMaxDataPort",
+	"PassiveMinDataPort",	"PassiveMaxDataPort",
+	"SameAddress",		"TimeOut",
+	"ValidCommands"
+};
+
+typedef struct {
+	u_int32_t id;		/* Request number of the sender	*/
+	char  who[256];		/* User (auth) name		*/
+	char  pwd[256];		/* User (auth) password		*/
+	char  peer[PEER_LEN];	/* Client address for syslog	*/
+} LDREQ;
+
+typedef struct {
+	u_int32_t id;		/* Request number answered	*/
+	int   rc;		/* 0=success, -1=failure/denied	*/
+	int   temp;		/* 1=failed on a server error	*/
+	int   found;		/* 1=user entry found		*/
+	int   off[LA_CNT];	/* Value offsets, -1=not set	*/
+	int   len;		/* Bytes used in dat		*/
+	char  dat[LDAP_DATSIZ];	/* The values, null terminated	*/
+} LDREP;
+
+typedef struct {
+	LDAP     *ld;		/* Connection handle or NULL	*/
+	int       bind;		/* LB_NONE, LB_SERV or LB_USER	*/
+	char     *bdn;		/* DN bound as ("" anonymous)	*/
+	int       use;		/* 1=takes part in the lookup	*/
+	int       msg;		/* Operation in flight, -1=none	*/
+	u_long    good;		/* Answers since it was opened	*/
+	u_long    wins;		/* Lookups it answered first	*/
+	time_t    rest;		/* Not reopened before		*/
+	u_int16_t port;		/* Server port			*/
+	char      host[256];	/* Server host name		*/
+} LDSRV;
+
+/*
+** All LDAPServers of a process; the first one that
+** answers a lookup serves the rest of it (cur, ld)
+*/
+typedef struct {
+	LDSRV   srv[LDAP_SRVMAX];	/* The servers		*/
+	int     nsrv;		/* Number of servers		*/
+	LDSRV  *cur;		/* Server serving the lookup	*/
+	LDAP   *ld;		/* Its connection handle	*/
+	int     down;		/* 1=server connection lost	*/
+	int     err;		/* Error of the last failed op.	*/
+} LDCONN;
+
+typedef struct {
+	int     kind;		/* LO_BIND or LO_FIND		*/
+	int     serv;		/* 1=bind as the proxy itself	*/
+	char   *dn;		/* DN to bind or search base	*/
+	char   *pw;		/* Password for the DN		*/
+	char   *flt;		/* Search filter		*/
+	char  **attrs;		/* Attributes to return		*/
+	int     only;		/* 1=attribute names only	*/
+} LDOP;
+
+/*
+** A lookup a session waits for; the helper answers
+** with a datagram to the socket pair of the process
+*/
+typedef struct ldpend_t {
+	struct ldpend_t *next;	/* Next lookup in flight	*/
+	CONTEXT  *ctx;		/* Session waiting for it	*/
+	int       busy;		/* 1=answer not yet there	*/
+	time_t    due;		/* Gives up at			*/
+	struct timeval beg;	/* Start of the lookup		*/
+	LDREQ     rq;		/* The request			*/
+	LDREP     rp;		/* The answer			*/
+} LDPEND;
+
+/*
+** Cache entry; the password is kept as a keyed MAC
+** only, a wrong one never matches an entry
+*/
+typedef struct {
+	u_int32_t hash;		/* Hash of the user name	*/
+	u_char    cred[MISC_HMAC_LEN]; /* MAC of name and pwd.	*/
+	int       gen;		/* Cache generation of entry	*/
+	time_t    born;		/* Time of the lookup		*/
+	time_t    expire;	/* Valid until, 0=unused	*/
+	char      who[256];	/* User (auth) name		*/
+	LDREP     rep;		/* The answer			*/
+} LCACHE;
+
+/*
+** The cache and its counters; shared by the daemon
+** and its children if ldap_cache_init was called
+*/
+typedef struct {
+	volatile int lock;	/* Spin lock for the table	*/
+	u_int32_t mask;		/* Number of entries - 1	*/
+	int       gen;		/* Bumped on every reload	*/
+	u_char    key[MISC_HMAC_LEN]; /* Random key of the MACs	*/
+	u_long    hits;		/* Logins granted from cache	*/
+	u_long    nhits;	/* Logins denied from cache	*/
+	u_long    miss;		/* Lookups not in the cache	*/
+	u_long    stale;	/* Misses on expired entries	*/
+	u_long    stored;	/* Answers entered		*/
+	double    asum;		/* Sum of the hit ages (secs)	*/
+	u_long    amax;		/* Max. age of a hit (secs)	*/
+	LCACHE    ent[1];	/* The entries (mask + 1)	*/
+} LCTAB;
+
+static int   ldap_conn_open(LDCONN *lc, char *peer);
+static void  ldap_conn_drop(LDCONN *lc);
+static void  ldap_srv_open(LDSRV *sv, char *peer);
+static void  ldap_srv_drop(LDSRV *sv);
+static void  ldap_srv_lost(LDSRV *sv, int err);
+static int   ldap_sick(int err);
+static int   ldap_race(LDCONN *lc, LDOP *op, LDAPMessage **res);
+static int   ldap_bind_as(LDCONN *lc, char *dn, char *pw, int serv);
+static int   ldap_find(LDCONN *lc, char *base, char *flt,
+                       char **attrs, int only, LDAPMessage **res);
+static void  ldap_lost(LDCONN *lc, int err);
+static void  ldap_serve(LDCONN *lc, LDREQ *rq, LDREP *rp);
+static void  ldap_fetch(LDCONN *lc, LDREQ *rq, LDREP *rp);
+static void  ldap_keep(LDREP *rp, int idx, char *val);
+static int   ldap_apply(CONTEXT *ctx, LDREP *rp);
+static int   ldap_pool_send(CONTEXT *ctx, LDREQ *rq);
+static void  ldap_pend_event(int sock);
+static void  ldap_pend_arm(void);
+static void  ldap_pend_free(LDPEND *lp);
+static void  ldap_cache_lock(int on);
+static void  ldap_cache_hash(LDREQ *rq, u_int32_t *hash, u_char *cred);
+static int   ldap_cache_look(LDREQ *rq, LDREP *rp, u_long *age);
+static void  ldap_cache_store(LDREQ *rq, LDREP *rp);
+static void  ldap_pool_serve(void);
 static char *ldap_attrib(LDAP *ld, LDAPMessage *e, char *attr, char *dflt);
 static int   ldap_exists(LDAP *ld, LDAPMessage *e, char *attr,
                                                    char *vstr, int cs);
-static int   ldap_auth(LDAP *ld, LDAPMessage *e, char *who, char *pwd, CONTEXT *);
+static int   ldap_auth(LDCONN *lc, LDAPMessage *e, char *who, char *pwd,
+                                                   char *peer);
 //Fred patch
-void patch_ldapgroup(LDAP *ld, char *who, CONTEXT *ctx);
-static char* prep_bind_auto(LDAP *ld, char *flt, char *base, char *peer);
+static int   patch_ldapgroup(LDCONN *lc, char *who, char *peer);
+static char* prep_bind_auto(LDCONN *lc, char *flt, char *base, char *peer);
 static char* prep_bind_fmt(char *str, char *who);
+
+
+/* ------------------------------------------------------------ */
+
+static LDCONN ldap_self;	/* Own connection, if no helper	*/
+
+static int    pool_fd[2] = { -1, -1 }; /* Requests: ask, serve	*/
+static volatile pid_t pool_pid[LDAP_POOLMAX]; /* Helper PIDs	*/
+static time_t pool_born[LDAP_POOLMAX];	/* Helper start times	*/
+
+static LDPEND *pend_head = NULL; /* Lookups in flight		*/
+static int    pend_fd[2] = { -1, -1 }; /* Answers: read, send	*/
+static pid_t  pend_pid = 0;	/* Process owning pend_fd	*/
+static u_int32_t pend_id = 0;	/* Last request number		*/
+
+static LCTAB *lctab = NULL;	/* The profile cache		*/
 #endif
 
+
 /* ------------------------------------------------------------ **
 **
 **	Function......:	ldap_setup_user
@@ -139,23 +364,36 @@ static char* prep_bind_fmt(char *str, char *who);
 **			who		Pointer to user auth name
 **			pwd		Pointer to user auth pwd
 **
-**	Return........:	0 on success
+**	Return........:	0 on success, 1 if the lookup is
+**			still running (call again later),
+**			-1 if the login is refused
 **
 **	Purpose.......: Read the user specific parameters from
-**			LDAP Server if one is known.
+**			LDAP Server if one is known. Answers of
+**			the last LDAPCacheTTL seconds are reused,
+**			else the lookup is sent to the helper
+**			processes if there are some and 1 is
+**			returned; the answer is picked up by
+**			the socket_exec loop (see ldap_busy).
+**			Without helpers, it is done over an own
+**			connection kept for the next login.
 **
 ** ------------------------------------------------------------ */
 
 int  ldap_setup_user(CONTEXT *ctx, char *who, char *pwd)
 {
-	char      *ptr = 0;
-	int        ver = 0;
+#if defined(HAVE_LIBLDAP)
+	struct timeval beg, end;
+	LDPEND *lp;
+	LDREQ rq;
+	LDREP rp;
+	char  how[64], *via;
+	u_long age;
+#endif
 
 	/*
 	** avoid unused... compiler warnings
 	*/
-	ver = ver;
-	ptr = ptr;
 	pwd = pwd;
 
 	/*
@@ -166,756 +404,2274 @@ int  ldap_setup_user(CONTEXT *ctx, char *who, char *pwd)
 
 #if defined(HAVE_LIBLDAP)
 	/*
-	** use configured ldap version or prefer v3 since
-	** OpenLDAP 2.x library defaults to v2, but the
-	** server does not accept v2 binds per default...
+	** Fred patch: refuse empty passwords, as many
+	** servers take them for an anonymous bind; the
+	** caller answers 530 - a worker serves others
 	*/
-#if   defined(LDAP_VERSION3)
-	ver = LDAP_VERSION3;
-#elif defined(LDAP_VERSION2)
-	ver = LDAP_VERSION2;
-#else
-	ver = 0;
-#endif
-	ptr = config_str(NULL, "LDAPVersion", NULL);
-	if(NULL != ptr) {
-		ver = atoi(ptr);
+	if(NULL == pwd || '\0' == *pwd) {
+		syslog_write(U_ERR, "[ %s ] no LDAP password for %s",
+		             ctx->cli_ctrl->peer, who);
+		return -1;
 	}
+	/*
+	** If an LDAP server is configured, insist on using it
+	*/
+	if(config_str(NULL, "LDAPServer", NULL) == NULL)
+		return 0;
 
-	// Patch Fred Bug mot de passe nul
-	
-	if (*pwd == '\0') {
-	syslog_write(U_ERR, "No Ldap password");
-	exit(-1);
+	if(strlen(who) >= sizeof(rq.who) ||
+	   strlen(pwd) >= sizeof(rq.pwd)) {
+		syslog_write(U_ERR, "[ %s ] LDAP user name or password "
+		             "too long", ctx->cli_ctrl->peer);
+		return -1;
 	}
+	memset(&rq, 0, sizeof(rq));
+	strcpy(rq.who, who);
+	strcpy(rq.pwd, pwd);
+	misc_strncpy(rq.peer, ctx->cli_ctrl->peer, sizeof(rq.peer));
+
 	/*
-	** If an LDAP server is configured, insist on using it
+	** A lookup sent by the last call for another
+	** user or password is of no use any more
 	*/
-	if((ptr = config_str(NULL, "LDAPServer", NULL)) != NULL) {
-		char       temp[MAX_PATH_SIZE];
-		char      *host;
-		u_int16_t  port;
-		int        rc;
-		LDAP      *ld;
+	for(lp = pend_head; NULL != lp && lp->ctx != ctx; lp = lp->next)
+		;
+	if(NULL != lp && (0 != strcmp(lp->rq.who, rq.who) ||
+	                  0 != strcmp(lp->rq.pwd, rq.pwd))) {
+		ldap_pend_free(lp);
+		ldap_pend_arm();
+		lp = NULL;
+	}
+	if(NULL != lp && 0 != lp->busy) {
+		memset(&rq, 0, sizeof(rq));
+		return 1;
+	}
 
-		misc_strncpy(temp, ptr, sizeof(temp));
+	gettimeofday(&beg, NULL);
+	if(NULL != lp) {
 		/*
-		** Determine LDAP server and port
+		** The answer is in - or the helper timed out
 		*/
-		host = temp;
-		if(NULL != (ptr = strchr(temp, ':'))) {
-			*ptr++ = '\0';
-			port = (int) socket_str2port(ptr, LDAP_PORT);
+		memcpy(&rp, &lp->rp, sizeof(rp));
+		beg = lp->beg;
+		if(rp.id == lp->rq.id) {
+			via = "helper";
+			ldap_cache_store(&rq, &rp);
 		} else {
-			port = (int) LDAP_PORT;
+			via = "helper timeout";
 		}
+		ldap_pend_free(lp);
+	} else if(ldap_cache_look(&rq, &rp, &age)) {
+		sprintf(how, "cache, %lu s old", age);
+		via = how;
+		if(0 != rp.rc) {
+			syslog_write(U_ERR, "LDAP user auth failed for "
+			             "%s from %s (cached)", who,
+			             ctx->cli_ctrl->peer);
+		}
+	} else if(0 == ldap_pool_send(ctx, &rq)) {
+		memset(&rq, 0, sizeof(rq));
+		return 1;
+	} else {
+		via = "own connection";
+		ldap_serve(&ldap_self, &rq, &rp);
+		ldap_cache_store(&rq, &rp);
+	}
+	memset(&rq, 0, sizeof(rq));
+	gettimeofday(&end, NULL);
 
-#if defined(COMPILE_DEBUG)
-		debug(2, "LDAP server: %s:%d", host, port);
+	syslog_write(T_DBG | L_AUTH, "[ %s ] LDAP lookup for '%s': %.1f ms (%s)",
+	             ctx->cli_ctrl->peer, who,
+	             (end.tv_sec  - beg.tv_sec)  * 1000.0 +
+	             (end.tv_usec - beg.tv_usec) / 1000.0, via);
+
+	return ldap_apply(ctx, &rp);
+#else
+	return 0;
 #endif
+}
 
-		/*
-		** Ready to contact the LDAP server
-		*/
-		if((ld = ldap_init(host, port)) == NULL) {
-			syslog_write(T_ERR,
-			             "[ %s ] can't reach LDAP server %s:%u for %s",
-			            ctx->cli_ctrl->peer, host, port, ctx->cli_ctrl->peer);
-			return -1;
-		} else {
-			syslog_write(T_DBG,
-			             "[ %s ] LDAP server %s:%u: initialized for %s",
-			             ctx->cli_ctrl->peer, host, port, ctx->cli_ctrl->peer);
-		}
 
-		if(ver > 0) {
-#if defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_PROTOCOL_VERSION)
-			ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &ver);
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_busy
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	1 while a lookup for the session is
+**			running, else 0
+**
+**	Purpose.......: Tell if ldap_setup_user has to wait.
+**
+** ------------------------------------------------------------ */
+
+int  ldap_busy(CONTEXT *ctx)
+{
+#if defined(HAVE_LIBLDAP)
+	LDPEND *lp;
+
+	for(lp = pend_head; NULL != lp; lp = lp->next) {
+		if(lp->ctx == ctx)
+			return lp->busy;
+	}
 #else
-			ld->ld_version = ver;
+	ctx = ctx;
 #endif
-		}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_drop
+**
+**	Parameters....:	ctx		Pointer to user context
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Forget the lookup of a closed session; a
+**			late answer to it is thrown away.
+**
+** ------------------------------------------------------------ */
+
+void ldap_drop(CONTEXT *ctx)
+{
+#if defined(HAVE_LIBLDAP)
+	LDPEND *lp;
 
-		rc = ldap_fetch(ld, ctx, who, pwd);
-		ldap_unbind(ld);
-		return rc;
+	for(lp = pend_head; NULL != lp; lp = lp->next) {
+		if(lp->ctx == ctx) {
+			ldap_pend_free(lp);
+			ldap_pend_arm();
+			return;
+		}
 	}
+#else
+	ctx = ctx;
 #endif
-	return 0;
 }
 
 
 #if defined(HAVE_LIBLDAP)
 /* ------------------------------------------------------------ **
 **
-**	Function......:	prep_bind_auto
+**	Function......:	ldap_conn_open
 **
-**	Parameters....:	ld		Pointer ldap struct
-**			flt		LDAP search filter
-**			base		BaseDN to search in
+**	Parameters....:	lc		Pointer to connection
 **			peer		Peer name for syslog
 **
-**	Return........:	bind-dn or NULL
+**	Return........:	0 if a server connection is open
 **
-**	Purpose.......:	Searches using anonymous bind
-**			for a dn we want to bind later.
+**	Purpose.......: Open the connections to the LDAPServer
+**			list that are not open. A server that
+**			failed before it answered anything is
+**			skipped for LDAP_REST seconds, unless
+**			all of them failed.
 **
 ** ------------------------------------------------------------ */
 
-static char* prep_bind_auto(LDAP *ld, char *flt, char *base, char *peer)
+static int ldap_conn_open(LDCONN *lc, char *peer)
 {
-	LDAPMessage *result, *e;
-	char        *attrs[] = {0, 0};
-	char        *bind_dn, *p, *d;
-	int          err;
-
-	if(NULL == base || '\0' == base[0]) {
-		misc_die(FL,"prep_bind_auto: ?base?");
-	}
+	char       temp[MAX_PATH_SIZE];
+	char      *host, *ptr;
+	LDSRV     *sv;
+	time_t     now;
+	int        i, cnt, rest;
 
 	/*
-	** pre-bind (anonymously)
+	** Determine the LDAP servers and ports once
 	*/
-	if((d = config_str(NULL, "LDAPPreBindDN", NULL)) &&
-	   (p = config_str(NULL, "LDAPPreBindPW", NULL))) {
-	    err = ldap_simple_bind_s(ld, d, p);
-	} else {
-	    err = ldap_simple_bind_s(ld, 0, 0);
-	}
-	if(LDAP_SUCCESS != err) {
-		syslog_write(T_ERR,
-		       "can't bind LDAP anonymously for %s: %.512s",
-		       peer, ldap_err2string(err));
-		return NULL;
-	}
-
-	result   = 0;
-	attrs[0] = config_str(NULL, "LDAPIdentifier", "CN");
+	if(0 == lc->nsrv) {
+		if((ptr = config_str(NULL, "LDAPServer", NULL)) == NULL)
+			return -1;
+		misc_strncpy(temp, ptr, sizeof(temp));
 
-	err = ldap_search_s(ld,  base,  LDAP_SCOPE_SUBTREE,
-	                    flt, attrs, 1, &result);
-	if(LDAP_SUCCESS != err) {
-		syslog_write(T_ERR,
-		       "can't find valid bind-dn for %s: %.512s",
-		       peer, ldap_err2string(err));
-		return NULL;
+		for(host = strtok(temp, ", \t"); NULL != host &&
+		    lc->nsrv < LDAP_SRVMAX; host = strtok(NULL, ", \t")) {
+			sv = &lc->srv[lc->nsrv++];
+			if(NULL != (ptr = strchr(host, ':'))) {
+				*ptr++ = '\0';
+				sv->port = socket_str2port(ptr, LDAP_PORT);
+			} else {
+				sv->port = LDAP_PORT;
+			}
+			misc_strncpy(sv->host, host, sizeof(sv->host));
+			sv->msg = -1;
+#if defined(COMPILE_DEBUG)
+			debug(2, "LDAP server: %s:%d", sv->host, sv->port);
+#endif
+		}
+		if(0 == lc->nsrv)
+			return -1;
 	}
 
-	e = ldap_first_entry(ld, result);
-	if(NULL == e) {
-		GET_LDERROR(ld, err);
-		syslog_write(T_ERR,
-		       "can't find valid bind-dn for %s", peer);
-		return NULL;
+	now = time(NULL);
+	for(i = 0, rest = 0; i < lc->nsrv; i++) {
+		if(NULL == lc->srv[i].ld && lc->srv[i].rest > now)
+			rest++;
 	}
-
-	/*
-	** OK, we have a DN
-	*/
-	if(NULL != (p = ldap_get_dn(ld, e))) {
-		bind_dn = misc_strdup(FL, p);
-		ldap_memfree(p);
-	} else {
-		bind_dn = NULL;
+	for(i = 0, cnt = 0; i < lc->nsrv; i++) {
+		sv = &lc->srv[i];
+		if(NULL == sv->ld && (sv->rest <= now || rest == lc->nsrv))
+			ldap_srv_open(sv, peer);
+		if(NULL != sv->ld)
+			cnt++;
 	}
-	ldap_msgfree(result);
-	syslog_write(T_DBG, "auto bind-dn='%.256s' for %s",
-		             NIL(bind_dn), peer);
-	return bind_dn;
+	return cnt ? 0 : -1;
 }
 
 
 /* ------------------------------------------------------------ **
 **
-**	Function......:	prep_bind_fmt
+**	Function......:	ldap_conn_drop
 **
-**	Parameters....:	str		Bind-DN fmt string
-**			who		Current user name
+**	Parameters....:	lc		Pointer to connection
 **
-**	Return........:	bind-dn or NULL
+**	Return........:	(none)
 **
-**	Purpose.......:	Checks if str contains a fmt
-**			and constructs a new base-dn.
+**	Purpose.......: Close the connections to the LDAPServers.
 **
 ** ------------------------------------------------------------ */
 
-static char* prep_bind_fmt(char *str, char *who)
+static void ldap_conn_drop(LDCONN *lc)
 {
-	char   *bind_dn, *p;
-	int    fmt = 0;
-	size_t len;
-
-	/*
-	** search for exactly one %s; if any other
-	** fmt's are present report an parse error.
-	*/
-	for(p=str; p && p[0] && (p = strchr(p, '%')); p++) {
-		if(!fmt && ('s' == p[1] || 'S' == p[1])) {
-			fmt = 1;
-		} else {
-			errno = 0;
-			misc_die(FL,"prep_bind_fmt: ?str?");
-		}
-	}
+	int i;
 
-	if(fmt) {
-		/*
-		** constuct LDAPBind DN and PW
-		*/
-		len = strlen(who) + strlen(str);
-		bind_dn = misc_alloc(FL, len);
-#if defined(HAVE_SNPRINTF)
-		snprintf(bind_dn, len, str, who);
-#else
-		sprintf(bind_dn, str, who);
-#endif
-		return bind_dn;
-	}
-	return 0;
+	for(i = 0; i < lc->nsrv; i++)
+		ldap_srv_drop(&lc->srv[i]);
+	lc->cur = NULL;
+	lc->ld  = NULL;
 }
 
+
 /* ------------------------------------------------------------ **
 **
-**	Function......:	ldap_fetch
+**	Function......:	ldap_srv_open
 **
-**	Parameters....:	ld		Pointer ldap struct
-**			ctx		Pointer to user context
-**			who		Pointer to user/auth name
-**			pwd		Pointer to user/auth pwd
+**	Parameters....:	sv		Pointer to server
+**			peer		Peer name for syslog
 **
-**	Return........:	0 on success
+**	Return........:	(none, sv->ld is NULL on failure)
 **
-**	Purpose.......: Read the user specific parameters from
-**			an LDAP Server.
+**	Purpose.......: Open the connection to one LDAPServer.
 **
 ** ------------------------------------------------------------ */
 
-static int ldap_fetch(LDAP *ld, CONTEXT *ctx, char *who, char *pwd)
+static void ldap_srv_open(LDSRV *sv, char *peer)
 {
-	char str[MAX_PATH_SIZE];
-	char *bind_dn, *bind_pw;
-	char *base_dn, *auth_dn;
-	char *idnt, *objc, *ptr, *p, *q;
-	char  lderr, auth_ok;
-	u_int16_t l, u;
-	LDAPMessage *result, *e;
+	char *ptr;
+	int   ver;
+#if defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_NETWORK_TIMEOUT)
+	struct timeval tv;
+#endif
 
-	/* Basic sanity */
-	if(ctx == NULL || ld == NULL || who == NULL) {
-		if(ld) ldap_unbind(ld);
-		misc_die(FL, "ldap_fetch: ?ctx? ?ld? ?who?");
+	/*
+	** Ready to contact the LDAP server
+	*/
+	if((sv->ld = ldap_init(sv->host, sv->port)) == NULL) {
+		syslog_write(T_ERR,
+		             "[ %s ] can't reach LDAP server %s:%u for %s",
+		            peer, sv->host, sv->port, peer);
+		sv->rest = time(NULL) + LDAP_REST;
+		return;
+	} else {
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP server %s:%u: initialized for %s",
+		             peer, sv->host, sv->port, peer);
 	}
+	sv->bind = LB_NONE;
+	sv->msg  = -1;
+	sv->good = 0;
 
 	/*
-	** construct filter for the search
-	**	(by LDAPIdentifier, maybe also ObjectClass)
+	** use configured ldap version or prefer v3 since
+	** OpenLDAP 2.x library defaults to v2, but the
+	** server does not accept v2 binds per default...
 	*/
-	idnt = config_str(NULL, "LDAPIdentifier", "CN");
-	objc = config_str(NULL, "LDAPObjectClass", NULL);
-	if(NULL != objc) {
-#if defined(HAVE_SNPRINTF)
-		snprintf(str, sizeof(str),
-			  "(&(ObjectClass=%.256s)(%.256s=%.256s))",
-			  objc,  idnt, who);
+#if   defined(LDAP_VERSION3)
+	ver = LDAP_VERSION3;
+#elif defined(LDAP_VERSION2)
+	ver = LDAP_VERSION2;
 #else
-		sprintf(str,
-			  "(&(ObjectClass=%.256s)(%.256s=%.256s))",
-			  objc,  idnt, who);
+	ver = 0;
 #endif
-	} else {
-#if defined(HAVE_SNPRINTF)
-		snprintf(str, sizeof(str), "(%.256s=%.256s)",
-			  idnt, who);
+	ptr = config_str(NULL, "LDAPVersion", NULL);
+	if(NULL != ptr) {
+		ver = atoi(ptr);
+	}
+	if(ver > 0) {
+#if defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_PROTOCOL_VERSION)
+		ldap_set_option(sv->ld, LDAP_OPT_PROTOCOL_VERSION, &ver);
 #else
-		sprintf(str, "(%.256s=%.256s)", idnt, who);
+		sv->ld->ld_version = ver;
 #endif
 	}
 
-	auth_ok = 0; /* OK if non-anonymous bind */
-	auth_dn = config_str(NULL, "LDAPAuthDN", NULL);
-	base_dn = config_str(NULL, "LDAPBaseDN", NULL);
-	if(NULL != (ptr = config_str(NULL, "LDAPBindDN", NULL))) {
+	/*
+	** Don't let a dead server hold up the connect
+	*/
+#if defined(HAVE_LDAP_SET_OPTION) && defined(LDAP_OPT_NETWORK_TIMEOUT)
+	tv.tv_sec  = config_int(NULL, "LDAPTimeOut", LDAP_OPWAIT);
+	tv.tv_usec = 0;
+	ldap_set_option(sv->ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_srv_drop
+**
+**	Parameters....:	sv		Pointer to server
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Close the connection to one LDAPServer.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_srv_drop(LDSRV *sv)
+{
+	if(NULL != sv->ld)
+		ldap_unbind(sv->ld);
+	if(NULL != sv->bdn)
+		misc_free(FL, sv->bdn);
+	sv->ld   = NULL;
+	sv->bdn  = NULL;
+	sv->bind = LB_NONE;
+	sv->use  = 0;
+	sv->msg  = -1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_srv_lost
+**
+**	Parameters....:	sv		Pointer to server
+**			err		LDAP error code
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Take a server out of the current lookup
+**			after it failed. If the connection is
+**			gone, it is closed; a server that never
+**			answered on it is skipped for a while.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_srv_lost(LDSRV *sv, int err)
+{
+	sv->use = 0;
+	if(2 != ldap_sick(err))
+		return;
+
+	syslog_write(T_WRN, "LDAP server %s:%u failed: %.512s",
+	             sv->host, sv->port, ldap_err2string(err));
+	if(0 == sv->good)
+		sv->rest = time(NULL) + LDAP_REST;
+	ldap_srv_drop(sv);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_sick
+**
+**	Parameters....:	err		LDAP error code
+**
+**	Return........:	2 if the connection is gone, 1 if the
+**			server can't serve now, else 0
+**
+**	Purpose.......: Tell server failures from answers.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_sick(int err)
+{
+	switch(err) {
+		case LDAP_SERVER_DOWN:
+#if defined(LDAP_CONNECT_ERROR)
+		case LDAP_CONNECT_ERROR:
+#endif
+#if defined(LDAP_TIMEOUT)
+		case LDAP_TIMEOUT:
+#endif
+			return 2;
+		case LDAP_BUSY:
+		case LDAP_UNAVAILABLE:
+		case LDAP_UNWILLING_TO_PERFORM:
+		case LDAP_OTHER:
+			return 1;
+	}
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_race
+**
+**	Parameters....:	lc		Pointer to connection
+**			op		Operation to perform
+**			res		Where to put the result
+**
+**	Return........:	LDAP error code
+**
+**	Purpose.......: Perform an operation of a lookup. Until
+**			a server answered it, the operation is
+**			sent to all servers taking part and the
+**			first healthy answer wins: its server
+**			serves the rest of the lookup, the other
+**			requests are abandoned. The proxy's own
+**			bind is done on all of them, so any may
+**			win the next step. Waits LDAPTimeOut
+**			seconds at most.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_race(LDCONN *lc, LDOP *op, LDAPMessage **res)
+{
+	struct timeval tv;
+	LDAPMessage *msg;
+	LDSRV  *sv;
+	fd_set  rfds;
+	time_t  due;
+	int     i, j, fd, cnt, ok, err, maxfd, poll;
+
+	if(NULL != res)
+		*res = NULL;
+	err = LDAP_SERVER_DOWN;
+
+	/*
+	** Send it to the server that won the lookup
+	** or to all that are still in the race
+	*/
+	for(i = 0, cnt = 0, ok = 0; i < lc->nsrv; i++) {
+		sv = &lc->srv[i];
+		sv->msg = -1;
+		if(NULL == sv->ld || 0 == sv->use ||
+		   (NULL != lc->cur && sv != lc->cur))
+			continue;
+
+		if(LO_BIND == op->kind) {
+			if(op->serv && LB_SERV == sv->bind &&
+			   0 == strcmp(sv->bdn, op->dn)) {
+				ok++;
+				continue;
+			}
+			if(NULL != sv->bdn) {
+				misc_free(FL, sv->bdn);
+				sv->bdn = NULL;
+			}
+			sv->bind = LB_NONE;
+			if('\0' == op->dn[0])
+				sv->msg = ldap_simple_bind(sv->ld, 0, 0);
+			else
+				sv->msg = ldap_simple_bind(sv->ld,
+				                           op->dn, op->pw);
+		} else {
+			sv->msg = ldap_search(sv->ld, op->dn,
+			                      LDAP_SCOPE_SUBTREE, op->flt,
+			                      op->attrs, op->only);
+		}
+		if(sv->msg < 0) {
+			sv->msg = -1;
+			GET_LDERROR(sv->ld, err);
+			ldap_srv_lost(sv, err);
+			continue;
+		}
+		cnt++;
+	}
+
+	due = time(NULL) + config_int(NULL, "LDAPTimeOut", LDAP_OPWAIT);
+	while(cnt > 0) {
 		/*
-		** check if we should use auth-/base-dn for bind
+		** Collect the answers that are in
 		*/
-		bind_pw = pwd;
-		bind_dn = 0;
-		if(0 == strcasecmp(ptr, "auto")) {
-			bind_dn = prep_bind_auto(ld, str, auth_dn ?
-			                         auth_dn : base_dn,
-			                         ctx->cli_ctrl->peer);
-			auth_ok = 1;
-			if(NULL == bind_dn) return -1;
-		} else
-		if(0 == strcasecmp(ptr, "AuthDN")) {
-			bind_dn = prep_bind_auto(ld, str, auth_dn,
-			                         ctx->cli_ctrl->peer);
-			auth_ok = 1;
-			if(NULL == bind_dn) return -1;
-		} else
-		if(0 == strcasecmp(ptr, "BaseDN")) {
-			bind_dn = prep_bind_auto(ld, str, base_dn,
-			                         ctx->cli_ctrl->peer);
-			auth_ok = 1;
-			if(NULL == bind_dn) return -1;
-		} else {
+		for(i = 0; i < lc->nsrv; i++) {
+			sv = &lc->srv[i];
+			if(sv->msg < 0)
+				continue;
+			tv.tv_sec  = 0;
+			tv.tv_usec = 0;
+			msg = NULL;
+			j = ldap_result(sv->ld, sv->msg, LDAP_MSG_ALL,
+			                &tv, &msg);
+			if(0 == j)
+				continue;
+			sv->msg = -1;
+			cnt--;
+
+			if(j < 0) {
+				GET_LDERROR(sv->ld, err);
+				if(LDAP_SUCCESS == err)
+					err = LDAP_SERVER_DOWN;
+				ldap_srv_lost(sv, err);
+				continue;
+			}
+			err = ldap_result2error(sv->ld, msg, 0);
+			if(0 != ldap_sick(err)) {
+				ldap_msgfree(msg);
+				ldap_srv_lost(sv, err);
+				continue;
+			}
+			sv->good++;
+
+			if(LO_BIND == op->kind) {
+				ldap_msgfree(msg);
+				msg = NULL;
+				if(LDAP_SUCCESS == err) {
+					sv->bdn  = misc_strdup(FL, op->dn);
+					sv->bind = op->serv ? LB_SERV : LB_USER;
+				}
+				if(op->serv) {
+					if(LDAP_SUCCESS == err)
+						ok++;
+					else
+						sv->use = 0;
+					continue;
+				}
+			}
+
 			/*
-			** check if we have a format in BindDN
+			** The first answer decides the lookup
 			*/
-			bind_dn = prep_bind_fmt(ptr, who);
-			if(NULL == bind_dn) {
-				/*
-				** use static LDAPBind DN and PW
-				*/
-				bind_dn = misc_strdup(FL, ptr);
-				bind_pw = config_str(NULL, "LDAPBindPW", NULL);
-			} else {
-				auth_ok = 1;
+			if(NULL == lc->cur) {
+				lc->cur = sv;
+				lc->ld  = sv->ld;
+				sv->wins++;
+			}
+			for(j = 0; j < lc->nsrv; j++) {
+				if(lc->srv[j].msg < 0)
+					continue;
+				ldap_abandon(lc->srv[j].ld, lc->srv[j].msg);
+				lc->srv[j].msg = -1;
 			}
+			if(NULL != res)
+				*res = msg;
+			else if(NULL != msg)
+				ldap_msgfree(msg);
+			return err;
 		}
+		if(0 == cnt)
+			break;
 
 		/*
-		** bind usind a dn & pw
+		** Wait for more; libraries not telling their
+		** socket are polled
 		*/
-		lderr = ldap_simple_bind_s(ld, bind_dn, bind_pw);
-		if(LDAP_SUCCESS != lderr) {
-			syslog_write(U_ERR,
-			      "can't bind LDAP dn='%.256s' for %s: %.512s",
-			      bind_dn, ctx->cli_ctrl->peer,
-			      ldap_err2string(lderr));
-			return -1;
+		FD_ZERO(&rfds);
+		for(i = 0, maxfd = -1, poll = 0; i < lc->nsrv; i++) {
+			sv = &lc->srv[i];
+			if(sv->msg < 0)
+				continue;
+			fd = -1;
+#if defined(HAVE_LDAP_GET_OPTION) && defined(LDAP_OPT_DESC)
+			if(LDAP_SUCCESS != ldap_get_option(sv->ld,
+			                           LDAP_OPT_DESC, &fd))
+				fd = -1;
+#endif
+			if(fd < 0 || fd >= FD_SETSIZE) {
+				poll = 1;
+				continue;
+			}
+			FD_SET(fd, &rfds);
+			if(fd > maxfd)
+				maxfd = fd;
 		}
-		syslog_write(T_DBG,
-		             "[ %s ] LDAP bind to dn='%.256s': succeed", ctx->cli_ctrl->peer, bind_dn);
-	} else {
-		/*
-		** bind anonymously
-		*/
-		lderr = ldap_simple_bind_s(ld, 0, 0);
-		if(LDAP_SUCCESS != lderr) {
-			syslog_write(T_ERR,
-			       "[ %s ] can't bind LDAP anonymously for %s: %.512s",
-			      ctx->cli_ctrl->peer, ctx->cli_ctrl->peer, ldap_err2string(lderr));
-			return -1;
+		if((tv.tv_sec = due - time(NULL)) <= 0)
+			break;
+		tv.tv_usec = 0;
+		if(poll) {
+			tv.tv_sec  = 0;
+			tv.tv_usec = 10000;
 		}
+		select(maxfd + 1, &rfds, NULL, NULL, &tv);
 	}
 
-	syslog_write(U_INF, "[ % s ] reading data for '%s' from LDAP",ctx->cli_ctrl->peer, who);
-	if(NULL != base_dn) {
-		syslog_write(T_DBG,
-		             "[ %s ] LDAP search: base='%.256s' filter='%.256s'",
-		             ctx->cli_ctrl->peer, base_dn, str);
-		result = 0;
-		lderr  = ldap_search_s(ld, base_dn, LDAP_SCOPE_SUBTREE,
-		                      str, NULL, 0, &result);
-				      
-		if(LDAP_SUCCESS != lderr) {
-			syslog_write(T_ERR,
-			             "[ %s ] can't read LDAP data for %s: %.512s",
-			             ctx->cli_ctrl->peer,ctx->cli_ctrl->peer,
-			             ldap_err2string(lderr));
-			return -1;
+	/*
+	** Servers that did not answer in time are out
+	*/
+	for(i = 0; i < lc->nsrv; i++) {
+		sv = &lc->srv[i];
+		if(sv->msg < 0)
+			continue;
+		syslog_write(T_WRN, "LDAP server %s:%u did not answer in time",
+		             sv->host, sv->port);
+		ldap_abandon(sv->ld, sv->msg);
+		sv->msg = -1;
+		err = LD_TMOUT;
+		ldap_srv_lost(sv, err);
+	}
+	if(LO_BIND == op->kind && op->serv && ok > 0)
+		return LDAP_SUCCESS;
+	return err;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_bind_as
+**
+**	Parameters....:	lc		Pointer to connection
+**			dn		DN to bind (NULL=anonymous)
+**			pw		Password for the DN
+**			serv		1 for the proxy's own DN
+**
+**	Return........:	LDAP error code
+**
+**	Purpose.......: Bind the connection. The bind as the
+**			proxy itself (anonymous, pre-bind or a
+**			static BindDN) is kept across lookups;
+**			user binds check a password and are
+**			always done.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_bind_as(LDCONN *lc, char *dn, char *pw, int serv)
+{
+	LDOP op;
+	int  err;
+
+	memset(&op, 0, sizeof(op));
+	op.kind = LO_BIND;
+	op.serv = serv;
+	op.dn   = (NULL == dn) ? "" : dn;
+	op.pw   = pw;
+
+	if(LDAP_SUCCESS != (err = ldap_race(lc, &op, NULL)))
+		ldap_lost(lc, err);
+	return err;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_find
+**
+**	Parameters....:	lc		Pointer to connection
+**			base		Search base DN
+**			flt		Search filter
+**			attrs		Attributes to return
+**			only		1=attribute names only
+**			res		Where to put the result
+**
+**	Return........:	LDAP error code
+**
+**	Purpose.......: Search the subtree below base.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_find(LDCONN *lc, char *base, char *flt,
+                     char **attrs, int only, LDAPMessage **res)
+{
+	LDOP op;
+
+	memset(&op, 0, sizeof(op));
+	op.kind  = LO_FIND;
+	op.dn    = base;
+	op.flt   = flt;
+	op.attrs = attrs;
+	op.only  = only;
+	return ldap_race(lc, &op, res);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_lost
+**
+**	Parameters....:	lc		Pointer to connection
+**			err		LDAP error code
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Remember a failed operation and note if
+**			the error means that the server connection
+**			is gone (e.g. an idle timeout on the server
+**			side).
+**
+** ------------------------------------------------------------ */
+
+static void ldap_lost(LDCONN *lc, int err)
+{
+	lc->err = err;
+	if(2 == ldap_sick(err))
+		lc->down = 1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_serve
+**
+**	Parameters....:	lc		Pointer to connection
+**			rq		Pointer to the request
+**			rp		Pointer to the reply
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Look up a user over the kept connections,
+**			which are reopened once if the lookup
+**			lost its server. A denial is marked as
+**			temporary if the server failed, so it
+**			is not cached.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_serve(LDCONN *lc, LDREQ *rq, LDREP *rp)
+{
+	int try, i;
+
+	for(try = 0; try < 2; try++) {
+		memset(rp, 0, sizeof(LDREP));
+		memset(rp->off, -1, sizeof(rp->off));
+		rp->rc   = -1;
+		rp->temp = 1;
+
+		if(0 != ldap_conn_open(lc, rq->peer))
+			return;
+
+		for(i = 0; i < lc->nsrv; i++)
+			lc->srv[i].use = (NULL != lc->srv[i].ld);
+		lc->cur  = NULL;
+		lc->ld   = NULL;
+		lc->down = 0;
+		lc->err  = LDAP_SUCCESS;
+		ldap_fetch(lc, rq, rp);
+		if(0 == lc->down) {
+			rp->temp = (0 != rp->rc &&
+			            LDAP_SUCCESS != lc->err &&
+			            LDAP_INVALID_CREDENTIALS != lc->err);
+			return;
 		}
 
-		
+		syslog_write(T_WRN, "[ %s ] LDAP server connection lost%s",
+		             rq->peer, try ? "" : " - reconnecting");
+	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	prep_bind_auto
+**
+**	Parameters....:	lc		Pointer to connection
+**			flt		LDAP search filter
+**			base		BaseDN to search in
+**			peer		Peer name for syslog
+**
+**	Return........:	bind-dn or NULL
+**
+**	Purpose.......:	Searches using anonymous bind
+**			for a dn we want to bind later.
+**
+** ------------------------------------------------------------ */
+
+static char* prep_bind_auto(LDCONN *lc, char *flt, char *base, char *peer)
+{
+	LDAPMessage *result, *e;
+	char        *attrs[] = {0, 0};
+	char        *bind_dn, *p, *d;
+	int          err;
+
+	if(NULL == base || '\0' == base[0]) {
+		misc_die(FL,"prep_bind_auto: ?base?");
+	}
+
+	/*
+	** pre-bind (anonymously)
+	*/
+	if((d = config_str(NULL, "LDAPPreBindDN", NULL)) &&
+	   (p = config_str(NULL, "LDAPPreBindPW", NULL))) {
+	    err = ldap_bind_as(lc, d, p, 1);
+	} else {
+	    err = ldap_bind_as(lc, 0, 0, 1);
+	}
+	if(LDAP_SUCCESS != err) {
+		syslog_write(T_ERR,
+		       "can't bind LDAP anonymously for %s: %.512s",
+		       peer, ldap_err2string(err));
+		return NULL;
+	}
+
+	result   = 0;
+	attrs[0] = config_str(NULL, "LDAPIdentifier", "CN");
+
+	err = ldap_find(lc, base, flt, attrs, 1, &result);
+	if(LDAP_SUCCESS != err) {
+		ldap_lost(lc, err);
+		syslog_write(T_ERR,
+		       "can't find valid bind-dn for %s: %.512s",
+		       peer, ldap_err2string(err));
+		if(result) ldap_msgfree(result);
+		return NULL;
+	}
+
+	e = ldap_first_entry(lc->ld, result);
+	if(NULL == e) {
+		GET_LDERROR(lc->ld, err);
+		syslog_write(T_ERR,
+		       "can't find valid bind-dn for %s", peer);
+		ldap_msgfree(result);
+		return NULL;
+	}
+
+	/*
+	** OK, we have a DN
+	*/
+	if(NULL != (p = ldap_get_dn(lc->ld, e))) {
+		bind_dn = misc_strdup(FL, p);
+		ldap_memfree(p);
+	} else {
+		bind_dn = NULL;
+	}
+	ldap_msgfree(result);
+	syslog_write(T_DBG | L_AUTH, "auto bind-dn='%.256s' for %s",
+		             NIL(bind_dn), peer);
+	return bind_dn;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	prep_bind_fmt
+**
+**	Parameters....:	str		Bind-DN fmt string
+**			who		Current user name
+**
+**	Return........:	bind-dn or NULL
+**
+**	Purpose.......:	Checks if str contains a fmt
+**			and constructs a new base-dn.
+**
+** ------------------------------------------------------------ */
+
+static char* prep_bind_fmt(char *str, char *who)
+{
+	char   *bind_dn, *p;
+	int    fmt = 0;
+	size_t len;
+
+	/*
+	** search for exactly one %s; if any other
+	** fmt's are present report an parse error.
+	*/
+	for(p=str; p && p[0] && (p = strchr(p, '%')); p++) {
+		if(!fmt && ('s' == p[1] || 'S' == p[1])) {
+			fmt = 1;
+		} else {
+			errno = 0;
+			misc_die(FL,"prep_bind_fmt: ?str?");
+		}
+	}
+
+	if(fmt) {
+		/*
+		** constuct LDAPBind DN and PW
+		*/
+		len = strlen(who) + strlen(str);
+		bind_dn = misc_alloc(FL, len);
+#if defined(HAVE_SNPRINTF)
+		snprintf(bind_dn, len, str, who);
+#else
+		sprintf(bind_dn, str, who);
+#endif
+		return bind_dn;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_fetch
+**
+**	Parameters....:	lc		Pointer to connection
+**			rq		Pointer to the request
+**			rp		Pointer to the reply
+**
+**	Return........:	(none, result in rp->rc)
+**
+**	Purpose.......: Authenticate the user and read its
+**			specific parameters from an LDAP Server.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_fetch(LDCONN *lc, LDREQ *rq, LDREP *rp)
+{
+	char str[MAX_PATH_SIZE];
+	char *bind_dn, *bind_pw;
+	char *base_dn, *auth_dn;
+	char *idnt, *objc, *ptr;
+	char *who = rq->who, *pwd = rq->pwd, *peer = rq->peer;
+	int   lderr, auth_ok, serv, i;
+	LDAPMessage *result, *e;
+
+	/* Basic sanity */
+	if(lc == NULL || lc->nsrv == 0 || rp == NULL) {
+		misc_die(FL, "ldap_fetch: ?lc? ?rp?");
+	}
+
+	/*
+	** construct filter for the search
+	**	(by LDAPIdentifier, maybe also ObjectClass)
+	*/
+	idnt = config_str(NULL, "LDAPIdentifier", "CN");
+	objc = config_str(NULL, "LDAPObjectClass", NULL);
+	if(NULL != objc) {
+#if defined(HAVE_SNPRINTF)
+		snprintf(str, sizeof(str),
+			  "(&(ObjectClass=%.256s)(%.256s=%.256s))",
+			  objc,  idnt, who);
+#else
+		sprintf(str,
+			  "(&(ObjectClass=%.256s)(%.256s=%.256s))",
+			  objc,  idnt, who);
+#endif
+	} else {
+#if defined(HAVE_SNPRINTF)
+		snprintf(str, sizeof(str), "(%.256s=%.256s)",
+			  idnt, who);
+#else
+		sprintf(str, "(%.256s=%.256s)", idnt, who);
+#endif
+	}
+
+	auth_ok = 0; /* OK if non-anonymous bind */
+	auth_dn = config_str(NULL, "LDAPAuthDN", NULL);
+	base_dn = config_str(NULL, "LDAPBaseDN", NULL);
+	if(NULL != (ptr = config_str(NULL, "LDAPBindDN", NULL))) {
+		/*
+		** check if we should use auth-/base-dn for bind
+		*/
+		bind_pw = pwd;
+		bind_dn = 0;
+		if(0 == strcasecmp(ptr, "auto")) {
+			bind_dn = prep_bind_auto(lc, str, auth_dn ?
+			                         auth_dn : base_dn, peer);
+			auth_ok = 1;
+			if(NULL == bind_dn) return;
+		} else
+		if(0 == strcasecmp(ptr, "AuthDN")) {
+			bind_dn = prep_bind_auto(lc, str, auth_dn, peer);
+			auth_ok = 1;
+			if(NULL == bind_dn) return;
+		} else
+		if(0 == strcasecmp(ptr, "BaseDN")) {
+			bind_dn = prep_bind_auto(lc, str, base_dn, peer);
+			auth_ok = 1;
+			if(NULL == bind_dn) return;
+		} else {
+			/*
+			** check if we have a format in BindDN
+			*/
+			bind_dn = prep_bind_fmt(ptr, who);
+			if(NULL == bind_dn) {
+				/*
+				** use static LDAPBind DN and PW
+				*/
+				bind_dn = misc_strdup(FL, ptr);
+				bind_pw = config_str(NULL, "LDAPBindPW", NULL);
+			} else {
+				auth_ok = 1;
+			}
+		}
+
+		/*
+		** bind usind a dn & pw; a static one is
+		** the proxy's own and stays bound
+		*/
+		serv  = !auth_ok;
+		lderr = ldap_bind_as(lc, bind_dn, bind_pw, serv);
+		if(LDAP_SUCCESS != lderr) {
+			syslog_write(U_ERR,
+			      "can't bind LDAP dn='%.256s' for %s: %.512s",
+			      bind_dn, peer, ldap_err2string(lderr));
+			misc_free(FL, bind_dn);
+			return;
+		}
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP bind to dn='%.256s': succeed", peer, bind_dn);
+		misc_free(FL, bind_dn);
+	} else {
+		/*
+		** bind anonymously
+		*/
+		lderr = ldap_bind_as(lc, 0, 0, 1);
+		if(LDAP_SUCCESS != lderr) {
+			syslog_write(T_ERR,
+			       "[ %s ] can't bind LDAP anonymously for %s: %.512s",
+			      peer, peer, ldap_err2string(lderr));
+			return;
+		}
+	}
+
+	syslog_write(U_INF, "[ % s ] reading data for '%s' from LDAP",peer, who);
+	if(NULL != base_dn) {
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP search: base='%.256s' filter='%.256s'",
+		             peer, base_dn, str);
+		result = 0;
+		lderr  = ldap_find(lc, base_dn, str, NULL, 0, &result);
+
+		if(LDAP_SUCCESS != lderr) {
+			ldap_lost(lc, lderr);
+			syslog_write(T_ERR,
+			             "[ %s ] can't read LDAP data for %s: %.512s",
+			             peer, peer, ldap_err2string(lderr));
+			if(result) ldap_msgfree(result);
+			return;
+		}
+
+
+
+		/*
+		** Check if we have a user data
+		** (else return 'error' or 'empty')
+		*/
+		if(NULL == (e = ldap_first_entry(lc->ld, result))) {
+			GET_LDERROR(lc->ld,lderr);
+			syslog_write(T_DBG | L_AUTH,
+			             "empty LDAP result for %s in base-dn='%s'",
+			             peer, base_dn);
+			ldap_msgfree(result);
+			e = result = NULL;
+		}
+	} else {
+		e = result = NULL;
+	}
+
+	/*
+	** Preform auth on userauth if type is ldap
+	*/
+	ptr = config_str(NULL, "UserAuthType", NULL);
+	if( ptr && 0 == strcasecmp(ptr, "ldap")) {
+		LDAPMessage *res=0, *a=e;
+		int rc = 0;
+
+		/*
+		** if LDAPAuthDN set, do auth on a different base...
+		*/
+		if(NULL != auth_dn) {
+			syslog_write(T_DBG | L_AUTH,
+			       "LDAP auth: base='%.256s' filter='%.256s'",
+			       auth_dn, str);
+
+			lderr = ldap_find(lc, auth_dn, str, NULL, 0, &res);
+			if(LDAP_SUCCESS != lderr) {
+				ldap_lost(lc, lderr);
+				syslog_write(T_ERR,
+				    "can't read LDAP auth-data for %s: %.512s",
+				    peer, ldap_err2string(lderr));
+				if(res) ldap_msgfree(res);
+				if(result) ldap_msgfree(result);
+				return;
+			}
+
+			if(NULL == (a = ldap_first_entry(lc->ld, res))) {
+				GET_LDERROR(lc->ld,lderr);
+				syslog_write(T_WRN,
+				    "empty LDAP result for %s in auth-dn='%s'",
+				    peer, auth_dn);
+				ldap_msgfree(res);
+				if(result) ldap_msgfree(result);
+				return;
+			}
+		} else
+		if(NULL == base_dn || NULL == e) {
+			errno = 0;
+			misc_die(FL, "ldap_fetch: ?LDAPBaseDN?");
+		}
+
+		/*
+		** OK, let's check the user auth now
+		*/
+		rc = ldap_auth(lc, a, who, pwd, peer);
+		if(res) ldap_msgfree(res);
+		if(0 > rc)  {
+			syslog_write(U_ERR,
+			             "LDAP user auth failed for %s from %s",
+			             who, peer);
+			if(result) ldap_msgfree(result);
+			return;
+		}
+		/*
+		** do not allow to configure UserAuthType=ldap
+		** and to skip all manual ldap checks without
+		** an sufficient ldap-bind.
+		*/
+		if(0 == rc && 0 == auth_ok) {
+			syslog_write(T_ERR, "LDAP auth config not sufficient");
+			if(result) ldap_msgfree(result);
+			return;
+		}
+
+	}
+
+	/*
+	** read proxy user profile data ...
+	** if we have a base_dn and result
+	*/
+	rp->rc = 0;
+	if(NULL == base_dn || NULL == e) {
+		return;
+	}
+
+	/*
+	** Keep the attribute values for ldap_apply
+	*/
+	rp->found = 1;
+	for(i = 0; i < LA_CNT; i++) {
+		ldap_keep(rp, i, ldap_attrib(lc->ld, e, ldap_attrs[i], NULL));
+	}
+
+	/*
+	** All relevant attributes have been read
+	*/
+	ldap_msgfree(result);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_keep
+**
+**	Parameters....:	rp		Pointer to the reply
+**			idx		Attribute index (LA_*)
+**			val		Attribute value or NULL
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Store an attribute value in the reply.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_keep(LDREP *rp, int idx, char *val)
+{
+	size_t len;
+
+	rp->off[idx] = -1;
+	if(NULL == val)
+		return;
+
+	len = strlen(val) + 1;
+	if(rp->len + len > sizeof(rp->dat)) {
+		syslog_write(T_WRN, "LDAP attribute %s too long - ignored",
+		             ldap_attrs[idx]);
+		return;
+	}
+	memcpy(rp->dat + rp->len, val, len);
+	rp->off[idx] = rp->len;
+	rp->len += len;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_apply
+**
+**	Parameters....:	ctx		Pointer to user context
+**			rp		Pointer to the reply
+**
+**	Return........:	0 on success
+**
+**	Purpose.......: Evaluate the user specific parameters
+**			read from the LDAP Server.
+**
+** ------------------------------------------------------------ */
+
+#define LA_VAL(rp,i)	((rp)->off[i] < 0 ? NULL : (rp)->dat + (rp)->off[i])
+
+static int ldap_apply(CONTEXT *ctx, LDREP *rp)
+{
+	char *p, *q;
+	u_int16_t l, u;
+
+	if(0 != rp->rc)
+		return -1;
+	if(0 == rp->found)
+		return 0;
+
+	/*
+	** Evaluate the destination FTP server address.
+	*/
+	p = LA_VAL(rp, LA_DADDR);
+	if(NULL != p && ctx->magic_addr == INADDR_ANY) {
+		ctx->srv_addr = socket_str2addr(p, INADDR_ANY);
+		if(INADDR_ANY == ctx->srv_addr) {
+			syslog_write(T_ERR, "can't eval DestAddr for %s",
+			                    ctx->cli_ctrl->peer);
+			return -1;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "ldap DestAddr for %s: '%s'", ctx->cli_ctrl->peer,
+				socket_addr2str(ctx->srv_addr));
+#endif
+	}
+
+	/*
+	** Evaluate the destination FTP server port
+	*/
+	p = LA_VAL(rp, LA_DPORT);
+	if(NULL != p && ctx->magic_port == INPORT_ANY) {
+		ctx->srv_port = socket_str2port(p, INPORT_ANY);
+		if(INPORT_ANY == ctx->srv_port) {
+			syslog_write(T_ERR, "can't eval DestPort for %s",
+			                    ctx->cli_ctrl->peer);
+			return -1;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "ldap DestPort for %s: %u",
+			ctx->cli_ctrl->peer, ctx->srv_port);
+#endif
+	}
+
+	/*
+	** Evaluate the destination transfer mode
+	*/
+	p = LA_VAL(rp, LA_DMODE);
+	if(NULL != p) {
+		if(strcasecmp(p, "active") == 0)
+			ctx->srv_mode = MOD_ACT_FTP;
+		else if (strcasecmp(p, "passive") == 0)
+			ctx->srv_mode = MOD_PAS_FTP;
+		else if (strcasecmp(p, "client") == 0)
+			ctx->srv_mode = MOD_CLI_FTP;
+		else {
+			syslog_write(T_ERR, "can't eval DestMode for %s",
+			                    ctx->cli_ctrl->peer);
+			return -1;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "ldap DestMode for %s: %s", ctx->cli_ctrl->peer, p);
+#endif
+	}
+
+	/*
+	** Evaluate the port ranges
+	*/
+	p = LA_VAL(rp, LA_DMINP);
+	q = LA_VAL(rp, LA_DMAXP);
+	if(NULL != p && NULL != q) {
+		l = socket_str2port(p, INPORT_ANY);
+		u = socket_str2port(q, INPORT_ANY);
+		if (l > 0 && u > 0 && u >= l) {
+			ctx->srv_lrng = l;
+			ctx->srv_urng = u;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "ldap DestRange for %s: %u-%u", ctx->cli_ctrl->peer,
+		         ctx->srv_lrng, ctx->srv_urng);
+#endif
+	}
+
+	p = LA_VAL(rp, LA_AMINP);
+	q = LA_VAL(rp, LA_AMAXP);
+	if(NULL != p && NULL != q) {
+		l = socket_str2port(p, INPORT_ANY);
+		u = socket_str2port(q, INPORT_ANY);
+		if (l > 0 && u > 0 && u >= l) {
+			ctx->act_lrng = l;
+			ctx->act_urng = u;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "ActiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
+		         ctx->act_lrng, ctx->act_urng);
+#endif
+	}
+
+	p = LA_VAL(rp, LA_PMINP);
+	q = LA_VAL(rp, LA_PMAXP);
+	if(NULL != p && NULL != q) {
+		l = socket_str2port(p, INPORT_ANY);
+		u = socket_str2port(q, INPORT_ANY);
+		if (l > 0 && u > 0 && u >= l) {
+			ctx->pas_lrng = l;
+			ctx->pas_urng = u;
+		}
+#if defined(COMPILE_DEBUG)
+		debug(2, "PassiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
+		         ctx->pas_lrng, ctx->pas_urng);
+#endif
+	}
+
+	/*
+	** Setup other configuration options
+	*/
+	p = LA_VAL(rp, LA_SADDR);
+	if(NULL != p) {
+		if (strcasecmp(p, "y") == 0)
+			ctx->same_adr = 1;
+		else if (strcasecmp(p, "on") == 0)
+			ctx->same_adr = 1;
+		else if (strcasecmp(p, "yes") == 0)
+			ctx->same_adr = 1;
+		else if (strcasecmp(p, "true") == 0)
+			ctx->same_adr = 1;
+		else if (*p >= '0' && *p <= '9')
+			ctx->same_adr = (atoi(p) != 0);
+		else
+			ctx->same_adr = 0;
+#if defined(COMPILE_DEBUG)
+		debug(2, "SameAddress for %s: %s", ctx->cli_ctrl->peer,
+		         ctx->same_adr ? "yes" : "no");
+#endif
+	}
+
+// Fred Patch Add Timeout in ftpclient.c
+
+	p = LA_VAL(rp, LA_TMOUT);
+	if(NULL == p)
+		p = "900";
+	if (*p >= '0' && *p <= '9')
+		ctx->timeout = atoi(p);
+	else
+		ctx->timeout = 900;
+
+#if defined(COMPILE_DEBUG)
+	debug(2, "TimeOut for %s: %d", ctx->cli_ctrl->peer,
+	ctx->timeout);
+#endif
+
+	/*
+	** Adjust the allow/deny flags for the commands
+	*/
+	p = LA_VAL(rp, LA_VCMDS);
+	if(NULL != p) {
+		cmds_set_allow(ctx, p);
+	}
+
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_auth
+**
+**	Parameters....:	lc		Pointer to connection
+**			e		Pointer to result buffer
+**			who		Pointer to user name
+**			pwd		Pointer to user pwd
+**			peer		Peer name for syslog
+**
+**	Return........:	0 on success
+**
+**	Purpose.......: Preform LDAP userauth
+**
+** ------------------------------------------------------------ */
+
+static int   ldap_auth(LDCONN *lc, LDAPMessage *e, char *who, char *pwd,
+                                                   char *peer)
+{
+	char str[MAX_PATH_SIZE];
+	char *v, *p, *q;
+	size_t len;
+	int    xrc = 0;
+	LDAP  *ld  = lc->ld;
+
+	if (ld == NULL || e == NULL || who == NULL)
+		misc_die(FL, "ldap_checkauth: ?ld? ?e? ?who?");
+
+	/*
+	** check "user enabled" flag if present
+	*/
+	if( (p = config_str(NULL, "LDAPAuthOKFlag", NULL))) {
+		misc_strncpy(str, p, sizeof(str));
+		if( (v = strchr(str, '=')))
+			*v++ = '\0';
+		else	v = 0;
+
+		if(v && strlen(v) && strlen(str)) {
+			if(0 != ldap_exists(ld, e, str, v, 0)) {
+				syslog_write(U_WRN,
+				"access denied for %s", NIL(who));
+				return -1;
+			} else {
+				syslog_write(T_DBG | L_AUTH,
+				"LDAP auth ok-check: '%.256s'='%.256s' passed",
+				NIL(str), NIL(v));
+				xrc = 1;
+			}
+		} else {
+			errno = 0;
+			misc_die(FL, "ldap_auth: ?LDAPAuthOKFlag?");
+		}
+	} else {
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP auth ok-check skipped", peer);
+		// Patch Fred 1 partie //
+		if(0 != patch_ldapgroup(lc, who, peer))
+			return -1;
+	}
+
+	/*
+	** check user pass match
+	*/
+
+	if( (p = config_str(NULL, "LDAPAuthPWAttr", "")) && strlen(p)) {
+		if(NULL == pwd)
+			pwd = "";
+			return -1;
+
+		v   = config_str(NULL, "LDAPAuthPWType", "plain");
+		q   = ldap_attrib(ld, e, p, "");
+		p   = 0;
+		len = 0;
+
+		if( !strncasecmp(v, "plain", sizeof("plain")-1)) {
+			/*
+			** plain passwd - no prefix
+			*/
+			len = sizeof("plain")-1;
+			p   = pwd;
+#if defined(HAVE_CRYPT)
+		} else
+		if( !strncasecmp(v, "crypt", sizeof("plain")-1)) {
+			/*
+			** crypt - no prefix
+			*/
+			len = sizeof("plain")-1;
+			p   = crypt(pwd, q);
+		} else
+		if( !strncasecmp(v, "{crypt}", sizeof("{crypt}")-1)) {
+			/*
+			** crypt - {crypt} prefix
+			*/
+			len = sizeof("{crypt}")-1;
+			if(strncasecmp(q, "{crypt}", len)) {
+				syslog_write(T_ERR,
+				             "ldap user auth - prefix missed");
+				return -1;
+			}
+			q+=len;
+			p = crypt(pwd, q);
+#endif
+		} else {
+			errno = 0;
+			misc_die(FL, "ldap_auth: ?LDAPAuthPWType?");
+		}
+
+		/*
+		** check if we have different minimal length
+		** it is coded in latest "char", i.e. plain9
+		*/
+		if(0 < len && strlen(v) == len+1 &&
+		   '0' <= v[len] && '9' >= v[len])
+		{
+			len = (size_t)v[len] - '0';
+		} else	len = PASS_MIN_LEN;
+
+		syslog_write(T_DBG | L_AUTH,
+		             "LDAP auth pw-type[%d]='%.256s'", len, v);
+#if defined(COMPILE_DEBUG)
+		debug(3,            "LDAP auth pw-check: '%.256s' ?= '%.256s'",
+		                    NIL(q), NIL(p));
+#endif
 
 		/*
-		** Check if we have a user data
-		** (else return 'error' or 'empty')
+		** check (lenght) and compare passwds; the user
+		** account is locked if LDAP-PWD is "*" or "!"
 		*/
-		if(NULL == (e = ldap_first_entry(ld, result))) {
-			GET_LDERROR(ld,lderr);
-			syslog_write(T_DBG,
-			             "empty LDAP result for %s in base-dn='%s'",
-			             ctx->cli_ctrl->peer, base_dn);
-			e = result = NULL;
+		if(p && strlen(p)>=len && strlen(q) == strlen(p) &&
+		   !(1==strlen(q) && ('*' == q[0] || '!' == q[0])))
+		{
+			if(0 == strcmp(q, p)) {
+				syslog_write(T_DBG | L_AUTH,
+				             "[ %s ] LDAP auth pw-check succeed", peer);
+				return xrc + 2;
+			}
 		}
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP auth pw-check failed", peer);
+		return -1;
 	} else {
-		e = result = NULL;
+		syslog_write(T_DBG | L_AUTH,
+		             "[ %s ] LDAP auth pw-check skipped", peer);
 	}
 
 	/*
-	** Preform auth on userauth if type is ldap
+	** OK, all configured manual LDAPAuth checks succeed...
 	*/
-	ptr = config_str(NULL, "UserAuthType", NULL);
-	if( ptr && 0 == strcasecmp(ptr, "ldap")) {
-		LDAPMessage *res=0, *a=e;
-		int rc = 0;
 
-		/*
-		** if LDAPAuthDN set, do auth on a different base...
-		*/
-		if(NULL != auth_dn) {
-			syslog_write(T_DBG,
-			       "LDAP auth: base='%.256s' filter='%.256s'",
-			       auth_dn, str);
+	return xrc;
+}
+#endif
 
-			lderr = ldap_search_s(ld, auth_dn, LDAP_SCOPE_SUBTREE,
-			                      str, NULL, 0, &res);
-			if(LDAP_SUCCESS != lderr) {
-				syslog_write(T_ERR,
-				    "can't read LDAP auth-data for %s: %.512s",
-				    ctx->cli_ctrl->peer,
-				    ldap_err2string(lderr));
-				if(result) ldap_msgfree(result);
-				return -1;
-			}
 
-			if(NULL == (a = ldap_first_entry(ld, res))) {
-				GET_LDERROR(ld,lderr);
-				syslog_write(T_WRN,
-				    "empty LDAP result for %s in auth-dn='%s'",
-				    ctx->cli_ctrl->peer, auth_dn);
-				if(result) ldap_msgfree(result);
-				return -1;
-			}
-		} else
-		if(NULL == base_dn || NULL == e) {
-			ldap_unbind(ld);
-			misc_die(FL, "ldap_fetch: ?LDAPBaseDN?");
-		}
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pool_check
+**
+**	Parameters....:	renew		1 after a config reload
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: keep LDAPHelpers helper processes
+**			running. They hold bound connections to
+**			the LDAPServer and serve the lookups of
+**			all children, which send their requests
+**			over a datagram socket pair created here
+**			before the first child is forked. After
+**			a reload the helpers are replaced, so
+**			they use the new configuration.
+**
+** ------------------------------------------------------------ */
 
-		/*
-		** OK, let's check the user auth now
-		*/
-		rc = ldap_auth(ld, a, who, pwd, ctx);
-		if(res) ldap_msgfree(res);
-		if(0 > rc)  {
-			syslog_write(U_ERR,
-			             "LDAP user auth failed for %s from %s",
-			             who, ctx->cli_ctrl->peer);
-			if(result) ldap_msgfree(result);
-			return -1;
-		}
-		/*
-		** do not allow to configure UserAuthType=ldap
-		** and to skip all manual ldap checks without
-		** an sufficient ldap-bind.
-		*/
-		if(0 == rc && 0 == auth_ok) {
-			syslog_write(T_ERR, "LDAP auth config not sufficient");
-			if(result) ldap_msgfree(result);
-			return -1;
+void ldap_pool_check(int renew)
+{
+#if defined(HAVE_LIBLDAP)
+	int want, i;
+	time_t now;
+	pid_t pid;
+
+	if(renew) {
+		for(i = 0; i < LDAP_POOLMAX; i++) {
+			if((pid = pool_pid[i]) != 0)
+				kill(pid, SIGTERM);
+			pool_pid[i] = 0;
 		}
-
 	}
 
-	/*
-	** read proxy user profile data ...
-	** if we have a base_dn and result
-	*/
-	if(NULL == base_dn || NULL == e) {
-		return 0;
+	want = 0;
+	if(NULL != config_str(NULL, "LDAPServer", NULL))
+		want = config_int(NULL, "LDAPHelpers", 2);
+	if(want <= 0)
+		return;
+	if(want > LDAP_POOLMAX)
+		want = LDAP_POOLMAX;
+
+	if(-1 == pool_fd[0] &&
+	   0 != socketpair(AF_UNIX, SOCK_DGRAM, 0, pool_fd)) {
+		syslog_error("can't create LDAP helper socket");
+		pool_fd[0] = pool_fd[1] = -1;
+		return;
 	}
 
 	/*
-	** Evaluate the destination FTP server address.
+	** Start the missing ones, but don't let a
+	** failing helper respawn more than once a
+	** second
 	*/
-	p = ldap_attrib(ld, e, "DestinationAddress", NULL);
-	if(NULL != p && ctx->magic_addr == INADDR_ANY) {
-		ctx->srv_addr = socket_str2addr(p, INADDR_ANY);
-		if(INADDR_ANY == ctx->srv_addr) {
-			syslog_write(T_ERR, "can't eval DestAddr for %s",
-			                    ctx->cli_ctrl->peer);
-			ldap_msgfree(result);
-			return -1;
+	now = time(NULL);
+	for(i = 0; i < want; i++) {
+		if(0 != pool_pid[i] || pool_born[i] == now)
+			continue;
+		pool_born[i] = now;
+
+		switch(pid = fork()) {
+			case -1:
+				syslog_error("can't fork LDAP helper");
+				return;
+			case 0:
+				ldap_pool_serve();
+				exit(EXIT_SUCCESS);
+			default:
+				pool_pid[i] = pid;
+				syslog_write(T_DBG | L_AUTH, "LDAP helper %d "
+				             "started with pid=%d", i, (int) pid);
 		}
-#if defined(COMPILE_DEBUG)
-		debug(2, "ldap DestAddr for %s: '%s'", ctx->cli_ctrl->peer,
-				socket_addr2str(ctx->srv_addr));
-#endif
 	}
+#else
+	renew = renew;
+#endif
+}
 
-	/*
-	** Evaluate the destination FTP server port
-	*/
-	p = ldap_attrib(ld, e, "DestinationPort", NULL);
-	if(NULL != p && ctx->magic_port == INPORT_ANY) {
-		ctx->srv_port = socket_str2port(p, INPORT_ANY);
-		if(INPORT_ANY == ctx->srv_port) {
-			syslog_write(T_ERR, "can't eval DestPort for %s",
-			                    ctx->cli_ctrl->peer);
-			ldap_msgfree(result);
-			return -1;
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pool_gone
+**
+**	Parameters....:	pid		Terminated process
+**
+**	Return........:	1 if it was a helper
+**
+**	Purpose.......: Daemon: forget a helper that terminated,
+**			ldap_pool_check will start a new one.
+**			Called from the SIGCHLD handler.
+**
+** ------------------------------------------------------------ */
+
+int  ldap_pool_gone(pid_t pid)
+{
+#if defined(HAVE_LIBLDAP)
+	int i;
+
+	for(i = 0; i < LDAP_POOLMAX; i++) {
+		if(pool_pid[i] == pid) {
+			pool_pid[i] = 0;
+			return 1;
 		}
-#if defined(COMPILE_DEBUG)
-		debug(2, "ldap DestPort for %s: %u",
-			ctx->cli_ctrl->peer, ctx->srv_port);
+	}
+#else
+	pid = pid;
 #endif
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pool_stop
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: terminate the helper processes.
+**
+** ------------------------------------------------------------ */
+
+void ldap_pool_stop(void)
+{
+#if defined(HAVE_LIBLDAP)
+	int i;
+
+	for(i = 0; i < LDAP_POOLMAX; i++) {
+		if(0 != pool_pid[i])
+			kill(pool_pid[i], SIGTERM);
 	}
+#endif
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_init
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: create the cache of LDAP answers
+**			in shared memory, so that the children
+**			forked afterwards share it. Without this
+**			call (or with LDAPCacheSize 0) nothing
+**			is cached.
+**
+** ------------------------------------------------------------ */
+
+void ldap_cache_init(void)
+{
+#if defined(HAVE_LIBLDAP)
+	size_t len;
+	int cnt;
+
+	if(NULL != lctab || NULL == config_str(NULL, "LDAPServer", NULL))
+		return;
+	if((cnt = config_int(NULL, "LDAPCacheSize", LC_ENTRIES)) <= 0)
+		return;
 
 	/*
-	** Evaluate the destination transfer mode
+	** Round the size up to a power of two
 	*/
-	p = ldap_attrib(ld, e, "DestinationTransferMode", NULL);
-	if(NULL != p) {
-		if(strcasecmp(p, "active") == 0)
-			ctx->srv_mode = MOD_ACT_FTP;
-		else if (strcasecmp(p, "passive") == 0)
-			ctx->srv_mode = MOD_PAS_FTP;
-		else if (strcasecmp(p, "client") == 0)
-			ctx->srv_mode = MOD_CLI_FTP;
-		else {
-			syslog_write(T_ERR, "can't eval DestMode for %s",
-			                    ctx->cli_ctrl->peer);
-			ldap_msgfree(result);
-			return -1;
-		}
-#if defined(COMPILE_DEBUG)
-		debug(2, "ldap DestMode for %s: %s", ctx->cli_ctrl->peer, p);
-#endif
+	if(cnt > (1 << 16))
+		cnt = (1 << 16);
+	for(len = LC_MINSIZE; len < (size_t) cnt; len <<= 1)
+		;
+	cnt = (int) len;
+	len = sizeof(LCTAB) + (cnt - 1) * sizeof(LCACHE);
+
+#if defined(HAVE_SHARED)
+	lctab = (LCTAB *) mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(lctab == (LCTAB *) MAP_FAILED) {
+		syslog_error("can't map LDAP cache");
+		exit(EXIT_FAILURE);
 	}
+	memset((void *) lctab, 0, len);
+#else
+	lctab = (LCTAB *) misc_alloc(FL, len);
+#endif
+	lctab->mask = (u_int32_t) (cnt - 1);
 
 	/*
-	** Evaluate the port ranges
+	** Without the key, which never leaves memory,
+	** a password can't be checked against an entry
 	*/
-	p = ldap_attrib(ld, e, "DestinationMinPort", NULL);
-	q = ldap_attrib(ld, e, "DestinationMaxPort", NULL);
-	if(NULL != p && NULL != q) {
-		l = socket_str2port(p, INPORT_ANY);
-		u = socket_str2port(q, INPORT_ANY);
-		if (l > 0 && u > 0 && u >= l) {
-			ctx->srv_lrng = l;
-			ctx->srv_urng = u;
-		}
-#if defined(COMPILE_DEBUG)
-		debug(2, "ldap DestRange for %s: %u-%u", ctx->cli_ctrl->peer,
-		         ctx->srv_lrng, ctx->srv_urng);
-#endif
-	}
+	misc_random(lctab->key, sizeof(lctab->key));
 
-	p = ldap_attrib(ld, e, "ActiveMinDataPort", NULL);
-	q = ldap_attrib(ld, e, "ActiveMaxDataPort", NULL);
-	if(NULL != p && NULL != q) {
-		l = socket_str2port(p, INPORT_ANY);
-		u = socket_str2port(q, INPORT_ANY);
-		if (l > 0 && u > 0 && u >= l) {
-			ctx->act_lrng = l;
-			ctx->act_urng = u;
-		}
 #if defined(COMPILE_DEBUG)
-		debug(2, "ActiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
-		         ctx->act_lrng, ctx->act_urng);
+	debug(2, "LDAP cache: %d entries, %lu bytes",
+			cnt, (u_long) len);
 #endif
-	}
-
-	p = ldap_attrib(ld, e, "PassiveMinDataPort", NULL);
-	q = ldap_attrib(ld, e, "PassiveMaxDataPort", NULL);
-	if(NULL != p && NULL != q) {
-		l = socket_str2port(p, INPORT_ANY);
-		u = socket_str2port(q, INPORT_ANY);
-		if (l > 0 && u > 0 && u >= l) {
-			ctx->pas_lrng = l;
-			ctx->pas_urng = u;
-		}
-#if defined(COMPILE_DEBUG)
-		debug(2, "PassiveRange for %s: %u-%u", ctx->cli_ctrl->peer,
-		         ctx->pas_lrng, ctx->pas_urng);
 #endif
-	}
+}
 
-	/*
-	** Setup other configuration options
-	*/
-	p = ldap_attrib(ld, e, "SameAddress", NULL);
-	if(NULL != p) {
-		if (strcasecmp(p, "y") == 0)
-			ctx->same_adr = 1;
-		else if (strcasecmp(p, "on") == 0)
-			ctx->same_adr = 1;
-		else if (strcasecmp(p, "yes") == 0)
-			ctx->same_adr = 1;
-		else if (strcasecmp(p, "true") == 0)
-			ctx->same_adr = 1;
-		else if (*p >= '0' && *p <= '9')
-			ctx->same_adr = (atoi(p) != 0);
-		else
-			ctx->same_adr = 0;
-#if defined(COMPILE_DEBUG)
-		debug(2, "SameAddress for %s: %s", ctx->cli_ctrl->peer,
-		         ctx->same_adr ? "yes" : "no");
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_flush
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Daemon: forget all cached answers after
+**			a reload; they may stem from another
+**			server or other access rules.
+**
+** ------------------------------------------------------------ */
+
+void ldap_cache_flush(void)
+{
+#if defined(HAVE_LIBLDAP)
+	if(NULL == lctab)
+		return;
+
+	ldap_cache_lock(1);
+	lctab->gen++;
+	ldap_cache_lock(0);
 #endif
-	}
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_stats
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log the cache counters.
+**
+** ------------------------------------------------------------ */
 
-// Fred Patch Add Timeout in ftpclient.c
+void ldap_cache_stats(void)
+{
+#if defined(HAVE_LIBLDAP)
+	u_long hits, nhits, miss, stale, stored, amax;
+	double asum;
+	u_int32_t i;
+	int used = 0;
+	time_t now;
 
-	p = ldap_attrib(ld, e, "TimeOut", "900");
-	if(NULL != p) {
-		if (*p >= '0' && *p <= '9')
-		ctx->timeout = atoi(p);
-	else
-		ctx->timeout = 900;
+	if(NULL == lctab)
+		return;
 
-#if defined(COMPILE_DEBUG)
-	debug(2, "TimeOut for %s: %d", ctx->cli_ctrl->peer,
-	ctx->timeout);
+	now = time(NULL);
+	ldap_cache_lock(1);
+	hits   = lctab->hits;
+	nhits  = lctab->nhits;
+	miss   = lctab->miss;
+	stale  = lctab->stale;
+	stored = lctab->stored;
+	asum   = lctab->asum;
+	amax   = lctab->amax;
+	for(i = 0; i <= lctab->mask; i++) {
+		if(lctab->ent[i].gen == lctab->gen &&
+		   lctab->ent[i].expire > now)
+			used++;
+	}
+	ldap_cache_lock(0);
+
+	syslog_write(T_INF, "LDAP cache: %lu hits, %lu negative hits, "
+	             "%lu misses (%lu expired), hit ratio %.1f%%",
+	             hits, nhits, miss, stale, (hits + nhits + miss) ?
+	             100.0 * (hits + nhits) / (hits + nhits + miss) : 0.0);
+	syslog_write(T_INF, "LDAP cache: %lu answers stored, "
+	             "%d/%lu cached, age of hits avg %.1f s, max %lu s",
+	             stored, used, (u_long) lctab->mask + 1,
+	             (hits + nhits) ? asum / (hits + nhits) : 0.0, amax);
 #endif
 }
-/*
-** Adjust the allow/deny flags for the commands
-*/
 
-	p = ldap_attrib(ld, e, "ValidCommands", NULL);
-	if(NULL != p) {
-		cmds_set_allow(p);
+
+#if defined(HAVE_LIBLDAP)
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pool_send
+**
+**	Parameters....:	ctx		Pointer to user context
+**			rq		Pointer to the request
+**
+**	Return........:	0 if a helper got it, -1 if there is
+**			no helper (use an own connection)
+**
+**	Purpose.......: Child: pass a lookup to the helpers. The
+**			request carries the sending end of a
+**			datagram socket pair of the process, the
+**			answer is read by ldap_pend_event when
+**			socket_exec finds it there.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_pool_send(CONTEXT *ctx, LDREQ *rq)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	LDPEND *lp;
+
+	if(-1 == pool_fd[0])
+		return -1;
+
+	/*
+	** The answer socket is created in the process
+	** that uses it, not inherited from the daemon
+	*/
+	if(pend_pid != getpid()) {
+		if(-1 != pend_fd[0]) {
+			socket_watch(-1, ldap_pend_event, 0);
+			close(pend_fd[0]);
+			close(pend_fd[1]);
+		}
+		pend_fd[0] = pend_fd[1] = -1;
+		if(0 != socketpair(AF_UNIX, SOCK_DGRAM, 0, pend_fd)) {
+			pend_fd[0] = pend_fd[1] = -1;
+			return -1;
+		}
+		pend_pid = getpid();
 	}
+	if(0 == ++pend_id)
+		pend_id = 1;
+	rq->id = pend_id;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base       = (void *) rq;
+	iov.iov_len        = sizeof(LDREQ);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level   = SOL_SOCKET;
+	cmsg->cmsg_type    = SCM_RIGHTS;
+	cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pend_fd[1], sizeof(int));
 
 	/*
-	** All relevant attributes have been evaluated
+	** A full queue means the helpers are gone
 	*/
-	ldap_msgfree(result);
+	if(sendmsg(pool_fd[0], &msg, MSG_DONTWAIT) != sizeof(LDREQ)) {
+		syslog_write(T_WRN, "[ %s ] LDAP helpers not available",
+		             rq->peer);
+		return -1;
+	}
 
+	lp = (LDPEND *) misc_alloc(FL, sizeof(LDPEND));
+	lp->ctx  = ctx;
+	lp->busy = 1;
+	lp->due  = time(NULL) + config_int(NULL, "LDAPHelperTimeOut",
+	                                   LDAP_WAIT);
+	gettimeofday(&lp->beg, NULL);
+	memcpy(&lp->rq, rq, sizeof(LDREQ));
+	lp->next  = pend_head;
+	pend_head = lp;
+	ldap_pend_arm();
+
+	syslog_write(T_DBG | L_AUTH, "[ %s ] LDAP lookup for '%s' sent "
+	             "to helper", rq->peer, rq->who);
 	return 0;
 }
 
 
 /* ------------------------------------------------------------ **
 **
-**	Function......:	ldap_auth
+**	Function......:	ldap_pend_event
 **
-**	Parameters....:	ld		Pointer to LDAP struct
-**			e		Pointer to result buffer
-**			who		Pointer to user name
-**			pwd		Pointer to user pwd
+**	Parameters....:	sock		The answer socket or -1
 **
-**	Return........:	0 on success
+**	Return........:	(none)
 **
-**	Purpose.......: Preform LDAP userauth
+**	Purpose.......: Child: socket_watch callback. Take the
+**			answers of the helpers and give up the
+**			lookups that ran out of time.
 **
 ** ------------------------------------------------------------ */
 
-static int   ldap_auth(LDAP *ld, LDAPMessage *e, char *who, char *pwd, CONTEXT *ctx )
+static void ldap_pend_event(int sock)
 {
-	char str[MAX_PATH_SIZE];
-	char *v, *p, *q;
-	size_t len;
-	int    xrc = 0;
-        /* Basic sanity */
-        if(ctx == NULL || ld == NULL || who == NULL) {
-                if(ld) ldap_unbind(ld);
-                misc_die(FL, "ldap_fetch: ?ctx? ?ld? ?who?");
-         }
+	LDPEND *lp;
+	LDREP   rp;
+	time_t  now;
+
+	while(-1 != sock &&
+	      recv(sock, &rp, sizeof(rp), MSG_DONTWAIT) >= 0) {
+		for(lp = pend_head; NULL != lp; lp = lp->next) {
+			if(lp->busy && lp->rq.id == rp.id) {
+				memcpy(&lp->rp, &rp, sizeof(rp));
+				lp->busy = 0;
+				break;
+			}
+		}
+		memset(&rp, 0, sizeof(rp));
+	}
 
-	if (ld == NULL || e == NULL)
-		misc_die(FL, "ldap_checkauth: ?ld? ?e?");
+	now = time(NULL);
+	for(lp = pend_head; NULL != lp; lp = lp->next) {
+		if(lp->busy && lp->due <= now) {
+			syslog_write(T_ERR, "[ %s ] LDAP helper timed out",
+			             lp->rq.peer);
+			memset(&lp->rp, 0, sizeof(LDREP));
+			memset(lp->rp.off, -1, sizeof(lp->rp.off));
+			lp->rp.rc   = -1;
+			lp->rp.temp = 1;
+			lp->busy    = 0;
+		}
+	}
+	ldap_pend_arm();
+}
 
-	/*
-	** check "user enabled" flag if present
-	*/
-	if( (p = config_str(NULL, "LDAPAuthOKFlag", NULL))) {
-		misc_strncpy(str, p, sizeof(str));
-		if( (v = strchr(str, '=')))
-			*v++ = '\0';
-		else	v = 0;
 
-		if(v && strlen(v) && strlen(str)) {
-			if(0 != ldap_exists(ld, e, str, v, 0)) {
-				syslog_write(U_WRN,
-				"access denied for %s", NIL(who));
-				return -1;
-			} else {
-				syslog_write(T_DBG,
-				"LDAP auth ok-check: '%.256s'='%.256s' passed",
-				NIL(str), NIL(v));
-				xrc = 1;
-			}
-		} else {
-			errno = 0;
-			misc_die(FL, "ldap_auth: ?LDAPAuthOKFlag?");
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pend_arm
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Child: let socket_exec watch the answer
+**			socket while lookups are running, and
+**			wake up when the first of them is due.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_pend_arm(void)
+{
+	LDPEND *lp;
+	time_t  due = 0;
+
+	for(lp = pend_head; NULL != lp; lp = lp->next) {
+		if(lp->busy && (0 == due || lp->due < due))
+			due = lp->due;
+	}
+	if(0 == due)
+		socket_watch(-1, ldap_pend_event, 0);
+	else
+		socket_watch(pend_fd[0], ldap_pend_event, due);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pend_free
+**
+**	Parameters....:	lp		Pointer to the lookup
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Child: unlink a lookup and wipe it.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_pend_free(LDPEND *lp)
+{
+	LDPEND **pp;
+
+	for(pp = &pend_head; NULL != *pp; pp = &(*pp)->next) {
+		if(*pp == lp) {
+			*pp = lp->next;
+			break;
 		}
-	} else {
-		syslog_write(T_DBG, "[ %s ] LDAP auth ok-check skipped",ctx->cli_ctrl->peer);
-		// Patch Fred 1 partie //
-		patch_ldapgroup(ld,who,ctx);
 	}
+	memset(lp, 0, sizeof(LDPEND));
+	misc_free(FL, lp);
+}
 
-	/*
-	** check user pass match
-	*/
 
-	if( (p = config_str(NULL, "LDAPAuthPWAttr", "")) && strlen(p)) {
-		if(NULL == pwd)
-			pwd = "";
-			return -1;
-					
-		v   = config_str(NULL, "LDAPAuthPWType", "plain");
-		q   = ldap_attrib(ld, e, p, "");
-		p   = 0;
-		len = 0;
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_pool_serve
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none, exits)
+**
+**	Purpose.......: Main loop of an LDAP helper process:
+**			serve the lookups of the children over
+**			the kept LDAPServer connections, until
+**			the daemon goes away.
+**
+** ------------------------------------------------------------ */
 
-		if( !strncasecmp(v, "plain", sizeof("plain")-1)) {
-			/*
-			** plain passwd - no prefix
-			*/
-			len = sizeof("plain")-1;
-			p   = pwd;
-#if defined(HAVE_CRYPT)
-		} else
-		if( !strncasecmp(v, "crypt", sizeof("plain")-1)) {
-			/*
-			** crypt - no prefix
-			*/
-			len = sizeof("plain")-1;
-			p   = crypt(pwd, q);
-		} else
-		if( !strncasecmp(v, "{crypt}", sizeof("{crypt}")-1)) {
-			/*
-			** crypt - {crypt} prefix
-			*/
-			len = sizeof("{crypt}")-1;
-			if(strncasecmp(q, "{crypt}", len)) {
-				syslog_write(T_ERR,
-				             "ldap user auth - prefix missed");
-				return -1;
-			}
-			q+=len;
-			p = crypt(pwd, q);
-#endif
-		} else {
-			errno = 0;
-			misc_die(FL, "ldap_auth: ?LDAPAuthPWType?");
+static void ldap_pool_serve(void)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct timeval tv;
+	fd_set rfds;
+	LDCONN lc;
+	LDREQ rq;
+	LDREP rp;
+	pid_t ppid;
+	u_long cnt = 0;
+	int fd, len, i;
+
+	misc_setprog("ftp-ldap", NULL);
+	misc_forget();
+	socket_lclose(0);
+	close(pool_fd[0]);
+
+	signal(SIGINT,  SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP,  SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&lc, 0, sizeof(lc));
+	ppid = getppid();
+	while(getppid() == ppid) {
+		FD_ZERO(&rfds);
+		FD_SET(pool_fd[1], &rfds);
+		tv.tv_sec  = 5;
+		tv.tv_usec = 0;
+		if(select(pool_fd[1] + 1, &rfds, NULL, NULL, &tv) <= 0)
+			continue;
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base       = (void *) &rq;
+		iov.iov_len        = sizeof(rq);
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		if((len = recvmsg(pool_fd[1], &msg, 0)) < 0)
+			continue;
+
+		fd   = -1;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level &&
+		   SCM_RIGHTS == cmsg->cmsg_type)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		if(-1 == fd)
+			continue;
+		if(sizeof(rq) != (size_t) len || (msg.msg_flags & MSG_CTRUNC)) {
+			close(fd);
+			continue;
 		}
+		rq.who[sizeof(rq.who) - 1]   = '\0';
+		rq.pwd[sizeof(rq.pwd) - 1]   = '\0';
+		rq.peer[sizeof(rq.peer) - 1] = '\0';
+
+		ldap_serve(&lc, &rq, &rp);
+		rp.id = rq.id;
+		cnt++;
 
 		/*
-		** check if we have different minimal length
-		** it is coded in latest "char", i.e. plain9
+		** One datagram; a child that can't take
+		** it times out on the lookup
 		*/
-		if(0 < len && strlen(v) == len+1 &&
-		   '0' <= v[len] && '9' >= v[len])
-		{
-			len = (size_t)v[len] - '0';
-		} else	len = PASS_MIN_LEN;
+		if(send(fd, &rp, sizeof(rp), MSG_DONTWAIT) != sizeof(rp)) {
+			syslog_write(T_WRN, "[ %s ] can't answer LDAP lookup",
+			             rq.peer);
+		}
+		memset(&rq, 0, sizeof(rq));
+		memset(&rp, 0, sizeof(rp));
+		close(fd);
+	}
 
-		syslog_write(T_DBG, "LDAP auth pw-type[%d]='%.256s'", len, v);
-#if defined(COMPILE_DEBUG)
-		debug(3,            "LDAP auth pw-check: '%.256s' ?= '%.256s'",
-		                    NIL(q), NIL(p));
+	syslog_write(T_DBG | L_AUTH, "LDAP helper done after %lu lookups", cnt);
+	for(i = 0; i < lc.nsrv; i++) {
+		syslog_write(T_DBG | L_AUTH, "LDAP server %s:%u answered first "
+		             "%lu times", lc.srv[i].host, lc.srv[i].port,
+		             lc.srv[i].wins);
+	}
+	ldap_conn_drop(&lc);
+	exit(EXIT_SUCCESS);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_lock
+**
+**	Parameters....:	on		1=lock, 0=unlock
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Serialize access to the shared cache;
+**			it is held for a copy of one entry.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_cache_lock(int on)
+{
+#if defined(HAVE_SHARED)
+	misc_spin(&lctab->lock, on);
+#else
+	on = on;		/* A private cache needs none	*/
 #endif
+}
 
-		/*
-		** check (lenght) and compare passwds; the user
-		** account is locked if LDAP-PWD is "*" or "!"
-		*/
-		if(p && strlen(p)>=len && strlen(q) == strlen(p) &&
-		   !(1==strlen(q) && ('*' == q[0] || '!' == q[0])))
-		{
-			if(0 == strcmp(q, p)) {
-				syslog_write(T_DBG,
-				             "[ %s ] LDAP auth pw-check succeed", ctx->cli_ctrl->peer );
-				return xrc + 2;
-			}
-		}
-		syslog_write(T_DBG, "[ %s ] LDAP auth pw-check failed", ctx->cli_ctrl->peer);
-		return -1;
-	} else {
-		syslog_write(T_DBG, "[ %s ] LDAP auth pw-check skipped", ctx->cli_ctrl->peer);
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_hash
+**
+**	Parameters....:	rq		Pointer to the request
+**			hash		Set to the user name hash
+**			cred		Set to the MISC_HMAC_LEN
+**					byte credential MAC
+**
+**	Return........:	(none)
+**
+**	Purpose.......: FNV-1a over the user name picks the
+**			bucket; the credentials are checked by
+**			HMAC-SHA256 over name and password,
+**			keyed with the random table key.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_cache_hash(LDREQ *rq, u_int32_t *hash, u_char *cred)
+{
+	u_char msg[sizeof(rq->who) + sizeof(rq->pwd)];
+	size_t wlen, plen;
+	u_int32_t h;
+	char *p;
+
+	for(h = 2166136261U, p = rq->who; *p != '\0'; p++) {
+		h ^= (u_int32_t) (unsigned char) *p;
+		h *= 16777619U;
 	}
+	*hash = h;
 
 	/*
-	** OK, all configured manual LDAPAuth checks succeed...
+	** The name ends with its null byte, so no other
+	** name and password give the same message
 	*/
+	wlen = strlen(rq->who) + 1;
+	plen = strlen(rq->pwd);
+	memcpy(msg, rq->who, wlen);
+	memcpy(msg + wlen, rq->pwd, plen);
+	misc_hmac(lctab->key, sizeof(lctab->key), msg, wlen + plen, cred);
+	memset(msg, 0, sizeof(msg));
+}
 
-	return xrc;
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_look
+**
+**	Parameters....:	rq		Pointer to the request
+**			rp		Set to the cached answer
+**			age		Set to its age in seconds
+**
+**	Return........:	1 if the answer is cached, 0 if not
+**
+**	Purpose.......: Cache lookup; a hit needs the same user
+**			name and password. Expired entries and
+**			those from before a reload are misses.
+**
+** ------------------------------------------------------------ */
+
+static int ldap_cache_look(LDREQ *rq, LDREP *rp, u_long *age)
+{
+	LCACHE *ent;
+	u_int32_t hash, i;
+	u_char cred[MISC_HMAC_LEN];
+	time_t now;
+	int found = 0;
+
+	if(NULL == lctab)
+		return 0;
+
+	ldap_cache_hash(rq, &hash, cred);
+	now = time(NULL);
+
+	ldap_cache_lock(1);
+	for(i = 0; i < LC_PROBE; i++) {
+		ent = &lctab->ent[(hash + i) & lctab->mask];
+		if(0 == ent->expire || ent->hash != hash ||
+		   ent->gen != lctab->gen || 0 != strcmp(ent->who, rq->who) ||
+		   !misc_memequ(ent->cred, cred, sizeof(cred)))
+			continue;
+		if(ent->expire <= now) {
+			lctab->stale++;
+			break;
+		}
+		memcpy(rp, &ent->rep, sizeof(LDREP));
+		*age  = (u_long) (now - ent->born);
+		found = 1;
+		if(0 == rp->rc)
+			lctab->hits++;
+		else
+			lctab->nhits++;
+		lctab->asum += (double) *age;
+		if(*age > lctab->amax)
+			lctab->amax = *age;
+		break;
+	}
+	if(0 == found)
+		lctab->miss++;
+	ldap_cache_lock(0);
+	return found;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	ldap_cache_store
+**
+**	Parameters....:	rq		Pointer to the request
+**			rp		Pointer to the answer
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Enter an answer for LDAPCacheTTL, or a
+**			denial for LDAPCacheNegativeTTL seconds.
+**			Failures of the server are not kept. A
+**			full probe sequence evicts the entry
+**			that expires first.
+**
+** ------------------------------------------------------------ */
+
+static void ldap_cache_store(LDREQ *rq, LDREP *rp)
+{
+	LCACHE *ent, *use = NULL;
+	u_int32_t hash, i;
+	u_char cred[MISC_HMAC_LEN];
+	time_t now;
+	int ttl;
+
+	if(NULL == lctab || 0 != rp->temp)
+		return;
+	if(0 == rp->rc)
+		ttl = config_int(NULL, "LDAPCacheTTL", LC_TTL);
+	else
+		ttl = config_int(NULL, "LDAPCacheNegativeTTL", LC_NEGTTL);
+	if(ttl <= 0)
+		return;
+
+	ldap_cache_hash(rq, &hash, cred);
+	now = time(NULL);
+
+	ldap_cache_lock(1);
+	for(i = 0; i < LC_PROBE; i++) {
+		ent = &lctab->ent[(hash + i) & lctab->mask];
+		if(0 != ent->expire && ent->hash == hash &&
+		   0 == strcmp(ent->who, rq->who) &&
+		   misc_memequ(ent->cred, cred, sizeof(cred))) {
+			use = ent;
+			break;
+		}
+		if( !LC_LIVE(ent, now)) {
+			if(NULL == use || LC_LIVE(use, now))
+				use = ent;
+		} else if(NULL == use || (LC_LIVE(use, now) &&
+		          ent->expire < use->expire)) {
+			use = ent;
+		}
+	}
+	use->hash    = hash;
+	memcpy(use->cred, cred, sizeof(use->cred));
+	use->gen     = lctab->gen;
+	use->born    = now;
+	use->expire  = now + (time_t) ttl;
+	misc_strncpy(use->who, rq->who, sizeof(use->who));
+	memcpy(&use->rep, rp, sizeof(LDREP));
+	lctab->stored++;
+	ldap_cache_lock(0);
 }
 
 
@@ -1046,7 +2802,7 @@ Fred-B Patch Ldap Group
 --------------------------------*/ 
 
 #if defined(HAVE_LIBLDAP)
-void patch_ldapgroup(LDAP *ld, char *who, CONTEXT *ctx)
+static int patch_ldapgroup(LDCONN *lc, char *who, char *peer)
 {
 
 	char *BASE; 	 
@@ -1063,22 +2819,22 @@ void patch_ldapgroup(LDAP *ld, char *who, CONTEXT *ctx)
 
 	BASE_DN = config_str(NULL, "LDAPBaseDN", NULL);
 	if (NULL == BASE_DN) {
-		return;
+		return 0;
 	}
 
 	
 	BASE = config_str(who, "BASE", NULL);
 	if (NULL == BASE) {
-		return;
+		return 0;
 	}
 
 	char * FILTRE_LU = config_str(who, "FILTER", NULL);
 		
 	if (NULL == FILTRE_LU) {
-		return;
+		return 0;
 	}
 
-	char FILTRE1[MAX_CAR_FILTRE]; FILTRE1[MAX_CAR_FILTRE+1] = '\0';
+	char FILTRE1[MAX_CAR_FILTRE+2]; FILTRE1[MAX_CAR_FILTRE+1] = '\0';
 	char *FILTRE;			 
 	FILTRE = FILTRE1; 
 
@@ -1095,32 +2851,36 @@ void patch_ldapgroup(LDAP *ld, char *who, CONTEXT *ctx)
 	strncat(FILTRE, FIN, (MAX_CAR_FILTRE)- strlen(FILTRE));
 	
 	syslog_write(U_INF, "");
-	syslog_write(U_INF,"[ %s ] Patch Fred-B LDAP Ldap Group", ctx->cli_ctrl->peer);
-	syslog_write(U_INF,"[ %s ] Filter Ldap_group : %s", ctx->cli_ctrl->peer, FILTRE1); 
+	syslog_write(U_INF,"[ %s ] Patch Fred-B LDAP Ldap Group", peer);
+	syslog_write(U_INF,"[ %s ] Filter Ldap_group : %s", peer, FILTRE1); 
 
-	rc = ldap_search_s(ld,BASE,LDAP_SCOPE_SUBTREE,FILTRE,attrib,0,&result);
+	result = 0;
+	rc = ldap_find(lc,BASE,FILTRE,attrib,0,&result);
 
 	if (rc != LDAP_SUCCESS )
 	   {
  	    syslog_write(T_ERR, "ldap_search_ext: %s\n", ldap_err2string(rc));
-	    ldap_unbind(ld);
-	    exit(1);
+	    ldap_lost(lc, rc);
+	    if (result) ldap_msgfree(result);
+	    return -1;
 	    }
 
-	resultldap = ldap_count_entries(ld,result);
+	resultldap = ldap_count_entries(lc->ld,result);
+	ldap_msgfree(result);
 
 	if (resultldap == 0)
 	{
-		syslog_write(T_ERR,"[ %s ] Bad Group User %s",ctx->cli_ctrl->peer, who);
-		syslog_write(T_ERR,"[ %s ] Exit patch ldap_group \n", ctx->cli_ctrl->peer);
-		exit(-1);
+		syslog_write(T_ERR,"[ %s ] Bad Group User %s",peer, who);
+		syslog_write(T_ERR,"[ %s ] Exit patch ldap_group \n", peer);
+		return -1;
 	}
 	else
 	{
-		syslog_write(U_INF,"[ %s ] Group ldap ok %s", ctx->cli_ctrl->peer, who);
-		syslog_write(U_INF,"[ %s ] Exit patch ldap_group \n", ctx->cli_ctrl->peer);
+		syslog_write(U_INF,"[ %s ] Group ldap ok %s", peer, who);
+		syslog_write(U_INF,"[ %s ] Exit patch ldap_group \n", peer);
 	}		
 
+	return 0;
  }
 
 #endif
@@ -42,6 +42,15 @@
 #endif
 
 int  ldap_setup_user(CONTEXT *ctx, char *who, char *pwd);
+int  ldap_busy      (CONTEXT *ctx);
+void ldap_drop      (CONTEXT *ctx);
+
+void ldap_pool_check(int renew);
+int  ldap_pool_gone (pid_t pid);
+void ldap_pool_stop (void);
+void ldap_cache_init (void);
+void ldap_cache_flush(void);
+void ldap_cache_stats(void);
 
 
 /* ------------------------------------------------------------ */
@@ -63,6 +63,7 @@ static char rcsid[] = "$Id: ftp-main.c,v 1.6.6.1 2003/05/07 11:08:55 mt Exp $";
 #include "com-config.h"
 #include "com-debug.h"
 #include "com-misc.h"
+#include "com-resolv.h"
 #include "com-socket.h"
 #include "com-syslog.h"
 #include "ftp-client.h"
@@ -302,6 +303,11 @@ int main(int argc, char *argv[])
 #if defined(COMPILE_DEBUG)
 		debug(1, "{{{{{ %s client-start", misc_getprog());
 #endif
+		/*
+		** Read resolv.conf before it gets out of reach
+		*/
+		resolv_init();
+
 		/*
 		** Change root directory
 		*/
@@ -319,6 +325,12 @@ int main(int argc, char *argv[])
 			syslog_open(p, config_str(NULL, "LogLevel", NULL));
 		else	syslog_close();
 
+		/*
+		** Compile the per-user settings and group
+		** rules (group files are chroot relative)
+		*/
+		client_profiles();
+
 		client_run();
 		exit(EXIT_SUCCESS);
 	}
@@ -332,6 +344,12 @@ int main(int argc, char *argv[])
 	*/
 	daemon_init(detach);
 
+	/*
+	** Compile the per-user settings and group rules
+	** once for all logins (inside the chroot)
+	*/
+	client_profiles();
+
 	/*
 	** Setup signal handling (mostly graceful exit)
 	*/
@@ -355,6 +373,7 @@ int main(int argc, char *argv[])
 			*/
 			config_flag = 0;
 			config_read(cfg_file, 0);
+			client_profiles();	/* new generation */
 
 			/*
 			** reopen / rotate log
@@ -362,6 +381,11 @@ int main(int argc, char *argv[])
 			syslog_open(config_str(NULL,
 			                       "LogDestination", NULL),
 			            config_str(NULL, "LogLevel", NULL));
+
+			/*
+			** let pre-forked workers pick it up
+			*/
+			daemon_check(1);
 		}
 
 		/*
@@ -372,6 +396,11 @@ int main(int argc, char *argv[])
 			syslog_rotate();
 		}
 
+		/*
+		** Keep the pool of pre-forked workers filled
+		*/
+		daemon_check(0);
+
 		/*
 		** Now perform the "real" main loop work
 		*/
@@ -0,0 +1,1005 @@
+/*
+ * $Id$
+ *
+ * FTP Proxy argument pattern matching
+ *
+ * Author(s): Jens-Gero Boehm <jens-gero.boehm@suse.de>
+ *            Pieter Hollants <pieter.hollants@suse.de>
+ *            Marius Tomaschewski <mt@suse.de>
+ *            Volker Wiegand <volker.wiegand@suse.de>
+ *
+ * This file is part of the SuSE Proxy Suite
+ *            See also  http://proxy-suite.suse.de/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * A history log can be found at the end of this file.
+ */
+
+#ifndef lint
+static char rcsid[] = "$Id$";
+#endif
+
+#include <config.h>
+
+#if defined(STDC_HEADERS)
+#  include <stdio.h>
+#  include <string.h>
+#  include <stdlib.h>
+#  include <stdarg.h>
+#  include <errno.h>
+#  include <ctype.h>
+#endif
+
+#if defined(TIME_WITH_SYS_TIME)
+#  include <sys/time.h>
+#  include <time.h>
+#else
+#  if defined(HAVE_SYS_TIME_H)
+#    include <sys/time.h>
+#  else
+#    include <time.h>
+#  endif
+#endif
+
+#if defined(HAVE_REGEX)
+#  include <sys/types.h>
+#  include <regex.h>
+#endif
+
+#include "com-config.h"
+#include "com-debug.h"
+#include "com-misc.h"
+#include "com-syslog.h"
+#include "ftp-match.h"
+
+
+#if defined(HAVE_REGEX)
+/*
+** The argument rules are POSIX extended RegEx's, used
+** with REG_NOSUB: only "does it match somewhere" is of
+** interest. That is answered by a DFA, built lazily
+** from a Thompson NFA of the pattern, in one pass over
+** the argument without backtracking. Patterns using
+** features not covered here (GNU escapes, collating
+** elements, ...) or growing too many DFA states are
+** left to regexec(). Compiled patterns are cached by
+** their text and shared by all users in the process.
+*/
+
+/* ------------------------------------------------------------ */
+
+#define PM_NODES	4096	/* Max. NFA nodes per pattern	*/
+#define PM_STATES	128	/* Max. DFA states per pattern	*/
+#define PM_DUPMAX	255	/* Max. count in {n,m}		*/
+#define PM_HASH		64	/* Buckets of the pattern cache	*/
+#define PM_CACHE	512	/* Max. patterns in the cache	*/
+
+#define N_EPS		0	/* Epsilon edge(s)		*/
+#define N_BOL		1	/* '^': only at the start	*/
+#define N_EOL		2	/* '$': only at the end		*/
+#define N_SET		3	/* One character out of a set	*/
+#define N_MATCH		4	/* The pattern matched		*/
+
+#define SET_ON(s, c)	((s)[(c) >> 3] |= (u_char) (1 << ((c) & 7)))
+#define SET_ISON(s, c)	((s)[(c) >> 3] &  (1 << ((c) & 7)))
+
+typedef struct {
+	short kind;		/* N_EPS, N_BOL, ...		*/
+	short set;		/* Character set (N_SET)	*/
+	int   e1;		/* Next node(s), -1 = none;	*/
+	int   e2;		/* N_SET: e1 after the char	*/
+} PNODE;
+
+typedef struct {
+	int beg;		/* First node of a fragment	*/
+	int end;		/* Its open N_EPS end node	*/
+} PFRAG;
+
+typedef struct {
+	int  *memb;		/* N_SET/N_EOL/N_MATCH nodes	*/
+	int   cnt;		/* Number of members		*/
+	int   bol;		/* 1=start of the argument	*/
+	int   acc;		/* 1=a match ends here		*/
+	int   acc_eol;		/* 1=match if the argument ends	*/
+	short next[256];	/* Next state, -1 = not built	*/
+} DSTATE;
+
+typedef struct pmatch_t {
+	struct pmatch_t *next;	/* Next pattern in hash bucket	*/
+	u_int32_t hash;		/* Hash of the pattern text	*/
+	char     *text;		/* The pattern text		*/
+	int       refs;		/* References (the cache is one)*/
+	regex_t   re;		/* Compiled by regcomp()	*/
+
+	int       use_dfa;	/* 0=leave it to regexec()	*/
+	PNODE    *node;		/* The NFA ...			*/
+	u_char  (*set)[32];	/* ... its character sets ...	*/
+	int       nnode;	/* ... and sizes		*/
+	int       start;	/* Start node			*/
+	DSTATE   *dfa[PM_STATES]; /* DFA states built so far	*/
+	int       ndfa;
+	int       dstart;	/* Start state, -1 = not built	*/
+} PMATCH;
+
+
+/* ------------------------------------------------------------ */
+
+static int   match_node (int kind);
+static int   match_set  (void);
+static PFRAG match_alt  (void);
+static PFRAG match_branch(void);
+static PFRAG match_piece(void);
+static PFRAG match_atom (void);
+static PFRAG match_count(PFRAG f, char *atom, int min, int max);
+static int   match_brack(u_char *set);
+static int   match_build(PMATCH *pm);
+static int   match_close(PMATCH *pm, int *seed, int nseed,
+                         int bol, int eol, int *memb);
+static int   match_state(PMATCH *pm, int *seed, int nseed, int bol);
+static int   match_step (PMATCH *pm, int st, int c);
+
+
+/* ------------------------------------------------------------ */
+
+static PMATCH *pm_tab[PM_HASH];	/* The pattern cache		*/
+static int     pm_cnt = 0;
+
+/*
+** Scratch space of the pattern compiler
+*/
+static char   *cp_ptr;		/* Parse position		*/
+static int     cp_bad;		/* Not for the DFA		*/
+static PNODE   cp_node[PM_NODES];
+static u_char  cp_set[PM_NODES][32];
+static int     cp_nnode, cp_nset;
+static int     cp_mark[PM_NODES]; /* Visit marks of match_close	*/
+static int     cp_gen = 0;
+static int     cp_stack[3 * PM_NODES + 1];
+static int     cp_memb[PM_NODES + 1];
+static int     cp_seed[PM_NODES + 1];
+
+/*
+** Statistics of this process
+*/
+static u_long  st_comp  = 0;	/* Patterns compiled		*/
+static u_long  st_regex = 0;	/* ... of them left to regexec	*/
+static u_long  st_reuse = 0;	/* Compiles served by the cache	*/
+static u_long  st_state = 0;	/* DFA states built		*/
+static u_long  st_check = 0;	/* Arguments checked		*/
+static double  st_usec  = 0.0;	/* Time spent checking (usec)	*/
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_comp
+**
+**	Parameters....:	pat		Pattern (POSIX ERE)
+**			err		Buffer for an error message
+**			len		Size of the buffer
+**
+**	Return........:	Compiled pattern or NULL on error
+**
+**	Purpose.......: Get a pattern from the cache or compile
+**			it; release it with match_free. Invalid
+**			patterns are refused as by regcomp().
+**
+** ------------------------------------------------------------ */
+
+void *match_comp(char *pat, char *err, size_t len)
+{
+	PMATCH *pm;
+	u_int32_t hash;
+	char *p;
+	int i;
+
+	if (pat == NULL || err == NULL)	/* Basic sanity check	*/
+		misc_die(FL, "match_comp: ?pat?");
+
+	for (hash = 2166136261U, p = pat; *p != '\0'; p++) {
+		hash ^= (u_int32_t) (u_char) *p;
+		hash *= 16777619U;
+	}
+	for (pm = pm_tab[hash % PM_HASH]; pm != NULL; pm = pm->next) {
+		if (pm->hash == hash && strcmp(pm->text, pat) == 0) {
+			pm->refs++;
+			st_reuse++;
+			return (void *) pm;
+		}
+	}
+
+	pm = (PMATCH *) misc_alloc(FL, sizeof(PMATCH));
+	if ((i = regcomp(&pm->re, pat, REG_EXTENDED | REG_NEWLINE |
+	                               REG_NOSUB)) != 0) {
+		regerror(i, &pm->re, err, len);
+		regfree(&pm->re);
+		misc_free(FL, pm);
+		return NULL;
+	}
+	pm->hash   = hash;
+	pm->text   = misc_strdup(FL, pat);
+	pm->refs   = 1;
+	pm->dstart = -1;
+	pm->use_dfa = match_build(pm);
+
+	st_comp++;
+	if (pm->use_dfa == 0)
+		st_regex++;
+#if defined(COMPILE_DEBUG)
+	debug(2, "pattern '%.256s': %s, %d nodes", pat,
+	         pm->use_dfa ? "dfa" : "regex", pm->nnode);
+#endif
+
+	/*
+	** Keep it for the next user, if there is room
+	*/
+	if (pm_cnt < PM_CACHE) {
+		pm->refs++;
+		pm->next = pm_tab[hash % PM_HASH];
+		pm_tab[hash % PM_HASH] = pm;
+		pm_cnt++;
+	}
+	return (void *) pm;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_free
+**
+**	Parameters....:	ptr		Compiled pattern
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Release a pattern from match_comp.
+**
+** ------------------------------------------------------------ */
+
+void match_free(void *ptr)
+{
+	PMATCH *pm = (PMATCH *) ptr;
+	int i;
+
+	if (pm == NULL || --pm->refs > 0)
+		return;
+
+	regfree(&pm->re);
+	for (i = 0; i < pm->ndfa; i++) {
+		misc_free(FL, pm->dfa[i]->memb);
+		misc_free(FL, pm->dfa[i]);
+	}
+	if (pm->node != NULL)
+		misc_free(FL, pm->node);
+	if (pm->set != NULL)
+		misc_free(FL, pm->set);
+	misc_free(FL, pm->text);
+	misc_free(FL, pm);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_exec
+**
+**	Parameters....:	ptr		Compiled pattern
+**			str		String to check
+**
+**	Return........:	1 if the pattern matches, 0 if not
+**
+**	Purpose.......: Check a string (argument); the DFA is
+**			extended on the way as needed.
+**
+** ------------------------------------------------------------ */
+
+int match_exec(void *ptr, char *str)
+{
+	PMATCH *pm = (PMATCH *) ptr;
+	struct timeval beg, end;
+	DSTATE *ds;
+	u_char *p;
+	int st, rc = -1;
+
+	if (pm == NULL || str == NULL)	/* Basic sanity check	*/
+		misc_die(FL, "match_exec: ?pm? ?str?");
+
+	gettimeofday(&beg, NULL);
+
+	/*
+	** A newline would start a new line for ^ and $
+	** (REG_NEWLINE); as arguments have none, leave
+	** that case to regexec
+	*/
+	if (pm->use_dfa != 0 && strchr(str, '\n') == NULL) {
+		st = pm->dstart;
+		if (st < 0)
+			st = pm->dstart = match_state(pm, &pm->start, 1, 1);
+		for (p = (u_char *) str; st >= 0; p++) {
+			ds = pm->dfa[st];
+			if (ds->acc) {
+				rc = 1;
+				break;
+			}
+			if (*p == '\0') {
+				rc = ds->acc_eol;
+				break;
+			}
+			if (ds->next[*p] < 0)
+				st = match_step(pm, st, *p);
+			else
+				st = ds->next[*p];
+		}
+	}
+	if (rc < 0)
+		rc = (regexec(&pm->re, str, 0, NULL, 0) == 0);
+
+	gettimeofday(&end, NULL);
+	st_check++;
+	st_usec += (end.tv_sec  - beg.tv_sec) * 1000000.0 +
+	           (end.tv_usec - beg.tv_usec);
+	return rc;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_stats
+**
+**	Parameters....:	(none)
+**
+**	Return........:	(none)
+**
+**	Purpose.......: Log the counters of this process.
+**
+** ------------------------------------------------------------ */
+
+void match_stats(void)
+{
+	if (st_comp == 0 && st_check == 0)
+		return;
+	syslog_write(T_DBG | L_RULE, "argument filter: %lu patterns compiled "
+	             "(%lu by regex), %lu reused, %lu dfa states, "
+	             "%lu checks, %.2f usec/check",
+	             st_comp, st_regex, st_reuse, st_state, st_check,
+	             st_check ? st_usec / st_check : 0.0);
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_build
+**
+**	Parameters....:	pm		Pattern compiled by regcomp
+**
+**	Return........:	1 if the DFA can be used, 0 if not
+**
+**	Purpose.......: Compile the pattern text into the NFA.
+**
+** ------------------------------------------------------------ */
+
+static int match_build(PMATCH *pm)
+{
+	PFRAG f;
+	int m;
+
+	cp_ptr   = pm->text;
+	cp_bad   = 0;
+	cp_nnode = 0;
+	cp_nset  = 0;
+
+	f = match_alt();
+	if (cp_bad != 0 || *cp_ptr != '\0')
+		return 0;		/* e.g. unbalanced ')'	*/
+	if ((m = match_node(N_MATCH)) < 0)
+		return 0;
+	cp_node[f.end].e1 = m;
+
+	pm->start = f.beg;
+	pm->nnode = cp_nnode;
+	pm->node  = (PNODE *) misc_alloc(FL, cp_nnode * sizeof(PNODE));
+	memcpy(pm->node, cp_node, cp_nnode * sizeof(PNODE));
+	if (cp_nset > 0) {
+		pm->set = (u_char (*)[32]) misc_alloc(FL, cp_nset * 32);
+		memcpy(pm->set, cp_set, cp_nset * 32);
+	}
+	return 1;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_node
+**
+**	Parameters....:	kind		Node type
+**
+**	Return........:	Index of a new NFA node, -1 if full
+**
+**	Purpose.......: Allocate a node from the scratch space.
+**
+** ------------------------------------------------------------ */
+
+static int match_node(int kind)
+{
+	if (cp_nnode >= PM_NODES) {
+		cp_bad = 1;
+		return -1;
+	}
+	cp_node[cp_nnode].kind = (short) kind;
+	cp_node[cp_nnode].set  = -1;
+	cp_node[cp_nnode].e1   = -1;
+	cp_node[cp_nnode].e2   = -1;
+	return cp_nnode++;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_set
+**
+**	Parameters....:	(none)
+**
+**	Return........:	Index of a new, empty character set
+**
+**	Purpose.......: Sets never outnumber the nodes.
+**
+** ------------------------------------------------------------ */
+
+static int match_set(void)
+{
+	memset(cp_set[cp_nset], 0, sizeof(cp_set[0]));
+	return cp_nset++;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_alt
+**
+**	Parameters....:	(none)
+**
+**	Return........:	NFA fragment
+**
+**	Purpose.......: regex := branch ( '|' branch )*
+**
+** ------------------------------------------------------------ */
+
+static PFRAG match_alt(void)
+{
+	PFRAG f, g;
+	int s, t;
+
+	f = match_branch();
+	while (cp_bad == 0 && *cp_ptr == '|') {
+		cp_ptr++;
+		g = match_branch();
+		if ((s = match_node(N_EPS)) < 0 ||
+		    (t = match_node(N_EPS)) < 0)
+			break;
+		cp_node[s].e1 = f.beg;
+		cp_node[s].e2 = g.beg;
+		cp_node[f.end].e1 = t;
+		cp_node[g.end].e1 = t;
+		f.beg = s;
+		f.end = t;
+	}
+	return f;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_branch
+**
+**	Parameters....:	(none)
+**
+**	Return........:	NFA fragment
+**
+**	Purpose.......: branch := piece*
+**
+** ------------------------------------------------------------ */
+
+static PFRAG match_branch(void)
+{
+	PFRAG f, g;
+
+	f.beg = f.end = match_node(N_EPS);
+	while (cp_bad == 0 && *cp_ptr != '\0' &&
+	       *cp_ptr != '|'  && *cp_ptr != ')') {
+		g = match_piece();
+		if (cp_bad != 0)
+			break;
+		cp_node[f.end].e1 = g.beg;
+		f.end = g.end;
+	}
+	return f;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_piece
+**
+**	Parameters....:	(none)
+**
+**	Return........:	NFA fragment
+**
+**	Purpose.......: piece := atom ( '*' | '+' | '?' | '{n,m}' )*
+**
+** ------------------------------------------------------------ */
+
+static PFRAG match_piece(void)
+{
+	PFRAG f;
+	char *atom = cp_ptr, *p;
+	int s, t, min, max, quant = 0;
+
+	f = match_atom();
+	while (cp_bad == 0) {
+		if (*cp_ptr == '*' || *cp_ptr == '?') {
+			/*
+			** s -> f -> t, s -> t (and back for '*')
+			*/
+			if ((s = match_node(N_EPS)) < 0 ||
+			    (t = match_node(N_EPS)) < 0)
+				break;
+			cp_node[s].e1 = f.beg;
+			cp_node[s].e2 = t;
+			cp_node[f.end].e1 = (*cp_ptr == '*') ? f.beg : t;
+			cp_node[f.end].e2 = t;
+			f.beg = s;
+			f.end = t;
+		} else
+		if (*cp_ptr == '+') {
+			if ((t = match_node(N_EPS)) < 0)
+				break;
+			cp_node[f.end].e1 = f.beg;
+			cp_node[f.end].e2 = t;
+			f.end = t;
+		} else
+		if (*cp_ptr == '{') {
+			/*
+			** Counts repeat the atom; leave a
+			** count after another one to regex
+			*/
+			if (quant != 0 || !isdigit((int) cp_ptr[1])) {
+				cp_bad = 1;
+				break;
+			}
+			min = (int) strtol(cp_ptr + 1, &p, 10);
+			max = min;
+			if (*p == ',') {
+				if (isdigit((int) *++p))
+					max = (int) strtol(p, &p, 10);
+				else
+					max = -1;
+			}
+			if (*p != '}' || min > PM_DUPMAX || max > PM_DUPMAX ||
+			    (max >= 0 && max < min)) {
+				cp_bad = 1;
+				break;
+			}
+			cp_ptr = p;
+			f = match_count(f, atom, min, max);
+		} else {
+			break;
+		}
+		cp_ptr++;
+		quant++;
+	}
+	return f;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_count
+**
+**	Parameters....:	f		Fragment of the atom
+**			atom		Text of the atom
+**			min		Min. count
+**			max		Max. count, -1=unlimited
+**
+**	Return........:	NFA fragment
+**
+**	Purpose.......: Expand atom{min,max}: the atom is parsed
+**			again for each further copy.
+**
+** ------------------------------------------------------------ */
+
+static PFRAG match_count(PFRAG f, char *atom, int min, int max)
+{
+	PFRAG r, g;
+	char *save = cp_ptr;
+	int i, s, t;
+
+	r.beg = r.end = match_node(N_EPS);
+	for (i = 0; cp_bad == 0 && (i < min || i < max ||
+	                            (max < 0 && i <= min)); i++) {
+		if (i > 0) {
+			cp_ptr = atom;
+			g = match_atom();
+		} else {
+			g = f;
+		}
+		if (cp_bad != 0 || (s = match_node(N_EPS)) < 0 ||
+		    (t = match_node(N_EPS)) < 0)
+			break;
+		cp_node[s].e1 = g.beg;
+		cp_node[g.end].e1 = t;
+		if (i >= min) {
+			/*
+			** Optional copy; the one after
+			** the minimum repeats for {n,}
+			*/
+			cp_node[s].e2 = t;
+			if (max < 0)
+				cp_node[g.end].e2 = g.beg;
+		}
+		cp_node[r.end].e1 = s;
+		r.end = t;
+	}
+	cp_ptr = save;
+	return r;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_atom
+**
+**	Parameters....:	(none)
+**
+**	Return........:	NFA fragment
+**
+**	Purpose.......: atom := '(' regex ')' | '[' set ']' | '.'
+**			        | '^' | '$' | '\' char | char
+**
+** ------------------------------------------------------------ */
+
+static PFRAG match_atom(void)
+{
+	PFRAG f;
+	int c, n, t, set;
+
+	f.beg = f.end = -1;
+	switch ((c = (u_char) *cp_ptr)) {
+	case '(':
+		cp_ptr++;
+		f = match_alt();
+		if (*cp_ptr != ')')
+			cp_bad = 1;
+		else
+			cp_ptr++;
+		return f;
+
+	case '^':
+	case '$':
+		cp_ptr++;
+		if ((n = match_node(c == '^' ? N_BOL : N_EOL)) < 0 ||
+		    (t = match_node(N_EPS)) < 0)
+			return f;
+		cp_node[n].e1 = t;
+		f.beg = n;
+		f.end = t;
+		return f;
+
+	case '*':
+	case '+':
+	case '?':
+	case '{':
+		cp_bad = 1;		/* Nothing to repeat	*/
+		return f;
+	}
+
+	if ((n = match_node(N_SET)) < 0 || (t = match_node(N_EPS)) < 0)
+		return f;
+	set = match_set();
+	cp_node[n].set = (short) set;
+	cp_node[n].e1  = t;
+	f.beg = n;
+	f.end = t;
+
+	if (c == '[') {
+		cp_ptr++;
+		if (match_brack(cp_set[set]) != 0)
+			cp_bad = 1;
+		return f;
+	}
+	if (c == '.') {
+		for (c = 1; c < 256; c++)
+			SET_ON(cp_set[set], c);
+		cp_set[set]['\n' >> 3] &= (u_char) ~(1 << ('\n' & 7));
+		cp_ptr++;
+		return f;
+	}
+	if (c == '\\') {
+		/*
+		** \1, \w, \< ... are left to regex
+		*/
+		c = (u_char) *++cp_ptr;
+		if (c == '\0' || isalnum(c)) {
+			cp_bad = 1;
+			return f;
+		}
+	}
+	SET_ON(cp_set[set], c);
+	cp_ptr++;
+	return f;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_brack
+**
+**	Parameters....:	set		Character set to fill
+**
+**	Return........:	0 on success, -1 if not for the DFA
+**
+**	Purpose.......: Parse a bracket expression; the '[' has
+**			been read. Ranges are byte ranges and the
+**			classes those of the C locale.
+**
+** ------------------------------------------------------------ */
+
+static int match_brack(u_char *set)
+{
+	static struct {
+		char *name;
+		int (*func)(int);
+	} cls[] = {
+		{ "alpha", isalpha }, { "digit", isdigit },
+		{ "alnum", isalnum }, { "upper", isupper },
+		{ "lower", islower }, { "space", isspace },
+		{ "punct", ispunct }, { "print", isprint },
+		{ "graph", isgraph }, { "cntrl", iscntrl },
+		{ "xdigit", isxdigit },
+		{ NULL, NULL }
+	};
+	int neg = 0, first = 1, lo, hi, c, i;
+	char *p;
+
+	if (*cp_ptr == '^') {
+		neg = 1;
+		cp_ptr++;
+	}
+	for ( ; ; first = 0) {
+		c = (u_char) *cp_ptr;
+		if (c == '\0')
+			return -1;
+		if (c == ']' && first == 0)
+			break;
+
+		if (c == '[' && cp_ptr[1] == ':') {
+			if ((p = strstr(cp_ptr + 2, ":]")) == NULL)
+				return -1;
+			for (i = 0; cls[i].name != NULL; i++) {
+				if (strlen(cls[i].name) == (size_t)
+				    (p - cp_ptr - 2) && strncmp(cls[i].name,
+				    cp_ptr + 2, p - cp_ptr - 2) == 0)
+					break;
+			}
+			if (cls[i].name == NULL)
+				return -1;
+			for (c = 1; c < 256; c++) {
+				if ((*cls[i].func)(c))
+					SET_ON(set, c);
+			}
+			cp_ptr = p + 2;
+			continue;
+		}
+		if (c == '[' && (cp_ptr[1] == '.' || cp_ptr[1] == '='))
+			return -1;	/* Collating elements	*/
+
+		lo = hi = c;
+		cp_ptr++;
+		if (*cp_ptr == '-' && cp_ptr[1] != ']' && cp_ptr[1] != '\0') {
+			hi = (u_char) cp_ptr[1];
+			if (hi == '[' || hi < lo)
+				return -1;
+			cp_ptr += 2;
+		}
+		for (c = lo; c <= hi; c++)
+			SET_ON(set, c);
+	}
+	cp_ptr++;
+
+	if (neg) {
+		for (i = 0; i < 32; i++)
+			set[i] = (u_char) ~set[i];
+		set['\n' >> 3] &= (u_char) ~(1 << ('\n' & 7));
+	}
+	set[0] &= (u_char) ~1;		/* No '\0' in strings	*/
+	return 0;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_close
+**
+**	Parameters....:	pm		Compiled pattern
+**			seed		Nodes to start from
+**			nseed		Number of seeds
+**			bol		1=at the start (pass '^')
+**			eol		1=at the end (pass '$')
+**			memb		Buffer for the members
+**
+**	Return........:	Number of members
+**
+**	Purpose.......: Epsilon closure: collect the N_SET, N_EOL
+**			and N_MATCH nodes reachable from the seeds,
+**			sorted, as the identity of a DFA state.
+**
+** ------------------------------------------------------------ */
+
+static int match_close(PMATCH *pm, int *seed, int nseed,
+                       int bol, int eol, int *memb)
+{
+	int sp = 0, cnt = 0, n, i, j;
+	PNODE *nd;
+
+	/*
+	** Every node is marked when first popped, so
+	** the stack holds at most the seeds and two
+	** edges per node
+	*/
+	cp_gen++;
+	for (i = 0; i < nseed; i++)
+		cp_stack[sp++] = seed[i];
+
+	while (sp > 0) {
+		n = cp_stack[--sp];
+		if (n < 0 || cp_mark[n] == cp_gen)
+			continue;
+		cp_mark[n] = cp_gen;
+		nd = &pm->node[n];
+		if (nd->kind == N_EPS) {
+			cp_stack[sp++] = nd->e1;
+			cp_stack[sp++] = nd->e2;
+			continue;
+		}
+		if (nd->kind == N_BOL) {
+			if (bol)
+				cp_stack[sp++] = nd->e1;
+			continue;
+		}
+		if (nd->kind == N_EOL && eol) {
+			cp_stack[sp++] = nd->e1;
+			continue;
+		}
+
+		/*
+		** Insertion sort, states are small
+		*/
+		for (j = cnt; j > 0 && memb[j - 1] > n; j--)
+			memb[j] = memb[j - 1];
+		memb[j] = n;
+		cnt++;
+	}
+	return cnt;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_state
+**
+**	Parameters....:	pm		Compiled pattern
+**			seed		Nodes to start from
+**			nseed		Number of seeds
+**			bol		1=at the start
+**
+**	Return........:	Index of the DFA state, -1 if there
+**			are too many
+**
+**	Purpose.......: Find or build the state of the closure.
+**
+** ------------------------------------------------------------ */
+
+static int match_state(PMATCH *pm, int *seed, int nseed, int bol)
+{
+	int *memb = cp_memb;
+	DSTATE *ds;
+	int cnt, ecnt, i;
+
+	cnt = match_close(pm, seed, nseed, bol, 0, memb);
+	for (i = 0; i < pm->ndfa; i++) {
+		ds = pm->dfa[i];
+		if (ds->cnt == cnt && ds->bol == bol &&
+		    memcmp(ds->memb, memb, cnt * sizeof(int)) == 0)
+			return i;
+	}
+	if (pm->ndfa >= PM_STATES) {
+		syslog_write(T_DBG | L_RULE, "pattern '%.256s': too many "
+		             "states, using regex", pm->text);
+		pm->use_dfa = 0;
+		return -1;
+	}
+
+	ds = (DSTATE *) misc_alloc(FL, sizeof(DSTATE));
+	ds->memb = (int *) misc_alloc(FL, (cnt + 1) * sizeof(int));
+	memcpy(ds->memb, memb, cnt * sizeof(int));
+	ds->cnt = cnt;
+	ds->bol = bol;
+	for (i = 0; i < 256; i++)
+		ds->next[i] = -1;
+
+	/*
+	** Accepting now, or if the argument ends here
+	** (then the '$' nodes may be passed as well)
+	*/
+	for (i = 0, ecnt = 0; i < cnt; i++) {
+		if (pm->node[memb[i]].kind == N_MATCH)
+			ds->acc = 1;
+		if (pm->node[memb[i]].kind == N_EOL)
+			cp_seed[ecnt++] = memb[i];
+	}
+	if (ds->acc == 0 && ecnt > 0) {
+		ecnt = match_close(pm, cp_seed, ecnt, bol, 1, memb);
+		for (i = 0; i < ecnt; i++) {
+			if (pm->node[memb[i]].kind == N_MATCH)
+				ds->acc_eol = 1;
+		}
+	}
+
+	pm->dfa[pm->ndfa] = ds;
+	st_state++;
+	return pm->ndfa++;
+}
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	match_step
+**
+**	Parameters....:	pm		Compiled pattern
+**			st		Current DFA state
+**			c		Next character
+**
+**	Return........:	Next DFA state, -1 if there are too
+**			many
+**
+**	Purpose.......: Build a transition. The start node is
+**			seeded at every position, as a match may
+**			begin anywhere.
+**
+** ------------------------------------------------------------ */
+
+static int match_step(PMATCH *pm, int st, int c)
+{
+	int *seed = cp_seed;
+	DSTATE *ds = pm->dfa[st];
+	PNODE *nd;
+	int i, n = 0, nx;
+
+	for (i = 0; i < ds->cnt; i++) {
+		nd = &pm->node[ds->memb[i]];
+		if (nd->kind == N_SET && SET_ISON(pm->set[nd->set], c))
+			seed[n++] = nd->e1;
+	}
+	seed[n++] = pm->start;
+
+	if ((nx = match_state(pm, seed, n, 0)) >= 0)
+		pm->dfa[st]->next[c] = (short) nx;
+	return nx;
+}
+#endif /* defined(HAVE_REGEX) */
+
+
+/* ------------------------------------------------------------
+ * $Log$
+ *
+ * ------------------------------------------------------------ */
@@ -0,0 +1,53 @@
+/*
+ * $Id$
+ *
+ * Header for FTP Proxy argument pattern matching
+ *
+ * Author(s): Jens-Gero Boehm <jens-gero.boehm@suse.de>
+ *            Pieter Hollants <pieter.hollants@suse.de>
+ *            Marius Tomaschewski <mt@suse.de>
+ *            Volker Wiegand <volker.wiegand@suse.de>
+ *
+ * This file is part of the SuSE Proxy Suite
+ *            See also  http://proxy-suite.suse.de/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ * A history log can be found at the end of this file.
+ */
+
+#if !defined(_FTP_MATCH_H_)
+#define _FTP_MATCH_H_
+
+#if defined(HAVE_REGEX)
+
+/* ------------------------------------------------------------ */
+
+void *match_comp (char *pat, char *err, size_t len);
+int   match_exec (void *pm, char *str);
+void  match_free (void *pm);
+void  match_stats(void);
+
+#endif /* defined(HAVE_REGEX) */
+
+/* ------------------------------------------------------------ */
+
+#endif /* defined(_FTP_MATCH_H_) */
+
+/* ------------------------------------------------------------
+ * $Log$
+ *
+ * ------------------------------------------------------------ */
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+#
+# Stub name server for the resolver test (tests/resolv-test.sh)
+#
+# Answers A queries for a few fixed names under ".test" on a local
+# UDP port and logs every question it gets, one name per line, so
+# the test can tell cache hits from queries that went out:
+#
+#   good.test          A 192.0.2.10, TTL 300
+#   alias.test         CNAME good.test, A of good.test
+#   nx.test            NXDOMAIN
+#   forged-id.test     an answer with a wrong id (A 198.51.100.66)
+#                      first, the right one (A 192.0.2.20) 50 ms later
+#   forged-quest.test  only answers that ask another name
+#                      (A 198.51.100.66)
+#   forged-owner.test  the right question, but an A record owned by
+#                      another name (A 198.51.100.66)
+#   forged-chain.test  CNAME to chain-end.test, but an A record
+#                      of another name (A 198.51.100.66)
+#
+# Anything else gets NXDOMAIN.
+#
+# Usage: dns-stub.py PORT LOGFILE
+#
+# This file is part of the SuSE Proxy Suite
+#            See also  http://proxy-suite.suse.de/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version
+# 2 of the License, or (at your option) any later version.
+#
+
+import socket
+import struct
+import sys
+import threading
+
+FORGED = "198.51.100.66"
+
+
+def name_enc(name):
+    out = b""
+    for label in name.rstrip(".").split("."):
+        out += bytes([len(label)]) + label.encode("ascii")
+    return out + b"\0"
+
+
+def name_dec(msg, off):
+    labels = []
+    while msg[off] != 0:
+        n = msg[off]
+        labels.append(msg[off + 1:off + 1 + n].decode("ascii"))
+        off += 1 + n
+    return ".".join(labels), off + 1
+
+
+def rr_a(owner, addr, ttl=300):
+    return (name_enc(owner) + struct.pack("!HHIH", 1, 1, ttl, 4) +
+            socket.inet_aton(addr))
+
+
+def rr_cname(owner, target, ttl=300):
+    data = name_enc(target)
+    return (name_enc(owner) + struct.pack("!HHIH", 5, 1, ttl, len(data)) +
+            data)
+
+
+def reply(qid, qname, rrs, rcode=0):
+    hdr = struct.pack("!HHHHHH", qid, 0x8180 | rcode, 1, len(rrs), 0, 0)
+    return hdr + name_enc(qname) + struct.pack("!HH", 1, 1) + b"".join(rrs)
+
+
+def answer(sock, peer, qid, qname):
+    q = qname.lower()
+    if q == "good.test":
+        sock.sendto(reply(qid, qname, [rr_a(qname, "192.0.2.10")]), peer)
+    elif q == "alias.test":
+        sock.sendto(reply(qid, qname, [rr_cname(qname, "good.test", 600),
+                                       rr_a("good.test", "192.0.2.10")]),
+                    peer)
+    elif q == "forged-id.test":
+        sock.sendto(reply(qid ^ 0x5a5a, qname, [rr_a(qname, FORGED)]), peer)
+        threading.Timer(0.05, sock.sendto,
+                        (reply(qid, qname, [rr_a(qname, "192.0.2.20")]),
+                         peer)).start()
+    elif q == "forged-quest.test":
+        sock.sendto(reply(qid, "good.test", [rr_a("good.test", FORGED)]),
+                    peer)
+    elif q == "forged-owner.test":
+        sock.sendto(reply(qid, qname, [rr_a("evil.test", FORGED)]), peer)
+    elif q == "forged-chain.test":
+        sock.sendto(reply(qid, qname,
+                          [rr_cname(qname, "chain-end.test"),
+                           rr_a("elsewhere.test", FORGED)]), peer)
+    else:
+        sock.sendto(reply(qid, qname, [], rcode=3), peer)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: dns-stub.py PORT LOGFILE")
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", int(sys.argv[1])))
+    log = open(sys.argv[2], "a", buffering=1)
+    while True:
+        msg, peer = sock.recvfrom(512)
+        if len(msg) < 12:
+            continue
+        qid, flags, qd = struct.unpack("!HHH", msg[:6])
+        if flags & 0x8000 or qd != 1:
+            continue
+        qname, _ = name_dec(msg, 12)
+        log.write(qname.lower() + "\n")
+        answer(sock, peer, qid, qname)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+#
+# Stub servers for the LDAP test (tests/ldap-test.sh)
+#
+#   ftp-stub.py ftp PORT        FTP server taking any login:
+#                               USER 331, PASS 230, NOOP 200,
+#                               QUIT 221, anything else 502
+#   ftp-stub.py blackhole PORT  accepts TCP connections and never
+#                               answers - a hung LDAP server
+#
+# This file is part of the SuSE Proxy Suite
+#            See also  http://proxy-suite.suse.de/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version
+# 2 of the License, or (at your option) any later version.
+#
+
+import socket
+import sys
+import threading
+
+REPLY = {
+    "USER": "331 Password required",
+    "PASS": "230 Logged in",
+    "NOOP": "200 NOOP ok",
+    "QUIT": "221 Bye",
+}
+
+
+def ftp_session(conn):
+    f = conn.makefile("rwb", buffering=0)
+    f.write(b"220 stub FTP server ready\r\n")
+    for line in f:
+        cmd = line.decode("latin-1").strip().split(" ")[0].upper()
+        f.write((REPLY.get(cmd, "502 Not implemented") + "\r\n").encode())
+        if cmd == "QUIT":
+            break
+    conn.close()
+
+
+def main():
+    if len(sys.argv) != 3 or sys.argv[1] not in ("ftp", "blackhole"):
+        sys.exit("usage: ftp-stub.py ftp|blackhole PORT")
+    lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    lsock.bind(("127.0.0.1", int(sys.argv[2])))
+    lsock.listen(16)
+    held = []
+    while True:
+        conn, _ = lsock.accept()
+        if sys.argv[1] == "blackhole":
+            held.append(conn)
+        else:
+            threading.Thread(target=ftp_session, args=(conn,),
+                             daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,226 @@
+#!/bin/sh
+#
+# Test the LDAP login path of ftp-proxy (ftp-proxy/ftp-ldap.c)
+# against a local slapd: helper lookups, the answer cache, the
+# race over several LDAPServers and refused logins.
+#
+# Needs slapd and slapadd (OpenLDAP), python3, and a tree built
+# with LDAP support; run it from the top of that tree:
+#
+#   ./configure --with-libldap && make && sh tests/ldap-test.sh
+#
+# What it does:
+#
+#   - loads ou=People,dc=test with uid=alice (password "secret")
+#     into a slapd of its own on 127.0.0.1:$LDAP_PORT
+#   - starts tests/ftp-stub.py as the FTP server behind the proxy
+#     and as a hung LDAP server that accepts and never answers
+#   - runs ftp-proxy standalone with one pre-forked worker serving
+#     several sessions, LDAPServer listing the hung server first
+#   - logs in through the proxy with python's ftplib:
+#       alice/secret           230, well below LDAPTimeOut, as
+#                              the race picks the live server
+#       alice/wrong            530
+#       alice/(empty)          530 while another session of the
+#                              same worker stays usable
+#       alice/secret, slapd
+#       stopped                230 from the cache
+#       alice/other, slapd
+#       stopped                530
+#
+# The ports are LDAP_PORT (default 3389) and the three above it.
+# SCHEMA_DIR and MODULE_DIR point to the OpenLDAP schema files
+# and modules if they are not in one of the usual places.
+#
+# This file is part of the SuSE Proxy Suite
+#            See also  http://proxy-suite.suse.de/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version
+# 2 of the License, or (at your option) any later version.
+#
+
+LDAP_PORT=${LDAP_PORT:-3389}
+HUNG_PORT=`expr $LDAP_PORT + 1`
+FTP_PORT=`expr $LDAP_PORT + 2`
+PROXY_PORT=`expr $LDAP_PORT + 3`
+
+PATH=$PATH:/usr/sbin:/usr/local/sbin:/usr/libexec
+TOP=`pwd`
+TMP=`mktemp -d /tmp/ldap-test.XXXXXX` || exit 1
+PIDS=
+
+cleanup() {
+	test -n "$PIDS" && kill $PIDS 2>/dev/null
+	test -f $TMP/proxy.pid && kill `cat $TMP/proxy.pid` 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup 0 1 2 15
+
+if test ! -x ftp-proxy/ftp-proxy ; then
+	echo "ldap-test: build the tree first (ftp-proxy/ftp-proxy)" >&2
+	exit 1
+fi
+if ! grep '^#define HAVE_LIBLDAP' config.h > /dev/null ; then
+	echo "ldap-test: configure --with-libldap first" >&2
+	exit 1
+fi
+for d in "$SCHEMA_DIR" /etc/ldap/schema /etc/openldap/schema \
+         /usr/local/etc/openldap/schema ; do
+	test -f "$d/core.schema" && { SCHEMA_DIR=$d ; break ; }
+done
+for d in "$MODULE_DIR" /usr/lib/ldap /usr/lib64/openldap \
+         /usr/lib/openldap /usr/local/libexec/openldap ; do
+	test -n "$d" && ls $d/back_mdb* > /dev/null 2>&1 && \
+		{ MODULE_DIR=$d ; break ; }
+done
+
+#
+# The directory
+#
+mkdir $TMP/db
+{
+	echo "include $SCHEMA_DIR/core.schema"
+	echo "include $SCHEMA_DIR/cosine.schema"
+	echo "include $SCHEMA_DIR/inetorgperson.schema"
+	if test -n "$MODULE_DIR" ; then
+		echo "modulepath $MODULE_DIR"
+		echo "moduleload back_mdb"
+	fi
+	echo "pidfile $TMP/slapd.pid"
+	echo "database mdb"
+	echo "directory $TMP/db"
+	echo "suffix dc=test"
+	echo "rootdn cn=admin,dc=test"
+	echo "rootpw admin"
+} > $TMP/slapd.conf
+
+cat > $TMP/data.ldif <<EOF
+dn: dc=test
+objectClass: dcObject
+objectClass: organization
+dc: test
+o: test
+
+dn: ou=People,dc=test
+objectClass: organizationalUnit
+ou: People
+
+dn: uid=alice,ou=People,dc=test
+objectClass: inetOrgPerson
+uid: alice
+cn: Alice
+sn: Test
+userPassword: secret
+EOF
+
+slapadd -f $TMP/slapd.conf -l $TMP/data.ldif || exit 1
+slapd -f $TMP/slapd.conf -h "ldap://127.0.0.1:$LDAP_PORT/" -d 0 \
+	> $TMP/slapd.log 2>&1 &
+SLAPD=$!
+PIDS="$PIDS $SLAPD"
+
+python3 tests/ftp-stub.py blackhole $HUNG_PORT &
+PIDS="$PIDS $!"
+python3 tests/ftp-stub.py ftp $FTP_PORT &
+PIDS="$PIDS $!"
+
+#
+# The proxy
+#
+cat > $TMP/ftp-proxy.conf <<EOF
+[-Global-]
+ServerType		standalone
+Listen			127.0.0.1
+Port			$PROXY_PORT
+PidFile			$TMP/proxy.pid
+LogDestination		$TMP/proxy.log
+LogLevel		DBG
+DestinationAddress	127.0.0.1
+DestinationPort		$FTP_PORT
+PreforkMinSpare		1
+PreforkMaxSpare		1
+WorkerSessions		8
+UserAuthType		ldap
+LDAPServer		127.0.0.1:$HUNG_PORT, 127.0.0.1:$LDAP_PORT
+LDAPTimeOut		10
+LDAPBaseDN		ou=People,dc=test
+LDAPBindDN		uid=%s,ou=People,dc=test
+LDAPIdentifier		uid
+LDAPHelpers		2
+LDAPCacheTTL		60
+LDAPCacheNegativeTTL	10
+EOF
+
+ftp-proxy/ftp-proxy -d -f $TMP/ftp-proxy.conf || exit 1
+sleep 2
+
+FAIL=0
+
+# login USER PASS WANT [MAXSECS]: log in through the proxy,
+# expect the reply code WANT within MAXSECS seconds
+login() {
+	res=`python3 - "$PROXY_PORT" "$1" "$2" <<'EOF'
+import ftplib, sys, time
+f = ftplib.FTP()
+f.connect("127.0.0.1", int(sys.argv[1]), timeout=30)
+t = time.time()
+try:
+    code = f.login(sys.argv[2], sys.argv[3])[:3]
+except ftplib.all_errors as e:
+    code = str(e)[:3]
+print(code, int(time.time() - t))
+EOF
+`
+	code=`echo $res | cut -d' ' -f1`
+	secs=`echo $res | cut -d' ' -f2`
+	if test "$code" = "$3" -a "${secs:-99}" -le "${4:-30}" ; then
+		echo "ok   $1/$2 -> $code in ${secs}s"
+	else
+		echo "FAIL $1/$2 -> $res, want $3 within ${4:-30}s"
+		FAIL=1
+	fi
+}
+
+login alice secret 230 3
+login alice wrong  530
+
+# An empty password is refused for its session only; the
+# first session, served by the same worker, goes on
+res=`python3 - "$PROXY_PORT" <<'EOF'
+import ftplib, sys
+a = ftplib.FTP(); a.connect("127.0.0.1", int(sys.argv[1]), timeout=30)
+a.login("alice", "secret")
+b = ftplib.FTP(); b.connect("127.0.0.1", int(sys.argv[1]), timeout=30)
+try:
+    b.login("alice", "")
+    print("empty=230")
+except ftplib.error_perm as e:
+    print("empty=" + str(e)[:3])
+try:
+    print("other=" + a.voidcmd("NOOP")[:3])
+except ftplib.all_errors as e:
+    print("other=lost")
+EOF
+`
+if test "`echo $res`" = "empty=530 other=200" ; then
+	echo "ok   empty password refused, other session alive"
+else
+	echo "FAIL empty password: $res, want empty=530 other=200"
+	FAIL=1
+fi
+
+# Without the directory only the cache can answer
+kill $SLAPD
+sleep 1
+login alice secret 230 3
+login alice other  530
+
+if test $FAIL != 0 ; then
+	echo "--- proxy log:"
+	cat $TMP/proxy.log
+	exit 1
+fi
+echo "all LDAP tests passed"
+exit 0
@@ -0,0 +1,84 @@
+/*
+ * $Id$
+ *
+ * Resolver test driver: looks up the names given on the command
+ * line through the caching resolver and prints one line for each,
+ * "name address" or "name -". See tests/resolv-test.sh.
+ *
+ * This file is part of the SuSE Proxy Suite
+ *            See also  http://proxy-suite.suse.de/
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "com-config.h"
+#include "com-misc.h"
+#include "com-resolv.h"
+#include "com-socket.h"
+#include "com-syslog.h"
+
+
+/* ------------------------------------------------------------ */
+
+static char *usage_arr[] = {
+	"usage: resolv-test config-file name ...",
+	NULL
+};
+
+
+/* ------------------------------------------------------------ **
+**
+**	Function......:	main
+**
+**	Parameters....:	argc, argv	Config file and names
+**
+**	Return........:	EXIT_SUCCESS
+**
+**	Purpose.......: Resolve the names in turn; a name given
+**			twice is answered from the cache.
+**
+** ------------------------------------------------------------ */
+
+int main(int argc, char *argv[])
+{
+	u_int32_t addr;
+	int i;
+
+	misc_setprog(argv[0], usage_arr);
+	if (argc < 3)
+		misc_usage(NULL);
+
+	syslog_stderr();
+	config_read(argv[1], 0);
+	resolv_init();
+
+	for (i = 2; i < argc; i++) {
+		addr = resolv_wait(argv[i], INADDR_NONE);
+		printf("%s %s\n", argv[i], (addr == INADDR_NONE) ?
+		       "-" : socket_addr2str(addr));
+		fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+#
+# Test the caching resolver (common/com-resolv.c) against a local
+# stub name server (tests/dns-stub.py): cache hits and misses,
+# negative answers and forged answers that must be dropped.
+#
+# Run it from the top of a configured and built tree:
+#
+#   ./configure && make && sh tests/resolv-test.sh
+#
+# Needs python3 for the stub; it listens on 127.0.0.1, port
+# $DNS_PORT (default 5353).
+#
+# This file is part of the SuSE Proxy Suite
+#            See also  http://proxy-suite.suse.de/
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version
+# 2 of the License, or (at your option) any later version.
+#
+
+DNS_PORT=${DNS_PORT:-5353}
+CC=${CC:-cc}
+TOP=`pwd`
+TMP=`mktemp -d /tmp/resolv-test.XXXXXX` || exit 1
+STUB=
+
+cleanup() {
+	test -n "$STUB" && kill $STUB 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup 0 1 2 15
+
+if test ! -f common/libcommon.a ; then
+	echo "resolv-test: build the tree first (common/libcommon.a)" >&2
+	exit 1
+fi
+$CC -I. -Icommon -o $TMP/resolv-test tests/resolv-test.c \
+	-Lcommon -lcommon || exit 1
+
+cat > $TMP/ftp-proxy.conf <<EOF
+[-Global-]
+AsyncResolver		yes
+ResolverAddress		127.0.0.1
+ResolverPort		$DNS_PORT
+ResolverTimeOut		1
+ResolverRetries		1
+ResolverNegativeTTL	30
+EOF
+
+python3 tests/dns-stub.py $DNS_PORT $TMP/queries &
+STUB=$!
+sleep 1
+
+FAIL=0
+
+# expect NAME ANSWER QUERIES: the name resolved to ANSWER with
+# QUERIES questions for it seen by the stub so far
+expect() {
+	got=`grep "^$1 " $TMP/out | tail -1 | cut -d' ' -f2`
+	cnt=`grep -c "^$1\$" $TMP/queries`
+	if test "$got" = "$2" -a "$cnt" = "$3" ; then
+		echo "ok   $1 -> $got ($cnt queries)"
+	else
+		echo "FAIL $1 -> $got ($cnt queries), want $2 ($3 queries)"
+		FAIL=1
+	fi
+}
+
+# One process, so the second lookup of a name has to come
+# from the cache: the stub must not see the question again
+$TMP/resolv-test $TMP/ftp-proxy.conf \
+	good.test good.test nx.test nx.test alias.test \
+	forged-id.test forged-quest.test forged-owner.test \
+	forged-chain.test > $TMP/out 2> $TMP/err
+
+expect good.test		192.0.2.10	1	# miss, then hit
+expect nx.test			-		1	# negative entry
+expect alias.test		192.0.2.10	1	# CNAME chain
+expect forged-id.test		192.0.2.20	1	# wrong id dropped
+expect forged-quest.test	-		1	# other question
+expect forged-owner.test	-		1	# A of another name
+expect forged-chain.test	-		1	# A off the chain
+
+if grep 198.51.100.66 $TMP/out > /dev/null ; then
+	echo "FAIL a forged address was accepted"
+	FAIL=1
+fi
+
+if test $FAIL != 0 ; then
+	echo "--- resolver log:"
+	cat $TMP/err
+	exit 1
+fi
+echo "all resolver tests passed"
+exit 0